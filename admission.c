@@ -0,0 +1,276 @@
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/util.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "admission.h"
+#include "server.h"
+
+struct queued_request {
+  struct admission *admission;
+  enum admission_class class;
+  struct evhttp_request *request;
+  struct event *deadline;
+  struct timeval queued;
+  TAILQ_ENTRY(queued_request) entries;
+};
+
+TAILQ_HEAD(queued_request_list, queued_request);
+
+struct admission_queue {
+  struct queued_request_list requests;
+  int length;
+
+  unsigned long admitted;
+  unsigned long queued;
+  unsigned long rejected;
+  unsigned long timed_out;
+  unsigned long cancelled;
+
+  // Milliseconds spent in the queue by admitted requests
+  unsigned long long wait_total;
+  unsigned long wait_max;
+};
+
+struct admission {
+  struct event_base *event_base;
+  struct event *pump;
+  admission_dispatch_fn dispatch;
+  admission_reject_fn reject;
+  void *userdata;
+
+  int max_in_flight;
+  int max_queued;
+  int max_queue_wait;
+  int in_flight;
+
+  // Moving average of the time spent in a queue, for Retry-After
+  long wait_average;
+
+  struct admission_queue queues[ADMISSION_NUM_CLASSES];
+};
+
+static const char *admission_class_names[ADMISSION_NUM_CLASSES] = {
+  "admin",
+  "write",
+  "read"
+};
+
+static void admission_pump(evutil_socket_t socket, short what, void *userdata);
+
+struct admission *admission_new(struct event_base *event_base,
+                                int max_in_flight,
+                                int max_queued,
+                                int max_queue_wait,
+                                admission_dispatch_fn dispatch,
+                                admission_reject_fn reject,
+                                void *userdata) {
+  struct admission *admission = calloc(1, sizeof (struct admission));
+  admission->event_base = event_base;
+  admission->pump = event_new(event_base, -1, 0, &admission_pump, admission);
+  admission->dispatch = dispatch;
+  admission->reject = reject;
+  admission->userdata = userdata;
+  admission->max_in_flight = max_in_flight;
+  admission->max_queued = max_queued;
+  admission->max_queue_wait = max_queue_wait;
+
+  for (int i = 0; i < ADMISSION_NUM_CLASSES; i++)
+    TAILQ_INIT(&admission->queues[i].requests);
+
+  return admission;
+}
+
+// Takes a request out of its queue, leaving the request itself alone
+static void dequeue_request(struct queued_request *queued) {
+  struct admission_queue *queue = &queued->admission->queues[queued->class];
+  TAILQ_REMOVE(&queue->requests, queued, entries);
+  queue->length--;
+
+  if (queued->deadline != NULL)
+    event_free(queued->deadline);
+
+  struct evhttp_connection *connection =
+      evhttp_request_get_connection(queued->request);
+
+  if (connection != NULL)
+    evhttp_connection_set_closecb(connection, NULL, NULL);
+
+  free(queued);
+}
+
+void admission_free(struct admission *admission) {
+  for (int i = 0; i < ADMISSION_NUM_CLASSES; i++) {
+    struct queued_request *queued;
+
+    while ((queued = TAILQ_FIRST(&admission->queues[i].requests)) != NULL)
+      dequeue_request(queued);
+  }
+
+  event_free(admission->pump);
+  free(admission);
+}
+
+// Seconds a turned away client should wait before trying again
+static int admission_retry_after(struct admission *admission) {
+  int retry_after = (admission->wait_average + 999) / 1000;
+  return retry_after < 1 ? 1 : retry_after;
+}
+
+static void admit_request(struct admission *admission,
+                          enum admission_class class,
+                          struct evhttp_request *request) {
+  admission->queues[class].admitted++;
+  admission->dispatch(request, admission->userdata);
+}
+
+static void admit_queued_request(struct queued_request *queued) {
+  struct admission *admission = queued->admission;
+  struct admission_queue *queue = &admission->queues[queued->class];
+  enum admission_class class = queued->class;
+  struct evhttp_request *request = queued->request;
+  struct timeval now, waited;
+  evutil_gettimeofday(&now, NULL);
+  evutil_timersub(&now, &queued->queued, &waited);
+  unsigned long wait = waited.tv_sec * 1000 + waited.tv_usec / 1000;
+  queue->wait_total += wait;
+
+  if (wait > queue->wait_max)
+    queue->wait_max = wait;
+
+  admission->wait_average += ((long) wait - admission->wait_average) / 8;
+  dequeue_request(queued);
+  admit_request(admission, class, request);
+}
+
+static void queued_request_deadline(evutil_socket_t socket,
+                                    short what,
+                                    void *userdata) {
+  struct queued_request *queued = userdata;
+  struct admission *admission = queued->admission;
+  struct evhttp_request *request = queued->request;
+  admission->queues[queued->class].timed_out++;
+  dequeue_request(queued);
+  admission->reject(request, admission_retry_after(admission),
+                    admission->userdata);
+}
+
+static void queued_request_closed(struct evhttp_connection *connection,
+                                  void *userdata) {
+  struct queued_request *queued = userdata;
+  struct evhttp_request *request = queued->request;
+  queued->admission->queues[queued->class].cancelled++;
+  dequeue_request(queued);
+  free_abandoned_request(request);
+}
+
+// Whether requests of a class have to wait behind others
+static bool must_queue(struct admission *admission,
+                       enum admission_class class) {
+  if (admission->in_flight >= admission->max_in_flight)
+    return true;
+
+  for (int i = 0; i <= class; i++) {
+    if (admission->queues[i].length > 0)
+      return true;
+  }
+
+  return false;
+}
+
+void admission_submit(struct admission *admission,
+                      enum admission_class class,
+                      struct evhttp_request *request) {
+  struct admission_queue *queue = &admission->queues[class];
+
+  if (class == ADMISSION_ADMIN || admission->max_in_flight <= 0 ||
+      !must_queue(admission, class)) {
+    admit_request(admission, class, request);
+    return;
+  }
+
+  if (queue->length >= admission->max_queued) {
+    queue->rejected++;
+    admission->reject(request, admission_retry_after(admission),
+                      admission->userdata);
+    return;
+  }
+
+  struct queued_request *queued = malloc(sizeof (struct queued_request));
+  queued->admission = admission;
+  queued->class = class;
+  queued->request = request;
+  queued->deadline = NULL;
+  evutil_gettimeofday(&queued->queued, NULL);
+  TAILQ_INSERT_TAIL(&queue->requests, queued, entries);
+  queue->length++;
+  queue->queued++;
+
+  if (admission->max_queue_wait > 0) {
+    struct timeval tv = {
+      admission->max_queue_wait / 1000,
+      (admission->max_queue_wait % 1000) * 1000
+    };
+    queued->deadline = evtimer_new(admission->event_base,
+                                   &queued_request_deadline, queued);
+    evtimer_add(queued->deadline, &tv);
+  }
+
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                &queued_request_closed, queued);
+}
+
+// Admits queued requests, highest priority first, while there's room
+static void admission_pump(evutil_socket_t socket, short what, void *userdata) {
+  struct admission *admission = userdata;
+
+  for (int i = 0; i < ADMISSION_NUM_CLASSES; i++) {
+    struct queued_request *queued;
+
+    while (admission->in_flight < admission->max_in_flight &&
+           (queued = TAILQ_FIRST(&admission->queues[i].requests)) != NULL) {
+      admit_queued_request(queued);
+    }
+  }
+}
+
+void admission_operation_started(struct admission *admission) {
+  admission->in_flight++;
+}
+
+void admission_operation_finished(struct admission *admission) {
+  admission->in_flight--;
+
+  // Admitting requests right away could start new operations in the middle of
+  // libspotify callbacks
+  event_active(admission->pump, 0, 1);
+}
+
+json_t *admission_to_json(struct admission *admission, json_t *object) {
+  json_object_set_new(object, "inFlight", json_integer(admission->in_flight));
+  json_object_set_new(object, "maxInFlight",
+                      json_integer(admission->max_in_flight));
+  json_t *queues = json_object();
+  json_object_set_new(object, "queues", queues);
+
+  for (int i = 0; i < ADMISSION_NUM_CLASSES; i++) {
+    struct admission_queue *queue = &admission->queues[i];
+    json_t *queue_json = json_object();
+    json_object_set_new(queue_json, "length", json_integer(queue->length));
+    json_object_set_new(queue_json, "admitted", json_integer(queue->admitted));
+    json_object_set_new(queue_json, "queued", json_integer(queue->queued));
+    json_object_set_new(queue_json, "rejected", json_integer(queue->rejected));
+    json_object_set_new(queue_json, "timedOut", json_integer(queue->timed_out));
+    json_object_set_new(queue_json, "cancelled",
+                        json_integer(queue->cancelled));
+    json_object_set_new(queue_json, "waitMsTotal",
+                        json_integer(queue->wait_total));
+    json_object_set_new(queue_json, "waitMsMax", json_integer(queue->wait_max));
+    json_object_set_new(queues, admission_class_names[i], queue_json);
+  }
+
+  return object;
+}
@@ -0,0 +1,55 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+// Caps the number of operations waiting for libspotify at a time. Requests
+// that arrive while the cap is reached wait in a queue for their class, and
+// the queues are served in priority order. Requests are turned away when their
+// queue is full or when they have waited for too long.
+struct admission;
+
+// In order of priority. Admin requests never wait for libspotify, so they are
+// always admitted right away.
+enum admission_class {
+  ADMISSION_ADMIN,
+  ADMISSION_WRITE,
+  ADMISSION_READ,
+  ADMISSION_NUM_CLASSES
+};
+
+// Handles an admitted request
+typedef void (*admission_dispatch_fn)(struct evhttp_request *request,
+                                      void *userdata);
+
+// Responds to a request that was turned away, telling the client to retry
+// after a number of seconds
+typedef void (*admission_reject_fn)(struct evhttp_request *request,
+                                    int retry_after,
+                                    void *userdata);
+
+// Queues hold at most max_queued requests each, for at most max_queue_wait
+// milliseconds (0 means forever)
+struct admission *admission_new(struct event_base *event_base,
+                                int max_in_flight,
+                                int max_queued,
+                                int max_queue_wait,
+                                admission_dispatch_fn dispatch,
+                                admission_reject_fn reject,
+                                void *userdata);
+
+// Drops queued requests without responding to them
+void admission_free(struct admission *);
+
+// Dispatches a request now, queues it, or rejects it
+void admission_submit(struct admission *,
+                      enum admission_class,
+                      struct evhttp_request *);
+
+// Counts an operation waiting for libspotify
+void admission_operation_started(struct admission *);
+
+// Frees up room for queued requests
+void admission_operation_finished(struct admission *);
+
+json_t *admission_to_json(struct admission *, json_t *object);
+
+#endif
@@ -0,0 +1,411 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "browse.h"
+#include "cache.h"
+#include "constants.h"
+#include "json.h"
+#include "metadata.h"
+
+struct browse_waiter {
+  struct browse *browse;
+  browse_done_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(browse_waiter) entries;
+};
+
+TAILQ_HEAD(browse_waiter_list, browse_waiter);
+
+// A browse under way, holding a reference to the album or artist
+struct browse {
+  struct browse_cache *cache;  // NULL once the cache is freed
+  char *uri;  // Also the hash key
+  sp_album *album;
+  sp_artist *artist;
+  long long started;
+  struct browse_waiter_list waiters;
+};
+
+struct browse_cache {
+  sp_session *session;
+  struct track_metadata *metadata;
+  struct cache *responses;
+  apr_hash_t *browses;
+  int num_browses;
+  int num_waiters;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long started;
+  unsigned long shared;
+  unsigned long completed;
+  unsigned long failed;
+  long long total_milliseconds;
+  long long max_milliseconds;
+};
+
+static long long now_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct browse_cache *browse_cache_new(sp_session *session,
+                                      struct track_metadata *metadata,
+                                      size_t max_bytes,
+                                      apr_pool_t *pool) {
+  struct browse_cache *cache = calloc(1, sizeof (struct browse_cache));
+  cache->session = session;
+  cache->metadata = metadata;
+  cache->responses = cache_new(max_bytes, 0, pool);
+  cache->browses = apr_hash_make(pool);
+  return cache;
+}
+
+static void browse_drop_waiters(struct browse *browse) {
+  struct browse_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&browse->waiters)) != NULL) {
+    TAILQ_REMOVE(&browse->waiters, waiter, entries);
+    free(waiter);
+  }
+}
+
+static void browse_free(struct browse *browse) {
+  browse_drop_waiters(browse);
+
+  if (browse->album != NULL)
+    sp_album_release(browse->album);
+
+  if (browse->artist != NULL)
+    sp_artist_release(browse->artist);
+
+  free(browse->uri);
+  free(browse);
+}
+
+void browse_cache_free(struct browse_cache *cache) {
+  // Browses are freed as they complete
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, cache->browses);
+       hi != NULL; hi = apr_hash_next(hi)) {
+    struct browse *browse;
+    apr_hash_this(hi, NULL, NULL, (void **) &browse);
+    browse_drop_waiters(browse);
+    browse->cache = NULL;
+  }
+
+  cache_free(cache->responses);
+  free(cache);
+}
+
+bool browse_cache_write(struct browse_cache *cache,
+                        const char *uri,
+                        struct evbuffer *buf) {
+  size_t length;
+  time_t stored;
+  char *body = cache_get(cache->responses, uri, &length, &stored);
+
+  if (body != NULL && time(NULL) - stored >= kBrowseResultTtlSeconds) {
+    cache_remove(cache->responses, uri);
+    body = NULL;
+  }
+
+  if (body == NULL) {
+    cache->misses++;
+    return false;
+  }
+
+  cache->hits++;
+  evbuffer_add(buf, body, length);
+  return true;
+}
+
+static void artist_to_evbuffer(sp_artist *artist, struct evbuffer *buf) {
+  if (artist == NULL) {
+    evbuffer_add(buf, "null", 4);
+    return;
+  }
+
+  evbuffer_add_printf(buf, "{\"uri\":");
+  json_link_to_evbuffer(buf, sp_link_create_from_artist(artist));
+  evbuffer_add_printf(buf, ",\"name\":");
+  json_string_to_evbuffer(buf, sp_artist_name(artist));
+  evbuffer_add(buf, "}", 1);
+}
+
+// Writes the URI, name and year of an album, without the closing brace
+static void album_to_evbuffer(sp_album *album, struct evbuffer *buf) {
+  evbuffer_add_printf(buf, "{\"uri\":");
+  json_link_to_evbuffer(buf, sp_link_create_from_album(album));
+  evbuffer_add_printf(buf, ",\"name\":");
+  json_string_to_evbuffer(buf, sp_album_name(album));
+  evbuffer_add_printf(buf, ",\"year\":%d", sp_album_year(album));
+}
+
+// Serializes an album browse. Returns the number of tracks that hadn't
+// loaded.
+static int albumbrowse_to_evbuffer(struct browse_cache *cache,
+                                   sp_albumbrowse *result,
+                                   struct evbuffer *buf) {
+  album_to_evbuffer(sp_albumbrowse_album(result), buf);
+  evbuffer_add_printf(buf, ",\"artist\":");
+  artist_to_evbuffer(sp_albumbrowse_artist(result), buf);
+  evbuffer_add_printf(buf, ",\"tracks\":");
+  int num_tracks = sp_albumbrowse_num_tracks(result);
+  sp_track **tracks = malloc(num_tracks * sizeof (sp_track *));
+
+  for (int i = 0; i < num_tracks; i++)
+    tracks[i] = sp_albumbrowse_track(result, i);
+
+  int num_unloaded = track_metadata_write_tracks(cache->metadata, tracks,
+                                                 num_tracks, buf);
+  free(tracks);
+  evbuffer_add(buf, "}", 1);
+  return num_unloaded;
+}
+
+static int artistbrowse_to_evbuffer(struct browse_cache *cache,
+                                    sp_artistbrowse *result,
+                                    struct evbuffer *buf) {
+  sp_artist *artist = sp_artistbrowse_artist(result);
+  evbuffer_add_printf(buf, "{\"uri\":");
+  json_link_to_evbuffer(buf, sp_link_create_from_artist(artist));
+  evbuffer_add_printf(buf, ",\"name\":");
+  json_string_to_evbuffer(buf, sp_artist_name(artist));
+  const char *biography = sp_artistbrowse_biography(result);
+  evbuffer_add_printf(buf, ",\"biography\":");
+  json_string_to_evbuffer(buf, biography != NULL ? biography : "");
+  evbuffer_add_printf(buf, ",\"albums\":[");
+
+  for (int i = 0; i < sp_artistbrowse_num_albums(result); i++) {
+    if (i > 0)
+      evbuffer_add(buf, ",", 1);
+
+    album_to_evbuffer(sp_artistbrowse_album(result, i), buf);
+    evbuffer_add(buf, "}", 1);
+  }
+
+  evbuffer_add_printf(buf, "],\"topTracks\":");
+  int num_tracks = sp_artistbrowse_num_tophit_tracks(result);
+  sp_track **tracks = malloc(num_tracks * sizeof (sp_track *));
+
+  for (int i = 0; i < num_tracks; i++)
+    tracks[i] = sp_artistbrowse_tophit_track(result, i);
+
+  int num_unloaded = track_metadata_write_tracks(cache->metadata, tracks,
+                                                 num_tracks, buf);
+  free(tracks);
+  evbuffer_add(buf, "}", 1);
+  return num_unloaded;
+}
+
+// Takes a browse that has completed off the cache, and calls back those
+// waiting for it
+static void browse_complete(struct browse *browse,
+                            sp_error error,
+                            struct evbuffer *buf,
+                            int num_unloaded) {
+  struct browse_cache *cache = browse->cache;
+  apr_hash_set(cache->browses, browse->uri, APR_HASH_KEY_STRING, NULL);
+  cache->num_browses--;
+  long long milliseconds = now_milliseconds() - browse->started;
+  cache->completed++;
+  cache->total_milliseconds += milliseconds;
+
+  if (milliseconds > cache->max_milliseconds)
+    cache->max_milliseconds = milliseconds;
+
+  const char *body = NULL;
+  size_t length = 0;
+
+  if (error == SP_ERROR_OK) {
+    length = evbuffer_get_length(buf);
+    body = (const char *) evbuffer_pullup(buf, length);
+
+    // Responses with tracks still loading are sent but not kept
+    if (num_unloaded == 0) {
+      char *stored = malloc(length);
+      memcpy(stored, body, length);
+      cache_put(cache->responses, browse->uri, stored, length, &free);
+    }
+  } else {
+    cache->failed++;
+  }
+
+  // Callbacks may start other browses, but not cancel their waiter
+  struct browse_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&browse->waiters)) != NULL) {
+    TAILQ_REMOVE(&browse->waiters, waiter, entries);
+    cache->num_waiters--;
+    waiter->callback(body, length, error, waiter->userdata);
+    free(waiter);
+  }
+
+  browse_free(browse);
+}
+
+static void albumbrowse_complete(sp_albumbrowse *result, void *userdata) {
+  struct browse *browse = userdata;
+
+  if (browse->cache == NULL) {
+    sp_albumbrowse_release(result);
+    browse_free(browse);
+    return;
+  }
+
+  sp_error error = sp_albumbrowse_error(result);
+  struct evbuffer *buf = evbuffer_new();
+  int num_unloaded = error == SP_ERROR_OK ?
+      albumbrowse_to_evbuffer(browse->cache, result, buf) : 0;
+  sp_albumbrowse_release(result);
+  browse_complete(browse, error, buf, num_unloaded);
+  evbuffer_free(buf);
+}
+
+static void artistbrowse_complete(sp_artistbrowse *result, void *userdata) {
+  struct browse *browse = userdata;
+
+  if (browse->cache == NULL) {
+    sp_artistbrowse_release(result);
+    browse_free(browse);
+    return;
+  }
+
+  sp_error error = sp_artistbrowse_error(result);
+  struct evbuffer *buf = evbuffer_new();
+  int num_unloaded = error == SP_ERROR_OK ?
+      artistbrowse_to_evbuffer(browse->cache, result, buf) : 0;
+  sp_artistbrowse_release(result);
+  browse_complete(browse, error, buf, num_unloaded);
+  evbuffer_free(buf);
+}
+
+static struct browse_waiter *browse_wait(struct browse *browse,
+                                         browse_done_fn callback,
+                                         void *userdata) {
+  struct browse_waiter *waiter = malloc(sizeof (struct browse_waiter));
+  waiter->browse = browse;
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+  TAILQ_INSERT_TAIL(&browse->waiters, waiter, entries);
+  browse->cache->num_waiters++;
+  return waiter;
+}
+
+// Returns the browse under way for a URI, or a new one if there's none
+static struct browse *browse_get(struct browse_cache *cache,
+                                 const char *uri,
+                                 bool *created) {
+  struct browse *browse = apr_hash_get(cache->browses, uri,
+                                       APR_HASH_KEY_STRING);
+  *created = browse == NULL;
+
+  if (browse != NULL) {
+    cache->shared++;
+    return browse;
+  }
+
+  browse = calloc(1, sizeof (struct browse));
+  browse->cache = cache;
+  browse->uri = strdup(uri);
+  browse->started = now_milliseconds();
+  TAILQ_INIT(&browse->waiters);
+  return browse;
+}
+
+static void browse_started(struct browse *browse) {
+  struct browse_cache *cache = browse->cache;
+  apr_hash_set(cache->browses, browse->uri, APR_HASH_KEY_STRING, browse);
+  cache->num_browses++;
+  cache->started++;
+}
+
+struct browse_waiter *browse_cache_wait_album(struct browse_cache *cache,
+                                              const char *uri,
+                                              sp_album *album,
+                                              browse_done_fn callback,
+                                              void *userdata) {
+  bool created;
+  struct browse *browse = browse_get(cache, uri, &created);
+
+  if (created) {
+    browse->album = album;
+    sp_album_add_ref(album);
+
+    if (sp_albumbrowse_create(cache->session, album, &albumbrowse_complete,
+                              browse) == NULL) {
+      browse_free(browse);
+      cache->failed++;
+      return NULL;
+    }
+
+    browse_started(browse);
+  }
+
+  return browse_wait(browse, callback, userdata);
+}
+
+struct browse_waiter *browse_cache_wait_artist(struct browse_cache *cache,
+                                               const char *uri,
+                                               sp_artist *artist,
+                                               browse_done_fn callback,
+                                               void *userdata) {
+  bool created;
+  struct browse *browse = browse_get(cache, uri, &created);
+
+  if (created) {
+    browse->artist = artist;
+    sp_artist_add_ref(artist);
+
+    // Albums and top tracks, but not every track of the artist
+    if (sp_artistbrowse_create(cache->session, artist,
+                               SP_ARTISTBROWSE_NO_TRACKS,
+                               &artistbrowse_complete, browse) == NULL) {
+      browse_free(browse);
+      cache->failed++;
+      return NULL;
+    }
+
+    browse_started(browse);
+  }
+
+  return browse_wait(browse, callback, userdata);
+}
+
+void browse_cache_cancel(struct browse_waiter *waiter) {
+  struct browse *browse = waiter->browse;
+  TAILQ_REMOVE(&browse->waiters, waiter, entries);
+  browse->cache->num_waiters--;
+  free(waiter);
+}
+
+json_t *browse_cache_to_json(struct browse_cache *cache, json_t *object) {
+  cache_to_json(cache->responses, object);
+  unsigned long lookups = cache->hits + cache->misses;
+  json_object_set_new(object, "hits", json_integer(cache->hits));
+  json_object_set_new(object, "misses", json_integer(cache->misses));
+  json_object_set_new(object, "hitRatio",
+                      json_real(lookups > 0 ?
+                                (double) cache->hits / lookups : 0));
+  json_object_set_new(object, "browses", json_integer(cache->started));
+  json_object_set_new(object, "sharedBrowses", json_integer(cache->shared));
+  json_object_set_new(object, "failed", json_integer(cache->failed));
+  json_object_set_new(object, "inFlight", json_integer(cache->num_browses));
+  json_object_set_new(object, "waiting", json_integer(cache->num_waiters));
+  json_object_set_new(object, "averageMilliseconds",
+                      json_integer(cache->completed > 0 ?
+                                   cache->total_milliseconds /
+                                   (long long) cache->completed : 0));
+  json_object_set_new(object, "maxMilliseconds",
+                      json_integer(cache->max_milliseconds));
+  return object;
+}
@@ -0,0 +1,67 @@
+#ifndef BROWSE_H_
+#define BROWSE_H_
+
+// Browses of albums and artists, with responses kept serialized in a cache
+// bounded by their total size, keyed by the URI of the album or artist.
+// Requests for a browse that is already under way wait for it rather than
+// starting another, and browses are released once they are serialized.
+// Responses are JSON objects:
+//
+//   {"uri":<string>,"name":<string>,"year":<int>,
+//    "artist":{"uri":<string>,"name":<string>},"tracks":[<track>]}
+//
+// for albums, and for artists:
+//
+//   {"uri":<string>,"name":<string>,"biography":<string>,
+//    "albums":[{"uri":<string>,"name":<string>,"year":<int>}],
+//    "topTracks":[<track>]}
+//
+// with tracks as written by track_metadata_write.
+struct browse_cache;
+
+struct browse_waiter;
+
+struct track_metadata;
+
+// Called once a browse has completed, with the response or, if it failed,
+// NULL and the error
+typedef void (*browse_done_fn)(const char *body,
+                               size_t length,
+                               sp_error error,
+                               void *userdata);
+
+struct browse_cache *browse_cache_new(sp_session *session,
+                                      struct track_metadata *metadata,
+                                      size_t max_bytes,
+                                      apr_pool_t *pool);
+
+// Waiters are dropped without being called. Browses under way are left to
+// complete.
+void browse_cache_free(struct browse_cache *);
+
+// Writes the cached response for an album or artist, by its canonical URI,
+// if there's a fresh one. Returns whether there was.
+bool browse_cache_write(struct browse_cache *,
+                        const char *uri,
+                        struct evbuffer *buf);
+
+// Waits for a browse of an album (or artist), starting it unless it's already
+// under way. Returns NULL, without calling back, if it couldn't be started.
+struct browse_waiter *browse_cache_wait_album(struct browse_cache *,
+                                              const char *uri,
+                                              sp_album *album,
+                                              browse_done_fn callback,
+                                              void *userdata);
+
+struct browse_waiter *browse_cache_wait_artist(struct browse_cache *,
+                                               const char *uri,
+                                               sp_artist *artist,
+                                               browse_done_fn callback,
+                                               void *userdata);
+
+// Stops waiting, without calling back
+void browse_cache_cancel(struct browse_waiter *);
+
+json_t *browse_cache_to_json(struct browse_cache *, json_t *object);
+
+#endif
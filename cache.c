@@ -0,0 +1,172 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "cache.h"
+
+struct cache_entry {
+  char *key;
+  void *value;
+  size_t size;
+  time_t stored;
+  cache_free_fn free_fn;
+  TAILQ_ENTRY(cache_entry) entries;
+};
+
+TAILQ_HEAD(cache_entry_list, cache_entry);
+
+struct cache {
+  apr_hash_t *index;
+  struct cache_entry_list lru;  // Most recently used first
+  size_t max_bytes;
+  size_t max_entries;
+  size_t num_bytes;
+  size_t num_entries;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+struct cache *cache_new(size_t max_bytes,
+                        size_t max_entries,
+                        apr_pool_t *pool) {
+  struct cache *cache = calloc(1, sizeof (struct cache));
+  cache->index = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->max_bytes = max_bytes;
+  cache->max_entries = max_entries;
+  return cache;
+}
+
+static void cache_entry_remove(struct cache *cache, struct cache_entry *entry) {
+  TAILQ_REMOVE(&cache->lru, entry, entries);
+  apr_hash_set(cache->index, entry->key, APR_HASH_KEY_STRING, NULL);
+  cache->num_bytes -= entry->size;
+  cache->num_entries--;
+
+  if (entry->free_fn != NULL)
+    entry->free_fn(entry->value);
+
+  free(entry->key);
+  free(entry);
+}
+
+void cache_free(struct cache *cache) {
+  struct cache_entry *entry;
+
+  while ((entry = TAILQ_FIRST(&cache->lru)) != NULL)
+    cache_entry_remove(cache, entry);
+
+  free(cache);
+}
+
+void *cache_get(struct cache *cache,
+                const char *key,
+                size_t *size,
+                time_t *stored) {
+  struct cache_entry *entry = apr_hash_get(cache->index, key,
+                                           APR_HASH_KEY_STRING);
+
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+
+  cache->hits++;
+  TAILQ_REMOVE(&cache->lru, entry, entries);
+  TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+
+  if (size != NULL)
+    *size = entry->size;
+
+  if (stored != NULL)
+    *stored = entry->stored;
+
+  return entry->value;
+}
+
+static bool cache_over_budget(struct cache *cache) {
+  return (cache->max_bytes > 0 && cache->num_bytes > cache->max_bytes) ||
+         (cache->max_entries > 0 && cache->num_entries > cache->max_entries);
+}
+
+void cache_put(struct cache *cache,
+               const char *key,
+               void *value,
+               size_t size,
+               cache_free_fn free_fn) {
+  cache_remove(cache, key);
+
+  if (cache->max_bytes > 0 && size > cache->max_bytes) {
+    if (free_fn != NULL)
+      free_fn(value);
+
+    return;
+  }
+
+  struct cache_entry *entry = malloc(sizeof (struct cache_entry));
+  entry->key = strdup(key);
+  entry->value = value;
+  entry->size = size;
+  entry->stored = time(NULL);
+  entry->free_fn = free_fn;
+  TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+  apr_hash_set(cache->index, entry->key, APR_HASH_KEY_STRING, entry);
+  cache->num_bytes += size;
+  cache->num_entries++;
+
+  while (cache_over_budget(cache)) {
+    cache_entry_remove(cache, TAILQ_LAST(&cache->lru, cache_entry_list));
+    cache->evictions++;
+  }
+}
+
+bool cache_grow(struct cache *cache, const char *key, size_t size) {
+  struct cache_entry *entry = apr_hash_get(cache->index, key,
+                                           APR_HASH_KEY_STRING);
+
+  if (entry == NULL ||
+      (cache->max_bytes > 0 && entry->size + size > cache->max_bytes)) {
+    return false;
+  }
+
+  entry->size += size;
+  cache->num_bytes += size;
+
+  // The grown value itself is kept, as its owner is still using it
+  while (cache_over_budget(cache) &&
+         TAILQ_LAST(&cache->lru, cache_entry_list) != entry) {
+    cache_entry_remove(cache, TAILQ_LAST(&cache->lru, cache_entry_list));
+    cache->evictions++;
+  }
+
+  return true;
+}
+
+bool cache_remove(struct cache *cache, const char *key) {
+  struct cache_entry *entry = apr_hash_get(cache->index, key,
+                                           APR_HASH_KEY_STRING);
+
+  if (entry == NULL)
+    return false;
+
+  cache_entry_remove(cache, entry);
+  return true;
+}
+
+json_t *cache_to_json(struct cache *cache, json_t *object) {
+  json_object_set_new(object, "entries", json_integer(cache->num_entries));
+  json_object_set_new(object, "bytes", json_integer(cache->num_bytes));
+  json_object_set_new(object, "maxEntries", json_integer(cache->max_entries));
+  json_object_set_new(object, "maxBytes", json_integer(cache->max_bytes));
+  json_object_set_new(object, "hits", json_integer(cache->hits));
+  json_object_set_new(object, "misses", json_integer(cache->misses));
+  json_object_set_new(object, "evictions", json_integer(cache->evictions));
+  return object;
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+// String-keyed LRU cache, bounded by the total size of its values and by its
+// number of entries (0 means unbounded).
+struct cache;
+
+typedef void (*cache_free_fn)(void *value);
+
+struct cache *cache_new(size_t max_bytes, size_t max_entries, apr_pool_t *);
+
+void cache_free(struct cache *);
+
+// Returns the value stored under key, or NULL. Optionally returns its size
+// and when it was stored.
+void *cache_get(struct cache *, const char *key, size_t *size, time_t *stored);
+
+// Stores a value under key, taking ownership of it (it's freed with free_fn,
+// which may be NULL, when replaced or evicted). Values larger than the cache
+// are freed right away.
+void cache_put(struct cache *,
+               const char *key,
+               void *value,
+               size_t size,
+               cache_free_fn free_fn);
+
+// Counts more bytes against the value under key, for what has been attached
+// to it since it was stored, evicting other values to make room. Returns
+// false (counting nothing) if there's no such value or it wouldn't fit.
+bool cache_grow(struct cache *, const char *key, size_t size);
+
+// Returns whether there was something to remove
+bool cache_remove(struct cache *, const char *key);
+
+json_t *cache_to_json(struct cache *, json_t *object);
+
+#endif
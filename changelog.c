@@ -0,0 +1,336 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "changelog.h"
+#include "constants.h"
+#include "json.h"
+#include "trackid.h"
+
+// Changes kept per playlist
+#define CHANGELOG_MAX_OPS 512
+
+struct changelog_op {
+  unsigned long long revision;
+  size_t length;
+  char json[];
+};
+
+struct playlist_log {
+  sp_playlist *playlist;  // Also the hash key
+  struct changelog *changelog;
+  bool loaded;
+
+  // Changes after `covered` are all in the log
+  unsigned long long covered;
+  unsigned long long revision;
+  struct changelog_op *ops[CHANGELOG_MAX_OPS];
+  int start;
+  int length;
+  size_t bytes;
+};
+
+struct changelog {
+  apr_hash_t *playlists;
+  unsigned long long last_revision;
+
+  void (*changed)(sp_playlist *, void *);
+  void *changed_userdata;
+
+  unsigned long deltas;
+  unsigned long misses;
+};
+
+struct changelog *changelog_new(apr_pool_t *pool) {
+  struct changelog *changelog = calloc(1, sizeof (struct changelog));
+  changelog->playlists = apr_hash_make(pool);
+
+  // Leaves room for a million revisions a second before they could overlap
+  // with those of a later run
+  changelog->last_revision = (unsigned long long) time(NULL) << 20;
+  return changelog;
+}
+
+void changelog_set_listener(struct changelog *changelog,
+                            void (*changed)(sp_playlist *, void *),
+                            void *userdata) {
+  changelog->changed = changed;
+  changelog->changed_userdata = userdata;
+}
+
+static void playlist_log_changed(struct playlist_log *log) {
+  struct changelog *changelog = log->changelog;
+
+  if (changelog->changed != NULL)
+    changelog->changed(log->playlist, changelog->changed_userdata);
+}
+
+static void playlist_log_drop_oldest(struct playlist_log *log) {
+  struct changelog_op *op = log->ops[log->start];
+  log->covered = op->revision;
+  log->bytes -= op->length;
+  free(op);
+  log->start = (log->start + 1) % CHANGELOG_MAX_OPS;
+  log->length--;
+}
+
+// Forgets all changes, starting over from a new revision
+static void playlist_log_reset(struct playlist_log *log) {
+  while (log->length > 0)
+    playlist_log_drop_oldest(log);
+
+  log->revision = ++log->changelog->last_revision;
+  log->covered = log->revision;
+}
+
+// Appends a change, numbering it with the next revision. Takes ownership of
+// the JSON object describing the change.
+static void playlist_log_append(struct playlist_log *log,
+                                const char *name,
+                                json_t *op_json) {
+  log->revision = ++log->changelog->last_revision;
+  playlist_log_changed(log);
+
+  // Changes made while the playlist is loading aren't of interest to anyone:
+  // clients only ever get revisions of loaded playlists
+  if (!log->loaded) {
+    log->covered = log->revision;
+    json_decref(op_json);
+    return;
+  }
+
+  json_object_set_new(op_json, "revision", json_integer(log->revision));
+  json_object_set_new(op_json, "op", json_string(name));
+  char *json_str = json_dumps(op_json, JSON_COMPACT);
+  json_decref(op_json);
+  size_t length = strlen(json_str);
+
+  if (length > (size_t) kChangelogMaxBytes) {
+    free(json_str);
+    playlist_log_reset(log);
+    return;
+  }
+
+  struct changelog_op *op = malloc(sizeof (struct changelog_op) + length + 1);
+  op->revision = log->revision;
+  op->length = length;
+  memcpy(op->json, json_str, length + 1);
+  free(json_str);
+
+  while (log->length == CHANGELOG_MAX_OPS ||
+         (log->length > 0 && log->bytes + length > kChangelogMaxBytes)) {
+    playlist_log_drop_oldest(log);
+  }
+
+  log->ops[(log->start + log->length) % CHANGELOG_MAX_OPS] = op;
+  log->length++;
+  log->bytes += length;
+}
+
+static struct playlist_log *playlist_log_get(struct changelog *changelog,
+                                             sp_playlist *playlist) {
+  return apr_hash_get(changelog->playlists, &playlist, sizeof (playlist));
+}
+
+static void tracks_added(sp_playlist *playlist,
+                         sp_track *const *tracks,
+                         int num_tracks,
+                         int position,
+                         void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL)
+    return;
+
+  json_t *op = json_object();
+  json_t *uris = json_array();
+  json_object_set_new(op, "position", json_integer(position));
+  json_object_set_new(op, "tracks", uris);
+
+  for (int i = 0; log->loaded && i < num_tracks; i++) {
+    char uri[kTrackLinkLength];
+    track_to_uri(tracks[i], uri, kTrackLinkLength);
+    json_array_append_new(uris, json_string(uri));
+  }
+
+  playlist_log_append(log, "tracks-added", op);
+}
+
+static void tracks_removed(sp_playlist *playlist,
+                           const int *tracks,
+                           int num_tracks,
+                           void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL)
+    return;
+
+  json_t *op = json_object();
+  json_object_set_new(op, "positions", positions_to_json(tracks, num_tracks));
+  playlist_log_append(log, "tracks-removed", op);
+}
+
+static void tracks_moved(sp_playlist *playlist,
+                         const int *tracks,
+                         int num_tracks,
+                         int new_position,
+                         void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL)
+    return;
+
+  json_t *op = json_object();
+  json_object_set_new(op, "positions", positions_to_json(tracks, num_tracks));
+  json_object_set_new(op, "newPosition", json_integer(new_position));
+  playlist_log_append(log, "tracks-moved", op);
+}
+
+static void playlist_renamed(sp_playlist *playlist, void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL)
+    return;
+
+  json_t *op = json_object();
+  json_object_set_new(op, "title", json_string(sp_playlist_name(playlist)));
+  playlist_log_append(log, "renamed", op);
+}
+
+static void description_changed(sp_playlist *playlist,
+                                const char *description,
+                                void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL)
+    return;
+
+  json_t *op = json_object();
+  json_object_set_new(op, "description",
+                      description != NULL ? json_string(description)
+                                          : json_null());
+  playlist_log_append(log, "description-changed", op);
+}
+
+// Changes are only followed while a playlist is loaded
+static void playlist_state_changed(sp_playlist *playlist, void *userdata) {
+  struct playlist_log *log = playlist_log_get(userdata, playlist);
+
+  if (log == NULL || log->loaded == sp_playlist_is_loaded(playlist))
+    return;
+
+  log->loaded = !log->loaded;
+  playlist_log_reset(log);
+  playlist_log_changed(log);
+}
+
+static sp_playlist_callbacks changelog_playlist_callbacks = {
+  .tracks_added = &tracks_added,
+  .tracks_removed = &tracks_removed,
+  .tracks_moved = &tracks_moved,
+  .playlist_renamed = &playlist_renamed,
+  .description_changed = &description_changed,
+  .playlist_state_changed = &playlist_state_changed
+};
+
+void changelog_watch(struct changelog *changelog, sp_playlist *playlist) {
+  if (playlist_log_get(changelog, playlist) != NULL)
+    return;
+
+  struct playlist_log *log = calloc(1, sizeof (struct playlist_log));
+  log->playlist = playlist;
+  log->changelog = changelog;
+  log->loaded = sp_playlist_is_loaded(playlist);
+  playlist_log_reset(log);
+  apr_hash_set(changelog->playlists, &log->playlist, sizeof (playlist), log);
+  sp_playlist_add_callbacks(playlist, &changelog_playlist_callbacks,
+                            changelog);
+}
+
+static void playlist_log_free(struct playlist_log *log) {
+  struct changelog *changelog = log->changelog;
+  sp_playlist_remove_callbacks(log->playlist, &changelog_playlist_callbacks,
+                               changelog);
+  apr_hash_set(changelog->playlists, &log->playlist, sizeof (log->playlist),
+               NULL);
+
+  while (log->length > 0)
+    playlist_log_drop_oldest(log);
+
+  free(log);
+}
+
+void changelog_unwatch(struct changelog *changelog, sp_playlist *playlist) {
+  struct playlist_log *log = playlist_log_get(changelog, playlist);
+
+  if (log != NULL)
+    playlist_log_free(log);
+}
+
+void changelog_free(struct changelog *changelog) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, changelog->playlists)) != NULL) {
+    void *log;
+    apr_hash_this(hi, NULL, NULL, &log);
+    playlist_log_free(log);
+  }
+
+  free(changelog);
+}
+
+unsigned long long changelog_revision(struct changelog *changelog,
+                                      sp_playlist *playlist) {
+  struct playlist_log *log = playlist_log_get(changelog, playlist);
+  return log != NULL && log->loaded ? log->revision : 0;
+}
+
+bool changelog_changes_since(struct changelog *changelog,
+                             sp_playlist *playlist,
+                             unsigned long long since,
+                             struct evbuffer *buf) {
+  struct playlist_log *log = playlist_log_get(changelog, playlist);
+
+  if (log == NULL || !log->loaded || since < log->covered ||
+      since > log->revision) {
+    changelog->misses++;
+    return false;
+  }
+
+  changelog->deltas++;
+  evbuffer_add_printf(buf, "{\"revision\":%llu,\"since\":%llu,\"ops\":[",
+                      log->revision, since);
+  bool first = true;
+
+  for (int i = 0; i < log->length; i++) {
+    struct changelog_op *op = log->ops[(log->start + i) % CHANGELOG_MAX_OPS];
+
+    if (op->revision <= since)
+      continue;
+
+    if (!first)
+      evbuffer_add(buf, ",", 1);
+
+    evbuffer_add(buf, op->json, op->length);
+    first = false;
+  }
+
+  evbuffer_add(buf, "]}", 2);
+  return true;
+}
+
+json_t *changelog_to_json(struct changelog *changelog, json_t *object) {
+  json_object_set_new(object, "playlists",
+                      json_integer(apr_hash_count(changelog->playlists)));
+  json_object_set_new(object, "revision",
+                      json_integer(changelog->last_revision));
+  json_object_set_new(object, "deltas", json_integer(changelog->deltas));
+  json_object_set_new(object, "misses", json_integer(changelog->misses));
+  return object;
+}
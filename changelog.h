@@ -0,0 +1,37 @@
+#ifndef CHANGELOG_H_
+#define CHANGELOG_H_
+
+// Recent changes to playlists, numbered by revision, for clients that have a
+// copy of a playlist and only need to know what has changed since. Revisions
+// are unique across playlists and (as long as the clock doesn't go backwards)
+// across restarts.
+struct changelog;
+
+struct changelog *changelog_new(apr_pool_t *pool);
+
+void changelog_free(struct changelog *);
+
+// Sets a function to call after a watched playlist has changed
+void changelog_set_listener(struct changelog *,
+                            void (*changed)(sp_playlist *, void *),
+                            void *userdata);
+
+// Starts logging changes to a playlist
+void changelog_watch(struct changelog *, sp_playlist *);
+
+// Stops logging changes to a playlist and forgets about them
+void changelog_unwatch(struct changelog *, sp_playlist *);
+
+// Returns the current revision of a loaded, watched playlist, or 0
+unsigned long long changelog_revision(struct changelog *, sp_playlist *);
+
+// Writes the changes to a playlist after a revision as JSON. Returns false,
+// without writing anything, if they aren't all known.
+bool changelog_changes_since(struct changelog *,
+                             sp_playlist *,
+                             unsigned long long since,
+                             struct evbuffer *buf);
+
+json_t *changelog_to_json(struct changelog *, json_t *object);
+
+#endif
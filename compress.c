@@ -0,0 +1,210 @@
+#include <ctype.h>
+#include <event2/buffer.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "constants.h"
+
+static const char *coding_names[COMPRESS_NUM_CODINGS] = {
+  [COMPRESS_IDENTITY] = "identity",
+  [COMPRESS_GZIP] = "gzip",
+  [COMPRESS_DEFLATE] = "deflate",
+  [COMPRESS_ZSTD] = "zstd"
+};
+
+// Preferred when q-values tie; codings not built in are never picked
+static const int coding_preferences[COMPRESS_NUM_CODINGS] = {
+  [COMPRESS_IDENTITY] = 0,
+  [COMPRESS_GZIP] = 2,
+  [COMPRESS_DEFLATE] = 1,
+#ifdef HAVE_ZSTD
+  [COMPRESS_ZSTD] = 3
+#else
+  [COMPRESS_ZSTD] = -1
+#endif
+};
+
+const char *compress_coding_name(enum compress_coding coding) {
+  return coding_names[coding];
+}
+
+// Compares a token of a header case-insensitively against a name
+static bool token_is(const char *token, size_t length, const char *name) {
+  if (strlen(name) != length)
+    return false;
+
+  for (size_t i = 0; i < length; i++) {
+    if (tolower((unsigned char) token[i]) != name[i])
+      return false;
+  }
+
+  return true;
+}
+
+enum compress_coding compress_negotiate(const char *accept_encoding) {
+  enum compress_coding best = COMPRESS_IDENTITY;
+  double best_q = 0;
+
+  if (accept_encoding == NULL)
+    return best;
+
+  const char *element = accept_encoding;
+
+  while (*element != '\0') {
+    size_t element_length = strcspn(element, ",");
+    const char *token = element + strspn(element, " \t");
+    size_t token_length = strcspn(token, ";, \t");
+    const char *params = memchr(element, ';', element_length);
+    double q = 1;
+
+    if (params != NULL) {
+      const char *q_param = strstr(params, "q=");
+
+      if (q_param != NULL && q_param < element + element_length)
+        q = strtod(q_param + 2, NULL);
+    }
+
+    for (int coding = COMPRESS_GZIP; coding < COMPRESS_NUM_CODINGS; coding++) {
+      bool named = token_is(token, token_length, coding_names[coding]) ||
+          (coding == COMPRESS_GZIP &&
+           (token_is(token, token_length, "x-gzip") ||
+            token_is(token, token_length, "*")));
+
+      if (!named || coding_preferences[coding] < 0 || q <= 0)
+        continue;
+
+      if (q > best_q || (q == best_q &&
+                         coding_preferences[coding] >
+                         coding_preferences[best])) {
+        best = coding;
+        best_q = q;
+      }
+    }
+
+    element += element_length;
+
+    if (*element == ',')
+      element++;
+  }
+
+  return best;
+}
+
+// Deflates the chunks of a buffer in turn, as a zlib stream or, with window
+// bits above 15, a gzip one
+static bool deflate_evbuffer(int window_bits,
+                             struct evbuffer_iovec *chunks,
+                             int num_chunks,
+                             struct evbuffer *out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof (stream));
+
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  bool ok = true;
+
+  for (int i = 0; i <= num_chunks && ok; i++) {
+    bool last = i == num_chunks;
+    stream.next_in = last ? Z_NULL : chunks[i].iov_base;
+    stream.avail_in = last ? 0 : chunks[i].iov_len;
+
+    // Output space is taken a chunk at a time until some is left over
+    do {
+      struct evbuffer_iovec space;
+      evbuffer_reserve_space(out, kCompressChunkBytes, &space, 1);
+      stream.next_out = space.iov_base;
+      stream.avail_out = space.iov_len;
+      ok = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH) != Z_STREAM_ERROR;
+      space.iov_len -= stream.avail_out;
+      evbuffer_commit_space(out, &space, 1);
+    } while (ok && stream.avail_out == 0);
+  }
+
+  deflateEnd(&stream);
+  return ok;
+}
+
+#ifdef HAVE_ZSTD
+static bool zstd_evbuffer(struct evbuffer_iovec *chunks,
+                          int num_chunks,
+                          struct evbuffer *out) {
+  ZSTD_CCtx *context = ZSTD_createCCtx();
+
+  if (context == NULL)
+    return false;
+
+  bool ok = true;
+
+  for (int i = 0; i <= num_chunks && ok; i++) {
+    bool last = i == num_chunks;
+    ZSTD_inBuffer input = {
+      .src = last ? NULL : chunks[i].iov_base,
+      .size = last ? 0 : chunks[i].iov_len
+    };
+    bool done;
+
+    do {
+      struct evbuffer_iovec space;
+      evbuffer_reserve_space(out, kCompressChunkBytes, &space, 1);
+      ZSTD_outBuffer output = { .dst = space.iov_base, .size = space.iov_len };
+      size_t remaining = ZSTD_compressStream2(
+          context, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+      ok = !ZSTD_isError(remaining);
+      space.iov_len = output.pos;
+      evbuffer_commit_space(out, &space, 1);
+      done = last ? remaining == 0 : input.pos == input.size;
+    } while (ok && !done);
+  }
+
+  ZSTD_freeCCtx(context);
+  return ok;
+}
+#endif
+
+bool compress_evbuffer(enum compress_coding coding,
+                       struct evbuffer *in,
+                       struct evbuffer *out) {
+  int num_chunks = evbuffer_peek(in, -1, NULL, NULL, 0);
+  struct evbuffer_iovec *chunks =
+      malloc((num_chunks > 0 ? num_chunks : 1) * sizeof (*chunks));
+  evbuffer_peek(in, -1, NULL, chunks, num_chunks);
+  struct evbuffer *compressed = evbuffer_new();
+  bool ok;
+
+  switch (coding) {
+    case COMPRESS_GZIP:
+      ok = deflate_evbuffer(MAX_WBITS + 16, chunks, num_chunks, compressed);
+      break;
+
+    case COMPRESS_DEFLATE:
+      ok = deflate_evbuffer(MAX_WBITS, chunks, num_chunks, compressed);
+      break;
+
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+      ok = zstd_evbuffer(chunks, num_chunks, compressed);
+      break;
+#endif
+
+    default:
+      ok = false;
+      break;
+  }
+
+  if (ok)
+    evbuffer_add_buffer(out, compressed);
+
+  evbuffer_free(compressed);
+  free(chunks);
+  return ok;
+}
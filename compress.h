@@ -0,0 +1,28 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+// Content codings for responses: gzip and deflate with zlib, and zstd when
+// built with HAVE_ZSTD
+enum compress_coding {
+  COMPRESS_IDENTITY,
+  COMPRESS_GZIP,
+  COMPRESS_DEFLATE,
+  COMPRESS_ZSTD,
+  COMPRESS_NUM_CODINGS
+};
+
+// Picks the coding to respond with from an Accept-Encoding header (which may
+// be NULL): the one with the highest q-value, zstd being preferred over gzip
+// and gzip over deflate when tied
+enum compress_coding compress_negotiate(const char *accept_encoding);
+
+// Returns the name of a coding for the Content-Encoding header
+const char *compress_coding_name(enum compress_coding coding);
+
+// Compresses what's in a buffer, chunk by chunk, adding the result to
+// another. Returns false if compression failed, leaving out as it was.
+bool compress_evbuffer(enum compress_coding coding,
+                       struct evbuffer *in,
+                       struct evbuffer *out);
+
+#endif
@@ -10,4 +10,72 @@ static const int kPlaylistLinkLength = 512;
 // Maximum number of characters in a playlist title
 static const int kMaxPlaylistTitleLength = 256;
 
+// Estimated memory held by a resident playlist or container, excluding tracks
+static const int kResidentOverheadBytes = 4096;
+
+// Estimated memory held per track of a resident playlist
+static const int kResidentTrackBytes = 256;
+
+// Maximum length of the key identifying a client for rate limiting
+static const int kMaxClientKeyLength = 256;
+
+// Seconds between heartbeats on idle event streams
+static const int kStreamHeartbeatSeconds = 15;
+
+// Seconds to keep following a playlist after its last event stream has ended,
+// and to let an ended stream drain
+static const int kStreamLingerSeconds = 60;
+
+// Unsent bytes an event stream may have before it's ended
+static const int kStreamMaxBufferBytes = 256 << 10;
+
+// Seconds a worker has to stay up for to be restarted right away when it
+// dies
+static const int kWorkerRestartSeconds = 1;
+
+// Milliseconds between writing out log lines
+static const int kLogFlushMilliseconds = 100;
+
+// Bytes of changes kept per playlist for clients asking what has changed
+static const int kChangelogMaxBytes = 256 << 10;
+
+// Playlists whose subscribers are kept
+static const int kSubscriberCacheMaxEntries = 10000;
+
+// Seconds after which an update of subscribers that hasn't come back is asked
+// for again
+static const int kSubscribersUpdateRetrySeconds = 30;
+
+// Users a batch of inbox posts may go to
+static const int kInboxBatchMaxUsers = 10000;
+
+// Tracks a page of search results has by default, and at most
+static const int kSearchDefaultLimit = 50;
+static const int kSearchMaxLimit = 200;
+
+// Seconds search results are served from the cache
+static const int kSearchResultTtlSeconds = 600;
+
+// Seconds albums and artists are served from the cache
+static const int kBrowseResultTtlSeconds = 3600;
+
+// Responses smaller than this many bytes aren't worth compressing
+static const int kCompressMinBytes = 1024;
+
+// Bytes of output space taken at a time while compressing
+static const int kCompressChunkBytes = 16 << 10;
+
+// Playlists a merge may take tracks from
+static const int kPlaylistMergeMaxSources = 100;
+
+// Tracks added to a copied or merged playlist at a time
+static const int kPlaylistMergeBatchTracks = 10000;
+
+// Jobs kept, running or finished, and bytes of results of finished ones
+static const int kJobsMaxEntries = 1000;
+static const int kJobsMaxBytes = 64 << 20;
+
+// Seconds clients are told to wait when there are too many jobs running
+static const int kJobsRetryAfterSeconds = 5;
+
 #endif
@@ -0,0 +1,444 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <apr_pools.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "containerindex.h"
+
+struct indexed_playlist {
+  sp_playlist *playlist;  // Also the hash key
+  struct container_index *index;
+  int position;  // The first, if it's in the container more than once
+  int occurrences;
+  char *title;  // As indexed; NULL while it has none
+};
+
+// Playlists sharing a title, in no particular order
+struct titled_playlists {
+  char *title;  // Also the hash key
+  struct indexed_playlist **playlists;
+  int num_playlists;
+  int capacity;
+};
+
+struct container_index {
+  sp_playlistcontainer *pc;  // Also the hash key
+  struct container_indexes *indexes;
+  apr_pool_t *pool;
+  apr_hash_t *playlists;
+  apr_hash_t *titles;
+};
+
+struct container_indexes {
+  apr_pool_t *pool;
+  apr_hash_t *containers;
+
+  unsigned long lookups;
+  unsigned long scans;
+  unsigned long rebuilds;
+};
+
+struct container_indexes *container_indexes_new(apr_pool_t *pool) {
+  struct container_indexes *indexes =
+      calloc(1, sizeof (struct container_indexes));
+  indexes->pool = pool;
+  indexes->containers = apr_hash_make(pool);
+  return indexes;
+}
+
+static void index_title_add(struct container_index *index,
+                            struct indexed_playlist *indexed) {
+  const char *title = sp_playlist_name(indexed->playlist);
+
+  // Playlists that haven't loaded have no title yet
+  if (title == NULL || *title == '\0')
+    return;
+
+  indexed->title = strdup(title);
+  struct titled_playlists *titled = apr_hash_get(index->titles, title,
+                                                 APR_HASH_KEY_STRING);
+
+  if (titled == NULL) {
+    titled = calloc(1, sizeof (struct titled_playlists));
+    titled->title = strdup(title);
+    apr_hash_set(index->titles, titled->title, APR_HASH_KEY_STRING, titled);
+  }
+
+  if (titled->num_playlists == titled->capacity) {
+    titled->capacity = titled->capacity > 0 ? 2 * titled->capacity : 1;
+    titled->playlists = realloc(titled->playlists,
+        titled->capacity * sizeof (struct indexed_playlist *));
+  }
+
+  titled->playlists[titled->num_playlists++] = indexed;
+}
+
+static void index_title_remove(struct container_index *index,
+                               struct indexed_playlist *indexed) {
+  if (indexed->title == NULL)
+    return;
+
+  struct titled_playlists *titled = apr_hash_get(index->titles,
+                                                 indexed->title,
+                                                 APR_HASH_KEY_STRING);
+  free(indexed->title);
+  indexed->title = NULL;
+
+  if (titled == NULL)
+    return;
+
+  for (int i = 0; i < titled->num_playlists; i++) {
+    if (titled->playlists[i] == indexed) {
+      titled->playlists[i] = titled->playlists[--titled->num_playlists];
+      break;
+    }
+  }
+
+  if (titled->num_playlists == 0) {
+    apr_hash_set(index->titles, titled->title, APR_HASH_KEY_STRING, NULL);
+    free(titled->playlists);
+    free(titled->title);
+    free(titled);
+  }
+}
+
+// Titles are indexed again when they change, or become known when the
+// playlist loads
+static void indexed_playlist_retitle(sp_playlist *playlist, void *userdata) {
+  struct indexed_playlist *indexed = userdata;
+  index_title_remove(indexed->index, indexed);
+  index_title_add(indexed->index, indexed);
+}
+
+static sp_playlist_callbacks indexed_playlist_callbacks = {
+  .playlist_renamed = &indexed_playlist_retitle,
+  .playlist_state_changed = &indexed_playlist_retitle
+};
+
+// A playlist that is in a container more than once is indexed at its first
+// position
+static struct indexed_playlist *index_add_playlist(
+    struct container_index *index,
+    sp_playlist *playlist,
+    int position) {
+  struct indexed_playlist *indexed =
+      calloc(1, sizeof (struct indexed_playlist));
+  indexed->playlist = playlist;
+  indexed->index = index;
+  indexed->position = position;
+  indexed->occurrences = 1;
+  apr_hash_set(index->playlists, &indexed->playlist, sizeof (playlist),
+               indexed);
+  index_title_add(index, indexed);
+  sp_playlist_add_callbacks(playlist, &indexed_playlist_callbacks, indexed);
+  return indexed;
+}
+
+static void index_remove_playlist(struct container_index *index,
+                                  struct indexed_playlist *indexed) {
+  sp_playlist_remove_callbacks(indexed->playlist, &indexed_playlist_callbacks,
+                               indexed);
+  index_title_remove(index, indexed);
+  apr_hash_set(index->playlists, &indexed->playlist,
+               sizeof (indexed->playlist), NULL);
+  free(indexed);
+}
+
+static void index_clear(struct container_index *index) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, index->playlists)) != NULL) {
+    void *indexed;
+    apr_hash_this(hi, NULL, NULL, &indexed);
+    index_remove_playlist(index, indexed);
+  }
+}
+
+// Shifts the positions of the playlists from one position to another
+// (inclusive) by delta, after playlists have been added, removed or moved
+static void index_shift_positions(struct container_index *index,
+                                  int from,
+                                  int to,
+                                  int delta) {
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, index->playlists);
+       hi != NULL; hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct indexed_playlist *indexed = value;
+
+    if (indexed->position >= from && indexed->position <= to)
+      indexed->position += delta;
+  }
+}
+
+// Finds the first position of a playlist that is in the container more than
+// once, which can't be worked out from the positions alone
+static int index_first_position(struct container_index *index,
+                                sp_playlist *playlist) {
+  sp_playlistcontainer *pc = index->pc;
+
+  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+    if (sp_playlistcontainer_playlist_type(pc, i) == SP_PLAYLIST_TYPE_PLAYLIST &&
+        sp_playlistcontainer_playlist(pc, i) == playlist) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void index_build(struct container_index *index) {
+  sp_playlistcontainer *pc = index->pc;
+  index_clear(index);
+  index->indexes->rebuilds++;
+
+  if (!sp_playlistcontainer_is_loaded(pc))
+    return;
+
+  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+    if (sp_playlistcontainer_playlist_type(pc, i) != SP_PLAYLIST_TYPE_PLAYLIST)
+      continue;
+
+    sp_playlist *playlist = sp_playlistcontainer_playlist(pc, i);
+    struct indexed_playlist *indexed = apr_hash_get(index->playlists,
+                                                    &playlist,
+                                                    sizeof (playlist));
+
+    if (indexed == NULL)
+      index_add_playlist(index, playlist, i);
+    else
+      indexed->occurrences++;
+  }
+}
+
+static void playlist_added(sp_playlistcontainer *pc,
+                           sp_playlist *playlist,
+                           int position,
+                           void *userdata) {
+  struct container_index *index = userdata;
+
+  // Positions from the new playlist on have shifted by one
+  index_shift_positions(index, position, INT_MAX, 1);
+
+  if (sp_playlistcontainer_playlist_type(pc, position) !=
+      SP_PLAYLIST_TYPE_PLAYLIST) {
+    return;
+  }
+
+  struct indexed_playlist *indexed = apr_hash_get(index->playlists, &playlist,
+                                                  sizeof (playlist));
+
+  if (indexed == NULL) {
+    index_add_playlist(index, playlist, position);
+    return;
+  }
+
+  // A playlist that was there already may have moved up to a new first
+  // position
+  indexed->occurrences++;
+
+  if (indexed->position > position)
+    indexed->position = position;
+}
+
+static void playlist_removed(sp_playlistcontainer *pc,
+                             sp_playlist *playlist,
+                             int position,
+                             void *userdata) {
+  struct container_index *index = userdata;
+  struct indexed_playlist *indexed = apr_hash_get(index->playlists, &playlist,
+                                                  sizeof (playlist));
+  index_shift_positions(index, position + 1, INT_MAX, -1);
+
+  if (indexed == NULL)
+    return;
+
+  if (--indexed->occurrences == 0)
+    index_remove_playlist(index, indexed);
+  else if (indexed->position == position)
+    indexed->position = index_first_position(index, playlist);
+}
+
+static void playlist_moved(sp_playlistcontainer *pc,
+                           sp_playlist *playlist,
+                           int position,
+                           int new_position,
+                           void *userdata) {
+  struct container_index *index = userdata;
+  struct indexed_playlist *indexed = apr_hash_get(index->playlists, &playlist,
+                                                  sizeof (playlist));
+
+  // The new position is in the container as it was before the move
+  if (new_position > position) {
+    new_position--;
+    index_shift_positions(index, position + 1, new_position, -1);
+  } else {
+    index_shift_positions(index, new_position, position - 1, 1);
+  }
+
+  if (indexed == NULL)
+    return;
+
+  if (indexed->occurrences > 1)
+    indexed->position = index_first_position(index, playlist);
+  else
+    indexed->position = new_position;
+}
+
+static void container_loaded(sp_playlistcontainer *pc, void *userdata) {
+  index_build(userdata);
+}
+
+static sp_playlistcontainer_callbacks container_index_callbacks = {
+  .playlist_added = &playlist_added,
+  .playlist_removed = &playlist_removed,
+  .playlist_moved = &playlist_moved,
+  .container_loaded = &container_loaded
+};
+
+void container_indexes_watch(struct container_indexes *indexes,
+                             sp_playlistcontainer *pc) {
+  if (apr_hash_get(indexes->containers, &pc, sizeof (pc)) != NULL)
+    return;
+
+  struct container_index *index = calloc(1, sizeof (struct container_index));
+  index->pc = pc;
+  index->indexes = indexes;
+  apr_pool_create(&index->pool, indexes->pool);
+  index->playlists = apr_hash_make(index->pool);
+  index->titles = apr_hash_make(index->pool);
+  apr_hash_set(indexes->containers, &index->pc, sizeof (pc), index);
+  sp_playlistcontainer_add_callbacks(pc, &container_index_callbacks, index);
+  index_build(index);
+}
+
+static void container_index_free(struct container_index *index) {
+  struct container_indexes *indexes = index->indexes;
+  sp_playlistcontainer_remove_callbacks(index->pc, &container_index_callbacks,
+                                        index);
+  index_clear(index);
+  apr_hash_set(indexes->containers, &index->pc, sizeof (index->pc), NULL);
+  apr_pool_destroy(index->pool);
+  free(index);
+}
+
+void container_indexes_unwatch(struct container_indexes *indexes,
+                               sp_playlistcontainer *pc) {
+  struct container_index *index = apr_hash_get(indexes->containers, &pc,
+                                               sizeof (pc));
+
+  if (index != NULL)
+    container_index_free(index);
+}
+
+void container_indexes_free(struct container_indexes *indexes) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, indexes->containers)) != NULL) {
+    void *index;
+    apr_hash_this(hi, NULL, NULL, &index);
+    container_index_free(index);
+  }
+
+  free(indexes);
+}
+
+// Containers that aren't indexed (or haven't loaded) are searched
+static struct container_index *container_index_get(
+    struct container_indexes *indexes,
+    sp_playlistcontainer *pc) {
+  struct container_index *index = apr_hash_get(indexes->containers, &pc,
+                                               sizeof (pc));
+
+  if (index == NULL || !sp_playlistcontainer_is_loaded(pc)) {
+    indexes->scans++;
+    return NULL;
+  }
+
+  indexes->lookups++;
+  return index;
+}
+
+int container_indexes_position(struct container_indexes *indexes,
+                               sp_playlistcontainer *pc,
+                               sp_playlist *playlist) {
+  struct container_index *index = container_index_get(indexes, pc);
+
+  if (index != NULL) {
+    struct indexed_playlist *indexed = apr_hash_get(index->playlists,
+                                                    &playlist,
+                                                    sizeof (playlist));
+    return indexed != NULL ? indexed->position : -1;
+  }
+
+  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+    if (sp_playlistcontainer_playlist_type(pc, i) == SP_PLAYLIST_TYPE_PLAYLIST &&
+        sp_playlistcontainer_playlist(pc, i) == playlist) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int compare_positions(const void *a, const void *b) {
+  return (*(struct indexed_playlist * const *) a)->position -
+      (*(struct indexed_playlist * const *) b)->position;
+}
+
+sp_playlist **container_indexes_titled(struct container_indexes *indexes,
+                                       sp_playlistcontainer *pc,
+                                       const char *title,
+                                       int *num_playlists) {
+  struct container_index *index = container_index_get(indexes, pc);
+  sp_playlist **playlists = NULL;
+  *num_playlists = 0;
+
+  if (index != NULL) {
+    struct titled_playlists *titled = apr_hash_get(index->titles, title,
+                                                   APR_HASH_KEY_STRING);
+
+    if (titled == NULL)
+      return NULL;
+
+    qsort(titled->playlists, titled->num_playlists,
+          sizeof (struct indexed_playlist *), &compare_positions);
+    playlists = malloc(titled->num_playlists * sizeof (sp_playlist *));
+
+    for (int i = 0; i < titled->num_playlists; i++)
+      playlists[i] = titled->playlists[i]->playlist;
+
+    *num_playlists = titled->num_playlists;
+    return playlists;
+  }
+
+  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+    if (sp_playlistcontainer_playlist_type(pc, i) != SP_PLAYLIST_TYPE_PLAYLIST)
+      continue;
+
+    sp_playlist *playlist = sp_playlistcontainer_playlist(pc, i);
+
+    if (strcmp(sp_playlist_name(playlist), title) == 0) {
+      playlists = realloc(playlists,
+                          (*num_playlists + 1) * sizeof (sp_playlist *));
+      playlists[(*num_playlists)++] = playlist;
+    }
+  }
+
+  return playlists;
+}
+
+json_t *container_indexes_to_json(struct container_indexes *indexes,
+                                  json_t *object) {
+  json_object_set_new(object, "containers",
+                      json_integer(apr_hash_count(indexes->containers)));
+  json_object_set_new(object, "lookups", json_integer(indexes->lookups));
+  json_object_set_new(object, "scans", json_integer(indexes->scans));
+  json_object_set_new(object, "rebuilds", json_integer(indexes->rebuilds));
+  return object;
+}
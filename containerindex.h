@@ -0,0 +1,35 @@
+#ifndef CONTAINERINDEX_H_
+#define CONTAINERINDEX_H_
+
+// Positions of the playlists in playlist containers, by playlist and by
+// title, kept up to date from container and playlist callbacks so that they
+// needn't be searched for. Containers that aren't watched are searched.
+struct container_indexes;
+
+struct container_indexes *container_indexes_new(apr_pool_t *pool);
+
+void container_indexes_free(struct container_indexes *);
+
+// Starts indexing a container
+void container_indexes_watch(struct container_indexes *,
+                             sp_playlistcontainer *);
+
+// Stops indexing a container
+void container_indexes_unwatch(struct container_indexes *,
+                               sp_playlistcontainer *);
+
+// Returns the position of a playlist in a container, or -1
+int container_indexes_position(struct container_indexes *,
+                               sp_playlistcontainer *,
+                               sp_playlist *);
+
+// Returns the playlists with a title in a container, in order, as a newly
+// allocated array (to be `free`d) of num_playlists; NULL if there are none
+sp_playlist **container_indexes_titled(struct container_indexes *,
+                                       sp_playlistcontainer *,
+                                       const char *title,
+                                       int *num_playlists);
+
+json_t *container_indexes_to_json(struct container_indexes *, json_t *object);
+
+#endif
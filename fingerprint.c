@@ -0,0 +1,340 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <inttypes.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "fingerprint.h"
+#include "fnv.h"
+#include "trackid.h"
+
+// Reads the ID of a track URI. URIs without one (local tracks) get a hash of
+// the URI instead, in the last 8 bytes.
+static void track_key_from_uri(const char *uri, unsigned char *key) {
+  if (track_id_from_uri(uri, key))
+    return;
+
+  uint64_t hash = fnv1a_string(kFnvOffsetBasis, uri);
+  memset(key, 0xff, TRACK_ID_LENGTH);
+
+  for (int i = 0; i < 8; i++)
+    key[TRACK_ID_LENGTH - 1 - i] = (hash >> (8 * i)) & 0xff;
+}
+
+static void track_key(sp_track *track, unsigned char *key) {
+  char uri[kTrackLinkLength];
+  track_to_uri(track, uri, kTrackLinkLength);
+  track_key_from_uri(uri, key);
+}
+
+fingerprint_t fingerprint_start(void) {
+  return kFnvOffsetBasis;
+}
+
+fingerprint_t fingerprint_add_uri(fingerprint_t fingerprint, const char *uri) {
+  unsigned char key[TRACK_ID_LENGTH];
+  track_key_from_uri(uri, key);
+  return fnv1a(fingerprint, key, TRACK_ID_LENGTH);
+}
+
+void fingerprint_to_string(fingerprint_t fingerprint, char *str) {
+  snprintf(str, FINGERPRINT_STRING_LENGTH + 1, "%016" PRIx64, fingerprint);
+}
+
+bool fingerprint_from_string(const char *str, fingerprint_t *fingerprint) {
+  if (*str == '"')
+    str++;
+
+  size_t length = strspn(str, "0123456789abcdefABCDEF");
+
+  if (length != FINGERPRINT_STRING_LENGTH ||
+      (str[length] != '\0' && strcmp(str + length, "\"") != 0)) {
+    return false;
+  }
+
+  return sscanf(str, "%16" SCNx64, fingerprint) == 1;
+}
+
+// Track keys of a watched playlist, in order
+struct playlist_tracks {
+  sp_playlist *playlist;  // Also the hash key
+  struct fingerprints *fingerprints;
+  bool read;  // Whether the keys have been read from the playlist
+  bool dirty;  // Whether the fingerprint has to be recomputed from the keys
+  fingerprint_t fingerprint;
+  unsigned char *keys;
+  int num_tracks;
+  int capacity;
+};
+
+struct fingerprints {
+  apr_hash_t *playlists;
+};
+
+struct fingerprints *fingerprints_new(apr_pool_t *pool) {
+  struct fingerprints *fingerprints = malloc(sizeof (struct fingerprints));
+  fingerprints->playlists = apr_hash_make(pool);
+  return fingerprints;
+}
+
+static void playlist_tracks_reserve(struct playlist_tracks *tracks,
+                                    int num_tracks) {
+  if (num_tracks <= tracks->capacity)
+    return;
+
+  tracks->capacity = num_tracks > 2 * tracks->capacity ?
+      num_tracks : 2 * tracks->capacity;
+  tracks->keys = realloc(tracks->keys, tracks->capacity * TRACK_ID_LENGTH);
+}
+
+static void playlist_tracks_forget(struct playlist_tracks *tracks) {
+  tracks->read = false;
+  tracks->num_tracks = 0;
+}
+
+static void playlist_tracks_read(struct playlist_tracks *tracks) {
+  sp_playlist *playlist = tracks->playlist;
+  int num_tracks = sp_playlist_num_tracks(playlist);
+  playlist_tracks_reserve(tracks, num_tracks);
+
+  for (int i = 0; i < num_tracks; i++) {
+    track_key(sp_playlist_track(playlist, i),
+              tracks->keys + i * TRACK_ID_LENGTH);
+  }
+
+  tracks->num_tracks = num_tracks;
+  tracks->read = true;
+  tracks->dirty = true;
+}
+
+static void tracks_added(sp_playlist *playlist,
+                         sp_track *const *added,
+                         int num_added,
+                         int position,
+                         void *userdata) {
+  struct playlist_tracks *tracks = apr_hash_get(
+      ((struct fingerprints *) userdata)->playlists, &playlist,
+      sizeof (playlist));
+
+  if (tracks == NULL || !tracks->read)
+    return;
+
+  if (position < 0 || position > tracks->num_tracks) {
+    playlist_tracks_forget(tracks);
+    return;
+  }
+
+  playlist_tracks_reserve(tracks, tracks->num_tracks + num_added);
+  unsigned char *at = tracks->keys + position * TRACK_ID_LENGTH;
+  memmove(at + num_added * TRACK_ID_LENGTH, at,
+          (tracks->num_tracks - position) * TRACK_ID_LENGTH);
+
+  for (int i = 0; i < num_added; i++)
+    track_key(added[i], at + i * TRACK_ID_LENGTH);
+
+  // Tracks appended to the end carry the fingerprint on
+  if (position == tracks->num_tracks && !tracks->dirty) {
+    tracks->fingerprint = fnv1a(tracks->fingerprint, at,
+                                num_added * TRACK_ID_LENGTH);
+  } else {
+    tracks->dirty = true;
+  }
+
+  tracks->num_tracks += num_added;
+}
+
+// Takes the keys at the given positions out of the sequence, optionally
+// copying them (in the given order) to `taken`. Returns false if a position
+// is out of range.
+static bool playlist_tracks_take(struct playlist_tracks *tracks,
+                                 const int *positions,
+                                 int num_positions,
+                                 unsigned char *taken) {
+  bool *marked = calloc(tracks->num_tracks, sizeof (bool));
+
+  for (int i = 0; i < num_positions; i++) {
+    if (positions[i] < 0 || positions[i] >= tracks->num_tracks) {
+      free(marked);
+      return false;
+    }
+
+    marked[positions[i]] = true;
+
+    if (taken != NULL) {
+      memcpy(taken + i * TRACK_ID_LENGTH,
+             tracks->keys + positions[i] * TRACK_ID_LENGTH, TRACK_ID_LENGTH);
+    }
+  }
+
+  int kept = 0;
+
+  for (int i = 0; i < tracks->num_tracks; i++) {
+    if (marked[i])
+      continue;
+
+    if (kept != i) {
+      memcpy(tracks->keys + kept * TRACK_ID_LENGTH,
+             tracks->keys + i * TRACK_ID_LENGTH, TRACK_ID_LENGTH);
+    }
+
+    kept++;
+  }
+
+  free(marked);
+  tracks->num_tracks = kept;
+  tracks->dirty = true;
+  return true;
+}
+
+static void tracks_removed(sp_playlist *playlist,
+                           const int *removed,
+                           int num_removed,
+                           void *userdata) {
+  struct playlist_tracks *tracks = apr_hash_get(
+      ((struct fingerprints *) userdata)->playlists, &playlist,
+      sizeof (playlist));
+
+  if (tracks == NULL || !tracks->read)
+    return;
+
+  if (!playlist_tracks_take(tracks, removed, num_removed, NULL))
+    playlist_tracks_forget(tracks);
+}
+
+static void tracks_moved(sp_playlist *playlist,
+                         const int *moved,
+                         int num_moved,
+                         int new_position,
+                         void *userdata) {
+  struct playlist_tracks *tracks = apr_hash_get(
+      ((struct fingerprints *) userdata)->playlists, &playlist,
+      sizeof (playlist));
+
+  if (tracks == NULL || !tracks->read)
+    return;
+
+  unsigned char *taken = malloc(num_moved * TRACK_ID_LENGTH);
+
+  if (!playlist_tracks_take(tracks, moved, num_moved, taken)) {
+    free(taken);
+    playlist_tracks_forget(tracks);
+    return;
+  }
+
+  // The new position counts the moved tracks that were before it
+  for (int i = 0; i < num_moved; i++) {
+    if (moved[i] < new_position)
+      new_position--;
+  }
+
+  if (new_position < 0 || new_position > tracks->num_tracks) {
+    free(taken);
+    playlist_tracks_forget(tracks);
+    return;
+  }
+
+  unsigned char *at = tracks->keys + new_position * TRACK_ID_LENGTH;
+  memmove(at + num_moved * TRACK_ID_LENGTH, at,
+          (tracks->num_tracks - new_position) * TRACK_ID_LENGTH);
+  memcpy(at, taken, num_moved * TRACK_ID_LENGTH);
+  tracks->num_tracks += num_moved;
+  free(taken);
+}
+
+// Track keys are read again from a playlist that has reloaded
+static void playlist_state_changed(sp_playlist *playlist, void *userdata) {
+  struct playlist_tracks *tracks = apr_hash_get(
+      ((struct fingerprints *) userdata)->playlists, &playlist,
+      sizeof (playlist));
+
+  if (tracks != NULL && !sp_playlist_is_loaded(playlist))
+    playlist_tracks_forget(tracks);
+}
+
+static sp_playlist_callbacks fingerprint_playlist_callbacks = {
+  .tracks_added = &tracks_added,
+  .tracks_removed = &tracks_removed,
+  .tracks_moved = &tracks_moved,
+  .playlist_state_changed = &playlist_state_changed
+};
+
+void fingerprints_watch(struct fingerprints *fingerprints,
+                        sp_playlist *playlist) {
+  if (apr_hash_get(fingerprints->playlists, &playlist,
+                   sizeof (playlist)) != NULL) {
+    return;
+  }
+
+  struct playlist_tracks *tracks = calloc(1, sizeof (struct playlist_tracks));
+  tracks->playlist = playlist;
+  tracks->fingerprints = fingerprints;
+  apr_hash_set(fingerprints->playlists, &tracks->playlist, sizeof (playlist),
+               tracks);
+  sp_playlist_add_callbacks(playlist, &fingerprint_playlist_callbacks,
+                            fingerprints);
+}
+
+static void playlist_tracks_free(struct playlist_tracks *tracks) {
+  struct fingerprints *fingerprints = tracks->fingerprints;
+  sp_playlist_remove_callbacks(tracks->playlist,
+                               &fingerprint_playlist_callbacks, fingerprints);
+  apr_hash_set(fingerprints->playlists, &tracks->playlist,
+               sizeof (tracks->playlist), NULL);
+  free(tracks->keys);
+  free(tracks);
+}
+
+void fingerprints_unwatch(struct fingerprints *fingerprints,
+                          sp_playlist *playlist) {
+  struct playlist_tracks *tracks = apr_hash_get(fingerprints->playlists,
+                                                &playlist, sizeof (playlist));
+
+  if (tracks != NULL)
+    playlist_tracks_free(tracks);
+}
+
+void fingerprints_free(struct fingerprints *fingerprints) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, fingerprints->playlists)) != NULL) {
+    void *tracks;
+    apr_hash_this(hi, NULL, NULL, &tracks);
+    playlist_tracks_free(tracks);
+  }
+
+  free(fingerprints);
+}
+
+fingerprint_t fingerprints_playlist(struct fingerprints *fingerprints,
+                                    sp_playlist *playlist) {
+  struct playlist_tracks *tracks = apr_hash_get(fingerprints->playlists,
+                                                &playlist, sizeof (playlist));
+
+  if (tracks == NULL) {
+    fingerprint_t fingerprint = fingerprint_start();
+    unsigned char key[TRACK_ID_LENGTH];
+
+    for (int i = 0; i < sp_playlist_num_tracks(playlist); i++) {
+      track_key(sp_playlist_track(playlist, i), key);
+      fingerprint = fnv1a(fingerprint, key, TRACK_ID_LENGTH);
+    }
+
+    return fingerprint;
+  }
+
+  if (!tracks->read)
+    playlist_tracks_read(tracks);
+
+  if (tracks->dirty) {
+    tracks->fingerprint = fnv1a(fingerprint_start(), tracks->keys,
+                                tracks->num_tracks * TRACK_ID_LENGTH);
+    tracks->dirty = false;
+  }
+
+  return tracks->fingerprint;
+}
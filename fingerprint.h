@@ -0,0 +1,44 @@
+#ifndef FINGERPRINT_H_
+#define FINGERPRINT_H_
+
+#include <stdint.h>
+
+// Fingerprints of the sequence of tracks in playlists. A fingerprint is a
+// hash of the track IDs in order, so two playlists (or a playlist and a list
+// of track URIs) with the same fingerprint have the same tracks.
+typedef uint64_t fingerprint_t;
+
+// Length of a fingerprint as a hex string, not counting the terminating NUL
+#define FINGERPRINT_STRING_LENGTH 16
+
+// Fingerprint of an empty sequence of tracks
+fingerprint_t fingerprint_start(void);
+
+// Appends a track, by URI, to a fingerprint
+fingerprint_t fingerprint_add_uri(fingerprint_t fingerprint, const char *uri);
+
+void fingerprint_to_string(fingerprint_t fingerprint, char *str);
+
+// Returns false if str isn't a fingerprint; surrounding quotes (as in ETags)
+// are ignored
+bool fingerprint_from_string(const char *str, fingerprint_t *fingerprint);
+
+// Keeps the fingerprints of playlists up to date from their callbacks, so
+// that they don't have to be computed from the tracks over again
+struct fingerprints;
+
+struct fingerprints *fingerprints_new(apr_pool_t *pool);
+
+void fingerprints_free(struct fingerprints *);
+
+// Starts following changes to a playlist
+void fingerprints_watch(struct fingerprints *, sp_playlist *);
+
+// Stops following changes to a playlist
+void fingerprints_unwatch(struct fingerprints *, sp_playlist *);
+
+// Returns the fingerprint of a loaded playlist. Cheap for watched playlists,
+// once their track IDs have been read.
+fingerprint_t fingerprints_playlist(struct fingerprints *, sp_playlist *);
+
+#endif
@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fnv.h"
+
+static const uint64_t kFnvPrime = 1099511628211ULL;
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= kFnvPrime;
+  }
+
+  return hash;
+}
+
+uint64_t fnv1a_string(uint64_t hash, const char *str) {
+  return fnv1a(hash, str, strlen(str));
+}
@@ -0,0 +1,16 @@
+#ifndef FNV_H_
+#define FNV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a, which can be carried on from where it left off: hashes start out
+// as kFnvOffsetBasis
+static const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
+
+// Hashes a string, not counting its terminating NUL
+uint64_t fnv1a_string(uint64_t hash, const char *str);
+
+#endif
@@ -0,0 +1,360 @@
+#include <ctype.h>
+#include <event2/buffer.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "formats.h"
+#include "trackid.h"
+
+static const char *content_types[] = {
+  [FORMAT_JSON] = "application/json; charset=UTF-8",
+  [FORMAT_URI_LIST] = "text/uri-list; charset=UTF-8",
+  [FORMAT_MSGPACK] = "application/msgpack",
+  [FORMAT_TRACK_IDS] = "application/x-spotify-track-ids"
+};
+
+static const char *names[] = {
+  [FORMAT_JSON] = "json",
+  [FORMAT_URI_LIST] = "uri-list",
+  [FORMAT_MSGPACK] = "msgpack",
+  [FORMAT_TRACK_IDS] = "track-ids"
+};
+
+static const unsigned char kTrackIdsMagic[4] = { 'S', 'P', 'T', 'I' };
+
+static const unsigned char kTrackIdsVersion = 1;
+
+const char *format_content_type(enum response_format format) {
+  return content_types[format];
+}
+
+const char *format_name(enum response_format format) {
+  return names[format];
+}
+
+// Compares a media range of a header case-insensitively against a type
+static bool media_range_is(const char *range, size_t length, const char *type) {
+  if (strlen(type) != length)
+    return false;
+
+  for (size_t i = 0; i < length; i++) {
+    if (tolower((unsigned char) range[i]) != type[i])
+      return false;
+  }
+
+  return true;
+}
+
+// Returns the format of a media range, or -1 if it isn't one we have
+static int media_range_format(const char *range,
+                              size_t length,
+                              bool track_ids) {
+  if (media_range_is(range, length, "application/json") ||
+      media_range_is(range, length, "application/*") ||
+      media_range_is(range, length, "*/*")) {
+    return FORMAT_JSON;
+  }
+
+  if (media_range_is(range, length, "text/uri-list"))
+    return FORMAT_URI_LIST;
+
+  if (media_range_is(range, length, "application/msgpack") ||
+      media_range_is(range, length, "application/x-msgpack")) {
+    return FORMAT_MSGPACK;
+  }
+
+  if (track_ids &&
+      media_range_is(range, length, "application/x-spotify-track-ids")) {
+    return FORMAT_TRACK_IDS;
+  }
+
+  return -1;
+}
+
+enum response_format format_negotiate(const char *accept, bool track_ids) {
+  enum response_format best = FORMAT_JSON;
+  double best_q = 0;
+
+  if (accept == NULL)
+    return best;
+
+  const char *element = accept;
+
+  while (*element != '\0') {
+    size_t element_length = strcspn(element, ",");
+    const char *range = element + strspn(element, " \t");
+    size_t range_length = strcspn(range, ";, \t");
+    const char *params = memchr(element, ';', element_length);
+    double q = 1;
+
+    if (params != NULL) {
+      const char *q_param = strstr(params, "q=");
+
+      if (q_param != NULL && q_param < element + element_length)
+        q = strtod(q_param + 2, NULL);
+    }
+
+    int format = media_range_format(range, range_length, track_ids);
+
+    if (format >= 0 && q > 0 &&
+        (q > best_q || (q == best_q && format == FORMAT_JSON))) {
+      best = format;
+      best_q = q;
+    }
+
+    element += element_length;
+
+    if (*element == ',')
+      element++;
+  }
+
+  return best;
+}
+
+static void msgpack_string(struct evbuffer *buf, const char *str) {
+  size_t length = strlen(str);
+  unsigned char header[5];
+  size_t header_length;
+
+  if (length < 32) {
+    header[0] = 0xa0 | length;
+    header_length = 1;
+  } else if (length < 0x100) {
+    header[0] = 0xd9;
+    header[1] = length;
+    header_length = 2;
+  } else if (length < 0x10000) {
+    header[0] = 0xda;
+    header[1] = length >> 8;
+    header[2] = length;
+    header_length = 3;
+  } else {
+    header[0] = 0xdb;
+    header[1] = length >> 24;
+    header[2] = length >> 16;
+    header[3] = length >> 8;
+    header[4] = length;
+    header_length = 5;
+  }
+
+  evbuffer_add(buf, header, header_length);
+  evbuffer_add(buf, str, length);
+}
+
+static void msgpack_uint(struct evbuffer *buf, uint32_t n) {
+  unsigned char bytes[5];
+  size_t length;
+
+  if (n < 0x80) {
+    bytes[0] = n;
+    length = 1;
+  } else if (n < 0x100) {
+    bytes[0] = 0xcc;
+    bytes[1] = n;
+    length = 2;
+  } else if (n < 0x10000) {
+    bytes[0] = 0xcd;
+    bytes[1] = n >> 8;
+    bytes[2] = n;
+    length = 3;
+  } else {
+    bytes[0] = 0xce;
+    bytes[1] = n >> 24;
+    bytes[2] = n >> 16;
+    bytes[3] = n >> 8;
+    bytes[4] = n;
+    length = 5;
+  }
+
+  evbuffer_add(buf, bytes, length);
+}
+
+static void msgpack_bool(struct evbuffer *buf, bool value) {
+  unsigned char byte = value ? 0xc3 : 0xc2;
+  evbuffer_add(buf, &byte, 1);
+}
+
+// Writes the header of an array or map: fix is the type byte of those with
+// up to 15 elements, followed by the 16- and 32-bit types
+static void msgpack_container(struct evbuffer *buf,
+                              unsigned char fix,
+                              uint32_t count) {
+  unsigned char bytes[5];
+  size_t length;
+
+  if (count < 16) {
+    bytes[0] = fix | count;
+    length = 1;
+  } else if (count < 0x10000) {
+    bytes[0] = fix == 0x90 ? 0xdc : 0xde;
+    bytes[1] = count >> 8;
+    bytes[2] = count;
+    length = 3;
+  } else {
+    bytes[0] = fix == 0x90 ? 0xdd : 0xdf;
+    bytes[1] = count >> 24;
+    bytes[2] = count >> 16;
+    bytes[3] = count >> 8;
+    bytes[4] = count;
+    length = 5;
+  }
+
+  evbuffer_add(buf, bytes, length);
+}
+
+static void msgpack_array(struct evbuffer *buf, uint32_t count) {
+  msgpack_container(buf, 0x90, count);
+}
+
+static void msgpack_map(struct evbuffer *buf, uint32_t count) {
+  msgpack_container(buf, 0x80, count);
+}
+
+static void msgpack_link(struct evbuffer *buf, sp_link *link) {
+  char uri[kPlaylistLinkLength];
+
+  if (link == NULL) {
+    unsigned char nil = 0xc0;
+    evbuffer_add(buf, &nil, 1);
+    return;
+  }
+
+  sp_link_as_string(link, uri, sizeof (uri));
+  sp_link_release(link);
+  msgpack_string(buf, uri);
+}
+
+// The same fields as playlist_to_json
+static void msgpack_playlist(struct evbuffer *buf, sp_playlist *playlist) {
+  const char *description = sp_playlist_get_description(playlist);
+  msgpack_map(buf, description != NULL ? 7 : 6);
+
+  sp_user *owner = sp_playlist_owner(playlist);
+  msgpack_string(buf, "creator");
+  msgpack_string(buf, sp_user_display_name(owner));
+  sp_user_release(owner);
+
+  msgpack_string(buf, "uri");
+  msgpack_link(buf, sp_link_create_from_playlist(playlist));
+  msgpack_string(buf, "title");
+  msgpack_string(buf, sp_playlist_name(playlist));
+  msgpack_string(buf, "collaborative");
+  msgpack_bool(buf, sp_playlist_is_collaborative(playlist));
+
+  if (description != NULL) {
+    msgpack_string(buf, "description");
+    msgpack_string(buf, description);
+  }
+
+  msgpack_string(buf, "subscriberCount");
+  msgpack_uint(buf, sp_playlist_num_subscribers(playlist));
+
+  msgpack_string(buf, "tracks");
+  int num_tracks = sp_playlist_num_tracks(playlist);
+  msgpack_array(buf, num_tracks);
+  char uri[kTrackLinkLength];
+
+  for (int i = 0; i < num_tracks; i++) {
+    track_to_uri(sp_playlist_track(playlist, i), uri, sizeof (uri));
+    msgpack_string(buf, uri);
+  }
+}
+
+static void uri_list_playlist(struct evbuffer *buf, sp_playlist *playlist) {
+  char uri[kTrackLinkLength];
+
+  for (int i = 0; i < sp_playlist_num_tracks(playlist); i++) {
+    int length = track_to_uri(sp_playlist_track(playlist, i), uri,
+                              sizeof (uri));
+
+    if (length >= (int) sizeof (uri))
+      length = sizeof (uri) - 1;
+
+    evbuffer_add(buf, uri, length);
+    evbuffer_add(buf, "\r\n", 2);
+  }
+}
+
+static void track_ids_playlist(struct evbuffer *buf, sp_playlist *playlist) {
+  uint32_t num_tracks = sp_playlist_num_tracks(playlist);
+  unsigned char header[12];
+  memcpy(header, kTrackIdsMagic, sizeof (kTrackIdsMagic));
+  header[4] = kTrackIdsVersion;
+  header[5] = header[6] = header[7] = 0;
+  header[8] = num_tracks >> 24;
+  header[9] = num_tracks >> 16;
+  header[10] = num_tracks >> 8;
+  header[11] = num_tracks;
+  evbuffer_add(buf, header, sizeof (header));
+
+  if (num_tracks == 0)
+    return;
+
+  // Written in place, all tracks at once
+  struct evbuffer_iovec space;
+  evbuffer_reserve_space(buf, num_tracks * TRACK_ID_LENGTH, &space, 1);
+  unsigned char *ids = space.iov_base;
+  char uri[kTrackLinkLength];
+
+  for (uint32_t i = 0; i < num_tracks; i++) {
+    track_to_uri(sp_playlist_track(playlist, i), uri, sizeof (uri));
+
+    if (!track_id_from_uri(uri, ids + i * TRACK_ID_LENGTH))
+      memset(ids + i * TRACK_ID_LENGTH, 0, TRACK_ID_LENGTH);
+  }
+
+  space.iov_len = num_tracks * TRACK_ID_LENGTH;
+  evbuffer_commit_space(buf, &space, 1);
+}
+
+void format_write_playlist(enum response_format format,
+                           sp_playlist *playlist,
+                           struct evbuffer *buf) {
+  switch (format) {
+    case FORMAT_URI_LIST:
+      uri_list_playlist(buf, playlist);
+      break;
+
+    case FORMAT_MSGPACK:
+      msgpack_playlist(buf, playlist);
+      break;
+
+    case FORMAT_TRACK_IDS:
+      track_ids_playlist(buf, playlist);
+      break;
+
+    case FORMAT_JSON:
+      break;
+  }
+}
+
+void format_write_playlists(enum response_format format,
+                            sp_playlist **playlists,
+                            int num_playlists,
+                            struct evbuffer *buf) {
+  if (format == FORMAT_MSGPACK) {
+    msgpack_map(buf, 1);
+    msgpack_string(buf, "playlists");
+    msgpack_array(buf, num_playlists);
+  }
+
+  for (int i = 0; i < num_playlists; i++) {
+    if (format == FORMAT_MSGPACK) {
+      msgpack_playlist(buf, playlists[i]);
+    } else if (format == FORMAT_URI_LIST) {
+      char uri[kPlaylistLinkLength];
+      sp_link *link = sp_link_create_from_playlist(playlists[i]);
+
+      if (link == NULL)
+        continue;
+
+      sp_link_as_string(link, uri, sizeof (uri));
+      sp_link_release(link);
+      evbuffer_add_printf(buf, "%s\r\n", uri);
+    }
+  }
+}
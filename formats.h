@@ -0,0 +1,43 @@
+#ifndef FORMATS_H_
+#define FORMATS_H_
+
+// Formats other than JSON that playlists and containers can be read in,
+// picked with the Accept header and written straight from libspotify:
+//
+//   text/uri-list                    URIs of the tracks (or of the playlists
+//                                    of a container), one per line
+//   application/msgpack              MessagePack, structured as the JSON
+//   application/x-spotify-track-ids  "SPTI", a version byte (1), three zero
+//                                    bytes and the number of tracks as a
+//                                    big-endian 32-bit integer, followed by
+//                                    the raw 16-byte ID of each track (zeros
+//                                    for local tracks); playlists only
+enum response_format {
+  FORMAT_JSON,
+  FORMAT_URI_LIST,
+  FORMAT_MSGPACK,
+  FORMAT_TRACK_IDS
+};
+
+// Picks the format to respond with from an Accept header (which may be NULL).
+// JSON is picked when nothing else is acceptable, and when tied with another.
+enum response_format format_negotiate(const char *accept, bool track_ids);
+
+const char *format_content_type(enum response_format format);
+
+// Short name of a format, for telling representations in it apart
+const char *format_name(enum response_format format);
+
+// Writes a loaded playlist in a format other than JSON
+void format_write_playlist(enum response_format format,
+                           sp_playlist *playlist,
+                           struct evbuffer *buf);
+
+// Writes the loaded playlists of a container as a URI list, or as
+// {"playlists":[<playlist>]} in MessagePack
+void format_write_playlists(enum response_format format,
+                            sp_playlist **playlists,
+                            int num_playlists,
+                            struct evbuffer *buf);
+
+#endif
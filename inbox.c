@@ -0,0 +1,344 @@
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "inbox.h"
+#include "json.h"
+#include "logger.h"
+#include "server.h"
+
+struct inbox_batch {
+  struct inbox_batches *batches;  // NULL once the batches are freed
+  struct evhttp_request *request;  // NULL once the client has gone away
+  char **users;
+  int num_users;
+  int next_user;  // Next to post to
+  sp_track **tracks;
+  int num_tracks;
+  char *message;
+
+  int num_in_flight;
+  int num_posted;
+  int num_failed;
+  int num_cancelled;
+  long long started;
+  TAILQ_ENTRY(inbox_batch) entries;
+};
+
+TAILQ_HEAD(inbox_batch_list, inbox_batch);
+
+// A post to the inbox of one user
+struct inbox_post {
+  struct inbox_batch *batch;
+  int user;
+};
+
+struct inbox_batches {
+  sp_session *session;
+  int window;
+  int num_in_flight;
+
+  // Batches with users left to post to, taking turns
+  struct inbox_batch_list waiting;
+  // Batches with only posts under way left
+  struct inbox_batch_list draining;
+
+  unsigned long num_batches;
+  unsigned long num_posted;
+  unsigned long num_failed;
+  unsigned long num_cancelled;
+  double last_posts_per_second;
+};
+
+static long long now_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct inbox_batches *inbox_batches_new(sp_session *session, int window) {
+  struct inbox_batches *batches = calloc(1, sizeof (struct inbox_batches));
+  batches->session = session;
+  batches->window = window > 0 ? window : 1;
+  TAILQ_INIT(&batches->waiting);
+  TAILQ_INIT(&batches->draining);
+  return batches;
+}
+
+static void inbox_batch_free(struct inbox_batch *batch) {
+  for (int i = 0; i < batch->num_users; i++)
+    free(batch->users[i]);
+
+  for (int i = 0; i < batch->num_tracks; i++)
+    sp_track_release(batch->tracks[i]);
+
+  free(batch->users);
+  free(batch->tracks);
+  free(batch->message);
+  free(batch);
+}
+
+static void inbox_batch_closed(struct evhttp_connection *connection,
+                               void *userdata);
+
+// Ends the response with totals and stops posting; the batch is freed once
+// no posts are under way
+static void inbox_batch_end(struct inbox_batch *batch) {
+  struct inbox_batches *batches = batch->batches;
+  struct evhttp_request *request = batch->request;
+  int num_cancelled = batch->num_users - batch->next_user;
+  batch->num_cancelled += num_cancelled;
+  batch->next_user = batch->num_users;
+  long long milliseconds = now_milliseconds() - batch->started;
+
+  if (batches != NULL) {
+    batches->num_cancelled += num_cancelled;
+
+    if (milliseconds > 0) {
+      batches->last_posts_per_second =
+          (batch->num_posted + batch->num_failed) * 1000.0 / milliseconds;
+    }
+  }
+
+  if (request != NULL) {
+    struct evhttp_connection *connection =
+        evhttp_request_get_connection(request);
+
+    if (connection != NULL)
+      evhttp_connection_set_closecb(connection, NULL, NULL);
+
+    struct evbuffer *buf = evbuffer_new();
+    evbuffer_add_printf(buf, "],\"posted\":%d,\"failed\":%d,\"cancelled\":%d,"
+                        "\"milliseconds\":%lld}", batch->num_posted,
+                        batch->num_failed, batch->num_cancelled,
+                        milliseconds);
+    evhttp_send_reply_chunk(request, buf);
+    evbuffer_free(buf);
+    evhttp_send_reply_end(request);
+    batch->request = NULL;
+  }
+}
+
+static void inbox_batch_result(struct inbox_batch *batch,
+                               int user,
+                               sp_error error) {
+  if (error == SP_ERROR_OK) {
+    batch->num_posted++;
+  } else {
+    batch->num_failed++;
+  }
+
+  if (batch->batches != NULL) {
+    if (error == SP_ERROR_OK) {
+      batch->batches->num_posted++;
+    } else {
+      batch->batches->num_failed++;
+    }
+  }
+
+  if (batch->request == NULL)
+    return;
+
+  struct evbuffer *buf = evbuffer_new();
+
+  if (batch->num_posted + batch->num_failed > 1)
+    evbuffer_add(buf, ",", 1);
+
+  evbuffer_add_printf(buf, "{\"user\":");
+  json_string_to_evbuffer(buf, batch->users[user]);
+
+  if (error == SP_ERROR_OK) {
+    evbuffer_add_printf(buf, ",\"ok\":true}");
+  } else {
+    evbuffer_add_printf(buf, ",\"ok\":false,\"message\":");
+    json_string_to_evbuffer(buf, sp_error_message(error));
+    evbuffer_add(buf, "}", 1);
+  }
+
+  evhttp_send_reply_chunk(batch->request, buf);
+  evbuffer_free(buf);
+}
+
+static void inbox_batches_post(struct inbox_batches *batches);
+
+// Takes a batch that's done off the lists, and frees it unless posts are
+// still under way
+static void inbox_batch_finish(struct inbox_batch *batch) {
+  struct inbox_batches *batches = batch->batches;
+
+  if (batch->next_user < batch->num_users)
+    return;
+
+  if (batches != NULL && batch->num_in_flight == 0)
+    TAILQ_REMOVE(&batches->draining, batch, entries);
+
+  if (batch->num_in_flight == 0)
+    inbox_batch_free(batch);
+}
+
+static void inbox_post_complete(sp_inbox *inbox, void *userdata) {
+  struct inbox_post *post = userdata;
+  struct inbox_batch *batch = post->batch;
+  struct inbox_batches *batches = batch->batches;
+  sp_error error = sp_inbox_error(inbox);
+  sp_inbox_release(inbox);
+  batch->num_in_flight--;
+  inbox_batch_result(batch, post->user, error);
+  free(post);
+
+  if (batch->next_user == batch->num_users && batch->num_in_flight == 0 &&
+      batch->request != NULL) {
+    inbox_batch_end(batch);
+  }
+
+  inbox_batch_finish(batch);
+
+  if (batches != NULL) {
+    batches->num_in_flight--;
+    inbox_batches_post(batches);
+  }
+}
+
+// Starts posts while there is room in the window, the waiting batches taking
+// turns
+static void inbox_batches_post(struct inbox_batches *batches) {
+  struct inbox_batch *batch;
+
+  while (batches->num_in_flight < batches->window &&
+         (batch = TAILQ_FIRST(&batches->waiting)) != NULL) {
+    TAILQ_REMOVE(&batches->waiting, batch, entries);
+    struct inbox_post *post = malloc(sizeof (struct inbox_post));
+    post->batch = batch;
+    post->user = batch->next_user++;
+    sp_inbox *inbox = sp_inbox_post_tracks(batches->session,
+        batch->users[post->user], batch->tracks, batch->num_tracks,
+        batch->message, &inbox_post_complete, post);
+
+    if (inbox == NULL) {
+      inbox_batch_result(batch, post->user, SP_ERROR_OTHER_TRANSIENT);
+      free(post);
+    } else {
+      batch->num_in_flight++;
+      batches->num_in_flight++;
+    }
+
+    if (batch->next_user < batch->num_users) {
+      TAILQ_INSERT_TAIL(&batches->waiting, batch, entries);
+    } else if (batch->num_in_flight > 0) {
+      TAILQ_INSERT_TAIL(&batches->draining, batch, entries);
+    } else {
+      inbox_batch_end(batch);
+      inbox_batch_free(batch);
+    }
+  }
+}
+
+static void inbox_batch_closed(struct evhttp_connection *connection,
+                               void *userdata) {
+  struct inbox_batch *batch = userdata;
+  struct inbox_batches *batches = batch->batches;
+  struct evhttp_request *request = batch->request;
+  batch->request = NULL;
+  log_debug("Client went away during inbox batch; cancelling %d posts",
+            batch->num_users - batch->next_user);
+
+  if (batch->next_user < batch->num_users) {
+    TAILQ_REMOVE(&batches->waiting, batch, entries);
+    inbox_batch_end(batch);
+    TAILQ_INSERT_TAIL(&batches->draining, batch, entries);
+  }
+
+  inbox_batch_finish(batch);
+  free_abandoned_request(request);
+}
+
+void inbox_batch_start(struct inbox_batches *batches,
+                       struct evhttp_request *request,
+                       const char **users,
+                       int num_users,
+                       sp_track **tracks,
+                       int num_tracks,
+                       const char *message) {
+  struct inbox_batch *batch = calloc(1, sizeof (struct inbox_batch));
+  batch->batches = batches;
+  batch->request = request;
+  batch->users = malloc(num_users * sizeof (char *));
+
+  for (int i = 0; i < num_users; i++)
+    batch->users[i] = strdup(users[i]);
+
+  batch->num_users = num_users;
+  batch->tracks = malloc(num_tracks * sizeof (sp_track *));
+
+  for (int i = 0; i < num_tracks; i++) {
+    batch->tracks[i] = tracks[i];
+    sp_track_add_ref(tracks[i]);
+  }
+
+  batch->num_tracks = num_tracks;
+  batch->message = strdup(message);
+  batch->started = now_milliseconds();
+  batches->num_batches++;
+
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-Type", "application/json; charset=UTF-8");
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                &inbox_batch_closed, batch);
+  evhttp_send_reply_start(request, HTTP_OK, "OK");
+  struct evbuffer *buf = evbuffer_new();
+  evbuffer_add_printf(buf, "{\"results\":[");
+  evhttp_send_reply_chunk(request, buf);
+  evbuffer_free(buf);
+
+  TAILQ_INSERT_TAIL(&batches->waiting, batch, entries);
+  inbox_batches_post(batches);
+}
+
+void inbox_batches_free(struct inbox_batches *batches) {
+  struct inbox_batch *batch;
+
+  while ((batch = TAILQ_FIRST(&batches->waiting)) != NULL) {
+    TAILQ_REMOVE(&batches->waiting, batch, entries);
+    inbox_batch_end(batch);
+    batch->batches = NULL;
+    inbox_batch_finish(batch);
+  }
+
+  while ((batch = TAILQ_FIRST(&batches->draining)) != NULL) {
+    TAILQ_REMOVE(&batches->draining, batch, entries);
+    inbox_batch_end(batch);
+    batch->batches = NULL;
+  }
+
+  free(batches);
+}
+
+json_t *inbox_batches_to_json(struct inbox_batches *batches, json_t *object) {
+  int running = 0;
+  struct inbox_batch *batch;
+
+  TAILQ_FOREACH(batch, &batches->waiting, entries)
+    running++;
+
+  TAILQ_FOREACH(batch, &batches->draining, entries)
+    running++;
+
+  json_object_set_new(object, "batches", json_integer(batches->num_batches));
+  json_object_set_new(object, "running", json_integer(running));
+  json_object_set_new(object, "inFlight",
+                      json_integer(batches->num_in_flight));
+  json_object_set_new(object, "window", json_integer(batches->window));
+  json_object_set_new(object, "posted", json_integer(batches->num_posted));
+  json_object_set_new(object, "failed", json_integer(batches->num_failed));
+  json_object_set_new(object, "cancelled",
+                      json_integer(batches->num_cancelled));
+  json_object_set_new(object, "postsPerSecond",
+                      json_real(batches->last_posts_per_second));
+  return object;
+}
@@ -0,0 +1,31 @@
+#ifndef INBOX_H_
+#define INBOX_H_
+
+// Posts of the same tracks to the inboxes of many users. At most a window of
+// posts are under way at a time, across all batches, and the result for each
+// user is streamed back as it comes in:
+//
+//   {"results":[{"user":<string>,"ok":<boolean>[,"message":<string>]},...],
+//    "posted":<int>,"failed":<int>,"cancelled":<int>,"milliseconds":<int>}
+//
+// If the client goes away, posts that haven't been started are cancelled.
+struct inbox_batches;
+
+struct inbox_batches *inbox_batches_new(sp_session *session, int window);
+
+// Ends all responses. Posts under way are left to complete.
+void inbox_batches_free(struct inbox_batches *);
+
+// Starts posting tracks to the inboxes of users in response to a request.
+// Copies users and message, and takes a reference to each track.
+void inbox_batch_start(struct inbox_batches *,
+                       struct evhttp_request *request,
+                       const char **users,
+                       int num_users,
+                       sp_track **tracks,
+                       int num_tracks,
+                       const char *message);
+
+json_t *inbox_batches_to_json(struct inbox_batches *, json_t *object);
+
+#endif
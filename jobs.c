@@ -0,0 +1,366 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/http_struct.h>
+#include <event2/keyvalq_struct.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "jobs.h"
+
+enum job_state {
+  JOB_RUNNING,
+  JOB_SYNCING,
+  JOB_DONE
+};
+
+static const char *job_state_names[] = {
+  [JOB_RUNNING] = "running",
+  [JOB_SYNCING] = "syncing",
+  [JOB_DONE] = "done"
+};
+
+struct job {
+  char id[JOBS_ID_LENGTH];  // Also the hash key
+  struct jobs *jobs;  // NULL once the table has been freed
+  TAILQ_ENTRY(job) entries;
+  char *method;
+  char *uri;
+  enum job_state state;
+  sp_playlist *syncing;  // Whose changes are counted, until the job is done
+  int ops_applied;
+  long long started;
+  long long finished;
+  int status;
+  char *result;
+  size_t result_length;
+};
+
+TAILQ_HEAD(job_list, job);
+
+struct jobs {
+  apr_hash_t *jobs;
+  struct job_list order;  // Oldest first
+  int num_jobs;
+  int num_running;
+  int max_jobs;
+  size_t bytes;
+  size_t max_bytes;
+  unsigned long next_id;
+
+  unsigned long started;
+  unsigned long completed;
+  unsigned long failed;
+  unsigned long rejected;
+  unsigned long evicted;
+  long long total_milliseconds;
+  long long max_milliseconds;
+};
+
+static long long now_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct jobs *jobs_new(int max_jobs, size_t max_bytes, apr_pool_t *pool) {
+  struct jobs *jobs = calloc(1, sizeof (struct jobs));
+  jobs->jobs = apr_hash_make(pool);
+  TAILQ_INIT(&jobs->order);
+  jobs->max_jobs = max_jobs;
+  jobs->max_bytes = max_bytes;
+  jobs->next_id = 1;
+  return jobs;
+}
+
+static void job_tracks_added(sp_playlist *playlist,
+                             sp_track *const *tracks,
+                             int num_tracks,
+                             int position,
+                             void *userdata) {
+  ((struct job *) userdata)->ops_applied += num_tracks;
+}
+
+static void job_tracks_removed(sp_playlist *playlist,
+                               const int *tracks,
+                               int num_tracks,
+                               void *userdata) {
+  ((struct job *) userdata)->ops_applied += num_tracks;
+}
+
+static void job_tracks_moved(sp_playlist *playlist,
+                             const int *tracks,
+                             int num_tracks,
+                             int new_position,
+                             void *userdata) {
+  ((struct job *) userdata)->ops_applied += num_tracks;
+}
+
+static sp_playlist_callbacks job_playlist_callbacks = {
+  .tracks_added = &job_tracks_added,
+  .tracks_removed = &job_tracks_removed,
+  .tracks_moved = &job_tracks_moved
+};
+
+static void job_stop_syncing(struct job *job) {
+  if (job->syncing == NULL)
+    return;
+
+  sp_playlist_remove_callbacks(job->syncing, &job_playlist_callbacks, job);
+  sp_playlist_release(job->syncing);
+  job->syncing = NULL;
+}
+
+static void job_free(struct job *job) {
+  job_stop_syncing(job);
+  free(job->method);
+  free(job->uri);
+  free(job->result);
+  free(job);
+}
+
+static void jobs_remove(struct jobs *jobs, struct job *job) {
+  apr_hash_set(jobs->jobs, job->id, APR_HASH_KEY_STRING, NULL);
+  TAILQ_REMOVE(&jobs->order, job, entries);
+  jobs->num_jobs--;
+  jobs->bytes -= job->result_length;
+  job_free(job);
+}
+
+// Evicts finished jobs, oldest first, until the table is within its bounds
+// with room for `num_new` more
+static void jobs_evict(struct jobs *jobs, int num_new) {
+  struct job *job = TAILQ_FIRST(&jobs->order);
+
+  while (job != NULL && (jobs->num_jobs + num_new > jobs->max_jobs ||
+                         jobs->bytes > jobs->max_bytes)) {
+    struct job *next = TAILQ_NEXT(job, entries);
+
+    if (job->state == JOB_DONE) {
+      jobs_remove(jobs, job);
+      jobs->evicted++;
+    }
+
+    job = next;
+  }
+}
+
+void jobs_free(struct jobs *jobs) {
+  struct job *job;
+
+  while ((job = TAILQ_FIRST(&jobs->order)) != NULL) {
+    TAILQ_REMOVE(&jobs->order, job, entries);
+
+    // Requests of running jobs still point at them; they're freed as the
+    // requests finish
+    if (job->state == JOB_DONE) {
+      job_free(job);
+    } else {
+      job_stop_syncing(job);
+      job->jobs = NULL;
+    }
+  }
+
+  free(jobs);
+}
+
+static const char *method_name(enum evhttp_cmd_type method) {
+  switch (method) {
+    case EVHTTP_REQ_GET:
+      return "GET";
+    case EVHTTP_REQ_POST:
+      return "POST";
+    case EVHTTP_REQ_PUT:
+      return "PUT";
+    case EVHTTP_REQ_DELETE:
+      return "DELETE";
+    default:
+      return "OTHER";
+  }
+}
+
+// Requests run by jobs are made with this callback, which libevent never
+// calls for them, so that they can be told apart
+static void job_request_callback(struct evhttp_request *request,
+                                 void *userdata) {
+}
+
+static struct job *request_job(struct evhttp_request *request) {
+  return request != NULL && request->cb == &job_request_callback ?
+      request->cb_arg : NULL;
+}
+
+// Headers that would have the response to a job differ from the JSON
+// clients get from it, or have the copy run as a job again
+static bool copied_header(const char *key) {
+  return strcasecmp(key, "Accept") != 0 &&
+      strcasecmp(key, "Accept-Encoding") != 0 &&
+      strcasecmp(key, "Prefer") != 0;
+}
+
+struct evhttp_request *jobs_start(struct jobs *jobs,
+                                  struct evhttp_request *request,
+                                  jobs_id_fn accept_id,
+                                  void *userdata,
+                                  char *id) {
+  jobs_evict(jobs, 1);
+
+  if (jobs->num_jobs >= jobs->max_jobs) {
+    jobs->rejected++;
+    return NULL;
+  }
+
+  struct job *job = calloc(1, sizeof (struct job));
+
+  do {
+    snprintf(job->id, sizeof (job->id), "%lu", jobs->next_id++);
+  } while (accept_id != NULL && !accept_id(job->id, userdata));
+
+  job->jobs = jobs;
+  job->method = strdup(method_name(evhttp_request_get_command(request)));
+  job->uri = strdup(evhttp_request_get_uri(request));
+  job->state = JOB_RUNNING;
+  job->started = now_milliseconds();
+  apr_hash_set(jobs->jobs, job->id, APR_HASH_KEY_STRING, job);
+  TAILQ_INSERT_TAIL(&jobs->order, job, entries);
+  jobs->num_jobs++;
+  jobs->num_running++;
+  jobs->started++;
+
+  // The copy has no connection; it's freed once it's responded to
+  struct evhttp_request *copy = evhttp_request_new(&job_request_callback, job);
+  copy->type = evhttp_request_get_command(request);
+  copy->uri = strdup(job->uri);
+  copy->uri_elems = evhttp_uri_parse(copy->uri);
+  struct evkeyval *header;
+
+  TAILQ_FOREACH(header, evhttp_request_get_input_headers(request), next) {
+    if (copied_header(header->key)) {
+      evhttp_add_header(evhttp_request_get_input_headers(copy), header->key,
+                        header->value);
+    }
+  }
+
+  evbuffer_add_buffer(evhttp_request_get_input_buffer(copy),
+                      evhttp_request_get_input_buffer(request));
+  snprintf(id, JOBS_ID_LENGTH, "%s", job->id);
+  return copy;
+}
+
+void jobs_syncing(struct evhttp_request *request, sp_playlist *playlist) {
+  struct job *job = request_job(request);
+
+  if (job == NULL || job->jobs == NULL || job->syncing != NULL)
+    return;
+
+  job->state = JOB_SYNCING;
+  job->syncing = playlist;
+  sp_playlist_add_ref(playlist);
+  sp_playlist_add_callbacks(playlist, &job_playlist_callbacks, job);
+}
+
+bool jobs_finish(struct evhttp_request *request,
+                 int code,
+                 struct evbuffer *body) {
+  struct job *job = request_job(request);
+
+  if (job == NULL)
+    return false;
+
+  struct jobs *jobs = job->jobs;
+
+  if (jobs == NULL) {
+    evhttp_request_free(request);
+    job_free(job);
+    return true;
+  }
+
+  job_stop_syncing(job);
+  job->state = JOB_DONE;
+  job->finished = now_milliseconds();
+  job->status = code;
+
+  // The body is usually the request's own output buffer, so it's copied
+  // before the request is freed
+  if (body != NULL && evbuffer_get_length(body) > 0) {
+    job->result_length = evbuffer_get_length(body);
+    job->result = malloc(job->result_length);
+    evbuffer_copyout(body, job->result, job->result_length);
+  }
+
+  evhttp_request_free(request);
+
+  long long milliseconds = job->finished - job->started;
+  jobs->num_running--;
+  jobs->completed++;
+  jobs->bytes += job->result_length;
+  jobs->total_milliseconds += milliseconds;
+
+  if (milliseconds > jobs->max_milliseconds)
+    jobs->max_milliseconds = milliseconds;
+
+  if (code >= 400)
+    jobs->failed++;
+
+  jobs_evict(jobs, 0);
+  return true;
+}
+
+json_t *jobs_job_to_json(struct jobs *jobs, const char *id) {
+  struct job *job = apr_hash_get(jobs->jobs, id, APR_HASH_KEY_STRING);
+
+  if (job == NULL)
+    return NULL;
+
+  json_t *json = json_object();
+  json_object_set_new(json, "id", json_string(job->id));
+  json_object_set_new(json, "method", json_string(job->method));
+  json_object_set_new(json, "uri", json_string(job->uri));
+  json_object_set_new(json, "state", json_string(job_state_names[job->state]));
+  json_object_set_new(json, "opsApplied", json_integer(job->ops_applied));
+  long long finished = job->state == JOB_DONE ?
+      job->finished : now_milliseconds();
+  json_object_set_new(json, "milliseconds",
+                      json_integer(finished - job->started));
+
+  if (job->state == JOB_DONE) {
+    json_object_set_new(json, "status", json_integer(job->status));
+    json_t *result = NULL;
+
+    if (job->result != NULL) {
+      json_error_t error;
+      result = json_loadb(job->result, job->result_length, 0,
+                          &error);
+    }
+
+    json_object_set_new(json, "result", result != NULL ? result : json_null());
+  }
+
+  return json;
+}
+
+json_t *jobs_to_json(struct jobs *jobs, json_t *object) {
+  json_object_set_new(object, "jobs", json_integer(jobs->num_jobs));
+  json_object_set_new(object, "running", json_integer(jobs->num_running));
+  json_object_set_new(object, "bytes", json_integer(jobs->bytes));
+  json_object_set_new(object, "started", json_integer(jobs->started));
+  json_object_set_new(object, "completed", json_integer(jobs->completed));
+  json_object_set_new(object, "failed", json_integer(jobs->failed));
+  json_object_set_new(object, "rejected", json_integer(jobs->rejected));
+  json_object_set_new(object, "evicted", json_integer(jobs->evicted));
+  json_object_set_new(object, "averageMilliseconds",
+                      json_integer(jobs->completed > 0 ?
+                                   jobs->total_milliseconds /
+                                   (long long) jobs->completed : 0));
+  json_object_set_new(object, "maxMilliseconds",
+                      json_integer(jobs->max_milliseconds));
+  return object;
+}
@@ -0,0 +1,53 @@
+#ifndef JOBS_H_
+#define JOBS_H_
+
+// Requests run as jobs, for clients that would rather not keep a connection
+// open while a playlist syncs. A job runs a copy of its request, whose
+// response is kept rather than sent, and clients ask for its progress and
+// result by its ID:
+//
+//   {"id":<string>,"method":<string>,"uri":<string>,
+//    "state":"running"|"syncing"|"done","opsApplied":<int>,
+//    "milliseconds":<int>[,"status":<int>,"result":<any>]}
+//
+// opsApplied counts the tracks added, removed and moved in the playlist the
+// job is syncing. Finished jobs are kept in a table bounded by their number
+// and the size of their results, and are evicted oldest first.
+struct jobs;
+
+// Decides whether an ID may be used, e.g. so that requests for the job reach
+// this process
+typedef bool (*jobs_id_fn)(const char *id, void *userdata);
+
+struct jobs *jobs_new(int max_jobs, size_t max_bytes, apr_pool_t *pool);
+
+// Running jobs are left to finish, without keeping their results
+void jobs_free(struct jobs *);
+
+// Starts a job for a request, returning the request to run in its place
+// (which takes the body) and writing the job's ID to `id`, of at least
+// JOBS_ID_LENGTH bytes. Returns NULL if the table is full of running jobs.
+struct evhttp_request *jobs_start(struct jobs *,
+                                  struct evhttp_request *request,
+                                  jobs_id_fn accept_id,
+                                  void *userdata,
+                                  char *id);
+
+#define JOBS_ID_LENGTH 24
+
+// Notes that the job running a request is waiting for a playlist to sync,
+// counting changes to it from then on. Does nothing for other requests.
+void jobs_syncing(struct evhttp_request *request, sp_playlist *playlist);
+
+// Keeps the response to a request run by a job, and frees the request.
+// Returns false, doing nothing, for other requests.
+bool jobs_finish(struct evhttp_request *request,
+                 int code,
+                 struct evbuffer *body);
+
+// Returns a job as JSON, or NULL if there is no such job
+json_t *jobs_job_to_json(struct jobs *, const char *id);
+
+json_t *jobs_to_json(struct jobs *, json_t *object);
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <event2/buffer.h>
 #include <jansson.h>
 #include <libspotify/api.h>
 #include <string.h>
@@ -14,7 +15,7 @@ json_t *playlist_to_json_set_collaborative(sp_playlist *playlist,
   return object;
 }
 
-json_t *playlist_to_json(sp_playlist *playlist, json_t *object) {
+json_t *playlist_metadata_to_json(sp_playlist *playlist, json_t *object) {
   assert(sp_playlist_is_loaded(playlist));
 
   // Owner
@@ -56,6 +57,11 @@ json_t *playlist_to_json(sp_playlist *playlist, json_t *object) {
   int num_subscribers = sp_playlist_num_subscribers(playlist);
   json_object_set_new(object, "subscriberCount",
                       json_integer(num_subscribers));
+  return object;
+}
+
+json_t *playlist_to_json(sp_playlist *playlist, json_t *object) {
+  playlist_metadata_to_json(playlist, object);
 
   // Tracks
   json_t *tracks = json_array();
@@ -106,3 +112,66 @@ int json_to_tracks(json_t *json, sp_track **tracks, int num_tracks) {
 
   return num_valid_tracks;
 }
+
+void json_string_to_evbuffer(struct evbuffer *buf, const char *str) {
+  // Runs of characters that needn't be escaped are added at once
+  evbuffer_add(buf, "\"", 1);
+  const char *run = str;
+
+  for (const char *c = str; *c != '\0'; c++) {
+    unsigned char ch = *c;
+
+    if (ch >= 0x20 && ch != '"' && ch != '\\')
+      continue;
+
+    evbuffer_add(buf, run, c - run);
+    run = c + 1;
+
+    switch (ch) {
+      case '"':
+        evbuffer_add(buf, "\\\"", 2);
+        break;
+
+      case '\\':
+        evbuffer_add(buf, "\\\\", 2);
+        break;
+
+      case '\n':
+        evbuffer_add(buf, "\\n", 2);
+        break;
+
+      case '\t':
+        evbuffer_add(buf, "\\t", 2);
+        break;
+
+      default:
+        evbuffer_add_printf(buf, "\\u%04x", ch);
+        break;
+    }
+  }
+
+  evbuffer_add(buf, run, strlen(run));
+  evbuffer_add(buf, "\"", 1);
+}
+
+void json_link_to_evbuffer(struct evbuffer *buf, sp_link *link) {
+  char uri[kTrackLinkLength];
+
+  if (link == NULL) {
+    evbuffer_add(buf, "null", 4);
+    return;
+  }
+
+  sp_link_as_string(link, uri, sizeof (uri));
+  sp_link_release(link);
+  json_string_to_evbuffer(buf, uri);
+}
+
+json_t *positions_to_json(const int *positions, int num_positions) {
+  json_t *array = json_array();
+
+  for (int i = 0; i < num_positions; i++)
+    json_array_append_new(array, json_integer(positions[i]));
+
+  return array;
+}
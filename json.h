@@ -3,6 +3,9 @@
 
 json_t *playlist_to_json(sp_playlist *, json_t *);
 
+// All of playlist_to_json but the tracks
+json_t *playlist_metadata_to_json(sp_playlist *, json_t *);
+
 json_t *playlist_to_json_set_collaborative(sp_playlist *, json_t *);
 
 // Read track URI into Spotify track
@@ -11,4 +14,14 @@ bool json_to_track(json_t *json, sp_track **track);
 // Read tracks from an JSON array of track URIs
 int json_to_tracks(json_t *json, sp_track **tracks, int num_tracks);
 
+// Positions of tracks in a playlist as a JSON array
+json_t *positions_to_json(const int *positions, int num_positions);
+
+// Writes a (UTF-8) string as a JSON string, without building a JSON value
+struct evbuffer;
+void json_string_to_evbuffer(struct evbuffer *buf, const char *str);
+
+// Writes a link as a JSON string, or null if there's none, releasing it
+void json_link_to_evbuffer(struct evbuffer *buf, sp_link *link);
+
 #endif
@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "logger.h"
+
+// Lines per thread waiting to be written out, and their maximum length
+#define LOGGER_RING_LINES 256
+#define LOGGER_LINE_LENGTH 256
+
+struct log_line {
+  struct timespec time;
+  int level;
+  char message[LOGGER_LINE_LENGTH];
+};
+
+// Lines of one thread. Only that thread adds lines (at head) and only the
+// flusher removes them (at tail), so neither needs a lock.
+struct log_ring {
+  struct log_line lines[LOGGER_RING_LINES];
+  unsigned long head;
+  unsigned long tail;
+  unsigned long written;
+  unsigned long dropped;
+  int thread;
+  struct log_ring *next;
+};
+
+enum logger_destination {
+  LOGGER_SYSLOG,
+  LOGGER_STDERR,
+  LOGGER_FILE
+};
+
+static const char *kLevelNames[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+int logger_level = LOGGER_MAX_LEVEL;
+
+static __thread struct log_ring *thread_ring = NULL;
+static struct log_ring *rings = NULL;
+static int num_rings = 0;
+
+static enum logger_destination destination = LOGGER_SYSLOG;
+static FILE *file = NULL;
+static bool opened = false;
+static bool stopping = false;
+static pthread_t flusher;
+
+static struct log_ring *thread_ring_new(void) {
+  struct log_ring *ring = calloc(1, sizeof (struct log_ring));
+  ring->thread = __sync_add_and_fetch(&num_rings, 1);
+
+  do {
+    ring->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  } while (!__sync_bool_compare_and_swap(&rings, ring->next, ring));
+
+  thread_ring = ring;
+  return ring;
+}
+
+void logger_write(int level, const char *format, ...) {
+  struct log_ring *ring = thread_ring != NULL ? thread_ring
+                                              : thread_ring_new();
+  unsigned long head = ring->head;
+
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      LOGGER_RING_LINES) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct log_line *line = &ring->lines[head % LOGGER_RING_LINES];
+  clock_gettime(CLOCK_REALTIME, &line->time);
+  line->level = level;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line->message, LOGGER_LINE_LENGTH, format, args);
+  va_end(args);
+
+  // Lines don't need their own newlines
+  size_t length = strlen(line->message);
+
+  while (length > 0 && line->message[length - 1] == '\n')
+    line->message[--length] = '\0';
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_line(struct log_line *line, int thread) {
+  if (destination == LOGGER_SYSLOG) {
+    syslog(line->level, "%s", line->message);
+    return;
+  }
+
+  char time_str[32];
+  struct tm tm;
+  gmtime_r(&line->time.tv_sec, &tm);
+  strftime(time_str, sizeof (time_str), "%Y-%m-%dT%H:%M:%S", &tm);
+  fprintf(file, "%s.%03ldZ %s [%d/%d] %s\n", time_str,
+          line->time.tv_nsec / 1000000, kLevelNames[line->level],
+          (int) getpid(), thread, line->message);
+}
+
+// Writes out the lines of all threads
+static void logger_flush(void) {
+  struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+  for (; ring != NULL; ring = ring->next) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+
+    for (; tail != head; tail++)
+      write_line(&ring->lines[tail % LOGGER_RING_LINES], ring->thread);
+
+    __atomic_fetch_add(&ring->written, tail - ring->tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  if (file != NULL)
+    fflush(file);
+}
+
+static void *flush_lines(void *userdata) {
+  struct timespec interval = {
+    kLogFlushMilliseconds / 1000, (kLogFlushMilliseconds % 1000) * 1000000
+  };
+
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    logger_flush();
+    nanosleep(&interval, NULL);
+  }
+
+  logger_flush();
+  return NULL;
+}
+
+static void start_flusher(void) {
+  __atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+  pthread_create(&flusher, NULL, &flush_lines, NULL);
+}
+
+static void stop_flusher(void) {
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  pthread_join(flusher, NULL);
+}
+
+// The flusher is stopped (having written out everything) while forking, so
+// that it doesn't hold any locks the child would need, and the child gets
+// one of its own
+static void before_fork(void) {
+  if (opened)
+    stop_flusher();
+}
+
+static void after_fork(void) {
+  if (opened)
+    start_flusher();
+}
+
+bool logger_open(const char *destination_name, int level) {
+  static bool fork_handlers = false;
+
+  if (destination_name == NULL || strcmp(destination_name, "syslog") == 0) {
+    destination = LOGGER_SYSLOG;
+    openlog("spotify-api-server", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+  } else if (strcmp(destination_name, "stderr") == 0) {
+    destination = LOGGER_STDERR;
+    file = stderr;
+  } else {
+    file = fopen(destination_name, "a");
+
+    if (file == NULL) {
+      fprintf(stderr, "Could not open log file %s: %s\n", destination_name,
+              strerror(errno));
+      return false;
+    }
+
+    destination = LOGGER_FILE;
+  }
+
+  logger_level = level;
+
+  if (!fork_handlers) {
+    pthread_atfork(&before_fork, &after_fork, &after_fork);
+    fork_handlers = true;
+  }
+
+  start_flusher();
+  opened = true;
+  return true;
+}
+
+void logger_close(void) {
+  if (!opened)
+    return;
+
+  opened = false;
+  stop_flusher();
+
+  if (destination == LOGGER_SYSLOG) {
+    closelog();
+  } else if (destination == LOGGER_FILE) {
+    fclose(file);
+  }
+
+  file = NULL;
+}
+
+int logger_level_from_name(const char *name) {
+  for (int i = 0; i < (int) (sizeof (kLevelNames) / sizeof (kLevelNames[0]));
+       i++) {
+    if (strcmp(name, kLevelNames[i]) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+json_t *logger_to_json(json_t *object) {
+  json_t *threads = json_array();
+  unsigned long written = 0, dropped = 0;
+  struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+  for (; ring != NULL; ring = ring->next) {
+    json_t *thread = json_object();
+    unsigned long ring_written = __atomic_load_n(&ring->written,
+                                                 __ATOMIC_RELAXED);
+    unsigned long ring_dropped = __atomic_load_n(&ring->dropped,
+                                                 __ATOMIC_RELAXED);
+    json_object_set_new(thread, "thread", json_integer(ring->thread));
+    json_object_set_new(thread, "written", json_integer(ring_written));
+    json_object_set_new(thread, "dropped", json_integer(ring_dropped));
+    json_array_append_new(threads, thread);
+    written += ring_written;
+    dropped += ring_dropped;
+  }
+
+  json_object_set_new(object, "level",
+                      json_string(kLevelNames[logger_level]));
+  json_object_set_new(object, "maxLevel",
+                      json_string(kLevelNames[LOGGER_MAX_LEVEL]));
+  json_object_set_new(object, "written", json_integer(written));
+  json_object_set_new(object, "dropped", json_integer(dropped));
+  json_object_set_new(object, "threads", threads);
+  return object;
+}
@@ -0,0 +1,50 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <syslog.h>
+
+// Logging that doesn't block the thread logging. Lines are written to a ring
+// buffer of the calling thread, and written out from a background thread to
+// syslog, stderr or a file. Lines that don't fit in a full buffer are dropped
+// and counted. Levels are the syslog priorities.
+
+// Most verbose level compiled in; lines at more verbose levels cost nothing
+#ifndef LOGGER_MAX_LEVEL
+#ifdef DEBUG
+#define LOGGER_MAX_LEVEL LOG_DEBUG
+#else
+#define LOGGER_MAX_LEVEL LOG_INFO
+#endif
+#endif
+
+// Most verbose level logged
+extern int logger_level;
+
+#define logger_log(level, ...) \
+  do { \
+    if ((level) <= LOGGER_MAX_LEVEL && (level) <= logger_level) \
+      logger_write((level), __VA_ARGS__); \
+  } while (0)
+
+#define log_crit(...) logger_log(LOG_CRIT, __VA_ARGS__)
+#define log_warning(...) logger_log(LOG_WARNING, __VA_ARGS__)
+#define log_info(...) logger_log(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) logger_log(LOG_DEBUG, __VA_ARGS__)
+
+// Starts writing out lines to a destination: "syslog", "stderr" or the path
+// of a file to append to. Returns false if the file couldn't be opened.
+bool logger_open(const char *destination, int level);
+
+// Writes out what's left and stops
+void logger_close(void);
+
+// Reads a level by name ("crit", "warning", "info", ...). Returns -1 for an
+// unknown name.
+int logger_level_from_name(const char *name);
+
+void logger_write(int level, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+json_t *logger_to_json(json_t *object);
+
+#endif
@@ -1,22 +1,64 @@
 #include <apr.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/buffer.h>
 #include <event2/thread.h>
 #include <getopt.h>
+#include <jansson.h>
 #include <libspotify/api.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <svn_diff.h>
 #include <sys/stat.h>
-#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "logger.h"
 #include "server.h"
+#include "shard.h"
+#include "shmcache.h"
+#include "supervisor.h"
 
 // Application keys are 321 bytes, from what I've seen... but ramp it up
 // to be on the safe side
 #define MAX_APPLICATION_KEY_SIZE 1024
 
+// Options without a short form
+enum {
+  OPT_RESIDENT_TRACKS = 256,
+  OPT_RESIDENT_BYTES,
+  OPT_SNAPSHOT_FILE,
+  OPT_MAX_STALE,
+  OPT_PLAYLIST_CACHE_BYTES,
+  OPT_LOAD_TIMEOUT,
+  OPT_SYNC_TIMEOUT,
+  OPT_MAX_IN_FLIGHT,
+  OPT_MAX_QUEUED,
+  OPT_MAX_QUEUE_WAIT,
+  OPT_READ_RATE,
+  OPT_READ_BURST,
+  OPT_WRITE_RATE,
+  OPT_WRITE_BURST,
+  OPT_RATE_LIMIT_CLIENTS,
+  OPT_API_KEYS,
+  OPT_WORKERS,
+  OPT_WORKER_PORT,
+  OPT_WORKER_ACCOUNTS,
+  OPT_SHARED_CACHE_BYTES,
+  OPT_SHARED_CACHE_TTL,
+  OPT_LOG,
+  OPT_LOG_LEVEL,
+  OPT_USER_CACHE_ENTRIES,
+  OPT_USER_CACHE_TTL,
+  OPT_SUBSCRIBERS_TTL,
+  OPT_INBOX_WINDOW,
+  OPT_TRACK_METADATA_BYTES,
+  OPT_SEARCH_CACHE_BYTES,
+  OPT_BROWSE_CACHE_BYTES
+};
+
 extern const unsigned char g_appkey[];
 extern const size_t g_appkey_size;
 
@@ -56,17 +98,156 @@ void read_application_key(char *path, sp_session_config *session_config) {
   fclose(file);
 }
 
+// Names a worker's own copy of a file or directory after the shared one
+static char *worker_path(const char *path, int worker) {
+  size_t size = strlen(path) + 16;
+  char *worker_path = malloc(size);
+  snprintf(worker_path, size, "%s.%d", path, worker);
+  return worker_path;
+}
+
+// Reads the username and password on a worker's line of the accounts file,
+// one "<username> <password>" per line. Leaves them as they are if there is
+// no such line.
+static void read_worker_account(const char *path,
+                                int worker,
+                                char **username,
+                                char **password) {
+  FILE *file = fopen(path, "r");
+
+  if (!file) {
+    log_warning("Could not open accounts file %s", path);
+    return;
+  }
+
+  char line[512];
+
+  for (int i = 0; fgets(line, sizeof (line), file) != NULL; i++) {
+    char account_username[256], account_password[256];
+
+    if (i != worker)
+      continue;
+
+    if (sscanf(line, "%255s %255s", account_username, account_password) == 2) {
+      free(*username);
+      free(*password);
+      *username = strdup(account_username);
+      *password = strdup(account_password);
+    }
+
+    fclose(file);
+    return;
+  }
+
+  log_warning("No account for worker %d in %s", worker, path);
+  fclose(file);
+}
+
+// Reads the API keys that clients are rate limited by, one per line
+static apr_hash_t *read_api_keys(const char *path, apr_pool_t *pool) {
+  FILE *file = fopen(path, "r");
+
+  if (!file) {
+    log_warning("Could not open API keys file %s", path);
+    return NULL;
+  }
+
+  apr_hash_t *api_keys = apr_hash_make(pool);
+  char line[512];
+
+  while (fgets(line, sizeof (line), file) != NULL) {
+    char api_key[256];
+
+    if (sscanf(line, "%255s", api_key) == 1) {
+      char *key = apr_pstrdup(pool, api_key);
+      apr_hash_set(api_keys, key, APR_HASH_KEY_STRING, key);
+    }
+  }
+
+  fclose(file);
+  return api_keys;
+}
+
+// Random token that workers recognize each other's requests by
+static char *worker_token(void) {
+  unsigned char bytes[SHARD_TOKEN_LENGTH / 2];
+  FILE *file = fopen("/dev/urandom", "rb");
+
+  if (!file || fread(bytes, 1, sizeof (bytes), file) != sizeof (bytes)) {
+    // Tokens only need to be hard to guess from the outside
+    srand(time(NULL) ^ getpid());
+
+    for (size_t i = 0; i < sizeof (bytes); i++)
+      bytes[i] = rand();
+  }
+
+  if (file)
+    fclose(file);
+
+  char *token = malloc(SHARD_TOKEN_LENGTH + 1);
+
+  for (size_t i = 0; i < sizeof (bytes); i++)
+    sprintf(token + 2 * i, "%02x", bytes[i]);
+
+  return token;
+}
+
 int main(int argc, char **argv) {
-  // Open syslog
-  openlog("spotify-api-server", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+  // Log to syslog until told otherwise
+  logger_open(NULL, LOGGER_MAX_LEVEL);
 
   // Initialize program state
-  struct state *state = malloc(sizeof(struct state));
+  struct state *state = calloc(1, sizeof(struct state));
 
   // Web server defaults
   state->http_host = strdup("127.0.0.1");
   state->http_port = 1337;
 
+  // Keep at most this many tracks' worth of playlists loaded
+  state->resident_max_tracks = 100000;
+
+  // Memory for last known good playlist serializations
+  state->playlist_cache_max_bytes = 64 << 20;
+
+  // Give up on requests waiting for libspotify after this many milliseconds
+  state->load_timeout = 30000;
+  state->sync_timeout = 60000;
+
+  // Queue requests beyond this many waiting for libspotify, and turn them
+  // away when the queues are full
+  state->max_in_flight = 64;
+  state->max_queued = 256;
+  state->max_queue_wait = 5000;
+
+  // Remember rate limits of at most this many clients
+  state->ratelimit_max_clients = 10000;
+
+  // Memory shared between workers for serialized playlists, and how long
+  // they are served from it
+  state->shared_cache_max_bytes = 64 << 20;
+  state->shared_cache_ttl = 5;
+
+  // Keep the containers and starred playlists of this many users, for this
+  // many seconds
+  state->user_cache_max_entries = 1000;
+  state->user_cache_ttl = 300;
+
+  // Serve subscribers of playlists for this many seconds before asking
+  // Spotify again
+  state->subscribers_ttl = 60;
+
+  // Post to at most this many inboxes at a time for batches
+  state->inbox_window = 16;
+
+  // Memory for serialized metadata of tracks
+  state->track_metadata_max_bytes = 16 << 20;
+
+  // Memory for serialized search results
+  state->search_cache_max_bytes = 16 << 20;
+
+  // Memory for serialized albums and artists
+  state->browse_cache_max_bytes = 16 << 20;
+
   // Initialize libev w/ pthreads
   evthread_use_pthreads();
 
@@ -80,7 +261,7 @@ int main(int argc, char **argv) {
   apr_status_t rv = apr_initialize();
 
   if (rv != APR_SUCCESS) {
-    syslog(LOG_CRIT, "Unable to initialize APR");
+    log_crit("Unable to initialize APR");
   } else {
     apr_pool_create(&state->pool, NULL);
 
@@ -88,7 +269,8 @@ int main(int argc, char **argv) {
     sp_session_callbacks session_callbacks = {
       .logged_in = &logged_in,
       .logged_out = &logged_out,
-      .notify_main_thread = &notify_main_thread
+      .notify_main_thread = &notify_main_thread,
+      .metadata_updated = &metadata_updated
     };
 
     sp_session_config session_config = {
@@ -106,6 +288,11 @@ int main(int argc, char **argv) {
     char *credentials_blob = NULL;
     bool remember_me = false;
     bool relogin = false;
+    bool max_stale_set = false;
+    char *worker_accounts = NULL;
+    char *api_keys = NULL;
+    char *log_destination = NULL;
+    int log_level = -1;
     struct option opts[] = {
       // Login configuration
       {"username", required_argument, NULL, 'u'},
@@ -135,6 +322,57 @@ int main(int argc, char **argv) {
       {"host", required_argument, NULL, 'H'},
       {"port", required_argument, NULL, 'P'},
 
+      // Residency limits (0 means unbounded)
+      {"resident-tracks", required_argument, NULL, OPT_RESIDENT_TRACKS},
+      {"resident-bytes", required_argument, NULL, OPT_RESIDENT_BYTES},
+
+      // Playlist snapshot file for fast restarts
+      {"snapshot-file", required_argument, NULL, OPT_SNAPSHOT_FILE},
+
+      // Serving playlists that haven't loaded yet (-1 means any age)
+      {"max-stale", required_argument, NULL, OPT_MAX_STALE},
+      {"playlist-cache-bytes", required_argument, NULL,
+       OPT_PLAYLIST_CACHE_BYTES},
+
+      // Milliseconds to wait for libspotify before responding with a 504
+      {"load-timeout", required_argument, NULL, OPT_LOAD_TIMEOUT},
+      {"sync-timeout", required_argument, NULL, OPT_SYNC_TIMEOUT},
+
+      // Admission control (0 in-flight means no cap)
+      {"max-in-flight", required_argument, NULL, OPT_MAX_IN_FLIGHT},
+      {"max-queued", required_argument, NULL, OPT_MAX_QUEUED},
+      {"max-queue-wait", required_argument, NULL, OPT_MAX_QUEUE_WAIT},
+
+      // Requests per second per client (0 means unlimited)
+      {"read-rate", required_argument, NULL, OPT_READ_RATE},
+      {"read-burst", required_argument, NULL, OPT_READ_BURST},
+      {"write-rate", required_argument, NULL, OPT_WRITE_RATE},
+      {"write-burst", required_argument, NULL, OPT_WRITE_BURST},
+      {"rate-limit-clients", required_argument, NULL, OPT_RATE_LIMIT_CLIENTS},
+      {"api-keys", required_argument, NULL, OPT_API_KEYS},
+
+      // Worker processes sharing the port (0 means a single process)
+      {"workers", required_argument, NULL, OPT_WORKERS},
+      {"worker-port", required_argument, NULL, OPT_WORKER_PORT},
+      {"worker-accounts", required_argument, NULL, OPT_WORKER_ACCOUNTS},
+      {"shared-cache-bytes", required_argument, NULL, OPT_SHARED_CACHE_BYTES},
+      {"shared-cache-ttl", required_argument, NULL, OPT_SHARED_CACHE_TTL},
+
+      // Where to log ("syslog", "stderr" or a file) and what
+      {"log", required_argument, NULL, OPT_LOG},
+      {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+
+      // Users whose containers and starred playlists are kept (0 means
+      // unbounded)
+      {"user-cache-entries", required_argument, NULL, OPT_USER_CACHE_ENTRIES},
+      {"user-cache-ttl", required_argument, NULL, OPT_USER_CACHE_TTL},
+      {"subscribers-ttl", required_argument, NULL, OPT_SUBSCRIBERS_TTL},
+      {"inbox-window", required_argument, NULL, OPT_INBOX_WINDOW},
+      {"track-metadata-bytes", required_argument, NULL,
+       OPT_TRACK_METADATA_BYTES},
+      {"search-cache-bytes", required_argument, NULL, OPT_SEARCH_CACHE_BYTES},
+      {"browse-cache-bytes", required_argument, NULL, OPT_BROWSE_CACHE_BYTES},
+
       {NULL, 0, NULL, 0}
     };
     const char optstring[] = "u:p:c:k:A:C:S:T:U:H:P:";
@@ -185,10 +423,209 @@ int main(int argc, char **argv) {
         case 'P':
           state->http_port = atoi(optarg);
           break;
+
+        case OPT_RESIDENT_TRACKS:
+          state->resident_max_tracks = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_RESIDENT_BYTES:
+          state->resident_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_SNAPSHOT_FILE:
+          state->snapshot_path = strdup(optarg);
+          break;
+
+        case OPT_MAX_STALE:
+          state->max_stale = atol(optarg);
+          max_stale_set = true;
+          break;
+
+        case OPT_PLAYLIST_CACHE_BYTES:
+          state->playlist_cache_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_LOAD_TIMEOUT:
+          state->load_timeout = atoi(optarg);
+          break;
+
+        case OPT_SYNC_TIMEOUT:
+          state->sync_timeout = atoi(optarg);
+          break;
+
+        case OPT_MAX_IN_FLIGHT:
+          state->max_in_flight = atoi(optarg);
+          break;
+
+        case OPT_MAX_QUEUED:
+          state->max_queued = atoi(optarg);
+          break;
+
+        case OPT_MAX_QUEUE_WAIT:
+          state->max_queue_wait = atoi(optarg);
+          break;
+
+        case OPT_READ_RATE:
+          state->read_rate = atof(optarg);
+          break;
+
+        case OPT_READ_BURST:
+          state->read_burst = atof(optarg);
+          break;
+
+        case OPT_WRITE_RATE:
+          state->write_rate = atof(optarg);
+          break;
+
+        case OPT_WRITE_BURST:
+          state->write_burst = atof(optarg);
+          break;
+
+        case OPT_RATE_LIMIT_CLIENTS:
+          state->ratelimit_max_clients = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_API_KEYS:
+          api_keys = strdup(optarg);
+          break;
+
+        case OPT_WORKERS:
+          state->num_workers = atoi(optarg);
+          break;
+
+        case OPT_WORKER_PORT:
+          state->worker_port = atoi(optarg);
+          break;
+
+        case OPT_WORKER_ACCOUNTS:
+          worker_accounts = strdup(optarg);
+          break;
+
+        case OPT_SHARED_CACHE_BYTES:
+          state->shared_cache_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_SHARED_CACHE_TTL:
+          state->shared_cache_ttl = atoi(optarg);
+          break;
+
+        case OPT_LOG:
+          log_destination = strdup(optarg);
+          break;
+
+        case OPT_LOG_LEVEL:
+          log_level = logger_level_from_name(optarg);
+
+          if (log_level < 0)
+            fprintf(stderr, "Unknown log level %s\n", optarg);
+
+          break;
+
+        case OPT_USER_CACHE_ENTRIES:
+          state->user_cache_max_entries = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_USER_CACHE_TTL:
+          state->user_cache_ttl = atoi(optarg);
+          break;
+
+        case OPT_SUBSCRIBERS_TTL:
+          state->subscribers_ttl = atoi(optarg);
+          break;
+
+        case OPT_INBOX_WINDOW:
+          state->inbox_window = atoi(optarg);
+          break;
+
+        case OPT_TRACK_METADATA_BYTES:
+          state->track_metadata_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_SEARCH_CACHE_BYTES:
+          state->search_cache_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+
+        case OPT_BROWSE_CACHE_BYTES:
+          state->browse_cache_max_bytes = strtoul(optarg, NULL, 10);
+          break;
+      }
+    }
+
+    if (log_destination != NULL || log_level >= 0) {
+      if (log_level < 0)
+        log_level = LOGGER_MAX_LEVEL;
+
+      logger_close();
+
+      if (!logger_open(log_destination, log_level))
+        logger_open(NULL, log_level);
+    }
+
+    if (api_keys != NULL)
+      state->api_keys = read_api_keys(api_keys, state->pool);
+
+    // Evicted playlists are only unloaded when libspotify is set up to keep
+    // playlists out of RAM to begin with
+    state->unload_evicted = session_config.initially_unload_playlists;
+
+    // Bursts default to a second's worth of requests
+    if (state->read_burst == 0)
+      state->read_burst = state->read_rate;
+
+    if (state->write_burst == 0)
+      state->write_burst = state->write_rate;
+
+    // Snapshots are there to be served while playlists load
+    if (state->snapshot_path != NULL && !max_stale_set)
+      state->max_stale = -1;
+
+    // Workers take forwarded requests on the ports after the shared one
+    if (state->worker_port == 0)
+      state->worker_port = state->http_port + 1;
+
+    // The supervisor only forks workers and waits for them. Each worker gets
+    // its own cache, settings, credentials and snapshot files.
+    bool supervisor = false;
+
+    if (state->num_workers > 0) {
+      state->worker_token = worker_token();
+      state->shared_cache = shmcache_new(state->shared_cache_max_bytes);
+      state->worker = supervise(state->num_workers);
+      supervisor = state->worker < 0;
+    }
+
+    if (state->num_workers > 0 && !supervisor) {
+      event_reinit(state->event_base);
+      session_config.cache_location = worker_path(
+          session_config.cache_location, state->worker);
+
+      if (session_config.settings_location != NULL) {
+        session_config.settings_location = worker_path(
+            session_config.settings_location, state->worker);
+      }
+
+      if (state->credentials_blob_filename != NULL) {
+        char *path = worker_path(state->credentials_blob_filename,
+                                 state->worker);
+        free(state->credentials_blob_filename);
+        state->credentials_blob_filename = path;
+      }
+
+      if (state->snapshot_path != NULL) {
+        char *path = worker_path(state->snapshot_path, state->worker);
+        free(state->snapshot_path);
+        state->snapshot_path = path;
+      }
+
+      if (worker_accounts != NULL) {
+        read_worker_account(worker_accounts, state->worker, &username,
+                            &password);
       }
     }
 
-    if (session_config.application_key_size == 0) {
+    if (supervisor) {
+      state->exit_status = EXIT_SUCCESS;
+    } else if (session_config.application_key_size == 0) {
       fprintf(stderr, "You didn't specify a path to your application key (use"
                       " -A/--application-key).\n");
     } else {
@@ -197,8 +634,8 @@ int main(int argc, char **argv) {
                                                         &session);
 
       if (session_create_error != SP_ERROR_OK) {
-        syslog(LOG_CRIT, "Error creating Spotify session: %s",
-               sp_error_message(session_create_error));
+        log_crit("Error creating Spotify session: %s",
+                 sp_error_message(session_create_error));
       } else {
         // Log in to Spotify
         if (relogin) {
@@ -217,6 +654,9 @@ int main(int argc, char **argv) {
     if (username != NULL) free(username);
     if (password != NULL) free(password);
     if (credentials_blob != NULL) free(credentials_blob);
+    if (worker_accounts != NULL) free(worker_accounts);
+    if (api_keys != NULL) free(api_keys);
+    if (log_destination != NULL) free(log_destination);
   }
 
   event_free(state->async);
@@ -224,8 +664,12 @@ int main(int argc, char **argv) {
   event_free(state->sigint);
   if (state->http != NULL) evhttp_free(state->http);
   free(state->http_host);
+  free(state->snapshot_path);
+  free(state->worker_token);
+  if (state->shared_cache != NULL) shmcache_free(state->shared_cache);
   event_base_free(state->event_base);
   int exit_status = state->exit_status;
   free(state);
+  logger_close();
   return exit_status;
 }
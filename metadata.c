@@ -0,0 +1,266 @@
+#include <apr.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "cache.h"
+#include "constants.h"
+#include "json.h"
+#include "metadata.h"
+
+struct track_metadata_waiter {
+  struct track_metadata *metadata;
+  sp_track **tracks;
+  int num_tracks;
+  int num_loaded;  // Tracks before this have all loaded
+  track_metadata_loaded_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(track_metadata_waiter) entries;
+};
+
+TAILQ_HEAD(track_metadata_waiter_list, track_metadata_waiter);
+
+struct track_metadata {
+  struct cache *fragments;
+  struct track_metadata_waiter_list waiters;
+  int num_waiters;
+
+  unsigned long updates;
+  unsigned long waits;
+  unsigned long unloaded;
+};
+
+struct track_metadata *track_metadata_new(size_t max_bytes, apr_pool_t *pool) {
+  struct track_metadata *metadata = calloc(1, sizeof (struct track_metadata));
+  metadata->fragments = cache_new(max_bytes, 0, pool);
+  TAILQ_INIT(&metadata->waiters);
+  return metadata;
+}
+
+static void track_metadata_waiter_free(struct track_metadata_waiter *waiter) {
+  for (int i = 0; i < waiter->num_tracks; i++)
+    sp_track_release(waiter->tracks[i]);
+
+  free(waiter->tracks);
+  free(waiter);
+}
+
+void track_metadata_free(struct track_metadata *metadata) {
+  struct track_metadata_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&metadata->waiters)) != NULL) {
+    TAILQ_REMOVE(&metadata->waiters, waiter, entries);
+    track_metadata_waiter_free(waiter);
+  }
+
+  cache_free(metadata->fragments);
+  free(metadata);
+}
+
+bool track_metadata_is_loaded(sp_track *track) {
+  if (!sp_track_is_loaded(track))
+    return false;
+
+  for (int i = 0; i < sp_track_num_artists(track); i++) {
+    if (!sp_artist_is_loaded(sp_track_artist(track, i)))
+      return false;
+  }
+
+  sp_album *album = sp_track_album(track);
+  return album == NULL || sp_album_is_loaded(album);
+}
+
+// Serializes a loaded track, marking artists and album that haven't loaded.
+// Returns false if any hadn't, so that it shouldn't be kept.
+static bool track_to_evbuffer(sp_track *track,
+                              const char *uri,
+                              struct evbuffer *buf) {
+  bool complete = true;
+  evbuffer_add_printf(buf, "{\"uri\":");
+  json_string_to_evbuffer(buf, uri);
+  evbuffer_add_printf(buf, ",\"name\":");
+  json_string_to_evbuffer(buf, sp_track_name(track));
+  evbuffer_add_printf(buf, ",\"duration\":%d,\"artists\":[",
+                      sp_track_duration(track));
+
+  for (int i = 0; i < sp_track_num_artists(track); i++) {
+    sp_artist *artist = sp_track_artist(track, i);
+    evbuffer_add_printf(buf, i > 0 ? ",{\"uri\":" : "{\"uri\":");
+    json_link_to_evbuffer(buf, sp_link_create_from_artist(artist));
+
+    if (sp_artist_is_loaded(artist)) {
+      evbuffer_add_printf(buf, ",\"name\":");
+      json_string_to_evbuffer(buf, sp_artist_name(artist));
+    } else {
+      evbuffer_add_printf(buf, ",\"loading\":true");
+      complete = false;
+    }
+
+    evbuffer_add(buf, "}", 1);
+  }
+
+  evbuffer_add_printf(buf, "],\"album\":");
+  sp_album *album = sp_track_album(track);
+
+  if (album == NULL) {
+    evbuffer_add_printf(buf, "null}");
+    return complete;
+  }
+
+  evbuffer_add_printf(buf, "{\"uri\":");
+  json_link_to_evbuffer(buf, sp_link_create_from_album(album));
+
+  if (sp_album_is_loaded(album)) {
+    evbuffer_add_printf(buf, ",\"name\":");
+    json_string_to_evbuffer(buf, sp_album_name(album));
+  } else {
+    evbuffer_add_printf(buf, ",\"loading\":true");
+    complete = false;
+  }
+
+  evbuffer_add_printf(buf, "}}");
+  return complete;
+}
+
+bool track_metadata_write(struct track_metadata *metadata,
+                          sp_track *track,
+                          struct evbuffer *buf) {
+  char uri[kTrackLinkLength];
+  sp_link *link = sp_link_create_from_track(track, 0);
+  sp_link_as_string(link, uri, sizeof (uri));
+  sp_link_release(link);
+  size_t length;
+  char *fragment = cache_get(metadata->fragments, uri, &length, NULL);
+
+  if (fragment != NULL) {
+    evbuffer_add(buf, fragment, length);
+    return true;
+  }
+
+  if (!sp_track_is_loaded(track)) {
+    evbuffer_add_printf(buf, "{\"uri\":");
+    json_string_to_evbuffer(buf, uri);
+    evbuffer_add_printf(buf, ",\"loading\":true}");
+    metadata->unloaded++;
+    return false;
+  }
+
+  struct evbuffer *track_buf = evbuffer_new();
+  bool complete = track_to_evbuffer(track, uri, track_buf);
+
+  if (complete) {
+    length = evbuffer_get_length(track_buf);
+    fragment = malloc(length);
+    evbuffer_copyout(track_buf, fragment, length);
+    cache_put(metadata->fragments, uri, fragment, length, &free);
+  } else {
+    metadata->unloaded++;
+  }
+
+  evbuffer_add_buffer(buf, track_buf);
+  evbuffer_free(track_buf);
+  return complete;
+}
+
+int track_metadata_write_tracks(struct track_metadata *metadata,
+                                sp_track **tracks,
+                                int num_tracks,
+                                struct evbuffer *buf) {
+  int num_unloaded = 0;
+  evbuffer_add(buf, "[", 1);
+
+  for (int i = 0; i < num_tracks; i++) {
+    if (i > 0)
+      evbuffer_add(buf, ",", 1);
+
+    if (!track_metadata_write(metadata, tracks[i], buf))
+      num_unloaded++;
+  }
+
+  evbuffer_add(buf, "]", 1);
+  return num_unloaded;
+}
+
+// Returns whether all tracks have loaded, picking up where it left off
+static bool track_metadata_waiter_done(struct track_metadata_waiter *waiter) {
+  while (waiter->num_loaded < waiter->num_tracks &&
+         track_metadata_is_loaded(waiter->tracks[waiter->num_loaded])) {
+    waiter->num_loaded++;
+  }
+
+  return waiter->num_loaded == waiter->num_tracks;
+}
+
+struct track_metadata_waiter *track_metadata_wait(
+    struct track_metadata *metadata,
+    sp_track **tracks,
+    int num_tracks,
+    track_metadata_loaded_fn callback,
+    void *userdata) {
+  struct track_metadata_waiter *waiter =
+      calloc(1, sizeof (struct track_metadata_waiter));
+  waiter->metadata = metadata;
+  waiter->tracks = malloc(num_tracks * sizeof (sp_track *));
+
+  for (int i = 0; i < num_tracks; i++) {
+    waiter->tracks[i] = tracks[i];
+    sp_track_add_ref(tracks[i]);
+  }
+
+  waiter->num_tracks = num_tracks;
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+  TAILQ_INSERT_TAIL(&metadata->waiters, waiter, entries);
+  metadata->num_waiters++;
+  metadata->waits++;
+  return waiter;
+}
+
+void track_metadata_cancel(struct track_metadata_waiter *waiter) {
+  TAILQ_REMOVE(&waiter->metadata->waiters, waiter, entries);
+  waiter->metadata->num_waiters--;
+  track_metadata_waiter_free(waiter);
+}
+
+void track_metadata_updated(struct track_metadata *metadata) {
+  metadata->updates++;
+
+  // Callbacks may wait for (or stop waiting for) other tracks, so those that
+  // are done are taken off first
+  struct track_metadata_waiter_list done;
+  TAILQ_INIT(&done);
+  struct track_metadata_waiter *waiter = TAILQ_FIRST(&metadata->waiters);
+
+  while (waiter != NULL) {
+    struct track_metadata_waiter *next = TAILQ_NEXT(waiter, entries);
+
+    if (track_metadata_waiter_done(waiter)) {
+      TAILQ_REMOVE(&metadata->waiters, waiter, entries);
+      metadata->num_waiters--;
+      TAILQ_INSERT_TAIL(&done, waiter, entries);
+    }
+
+    waiter = next;
+  }
+
+  while ((waiter = TAILQ_FIRST(&done)) != NULL) {
+    TAILQ_REMOVE(&done, waiter, entries);
+    waiter->callback(waiter->userdata);
+    track_metadata_waiter_free(waiter);
+  }
+}
+
+json_t *track_metadata_to_json(struct track_metadata *metadata,
+                               json_t *object) {
+  cache_to_json(metadata->fragments, object);
+  json_object_set_new(object, "waiting", json_integer(metadata->num_waiters));
+  json_object_set_new(object, "waits", json_integer(metadata->waits));
+  json_object_set_new(object, "metadataUpdates",
+                      json_integer(metadata->updates));
+  json_object_set_new(object, "unloaded", json_integer(metadata->unloaded));
+  return object;
+}
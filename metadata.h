@@ -0,0 +1,58 @@
+#ifndef METADATA_H_
+#define METADATA_H_
+
+// Metadata of tracks (name, artists, album and duration) serialized as JSON
+// objects, kept in a cache bounded by their total size. Requests waiting for
+// tracks to load are checked once each time the session's metadata is
+// updated, rather than each following tracks of its own.
+struct track_metadata;
+
+struct track_metadata_waiter;
+
+// Called once all tracks waited for have loaded
+typedef void (*track_metadata_loaded_fn)(void *userdata);
+
+struct track_metadata *track_metadata_new(size_t max_bytes, apr_pool_t *pool);
+
+// Waiters are dropped without being called
+void track_metadata_free(struct track_metadata *);
+
+// Writes a track as a JSON object:
+//
+//   {"uri":<string>,"name":<string>,"duration":<int>,
+//    "artists":[{"uri":<string>,"name":<string>}],
+//    "album":{"uri":<string>,"name":<string>}}
+//
+// or, if it hasn't loaded, {"uri":<string>,"loading":true}. Artists and the
+// album that haven't loaded are {"uri":<string>,"loading":true} too. Returns
+// whether the track, its artists and album had all loaded.
+bool track_metadata_write(struct track_metadata *,
+                          sp_track *track,
+                          struct evbuffer *buf);
+
+// Whether a track, its artists and its album have loaded
+bool track_metadata_is_loaded(sp_track *track);
+
+// Writes tracks as a JSON array. Returns the number that hadn't loaded.
+int track_metadata_write_tracks(struct track_metadata *,
+                                sp_track **tracks,
+                                int num_tracks,
+                                struct evbuffer *buf);
+
+// Waits for tracks, some not loaded yet, to load. Takes references to them.
+struct track_metadata_waiter *track_metadata_wait(
+    struct track_metadata *,
+    sp_track **tracks,
+    int num_tracks,
+    track_metadata_loaded_fn callback,
+    void *userdata);
+
+// Stops waiting, without calling back
+void track_metadata_cancel(struct track_metadata_waiter *);
+
+// To be called from the session's metadata_updated callback
+void track_metadata_updated(struct track_metadata *);
+
+json_t *track_metadata_to_json(struct track_metadata *, json_t *object);
+
+#endif
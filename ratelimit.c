@@ -0,0 +1,186 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+struct bucket {
+  double tokens;
+  unsigned long allowed;
+  unsigned long limited;
+};
+
+struct client {
+  char *key;
+  struct bucket reads;
+  struct bucket writes;
+  double updated;  // When the buckets were last refilled
+  time_t last_seen;
+  TAILQ_ENTRY(client) entries;
+};
+
+TAILQ_HEAD(client_list, client);
+
+struct ratelimit {
+  apr_hash_t *index;
+  struct client_list lru;  // Most recently seen first
+  size_t num_clients;
+  size_t max_clients;
+
+  double read_rate;
+  double read_burst;
+  double write_rate;
+  double write_burst;
+
+  unsigned long evictions;
+};
+
+static double now_seconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct ratelimit *ratelimit_new(double read_rate,
+                                double read_burst,
+                                double write_rate,
+                                double write_burst,
+                                size_t max_clients,
+                                apr_pool_t *pool) {
+  struct ratelimit *ratelimit = calloc(1, sizeof (struct ratelimit));
+  ratelimit->index = apr_hash_make(pool);
+  TAILQ_INIT(&ratelimit->lru);
+  ratelimit->max_clients = max_clients;
+  ratelimit->read_rate = read_rate;
+  ratelimit->write_rate = write_rate;
+
+  // A bucket holds at least one request, or nothing would ever get through
+  ratelimit->read_burst = read_burst < 1 ? 1 : read_burst;
+  ratelimit->write_burst = write_burst < 1 ? 1 : write_burst;
+  return ratelimit;
+}
+
+static void client_remove(struct ratelimit *ratelimit, struct client *client) {
+  TAILQ_REMOVE(&ratelimit->lru, client, entries);
+  apr_hash_set(ratelimit->index, client->key, APR_HASH_KEY_STRING, NULL);
+  ratelimit->num_clients--;
+  free(client->key);
+  free(client);
+}
+
+void ratelimit_free(struct ratelimit *ratelimit) {
+  struct client *client;
+
+  while ((client = TAILQ_FIRST(&ratelimit->lru)) != NULL)
+    client_remove(ratelimit, client);
+
+  free(ratelimit);
+}
+
+static struct client *client_get(struct ratelimit *ratelimit,
+                                 const char *key,
+                                 double now) {
+  struct client *client = apr_hash_get(ratelimit->index, key,
+                                       APR_HASH_KEY_STRING);
+
+  if (client != NULL) {
+    TAILQ_REMOVE(&ratelimit->lru, client, entries);
+    TAILQ_INSERT_HEAD(&ratelimit->lru, client, entries);
+    return client;
+  }
+
+  if (ratelimit->max_clients > 0 &&
+      ratelimit->num_clients >= ratelimit->max_clients) {
+    client_remove(ratelimit, TAILQ_LAST(&ratelimit->lru, client_list));
+    ratelimit->evictions++;
+  }
+
+  client = calloc(1, sizeof (struct client));
+  client->key = strdup(key);
+  client->reads.tokens = ratelimit->read_burst;
+  client->writes.tokens = ratelimit->write_burst;
+  client->updated = now;
+  TAILQ_INSERT_HEAD(&ratelimit->lru, client, entries);
+  apr_hash_set(ratelimit->index, client->key, APR_HASH_KEY_STRING, client);
+  ratelimit->num_clients++;
+  return client;
+}
+
+static void bucket_refill(struct bucket *bucket,
+                          double rate,
+                          double burst,
+                          double elapsed) {
+  bucket->tokens += rate * elapsed;
+
+  if (bucket->tokens > burst)
+    bucket->tokens = burst;
+}
+
+int ratelimit_take(struct ratelimit *ratelimit, const char *key, bool write) {
+  double rate = write ? ratelimit->write_rate : ratelimit->read_rate;
+
+  if (rate <= 0)
+    return 0;
+
+  double now = now_seconds();
+  struct client *client = client_get(ratelimit, key, now);
+  double elapsed = now - client->updated;
+
+  if (elapsed > 0) {
+    bucket_refill(&client->reads, ratelimit->read_rate, ratelimit->read_burst,
+                  elapsed);
+    bucket_refill(&client->writes, ratelimit->write_rate,
+                  ratelimit->write_burst, elapsed);
+    client->updated = now;
+  }
+
+  client->last_seen = time(NULL);
+  struct bucket *bucket = write ? &client->writes : &client->reads;
+
+  if (bucket->tokens >= 1) {
+    bucket->tokens -= 1;
+    bucket->allowed++;
+    return 0;
+  }
+
+  bucket->limited++;
+  return (int) ((1 - bucket->tokens) / rate) + 1;
+}
+
+static json_t *bucket_to_json(struct bucket *bucket, json_t *object) {
+  json_object_set_new(object, "tokens", json_real(bucket->tokens));
+  json_object_set_new(object, "allowed", json_integer(bucket->allowed));
+  json_object_set_new(object, "limited", json_integer(bucket->limited));
+  return object;
+}
+
+json_t *ratelimit_to_json(struct ratelimit *ratelimit, json_t *object) {
+  json_object_set_new(object, "readRate", json_real(ratelimit->read_rate));
+  json_object_set_new(object, "readBurst", json_real(ratelimit->read_burst));
+  json_object_set_new(object, "writeRate", json_real(ratelimit->write_rate));
+  json_object_set_new(object, "writeBurst", json_real(ratelimit->write_burst));
+  json_object_set_new(object, "evictions", json_integer(ratelimit->evictions));
+  json_t *clients = json_array();
+  json_object_set_new(object, "clients", clients);
+  struct client *client;
+
+  TAILQ_FOREACH(client, &ratelimit->lru, entries) {
+    json_t *client_json = json_object();
+    json_object_set_new(client_json, "client", json_string(client->key));
+    json_object_set_new(client_json, "lastSeen",
+                        json_integer(client->last_seen));
+    json_object_set_new(client_json, "reads",
+                        bucket_to_json(&client->reads, json_object()));
+    json_object_set_new(client_json, "writes",
+                        bucket_to_json(&client->writes, json_object()));
+    json_array_append_new(clients, client_json);
+  }
+
+  return object;
+}
@@ -0,0 +1,25 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+// Token buckets per client, one for reads and one for writes. Rates are in
+// requests per second (0 means unlimited) and bursts in requests. Remembers at
+// most max_clients clients, forgetting the ones that were seen the longest
+// time ago.
+struct ratelimit;
+
+struct ratelimit *ratelimit_new(double read_rate,
+                                double read_burst,
+                                double write_rate,
+                                double write_burst,
+                                size_t max_clients,
+                                apr_pool_t *pool);
+
+void ratelimit_free(struct ratelimit *);
+
+// Takes a token from one of the client's buckets. Returns 0 if there was one,
+// or else the number of seconds until there is.
+int ratelimit_take(struct ratelimit *, const char *client, bool write);
+
+json_t *ratelimit_to_json(struct ratelimit *, json_t *object);
+
+#endif
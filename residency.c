@@ -0,0 +1,389 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "constants.h"
+#include "residency.h"
+
+enum resident_type {
+  RESIDENT_PLAYLIST,
+  RESIDENT_PLAYLISTCONTAINER
+};
+
+struct resident {
+  enum resident_type type;
+  void *object;  // sp_playlist or sp_playlistcontainer; also the hash key
+  size_t num_tracks;
+  size_t num_bytes;
+  unsigned long hits;
+  time_t last_used;
+  int pins;
+  TAILQ_ENTRY(resident) entries;
+};
+
+TAILQ_HEAD(resident_list, resident);
+
+#define MAX_OBSERVERS 8
+
+struct residency {
+  sp_session *session;
+  apr_hash_t *index;
+  struct resident_list lru;  // Most recently used first
+
+  size_t max_tracks;
+  size_t max_bytes;
+  bool unload_evicted;
+
+  const struct residency_observer *observers[MAX_OBSERVERS];
+  void *observer_userdata[MAX_OBSERVERS];
+  int num_observers;
+
+  size_t num_playlists;
+  size_t num_playlistcontainers;
+  size_t num_tracks;
+  size_t num_bytes;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long reload_waits;
+  unsigned long evictions;
+};
+
+struct residency *residency_new(sp_session *session,
+                                size_t max_tracks,
+                                size_t max_bytes,
+                                bool unload_evicted,
+                                apr_pool_t *pool) {
+  struct residency *residency = calloc(1, sizeof (struct residency));
+  residency->session = session;
+  residency->index = apr_hash_make(pool);
+  TAILQ_INIT(&residency->lru);
+  residency->max_tracks = max_tracks;
+  residency->max_bytes = max_bytes;
+  residency->unload_evicted = unload_evicted;
+  return residency;
+}
+
+bool residency_add_observer(struct residency *residency,
+                            const struct residency_observer *observer,
+                            void *userdata) {
+  if (residency->num_observers == MAX_OBSERVERS)
+    return false;
+
+  residency->observers[residency->num_observers] = observer;
+  residency->observer_userdata[residency->num_observers] = userdata;
+  residency->num_observers++;
+  return true;
+}
+
+// Re-estimates what an entry holds; playlists grow and shrink while resident
+static void resident_update_size(struct residency *residency,
+                                 struct resident *resident) {
+  residency->num_tracks -= resident->num_tracks;
+  residency->num_bytes -= resident->num_bytes;
+  resident->num_tracks = 0;
+
+  if (resident->type == RESIDENT_PLAYLIST) {
+    sp_playlist *playlist = resident->object;
+
+    if (sp_playlist_is_loaded(playlist))
+      resident->num_tracks = sp_playlist_num_tracks(playlist);
+  }
+
+  resident->num_bytes = kResidentOverheadBytes +
+                        resident->num_tracks * kResidentTrackBytes;
+  residency->num_tracks += resident->num_tracks;
+  residency->num_bytes += resident->num_bytes;
+}
+
+static void residency_evict(struct residency *residency);
+
+// Re-estimates a resident playlist as it loads or changes, evicting others if
+// that takes the residency over budget. The playlist itself is kept, being in
+// the middle of its callback.
+static void resident_playlist_changed(sp_playlist *playlist, void *userdata) {
+  struct residency *residency = userdata;
+  struct resident *resident = apr_hash_get(residency->index, &playlist,
+                                           sizeof (void *));
+
+  if (resident == NULL)
+    return;
+
+  resident_update_size(residency, resident);
+  resident->pins++;
+  residency_evict(residency);
+  resident->pins--;
+}
+
+static void resident_tracks_added(sp_playlist *playlist,
+                                  sp_track *const *tracks,
+                                  int num_tracks,
+                                  int position,
+                                  void *userdata) {
+  resident_playlist_changed(playlist, userdata);
+}
+
+static void resident_tracks_removed(sp_playlist *playlist,
+                                    const int *tracks,
+                                    int num_tracks,
+                                    void *userdata) {
+  resident_playlist_changed(playlist, userdata);
+}
+
+static sp_playlist_callbacks resident_playlist_callbacks = {
+  .playlist_state_changed = &resident_playlist_changed,
+  .tracks_added = &resident_tracks_added,
+  .tracks_removed = &resident_tracks_removed
+};
+
+static void resident_remove(struct residency *residency,
+                            struct resident *resident) {
+  TAILQ_REMOVE(&residency->lru, resident, entries);
+  apr_hash_set(residency->index, &resident->object, sizeof (void *), NULL);
+  residency->num_tracks -= resident->num_tracks;
+  residency->num_bytes -= resident->num_bytes;
+
+  switch (resident->type) {
+    case RESIDENT_PLAYLIST:
+      {
+        sp_playlist *playlist = resident->object;
+
+        for (int i = 0; i < residency->num_observers; i++) {
+          if (residency->observers[i]->playlist_removed != NULL) {
+            residency->observers[i]->playlist_removed(
+                playlist, residency->observer_userdata[i]);
+          }
+        }
+
+        sp_playlist_remove_callbacks(playlist, &resident_playlist_callbacks,
+                                     residency);
+
+        if (residency->unload_evicted)
+          sp_playlist_set_in_ram(residency->session, playlist, false);
+
+        sp_playlist_release(playlist);
+        residency->num_playlists--;
+      }
+      break;
+
+    case RESIDENT_PLAYLISTCONTAINER:
+      for (int i = 0; i < residency->num_observers; i++) {
+        if (residency->observers[i]->playlistcontainer_removed != NULL) {
+          residency->observers[i]->playlistcontainer_removed(
+              resident->object, residency->observer_userdata[i]);
+        }
+      }
+
+      sp_playlistcontainer_release(resident->object);
+      residency->num_playlistcontainers--;
+      break;
+  }
+
+  free(resident);
+}
+
+static bool residency_over_budget(struct residency *residency) {
+  return (residency->max_tracks > 0 &&
+          residency->num_tracks > residency->max_tracks) ||
+         (residency->max_bytes > 0 &&
+          residency->num_bytes > residency->max_bytes);
+}
+
+// Evicts least recently used entries that aren't pinned, but never the most
+// recently used one
+static void residency_evict(struct residency *residency) {
+  struct resident *victim = TAILQ_LAST(&residency->lru, resident_list);
+
+  while (residency_over_budget(residency)) {
+    while (victim != NULL && victim->pins > 0)
+      victim = TAILQ_PREV(victim, resident_list, entries);
+
+    if (victim == NULL || victim == TAILQ_FIRST(&residency->lru))
+      break;
+
+    struct resident *previous = TAILQ_PREV(victim, resident_list, entries);
+    resident_remove(residency, victim);
+    residency->evictions++;
+    victim = previous;
+  }
+}
+
+static bool residency_touch(struct residency *residency,
+                            enum resident_type type,
+                            void *object) {
+  struct resident *resident = apr_hash_get(residency->index, &object,
+                                           sizeof (void *));
+  bool hit = resident != NULL;
+
+  if (hit) {
+    TAILQ_REMOVE(&residency->lru, resident, entries);
+    residency->hits++;
+  } else {
+    resident = calloc(1, sizeof (struct resident));
+    resident->type = type;
+    resident->object = object;
+
+    if (type == RESIDENT_PLAYLIST) {
+      sp_playlist_add_ref(object);
+      sp_playlist_add_callbacks(object, &resident_playlist_callbacks,
+                                residency);
+      residency->num_playlists++;
+
+      for (int i = 0; i < residency->num_observers; i++) {
+        if (residency->observers[i]->playlist_added != NULL) {
+          residency->observers[i]->playlist_added(
+              object, residency->observer_userdata[i]);
+        }
+      }
+    } else {
+      sp_playlistcontainer_add_ref(object);
+      residency->num_playlistcontainers++;
+
+      for (int i = 0; i < residency->num_observers; i++) {
+        if (residency->observers[i]->playlistcontainer_added != NULL) {
+          residency->observers[i]->playlistcontainer_added(
+              object, residency->observer_userdata[i]);
+        }
+      }
+    }
+
+    apr_hash_set(residency->index, &resident->object, sizeof (void *),
+                 resident);
+    residency->misses++;
+  }
+
+  TAILQ_INSERT_HEAD(&residency->lru, resident, entries);
+  resident->hits += hit ? 1 : 0;
+  resident->last_used = time(NULL);
+  resident_update_size(residency, resident);
+  residency_evict(residency);
+  return hit;
+}
+
+bool residency_touch_playlist(struct residency *residency,
+                              sp_playlist *playlist) {
+  bool hit = residency_touch(residency, RESIDENT_PLAYLIST, playlist);
+
+  // Evicted earlier (or unloaded by libspotify): ask for it to be loaded
+  if (!sp_playlist_is_in_ram(residency->session, playlist))
+    sp_playlist_set_in_ram(residency->session, playlist, true);
+
+  return hit;
+}
+
+void residency_pin_playlist(struct residency *residency,
+                            sp_playlist *playlist) {
+  residency_touch_playlist(residency, playlist);
+  struct resident *resident = apr_hash_get(residency->index, &playlist,
+                                           sizeof (void *));
+
+  if (resident != NULL)
+    resident->pins++;
+}
+
+void residency_unpin_playlist(struct residency *residency,
+                              sp_playlist *playlist) {
+  struct resident *resident = apr_hash_get(residency->index, &playlist,
+                                           sizeof (void *));
+
+  if (resident != NULL && resident->pins > 0) {
+    resident->pins--;
+    residency_evict(residency);
+  }
+}
+
+bool residency_touch_playlistcontainer(struct residency *residency,
+                                       sp_playlistcontainer *pc) {
+  return residency_touch(residency, RESIDENT_PLAYLISTCONTAINER, pc);
+}
+
+void residency_note_reload_wait(struct residency *residency) {
+  residency->reload_waits++;
+}
+
+void residency_free(struct residency *residency) {
+  struct resident *resident;
+
+  while ((resident = TAILQ_FIRST(&residency->lru)) != NULL)
+    resident_remove(residency, resident);
+
+  free(residency);
+}
+
+static json_t *resident_to_json(struct resident *resident, json_t *object) {
+  switch (resident->type) {
+    case RESIDENT_PLAYLIST:
+      {
+        sp_playlist *playlist = resident->object;
+        sp_link *link = sp_link_create_from_playlist(playlist);
+
+        if (link != NULL) {
+          char uri[kPlaylistLinkLength];
+          sp_link_as_string(link, uri, kPlaylistLinkLength);
+          sp_link_release(link);
+          json_object_set_new(object, "uri", json_string_nocheck(uri));
+        }
+
+        json_object_set_new(object, "type", json_string_nocheck("playlist"));
+        json_object_set_new(object, "loaded",
+            sp_playlist_is_loaded(playlist) ? json_true() : json_false());
+      }
+      break;
+
+    case RESIDENT_PLAYLISTCONTAINER:
+      {
+        sp_playlistcontainer *pc = resident->object;
+        sp_user *owner = sp_playlistcontainer_owner(pc);
+
+        if (owner != NULL) {
+          json_object_set_new(object, "user",
+                              json_string(sp_user_canonical_name(owner)));
+        }
+
+        json_object_set_new(object, "type",
+                            json_string_nocheck("playlistcontainer"));
+        json_object_set_new(object, "loaded",
+            sp_playlistcontainer_is_loaded(pc) ? json_true() : json_false());
+      }
+      break;
+  }
+
+  json_object_set_new(object, "tracks", json_integer(resident->num_tracks));
+  json_object_set_new(object, "hits", json_integer(resident->hits));
+  json_object_set_new(object, "lastUsed", json_integer(resident->last_used));
+  json_object_set_new(object, "pins", json_integer(resident->pins));
+  return object;
+}
+
+json_t *residency_to_json(struct residency *residency, json_t *object) {
+  json_object_set_new(object, "playlists",
+                      json_integer(residency->num_playlists));
+  json_object_set_new(object, "playlistContainers",
+                      json_integer(residency->num_playlistcontainers));
+  json_object_set_new(object, "tracks", json_integer(residency->num_tracks));
+  json_object_set_new(object, "bytes", json_integer(residency->num_bytes));
+  json_object_set_new(object, "maxTracks",
+                      json_integer(residency->max_tracks));
+  json_object_set_new(object, "maxBytes", json_integer(residency->max_bytes));
+  json_object_set_new(object, "hits", json_integer(residency->hits));
+  json_object_set_new(object, "misses", json_integer(residency->misses));
+  json_object_set_new(object, "reloadWaits",
+                      json_integer(residency->reload_waits));
+  json_object_set_new(object, "evictions",
+                      json_integer(residency->evictions));
+
+  json_t *entries = json_array();
+  json_object_set_new(object, "entries", entries);
+  struct resident *resident;
+
+  TAILQ_FOREACH(resident, &residency->lru, entries) {
+    json_array_append_new(entries, resident_to_json(resident, json_object()));
+  }
+
+  return object;
+}
@@ -0,0 +1,51 @@
+#ifndef RESIDENCY_H_
+#define RESIDENCY_H_
+
+// Keeps references to recently used playlists and playlist containers so that
+// libspotify doesn't unload them between requests. Bounded by the total number
+// of tracks and by an estimate of the memory they use, which is updated as
+// playlists load and change.
+struct residency;
+
+// Notified when playlists and containers enter and leave the residency set,
+// e.g. to follow changes to them only while they are kept loaded
+struct residency_observer {
+  void (*playlist_added)(sp_playlist *playlist, void *userdata);
+  void (*playlist_removed)(sp_playlist *playlist, void *userdata);
+  void (*playlistcontainer_added)(sp_playlistcontainer *pc, void *userdata);
+  void (*playlistcontainer_removed)(sp_playlistcontainer *pc, void *userdata);
+};
+
+struct residency *residency_new(sp_session *session,
+                                size_t max_tracks,
+                                size_t max_bytes,
+                                bool unload_evicted,
+                                apr_pool_t *pool);
+
+// Releases all held references
+void residency_free(struct residency *);
+
+// Returns false if there's no room for another observer
+bool residency_add_observer(struct residency *,
+                            const struct residency_observer *,
+                            void *userdata);
+
+// Marks a playlist as recently used. Returns true if it was already resident.
+bool residency_touch_playlist(struct residency *, sp_playlist *);
+
+// Keeps a playlist resident (and loaded) until it's unpinned as many times
+void residency_pin_playlist(struct residency *, sp_playlist *);
+
+void residency_unpin_playlist(struct residency *, sp_playlist *);
+
+// Marks a playlist container as recently used. Returns true if it was already
+// resident.
+bool residency_touch_playlistcontainer(struct residency *,
+                                       sp_playlistcontainer *);
+
+// Counts a request that had to wait for a playlist or container to load
+void residency_note_reload_wait(struct residency *);
+
+json_t *residency_to_json(struct residency *, json_t *object);
+
+#endif
@@ -0,0 +1,278 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <ctype.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "cache.h"
+#include "constants.h"
+#include "json.h"
+#include "metadata.h"
+#include "search.h"
+
+struct search_waiter {
+  struct search *search;
+  search_done_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(search_waiter) entries;
+};
+
+TAILQ_HEAD(search_waiter_list, search_waiter);
+
+// A search under way
+struct search {
+  struct search_cache *cache;  // NULL once the cache is freed
+  char *key;  // Also the hash key
+  char *query;
+  int offset;
+  int limit;
+  struct search_waiter_list waiters;
+};
+
+struct search_cache {
+  sp_session *session;
+  struct track_metadata *metadata;
+  struct cache *responses;
+  apr_hash_t *searches;
+  int num_searches;
+  int num_waiters;
+
+  unsigned long started;
+  unsigned long shared;
+  unsigned long failed;
+};
+
+struct search_cache *search_cache_new(sp_session *session,
+                                      struct track_metadata *metadata,
+                                      size_t max_bytes,
+                                      apr_pool_t *pool) {
+  struct search_cache *cache = calloc(1, sizeof (struct search_cache));
+  cache->session = session;
+  cache->metadata = metadata;
+  cache->responses = cache_new(max_bytes, 0, pool);
+  cache->searches = apr_hash_make(pool);
+  return cache;
+}
+
+static void search_drop_waiters(struct search *search) {
+  struct search_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&search->waiters)) != NULL) {
+    TAILQ_REMOVE(&search->waiters, waiter, entries);
+    free(waiter);
+  }
+}
+
+static void search_free(struct search *search) {
+  search_drop_waiters(search);
+  free(search->key);
+  free(search->query);
+  free(search);
+}
+
+void search_cache_free(struct search_cache *cache) {
+  // Searches are freed as they complete
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, cache->searches);
+       hi != NULL; hi = apr_hash_next(hi)) {
+    struct search *search;
+    apr_hash_this(hi, NULL, NULL, (void **) &search);
+    search_drop_waiters(search);
+    search->cache = NULL;
+  }
+
+  cache_free(cache->responses);
+  free(cache);
+}
+
+void search_normalize_query(char *query) {
+  char *out = query;
+  bool space = false;
+
+  for (char *in = query; *in != '\0'; in++) {
+    if (isspace((unsigned char) *in)) {
+      space = out != query;
+      continue;
+    }
+
+    if (space) {
+      *out++ = ' ';
+      space = false;
+    }
+
+    // Bytes of UTF-8 sequences are left alone
+    *out++ = (unsigned char) *in < 0x80 ? tolower((unsigned char) *in) : *in;
+  }
+
+  *out = '\0';
+}
+
+static char *search_key(const char *query, int offset, int limit) {
+  size_t size = strlen(query) + 32;
+  char *key = malloc(size);
+  snprintf(key, size, "%d:%d:%s", offset, limit, query);
+  return key;
+}
+
+bool search_cache_write(struct search_cache *cache,
+                        const char *query,
+                        int offset,
+                        int limit,
+                        struct evbuffer *buf) {
+  char *key = search_key(query, offset, limit);
+  size_t length;
+  time_t stored;
+  char *body = cache_get(cache->responses, key, &length, &stored);
+
+  // Results change, if slowly
+  if (body != NULL && time(NULL) - stored >= kSearchResultTtlSeconds) {
+    cache_remove(cache->responses, key);
+    body = NULL;
+  }
+
+  free(key);
+
+  if (body == NULL)
+    return false;
+
+  evbuffer_add(buf, body, length);
+  return true;
+}
+
+// Serializes the results of a search. Returns the number of tracks that
+// hadn't loaded.
+static int search_to_evbuffer(struct search *search,
+                              sp_search *result,
+                              struct evbuffer *buf) {
+  evbuffer_add_printf(buf, "{\"query\":");
+  json_string_to_evbuffer(buf, search->query);
+  evbuffer_add_printf(buf, ",\"offset\":%d,\"limit\":%d,\"total\":%d,"
+                      "\"tracks\":", search->offset, search->limit,
+                      sp_search_total_tracks(result));
+  int num_tracks = sp_search_num_tracks(result);
+  sp_track **tracks = malloc(num_tracks * sizeof (sp_track *));
+
+  for (int i = 0; i < num_tracks; i++)
+    tracks[i] = sp_search_track(result, i);
+
+  int num_unloaded = track_metadata_write_tracks(search->cache->metadata,
+                                                 tracks, num_tracks, buf);
+  free(tracks);
+  evbuffer_add(buf, "}", 1);
+  return num_unloaded;
+}
+
+static void search_complete(sp_search *result, void *userdata) {
+  struct search *search = userdata;
+  struct search_cache *cache = search->cache;
+
+  if (cache == NULL) {
+    sp_search_release(result);
+    search_free(search);
+    return;
+  }
+
+  apr_hash_set(cache->searches, search->key, APR_HASH_KEY_STRING, NULL);
+  cache->num_searches--;
+  sp_error error = sp_search_error(result);
+  struct evbuffer *buf = evbuffer_new();
+  const char *body = NULL;
+  size_t length = 0;
+
+  if (error == SP_ERROR_OK) {
+    int num_unloaded = search_to_evbuffer(search, result, buf);
+    length = evbuffer_get_length(buf);
+    body = (const char *) evbuffer_pullup(buf, length);
+
+    // Responses with tracks still loading are sent but not kept
+    if (num_unloaded == 0) {
+      char *stored = malloc(length);
+      memcpy(stored, body, length);
+      cache_put(cache->responses, search->key, stored, length, &free);
+    }
+  } else {
+    cache->failed++;
+  }
+
+  sp_search_release(result);
+
+  // Callbacks may start other searches, but not cancel their waiter
+  struct search_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&search->waiters)) != NULL) {
+    TAILQ_REMOVE(&search->waiters, waiter, entries);
+    cache->num_waiters--;
+    waiter->callback(body, length, error, waiter->userdata);
+    free(waiter);
+  }
+
+  evbuffer_free(buf);
+  search_free(search);
+}
+
+struct search_waiter *search_cache_wait(struct search_cache *cache,
+                                        const char *query,
+                                        int offset,
+                                        int limit,
+                                        search_done_fn callback,
+                                        void *userdata) {
+  char *key = search_key(query, offset, limit);
+  struct search *search = apr_hash_get(cache->searches, key,
+                                       APR_HASH_KEY_STRING);
+
+  if (search != NULL) {
+    free(key);
+    cache->shared++;
+  } else {
+    search = calloc(1, sizeof (struct search));
+    search->cache = cache;
+    search->key = key;
+    search->query = strdup(query);
+    search->offset = offset;
+    search->limit = limit;
+    TAILQ_INIT(&search->waiters);
+
+    if (sp_search_create(cache->session, query, offset, limit, 0, 0, 0, 0,
+                         0, 0, SP_SEARCH_STANDARD, &search_complete,
+                         search) == NULL) {
+      search_free(search);
+      cache->failed++;
+      return NULL;
+    }
+
+    apr_hash_set(cache->searches, search->key, APR_HASH_KEY_STRING, search);
+    cache->num_searches++;
+    cache->started++;
+  }
+
+  struct search_waiter *waiter = malloc(sizeof (struct search_waiter));
+  waiter->search = search;
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+  TAILQ_INSERT_TAIL(&search->waiters, waiter, entries);
+  cache->num_waiters++;
+  return waiter;
+}
+
+void search_cache_cancel(struct search_waiter *waiter) {
+  struct search *search = waiter->search;
+  TAILQ_REMOVE(&search->waiters, waiter, entries);
+  search->cache->num_waiters--;
+  free(waiter);
+}
+
+json_t *search_cache_to_json(struct search_cache *cache, json_t *object) {
+  cache_to_json(cache->responses, object);
+  json_object_set_new(object, "searches", json_integer(cache->started));
+  json_object_set_new(object, "sharedSearches", json_integer(cache->shared));
+  json_object_set_new(object, "failed", json_integer(cache->failed));
+  json_object_set_new(object, "inFlight", json_integer(cache->num_searches));
+  json_object_set_new(object, "waiting", json_integer(cache->num_waiters));
+  return object;
+}
@@ -0,0 +1,61 @@
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+// Track searches, with responses kept serialized in a cache bounded by their
+// total size, keyed by normalized query and page. Requests for a search that
+// is already under way wait for it rather than starting another. Responses
+// are JSON objects:
+//
+//   {"query":<string>,"offset":<int>,"limit":<int>,"total":<int>,
+//    "tracks":[<track>]}
+//
+// with tracks as written by track_metadata_write.
+struct search_cache;
+
+struct search_waiter;
+
+struct track_metadata;
+
+// Called once a search has completed, with the response or, if it failed,
+// NULL and the error
+typedef void (*search_done_fn)(const char *body,
+                               size_t length,
+                               sp_error error,
+                               void *userdata);
+
+struct search_cache *search_cache_new(sp_session *session,
+                                      struct track_metadata *metadata,
+                                      size_t max_bytes,
+                                      apr_pool_t *pool);
+
+// Waiters are dropped without being called. Searches under way are left to
+// complete.
+void search_cache_free(struct search_cache *);
+
+// Normalizes a query in place: trims it, collapses runs of whitespace and
+// lowercases ASCII letters
+void search_normalize_query(char *query);
+
+// Writes the cached response for a normalized query, if there's a fresh one.
+// Returns whether there was.
+bool search_cache_write(struct search_cache *,
+                        const char *query,
+                        int offset,
+                        int limit,
+                        struct evbuffer *buf);
+
+// Waits for a search for a normalized query, starting it unless it's already
+// under way. Returns NULL, without calling back, if it couldn't be started.
+struct search_waiter *search_cache_wait(struct search_cache *,
+                                        const char *query,
+                                        int offset,
+                                        int limit,
+                                        search_done_fn callback,
+                                        void *userdata);
+
+// Stops waiting, without calling back
+void search_cache_cancel(struct search_waiter *);
+
+json_t *search_cache_to_json(struct search_cache *, json_t *object);
+
+#endif
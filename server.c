@@ -16,44 +16,94 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include <apr.h>
+#include <apr_hash.h>
 #include <assert.h>
 #include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <event2/thread.h>
 #include <event2/util.h>
+#include <inttypes.h>
 #include <jansson.h>
 #include <libspotify/api.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <svn_diff.h>
 #include <sys/queue.h>
-#include <syslog.h>
+#include <time.h>
 
+#include "admission.h"
+#include "browse.h"
+#include "cache.h"
+#include "changelog.h"
+#include "compress.h"
 #include "constants.h"
+#include "containerindex.h"
 #include "diff.h"
+#include "fingerprint.h"
+#include "fnv.h"
+#include "formats.h"
+#include "inbox.h"
+#include "jobs.h"
 #include "json.h"
+#include "logger.h"
+#include "metadata.h"
+#include "ratelimit.h"
+#include "residency.h"
+#include "search.h"
 #include "server.h"
-
+#include "shard.h"
+#include "shmcache.h"
+#include "snapshot.h"
+#include "streams.h"
+#include "subscribers.h"
+#include "trackindex.h"
+#include "usercache.h"
+
+#define HTTP_ACCEPTED 202
 #define HTTP_PARTIAL 210
 #define HTTP_ERROR 500
 #define HTTP_NOTIMPL 501
+#define HTTP_PRECONDITION_FAILED 412
+#define HTTP_TOO_MANY_REQUESTS 429
+#define HTTP_GATEWAY_TIMEOUT 504
+
+// Longest entity tag of a playlist: its quoted fingerprint, and the format
+// and coding of the representation
+#define PLAYLIST_ETAG_LENGTH (FINGERPRINT_STRING_LENGTH + 24)
 
 typedef void (*handle_playlist_fn)(sp_playlist *playlist,
                                    struct evhttp_request *request,
                                    void *userdata);
 
+// Called when a request is given up on while waiting for a playlist. Only
+// needs to clean up after itself: the playlist is released by the caller.
+typedef void (*cancel_playlist_fn)(sp_playlist *playlist, void *userdata);
+
+// A request waiting for libspotify, with a deadline and a way to be cancelled
+// if the client goes away
+struct parked_request {
+  struct state *state;
+  struct evhttp_request *request;
+  struct event *deadline;
+};
+
 // State of a request as it's threaded through libspotify callbacks
 struct playlist_handler {
+  struct parked_request parked;
   sp_playlist_callbacks *playlist_callbacks;
-  struct evhttp_request *request;
+  sp_playlist *playlist;
   handle_playlist_fn callback;
+  cancel_playlist_fn cancel;
   void *userdata;
 };
 
@@ -62,22 +112,90 @@ typedef void (*handle_playlistcontainer_fn)(sp_playlistcontainer *,
                                             void *);
 
 struct playlistcontainer_handler {
+  struct parked_request parked;
   sp_playlistcontainer_callbacks *playlistcontainer_callbacks;
-  struct evhttp_request *request;
+  sp_playlistcontainer *pc;
   handle_playlistcontainer_fn callback;
   void *userdata;
 };
 
-static void send_reply(struct evhttp_request *request,
-                       int code,
-                       const char *message,
-                       struct evbuffer *body) {
+// The coding the client accepts that responses are best compressed with
+static enum compress_coding request_coding(struct evhttp_request *request) {
+  return compress_negotiate(evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Accept-Encoding"));
+}
+
+// Adds the coding headers, also telling the entity tag (if any) of the
+// compressed representation from the uncompressed one's
+static void add_coding_headers(struct evhttp_request *request,
+                               enum compress_coding coding) {
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  evhttp_add_header(headers, "Vary", "Accept-Encoding");
+
+  if (coding == COMPRESS_IDENTITY)
+    return;
+
+  evhttp_add_header(headers, "Content-Encoding", compress_coding_name(coding));
+  const char *etag = evhttp_find_header(headers, "ETag");
+  size_t length = etag != NULL ? strlen(etag) : 0;
+
+  if (length < 2 || etag[length - 1] != '"')
+    return;
+
+  char coded_etag[PLAYLIST_ETAG_LENGTH + 1];
+  snprintf(coded_etag, sizeof (coded_etag), "%.*s-%s\"", (int) length - 1,
+           etag, compress_coding_name(coding));
+  evhttp_remove_header(headers, "ETag");
+  evhttp_add_header(headers, "ETag", coded_etag);
+}
+
+// Compresses a response body in place if it's worth it and the client
+// accepts a coding, unless it has been compressed already
+static void compress_reply(struct evhttp_request *request,
+                           struct evbuffer *body) {
+  if (evbuffer_get_length(body) < kCompressMinBytes ||
+      evhttp_find_header(evhttp_request_get_output_headers(request),
+                         "Content-Encoding") != NULL) {
+    return;
+  }
+
+  enum compress_coding coding = request_coding(request);
+  struct evbuffer *compressed = evbuffer_new();
+
+  if (coding != COMPRESS_IDENTITY &&
+      !compress_evbuffer(coding, body, compressed)) {
+    log_warning("Failed to compress response with %s",
+                compress_coding_name(coding));
+    coding = COMPRESS_IDENTITY;
+  }
+
+  if (coding != COMPRESS_IDENTITY) {
+    evbuffer_drain(body, evbuffer_get_length(body));
+    evbuffer_add_buffer(body, compressed);
+  }
+
+  evbuffer_free(compressed);
+  add_coding_headers(request, coding);
+}
+
+static void send_reply_typed(struct evhttp_request *request,
+                             int code,
+                             const char *message,
+                             const char *content_type,
+                             struct evbuffer *body) {
+  // Responses to requests run as jobs are kept for clients to ask for
+  if (jobs_finish(request, code, body))
+    return;
+
   evhttp_add_header(evhttp_request_get_output_headers(request),
-                    "Content-type", "application/json; charset=UTF-8");
+                    "Content-type", content_type);
   bool empty_body = body == NULL;
 
-  if (empty_body)
+  if (empty_body) {
     body = evbuffer_new();
+  } else {
+    compress_reply(request, body);
+  }
 
   evhttp_send_reply(request, code, message, body);
 
@@ -85,6 +203,24 @@ static void send_reply(struct evhttp_request *request,
     evbuffer_free(body);
 }
 
+static void send_reply(struct evhttp_request *request,
+                       int code,
+                       const char *message,
+                       struct evbuffer *body) {
+  send_reply_typed(request, code, message,
+                   format_content_type(FORMAT_JSON), body);
+}
+
+// The format the client accepts a playlist (or, without track_ids, a
+// container) in. Responses vary by it.
+static enum response_format request_format(struct evhttp_request *request,
+                                           bool track_ids) {
+  evhttp_add_header(evhttp_request_get_output_headers(request), "Vary",
+                    "Accept");
+  return format_negotiate(evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Accept"), track_ids);
+}
+
 // Sends JSON to the client (also `free`s the JSON object)
 static void send_reply_json(struct evhttp_request *request,
                             int code,
@@ -114,54 +250,219 @@ static void send_error_sp(struct evhttp_request *request,
   send_error(request, code, message);
 }
 
+// Milliseconds a request may wait for libspotify: the timeout query parameter
+// or else the default for the route
+static int request_timeout(struct evhttp_request *request,
+                           int default_timeout) {
+  if (request == NULL)
+    return default_timeout;
+
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *timeout_field = evhttp_find_header(&query_fields, "timeout");
+  int timeout;
+
+  if (timeout_field == NULL || sscanf(timeout_field, "%d", &timeout) != 1 ||
+      timeout < 0) {
+    timeout = default_timeout;
+  }
+
+  evhttp_clear_headers(&query_fields);
+  return timeout;
+}
+
+// Arms the deadline of a waiting request (unless timeout is 0) and cancels it
+// if the client disconnects
+static void park_request(struct parked_request *parked,
+                         struct state *state,
+                         struct evhttp_request *request,
+                         int default_timeout,
+                         event_callback_fn deadline_callback,
+                         void (*close_callback)(struct evhttp_connection *,
+                                                void *),
+                         void *handler) {
+  parked->state = state;
+  parked->request = request;
+  parked->deadline = NULL;
+  state->num_parked_requests++;
+  admission_operation_started(state->admission);
+  int timeout = request_timeout(request, default_timeout);
+
+  if (timeout > 0) {
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    parked->deadline = evtimer_new(state->event_base, deadline_callback,
+                                   handler);
+    evtimer_add(parked->deadline, &tv);
+  }
+
+  // Requests run as jobs have no connection
+  if (request != NULL && evhttp_request_get_connection(request) != NULL) {
+    evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                  close_callback, handler);
+  }
+}
+
+void free_abandoned_request(struct evhttp_request *request) {
+  if (request != NULL && evhttp_request_get_connection(request) == NULL)
+    evhttp_request_free(request);
+}
+
+static void unpark_request(struct parked_request *parked) {
+  parked->state->num_parked_requests--;
+  admission_operation_finished(parked->state->admission);
+
+  if (parked->deadline != NULL)
+    event_free(parked->deadline);
+
+  if (parked->request != NULL &&
+      evhttp_request_get_connection(parked->request) != NULL) {
+    evhttp_connection_set_closecb(
+        evhttp_request_get_connection(parked->request), NULL, NULL);
+  }
+}
+
+// Stops waiting, without calling back or releasing the playlist
+static void unregister_playlist_callbacks(struct playlist_handler *handler) {
+  sp_playlist_remove_callbacks(handler->playlist, handler->playlist_callbacks,
+                               handler);
+  unpark_request(&handler->parked);
+  free(handler);
+}
+
+// Gives up on a waiting request; the request itself isn't responded to
+static void cancel_playlist_handler(struct playlist_handler *handler) {
+  sp_playlist *playlist = handler->playlist;
+
+  if (handler->cancel != NULL)
+    handler->cancel(playlist, handler->userdata);
+
+  unregister_playlist_callbacks(handler);
+  sp_playlist_release(playlist);
+}
+
+static void playlist_handler_deadline(evutil_socket_t socket,
+                                      short what,
+                                      void *userdata) {
+  struct playlist_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_deadlines_exceeded++;
+  cancel_playlist_handler(handler);
+
+  if (request != NULL) {
+    send_error(request, HTTP_GATEWAY_TIMEOUT,
+               "Timed out waiting for playlist");
+  }
+}
+
+static void playlist_handler_closed(struct evhttp_connection *connection,
+                                    void *userdata) {
+  struct playlist_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_cancelled_requests++;
+  cancel_playlist_handler(handler);
+  free_abandoned_request(request);
+}
+
+// Waits for playlist callbacks before calling back with the request. The
+// reference to the playlist is passed on to the callback, or released if
+// the request times out (after `timeout` milliseconds, unless overridden by
+// the request) or the client goes away.
 static struct playlist_handler *register_playlist_callbacks(
     sp_playlist *playlist,
     struct evhttp_request *request,
     handle_playlist_fn callback,
     sp_playlist_callbacks *playlist_callbacks,
-    void *userdata) {
+    struct state *state,
+    int timeout) {
   struct playlist_handler *handler = malloc(sizeof (struct playlist_handler));
-  handler->request = request;
   handler->callback = callback;
+  handler->cancel = NULL;
+  handler->playlist = playlist;
   handler->playlist_callbacks = playlist_callbacks;
-  handler->userdata = userdata;
+  handler->userdata = state;
+  park_request(&handler->parked, state, request, timeout,
+               &playlist_handler_deadline, &playlist_handler_closed, handler);
   sp_playlist_add_callbacks(playlist, handler->playlist_callbacks, handler);
+
+  if (playlist_callbacks->playlist_update_in_progress != NULL)
+    jobs_syncing(request, playlist);
   return handler;
 }
 
 static void playlist_dispatch(sp_playlist *playlist, void *userdata) {
   struct playlist_handler *handler = userdata;
-  sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks, handler);
-  handler->playlist_callbacks = NULL;
-  handler->callback(playlist, handler->request, handler->userdata);
+  struct evhttp_request *request = handler->parked.request;
+  handle_playlist_fn callback = handler->callback;
+  void *callback_userdata = handler->userdata;
+  unregister_playlist_callbacks(handler);
+  callback(playlist, request, callback_userdata);
+}
+
+static void unregister_playlistcontainer_callbacks(
+    struct playlistcontainer_handler *handler) {
+  sp_playlistcontainer_remove_callbacks(handler->pc,
+                                        handler->playlistcontainer_callbacks,
+                                        handler);
+  unpark_request(&handler->parked);
   free(handler);
 }
 
+static void playlistcontainer_handler_deadline(evutil_socket_t socket,
+                                               short what,
+                                               void *userdata) {
+  struct playlistcontainer_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  sp_playlistcontainer *pc = handler->pc;
+  handler->parked.state->num_deadlines_exceeded++;
+  unregister_playlistcontainer_callbacks(handler);
+  sp_playlistcontainer_release(pc);
+
+  if (request != NULL) {
+    send_error(request, HTTP_GATEWAY_TIMEOUT,
+               "Timed out waiting for playlist container");
+  }
+}
+
+static void playlistcontainer_handler_closed(
+    struct evhttp_connection *connection,
+    void *userdata) {
+  struct playlistcontainer_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  sp_playlistcontainer *pc = handler->pc;
+  handler->parked.state->num_cancelled_requests++;
+  unregister_playlistcontainer_callbacks(handler);
+  sp_playlistcontainer_release(pc);
+  free_abandoned_request(request);
+}
+
 static struct playlistcontainer_handler *register_playlistcontainer_callbacks(
     sp_playlistcontainer *pc,
     struct evhttp_request *request,
     handle_playlistcontainer_fn callback,
     sp_playlistcontainer_callbacks *playlistcontainer_callbacks,
-    void *userdata) {
+    struct state *state,
+    int timeout) {
   struct playlistcontainer_handler *handler = malloc(sizeof (struct playlistcontainer_handler));
-  handler->request = request;
   handler->callback = callback;
+  handler->pc = pc;
   handler->playlistcontainer_callbacks = playlistcontainer_callbacks;
-  handler->userdata = userdata;
+  handler->userdata = state;
+  park_request(&handler->parked, state, request, timeout,
+               &playlistcontainer_handler_deadline,
+               &playlistcontainer_handler_closed, handler);
   sp_error error = sp_playlistcontainer_add_callbacks(pc, handler->playlistcontainer_callbacks,
                                      handler);
-  syslog(LOG_DEBUG, "playlistcontainer_add_callbacks: %d", error);
+  log_debug("playlistcontainer_add_callbacks: %d", error);
   return handler;
 }
 
 static void playlistcontainer_dispatch(sp_playlistcontainer *pc, void *userdata) {
   struct playlistcontainer_handler *handler = userdata;
-  sp_playlistcontainer_remove_callbacks(pc,
-                                        handler->playlistcontainer_callbacks,
-                                        handler);
-  handler->playlistcontainer_callbacks = NULL;
-  handler->callback(pc, handler->request, handler->userdata);
-  free(handler);
+  struct evhttp_request *request = handler->parked.request;
+  handle_playlistcontainer_fn callback = handler->callback;
+  void *callback_userdata = handler->userdata;
+  unregister_playlistcontainer_callbacks(handler);
+  callback(pc, request, callback_userdata);
 }
 
 static void playlist_dispatch_if_loaded(sp_playlist *playlist, void *userdata) {
@@ -203,194 +504,1389 @@ static void not_implemented(sp_playlist *playlist,
                             struct evhttp_request *request,
                             void *userdata) {
   sp_playlist_release(playlist);
-  evhttp_send_error(request, HTTP_NOTIMPL, "Not Implemented");
+  send_error(request, HTTP_NOTIMPL, "Not Implemented");
 }
 
-// Responds with an entire playlist
-static void get_playlist(sp_playlist *playlist,
-                         struct evhttp_request *request,
-                         void *userdata) {
-  json_t *json = json_object();
+// Last known good serialization of a playlist, kept for serving it while it
+// isn't loaded, and for as long as its revision and the fields the revision
+// doesn't follow stay the same. It's compressed with each coding the first
+// time a client asks for that coding.
+struct playlist_serialization {
+  unsigned long long revision;  // 0 if not known
+  uint64_t digest;  // Of the fields other than tracks, see playlist_digest
+  struct evbuffer *compressed[COMPRESS_NUM_CODINGS];
+  size_t length;
+  char body[];
+};
 
-  if (playlist_to_json(playlist, json) == NULL) {
-    json_decref(json);
-    send_error(request, HTTP_ERROR, "");
-    return;
+static void playlist_serialization_free(void *value) {
+  struct playlist_serialization *serialization = value;
+
+  for (int i = 0; i < COMPRESS_NUM_CODINGS; i++) {
+    if (serialization->compressed[i] != NULL)
+      evbuffer_free(serialization->compressed[i]);
   }
 
-  sp_playlist_release(playlist);
-  send_reply_json(request, HTTP_OK, "OK", json);
+  free(serialization);
 }
 
-static void get_playlist_collaborative(sp_playlist *playlist,
-                                       struct evhttp_request *request,
-                                       void *userdata) {
-  assert(sp_playlist_is_loaded(playlist));
-  json_t *json = json_object();
-  playlist_to_json_set_collaborative(playlist, json);
-  sp_playlist_release(playlist);
-  send_reply_json(request, HTTP_OK, "OK", json);
+// Hashes a field of a digest, which may be NULL, followed by a separator
+static uint64_t digest_field(uint64_t hash, const char *str) {
+  if (str != NULL)
+    hash = fnv1a_string(hash, str);
+
+  return fnv1a(hash, "\xff", 1);
 }
 
-static void get_playlist_subscribers_callback(sp_playlist *playlist,
-                                              struct evhttp_request *request,
-                                              void *userdata) {
-  assert(sp_playlist_is_loaded(playlist));
-  sp_subscribers *subscribers = sp_playlist_subscribers(playlist);
-  json_t *array = json_array();
+// Hashes the fields of a playlist that change without a new revision (such
+// as the collaborative flag and subscriber count), along with its title and
+// description
+static uint64_t playlist_digest(sp_playlist *playlist) {
+  char numbers[32];
+  snprintf(numbers, sizeof (numbers), "%d:%u",
+           sp_playlist_is_collaborative(playlist),
+           sp_playlist_num_subscribers(playlist));
+  sp_user *owner = sp_playlist_owner(playlist);
+  uint64_t hash = digest_field(kFnvOffsetBasis, numbers);
+  hash = digest_field(hash, sp_user_display_name(owner));
+  sp_user_release(owner);
+  hash = digest_field(hash, sp_playlist_name(playlist));
+  return digest_field(hash, sp_playlist_get_description(playlist));
+}
 
-  for (int i = 0; i < subscribers->count; i++) {
-    char *subscriber = subscribers->subscribers[i];
-    json_array_append_new(array, json_string(subscriber));
+// Adds a serialization of a playlist (cached under uri) to a response,
+// compressed with the coding the client accepts
+static void add_playlist_serialization(
+    struct evhttp_request *request,
+    struct playlist_serialization *serialization,
+    const char *uri,
+    struct state *state) {
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  enum compress_coding coding = request_coding(request);
+
+  if (coding == COMPRESS_IDENTITY || serialization->length < kCompressMinBytes) {
+    evbuffer_add(buf, serialization->body, serialization->length);
+    return;
   }
 
-  sp_playlist_subscribers_free(subscribers);
-  sp_playlist_release(playlist);
-  send_reply_json(request, HTTP_OK, "OK", array);
+  struct evbuffer *compressed = serialization->compressed[coding];
+
+  if (compressed == NULL) {
+    struct evbuffer *body = evbuffer_new();
+    compressed = evbuffer_new();
+    evbuffer_add_reference(body, serialization->body, serialization->length,
+                           NULL, NULL);
+    bool compressed_ok = compress_evbuffer(coding, body, compressed);
+    evbuffer_free(body);
+
+    // Sent as it is if it couldn't be compressed
+    if (!compressed_ok) {
+      evbuffer_free(compressed);
+      evbuffer_add(buf, serialization->body, serialization->length);
+      return;
+    }
+
+    // Kept along with the serialization if it fits the cache's budget
+    if (cache_grow(state->playlist_cache, uri,
+                   evbuffer_get_length(compressed))) {
+      serialization->compressed[coding] = compressed;
+    }
+  }
+
+  size_t length = evbuffer_get_length(compressed);
+  evbuffer_add(buf, evbuffer_pullup(compressed, length), length);
+  add_coding_headers(request, coding);
+
+  if (serialization->compressed[coding] != compressed)
+    evbuffer_free(compressed);
 }
 
-static void get_playlist_subscribers(sp_playlist *playlist,
-                                     struct evhttp_request *request,
-                                     void *userdata) {
-  assert(sp_playlist_is_loaded(playlist));
-  sp_session *session = userdata;
-  register_playlist_callbacks(playlist, request,
-                              &get_playlist_subscribers_callback,
-                              &playlist_subscribers_changed_callbacks,
-                              userdata);
-  sp_playlist_update_subscribers(session, playlist);
+// Writes the fingerprint of the playlist's tracks as an entity tag of its
+// representation in a format, which is suffixed with the format unless JSON
+static void playlist_etag(sp_playlist *playlist,
+                          enum response_format format,
+                          struct state *state,
+                          char etag[PLAYLIST_ETAG_LENGTH + 1]) {
+  char fingerprint[FINGERPRINT_STRING_LENGTH + 1];
+  fingerprint_to_string(fingerprints_playlist(state->fingerprints, playlist),
+                        fingerprint);
+
+  if (format == FORMAT_JSON) {
+    snprintf(etag, PLAYLIST_ETAG_LENGTH + 1, "\"%s\"", fingerprint);
+  } else {
+    snprintf(etag, PLAYLIST_ETAG_LENGTH + 1, "\"%s-%s\"", fingerprint,
+             format_name(format));
+  }
 }
 
-// Reads JSON from the requests body. Returns NULL on any error.
-static json_t *read_request_body_json(struct evhttp_request *request,
-                                      json_error_t *error) {
-  struct evbuffer *buf = evhttp_request_get_input_buffer(request);
-  size_t buflen = evbuffer_get_length(buf);
+// Reads the fingerprint from an entity tag of any representation of a
+// playlist
+static bool etag_fingerprint(const char *etag, fingerprint_t *fingerprint) {
+  char str[PLAYLIST_ETAG_LENGTH + 1];
+  snprintf(str, sizeof (str), "%.*s", (int) strcspn(etag, "-"), etag);
+  return fingerprint_from_string(str, fingerprint);
+}
 
-  if (buflen == 0)
-    return NULL;
+// Tags a response in a format with the fingerprint of the playlist's tracks
+static void add_playlist_format_etag(struct evhttp_request *request,
+                                     sp_playlist *playlist,
+                                     enum response_format format,
+                                     struct state *state) {
+  char etag[PLAYLIST_ETAG_LENGTH + 1];
+  playlist_etag(playlist, format, state, etag);
+  evhttp_add_header(evhttp_request_get_output_headers(request), "ETag", etag);
+}
 
-  // Read body
-  char *body = malloc(buflen + 1);
+// Tags a JSON response with the fingerprint of the playlist's tracks
+static void add_playlist_etag(struct evhttp_request *request,
+                              sp_playlist *playlist,
+                              struct state *state) {
+  add_playlist_format_etag(request, playlist, FORMAT_JSON, state);
+}
 
-  if (body == NULL)
-    return NULL; // TODO(liesen): Handle memory alloc fail
+// Shares a serialization of a playlist with other workers
+static void share_playlist_serialization(sp_playlist *playlist,
+                                         const char *uri,
+                                         const char *body,
+                                         size_t length,
+                                         struct state *state) {
+  if (state->shared_cache == NULL)
+    return;
 
-  if (evbuffer_remove(buf, body, buflen) == -1) {
-    free(body);
+  char etag[PLAYLIST_ETAG_LENGTH + 1];
+  playlist_etag(playlist, FORMAT_JSON, state, etag);
+  shmcache_put(state->shared_cache, uri, body, length, etag,
+               state->shared_cache_ttl);
+}
+
+// Serializes a playlist, remembering a copy of the result (and sharing it
+// with other workers). Returns NULL on error; the result is to be `free`d.
+static char *serialize_playlist(sp_playlist *playlist, struct state *state) {
+  json_t *json = json_object();
+
+  if (playlist_to_json(playlist, json) == NULL) {
+    json_decref(json);
     return NULL;
   }
 
-  body[buflen] = '\0';
-
-  // Parse JSON
-  json_t *json = json_loads(body, 0, error);
-  free(body);
-  return json;
+  char *json_str = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
+  sp_link *link = sp_link_create_from_playlist(playlist);
+
+  // Playlists without a link have no URI to be remembered by
+  if (link == NULL)
+    return json_str;
+
+  char uri[kPlaylistLinkLength];
+  sp_link_as_string(link, uri, kPlaylistLinkLength);
+  sp_link_release(link);
+  size_t length = strlen(json_str);
+  struct playlist_serialization *serialization =
+      calloc(1, sizeof (struct playlist_serialization) + length + 1);
+  serialization->revision = changelog_revision(state->changelog, playlist);
+  serialization->digest = playlist_digest(playlist);
+  serialization->length = length;
+  memcpy(serialization->body, json_str, length + 1);
+  cache_put(state->playlist_cache, uri, serialization, length,
+            &playlist_serialization_free);
+  share_playlist_serialization(playlist, uri, json_str, length, state);
+  return json_str;
 }
 
-static void inbox_post_complete(sp_inbox *inbox, void *userdata) {
-  struct evhttp_request *request = userdata;
-  sp_error inbox_error = sp_inbox_error(inbox);
-  sp_inbox_release(inbox);
+// Returns the remembered serialization of a playlist if it's of the given
+// (known) revision and its other fields are as serialized, or NULL
+static struct playlist_serialization *find_playlist_serialization(
+    sp_playlist *playlist,
+    unsigned long long revision,
+    char uri[kPlaylistLinkLength],
+    struct state *state) {
+  sp_link *link = sp_link_create_from_playlist(playlist);
 
-  switch (inbox_error) {
-    case SP_ERROR_OK:
-      send_reply(request, HTTP_OK, "OK", NULL);
-      break;
+  if (link == NULL)
+    return NULL;
 
-    case SP_ERROR_NO_SUCH_USER:
-      send_error_sp(request, HTTP_NOTFOUND, inbox_error);
-      break;
+  sp_link_as_string(link, uri, kPlaylistLinkLength);
+  sp_link_release(link);
 
-    default:
-      send_error_sp(request, HTTP_ERROR, inbox_error);
-      break;
-  }
+  if (revision == 0)
+    return NULL;
+
+  struct playlist_serialization *serialization = cache_get(
+      state->playlist_cache, uri, NULL, NULL);
+  return serialization != NULL && serialization->revision == revision &&
+      serialization->digest == playlist_digest(playlist) ? serialization : NULL;
 }
 
-static void get_user_playlists(sp_playlistcontainer *pc,
-                               struct evhttp_request *request,
-                               void *userdata) {
-  json_t *json = json_object();
-  json_t *playlists = json_array();
-  json_object_set_new(json, "playlists", playlists);
-  int status = HTTP_OK;
 
-  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
-    if (sp_playlistcontainer_playlist_type(pc, i) != SP_PLAYLIST_TYPE_PLAYLIST)
-      continue;
+// Whether any of a comma-separated list of entity tags has a fingerprint.
+// Weak tags are compared by their value.
+static bool etags_match_fingerprint(const char *etags,
+                                    fingerprint_t fingerprint) {
+  while (*etags != '\0') {
+    etags += strspn(etags, " \t,");
+    size_t length = strcspn(etags, ",");
+    const char *etag = etags;
+    size_t etag_length = length;
+    etags += length;
+
+    while (etag_length > 0 &&
+           (etag[etag_length - 1] == ' ' || etag[etag_length - 1] == '\t')) {
+      etag_length--;
+    }
+
+    if (etag_length >= 2 && strncmp(etag, "W/", 2) == 0) {
+      etag += 2;
+      etag_length -= 2;
+    }
 
-    sp_playlist *playlist = sp_playlistcontainer_playlist(pc, i);
+    char str[PLAYLIST_ETAG_LENGTH + 1];
+    fingerprint_t tag_fingerprint;
 
-    if (!sp_playlist_is_loaded(playlist)) {
-      status = HTTP_PARTIAL;
-      continue;
+    if (etag_length > 0 && etag_length <= PLAYLIST_ETAG_LENGTH) {
+      snprintf(str, sizeof (str), "%.*s", (int) etag_length, etag);
+
+      if (etag_fingerprint(str, &tag_fingerprint) &&
+          tag_fingerprint == fingerprint) {
+        return true;
+      }
     }
+  }
+
+  return false;
+}
 
-    json_t *playlist_json = json_object();
-    playlist_to_json(playlist, playlist_json);
-    json_array_append_new(playlists, playlist_json);
+// Checks the If-Match header of a request to change a playlist against the
+// fingerprint of its tracks. Responds with 412 (and returns false) if the
+// client's version of the playlist is out of date.
+static bool playlist_precondition(sp_playlist *playlist,
+                                  struct evhttp_request *request,
+                                  struct state *state) {
+  const char *if_match = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "If-Match");
+
+  if (if_match == NULL || strcmp(if_match, "*") == 0)
+    return true;
+
+  if (etags_match_fingerprint(
+          if_match, fingerprints_playlist(state->fingerprints, playlist))) {
+    return true;
   }
 
-  sp_playlistcontainer_release(pc);
-  send_reply_json(request, status, status == HTTP_OK ? "OK" : "Partial Content",
-                  json);
+  add_playlist_etag(request, playlist, state);
+  send_error(request, HTTP_PRECONDITION_FAILED, "Precondition Failed");
+  return false;
 }
 
-static void put_user_inbox(const char *user,
-                           struct evhttp_request *request,
-                           void *userdata) {
-  json_error_t loads_error;
-  json_t *json = read_request_body_json(request, &loads_error);
+// Reads the revision a client already has a playlist at from the since query
+// parameter of a GET request. Returns false if there isn't one.
+static bool request_since(struct evhttp_request *request,
+                          unsigned long long *since) {
+  if (evhttp_request_get_command(request) != EVHTTP_REQ_GET)
+    return false;
 
-  if (json == NULL) {
-    send_error(request, HTTP_BADREQUEST,
-        loads_error.text ? loads_error.text : "Unable to parse JSON");
-    return;
-  }
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *since_field = evhttp_find_header(&query_fields, "since");
+  bool found = since_field != NULL && sscanf(since_field, "%llu", since) == 1;
+  evhttp_clear_headers(&query_fields);
+  return found;
+}
 
-  if (!json_is_object(json)) {
-    json_decref(json);
-    send_error(request, HTTP_BADREQUEST, "Not valid JSON object");
+// Tags a response with the revision of the playlist, for asking what has
+// changed since
+static void add_playlist_revision(struct evhttp_request *request,
+                                  sp_playlist *playlist,
+                                  struct state *state) {
+  unsigned long long revision = changelog_revision(state->changelog, playlist);
+
+  if (revision == 0)
     return;
-  }
 
-  json_t *tracks_json = json_object_get(json, "tracks");
+  char revision_str[21];
+  snprintf(revision_str, sizeof (revision_str), "%llu", revision);
+  evhttp_add_header(evhttp_request_get_output_headers(request), "X-Revision",
+                    revision_str);
+}
 
-  if (!json_is_array(tracks_json)) {
-    json_decref(tracks_json);
-    send_error(request, HTTP_BADREQUEST, "tracks is not valid JSON array");
-    return;
-  }
+// Whether a GET request asks for the metadata of tracks in place of their
+// URIs, with expand=tracks
+static bool request_expand_tracks(struct evhttp_request *request) {
+  if (evhttp_request_get_command(request) != EVHTTP_REQ_GET)
+    return false;
 
-  // Handle empty array
-  int num_tracks = json_array_size(tracks_json);
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *expand_field = evhttp_find_header(&query_fields, "expand");
+  bool expand = expand_field != NULL && strcmp(expand_field, "tracks") == 0;
+  evhttp_clear_headers(&query_fields);
+  return expand;
+}
 
-  if (num_tracks == 0) {
-    send_reply(request, HTTP_OK, "OK", NULL);
-    return;
-  }
+// Reads the tracks of a playlist into a newly allocated array
+static sp_track **playlist_tracks(sp_playlist *playlist, int *num_tracks) {
+  *num_tracks = sp_playlist_num_tracks(playlist);
+  sp_track **tracks = malloc(*num_tracks * sizeof (sp_track *));
 
-  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
-  int num_valid_tracks = json_to_tracks(tracks_json, tracks, num_tracks);
+  for (int i = 0; i < *num_tracks; i++)
+    tracks[i] = sp_playlist_track(playlist, i);
 
+  return tracks;
+}
+
+// Sends a playlist with the metadata of its tracks, as far as it has loaded:
+// as Partial Content if some tracks haven't
+static void send_playlist_expanded(sp_playlist *playlist,
+                                   struct evhttp_request *request,
+                                   struct state *state) {
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  json_t *json = json_object();
+  playlist_metadata_to_json(playlist, json);
+  char *json_str = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
+
+  // All but the closing brace, then the tracks
+  evbuffer_add(buf, json_str, strlen(json_str) - 1);
+  free(json_str);
+  evbuffer_add_printf(buf, ",\"tracks\":");
+  int num_tracks;
+  sp_track **tracks = playlist_tracks(playlist, &num_tracks);
+  int num_unloaded = track_metadata_write_tracks(state->track_metadata,
+                                                 tracks, num_tracks, buf);
+  free(tracks);
+  evbuffer_add(buf, "}", 1);
+  add_playlist_revision(request, playlist, state);
+  sp_playlist_release(playlist);
+
+  if (num_unloaded > 0) {
+    send_reply(request, HTTP_PARTIAL, "Partial Content", buf);
+  } else {
+    send_reply(request, HTTP_OK, "OK", buf);
+  }
+}
+
+// A request waiting for the tracks of a playlist to load, to expand them
+struct expand_handler {
+  struct parked_request parked;
+  struct track_metadata_waiter *waiter;
+  sp_playlist *playlist;
+};
+
+static void expand_handler_deadline(evutil_socket_t socket,
+                                    short what,
+                                    void *userdata) {
+  struct expand_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  struct state *state = handler->parked.state;
+  sp_playlist *playlist = handler->playlist;
+  state->num_deadlines_exceeded++;
+  track_metadata_cancel(handler->waiter);
+  unpark_request(&handler->parked);
+  free(handler);
+
+  // What has loaded is sent, with the rest marked as loading
+  send_playlist_expanded(playlist, request, state);
+}
+
+static void expand_handler_closed(struct evhttp_connection *connection,
+                                  void *userdata) {
+  struct expand_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_cancelled_requests++;
+  track_metadata_cancel(handler->waiter);
+  unpark_request(&handler->parked);
+  sp_playlist_release(handler->playlist);
+  free(handler);
+  free_abandoned_request(request);
+}
+
+static void expand_dispatch(void *userdata) {
+  struct expand_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  struct state *state = handler->parked.state;
+  sp_playlist *playlist = handler->playlist;
+
+  // The waiter is freed after calling back
+  unpark_request(&handler->parked);
+  free(handler);
+  send_playlist_expanded(playlist, request, state);
+}
+
+// Responds with a playlist with the metadata of its tracks once all of them
+// have loaded, waiting for them together
+static void get_playlist_expanded(sp_playlist *playlist,
+                                  struct evhttp_request *request,
+                                  struct state *state) {
+  int num_tracks;
+  sp_track **tracks = playlist_tracks(playlist, &num_tracks);
+  bool loaded = true;
+
+  for (int i = 0; i < num_tracks && loaded; i++)
+    loaded = track_metadata_is_loaded(tracks[i]);
+
+  if (loaded) {
+    free(tracks);
+    send_playlist_expanded(playlist, request, state);
+    return;
+  }
+
+  struct expand_handler *handler = malloc(sizeof (struct expand_handler));
+  handler->playlist = playlist;
+  park_request(&handler->parked, state, request, state->load_timeout,
+               &expand_handler_deadline, &expand_handler_closed, handler);
+  handler->waiter = track_metadata_wait(state->track_metadata, tracks,
+                                        num_tracks, &expand_dispatch,
+                                        handler);
+  free(tracks);
+}
+
+// Responds with an entire playlist, or just the changes to it since the
+// revision the client has if they are all known
+static void get_playlist(sp_playlist *playlist,
+                         struct evhttp_request *request,
+                         void *userdata) {
+  struct state *state = userdata;
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  unsigned long long since;
+
+  if (request_expand_tracks(request)) {
+    get_playlist_expanded(playlist, request, state);
+    return;
+  }
+
+  add_playlist_revision(request, playlist, state);
+  enum response_format format = request_format(request, true);
+
+  if (format != FORMAT_JSON) {
+    format_write_playlist(format, playlist, buf);
+    add_playlist_format_etag(request, playlist, format, state);
+    sp_playlist_release(playlist);
+    send_reply_typed(request, HTTP_OK, "OK", format_content_type(format), buf);
+    return;
+  }
+
+  if (request_since(request, &since) &&
+      changelog_changes_since(state->changelog, playlist, since, buf)) {
+    add_playlist_etag(request, playlist, state);
+    sp_playlist_release(playlist);
+    send_reply(request, HTTP_OK, "OK", buf);
+    return;
+  }
+
+  // Playlists are serialized (and compressed) once per revision
+  char uri[kPlaylistLinkLength];
+  unsigned long long revision = changelog_revision(state->changelog, playlist);
+  struct playlist_serialization *serialization =
+      find_playlist_serialization(playlist, revision, uri, state);
+
+  if (serialization != NULL) {
+    share_playlist_serialization(playlist, uri, serialization->body,
+                                 serialization->length, state);
+  } else {
+    char *json_str = serialize_playlist(playlist, state);
+
+    if (json_str == NULL) {
+      sp_playlist_release(playlist);
+      send_error(request, HTTP_ERROR, "");
+      return;
+    }
+
+    serialization = find_playlist_serialization(playlist, revision, uri,
+                                                state);
+
+    if (serialization == NULL)
+      evbuffer_add(buf, json_str, strlen(json_str));
+
+    free(json_str);
+  }
+
+  // Tagged first, for the tag to tell which coding it's sent in
+  add_playlist_etag(request, playlist, state);
+
+  if (serialization != NULL)
+    add_playlist_serialization(request, serialization, uri, state);
+
+  sp_playlist_release(playlist);
+  send_reply(request, HTTP_OK, "OK", buf);
+}
+
+// Playlist that is reloading in the background
+struct playlist_refresh {
+  sp_playlist *playlist;
+};
+
+// Forgets about a refresh when it's done, or given up on because the playlist
+// didn't load in time
+static void forget_playlist_refresh(sp_playlist *playlist, void *userdata) {
+  struct state *state = userdata;
+  struct playlist_refresh *refresh = apr_hash_get(state->playlist_refreshes,
+                                                  &playlist,
+                                                  sizeof (playlist));
+
+  if (refresh != NULL) {
+    apr_hash_set(state->playlist_refreshes, &playlist, sizeof (playlist),
+                 NULL);
+    free(refresh);
+  }
+}
+
+// Updates the serialization of a playlist once it has loaded, after a stale
+// response has been sent for it
+static void refresh_playlist(sp_playlist *playlist,
+                             struct evhttp_request *request,
+                             void *userdata) {
+  struct state *state = userdata;
+  forget_playlist_refresh(playlist, state);
+  free(serialize_playlist(playlist, state));
+  sp_playlist_release(playlist);
+}
+
+static void get_playlist_collaborative(sp_playlist *playlist,
+                                       struct evhttp_request *request,
+                                       void *userdata) {
+  assert(sp_playlist_is_loaded(playlist));
+  json_t *json = json_object();
+  playlist_to_json_set_collaborative(playlist, json);
+  sp_playlist_release(playlist);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Streams changes to a playlist as server-sent events
+static void get_playlist_events(sp_playlist *playlist,
+                                struct evhttp_request *request,
+                                void *userdata) {
+  struct state *state = userdata;
+  const char *last_event_id = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Last-Event-ID");
+  playlist_streams_subscribe(state->streams, playlist, request,
+                             last_event_id);
+  sp_playlist_release(playlist);
+}
+
+static void get_playlist_subscribers_callback(sp_playlist *playlist,
+                                              struct evhttp_request *request,
+                                              void *userdata) {
+  assert(sp_playlist_is_loaded(playlist));
+  struct state *state = userdata;
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  subscriber_cache_write_updated(state->subscribers, playlist, buf);
+  sp_playlist_release(playlist);
+  send_reply(request, HTTP_OK, "OK", buf);
+}
+
+static void get_playlist_subscribers(sp_playlist *playlist,
+                                     struct evhttp_request *request,
+                                     void *userdata) {
+  assert(sp_playlist_is_loaded(playlist));
+  struct state *state = userdata;
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+
+  if (subscriber_cache_write(state->subscribers, playlist, buf)) {
+    sp_playlist_release(playlist);
+    send_reply(request, HTTP_OK, "OK", buf);
+    return;
+  }
+
+  register_playlist_callbacks(playlist, request,
+                              &get_playlist_subscribers_callback,
+                              &playlist_subscribers_changed_callbacks,
+                              state, state->load_timeout);
+  subscriber_cache_update(state->subscribers, playlist);
+}
+
+// Reads JSON from the requests body. Returns NULL on any error.
+static json_t *read_request_body_json(struct evhttp_request *request,
+                                      json_error_t *error) {
+  struct evbuffer *buf = evhttp_request_get_input_buffer(request);
+  size_t buflen = evbuffer_get_length(buf);
+
+  if (buflen == 0)
+    return NULL;
+
+  // Read body
+  char *body = malloc(buflen + 1);
+
+  if (body == NULL)
+    return NULL; // TODO(liesen): Handle memory alloc fail
+
+  if (evbuffer_remove(buf, body, buflen) == -1) {
+    free(body);
+    return NULL;
+  }
+
+  body[buflen] = '\0';
+
+  // Parse JSON
+  json_t *json = json_loads(body, 0, error);
+  free(body);
+  return json;
+}
+
+static void inbox_post_complete(sp_inbox *inbox, void *userdata) {
+  struct evhttp_request *request = userdata;
+  sp_error inbox_error = sp_inbox_error(inbox);
+  sp_inbox_release(inbox);
+
+  switch (inbox_error) {
+    case SP_ERROR_OK:
+      send_reply(request, HTTP_OK, "OK", NULL);
+      break;
+
+    case SP_ERROR_NO_SUCH_USER:
+      send_error_sp(request, HTTP_NOTFOUND, inbox_error);
+      break;
+
+    default:
+      send_error_sp(request, HTTP_ERROR, inbox_error);
+      break;
+  }
+}
+
+static void append_playlist_json(json_t *playlists,
+                                 sp_playlist *playlist,
+                                 int *status) {
+  if (!sp_playlist_is_loaded(playlist)) {
+    *status = HTTP_PARTIAL;
+    return;
+  }
+
+  json_t *playlist_json = json_object();
+  playlist_to_json(playlist, playlist_json);
+  json_array_append_new(playlists, playlist_json);
+}
+
+// Reads the title to filter a user's playlists by from the title query
+// parameter. Returns NULL if there isn't one; the result is to be `free`d.
+static char *request_title(struct evhttp_request *request) {
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *title_field = evhttp_find_header(&query_fields, "title");
+  char *title = title_field != NULL ? strdup(title_field) : NULL;
+  evhttp_clear_headers(&query_fields);
+  return title;
+}
+
+// Responds with the loaded playlists of a container in a format other than
+// JSON
+static void send_user_playlists_formatted(sp_playlistcontainer *pc,
+                                          struct evhttp_request *request,
+                                          enum response_format format,
+                                          struct state *state) {
+  int num_playlists = 0;
+  sp_playlist **playlists;
+  char *title = request_title(request);
+
+  if (title != NULL) {
+    playlists = container_indexes_titled(state->container_indexes, pc, title,
+                                         &num_playlists);
+    free(title);
+  } else {
+    playlists = malloc(sp_playlistcontainer_num_playlists(pc) *
+                       sizeof (sp_playlist *));
+
+    for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+      if (sp_playlistcontainer_playlist_type(pc, i) ==
+          SP_PLAYLIST_TYPE_PLAYLIST) {
+        playlists[num_playlists++] = sp_playlistcontainer_playlist(pc, i);
+      }
+    }
+  }
+
+  // Those that haven't loaded are left out, as in JSON
+  int num_loaded = 0;
+
+  for (int i = 0; i < num_playlists; i++) {
+    if (sp_playlist_is_loaded(playlists[i]))
+      playlists[num_loaded++] = playlists[i];
+  }
+
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  format_write_playlists(format, playlists, num_loaded, buf);
+  free(playlists);
+  sp_playlistcontainer_release(pc);
+  int status = num_loaded == num_playlists ? HTTP_OK : HTTP_PARTIAL;
+  send_reply_typed(request, status,
+                   status == HTTP_OK ? "OK" : "Partial Content",
+                   format_content_type(format), buf);
+}
+
+static void get_user_playlists(sp_playlistcontainer *pc,
+                               struct evhttp_request *request,
+                               void *userdata) {
+  struct state *state = userdata;
+  enum response_format format = request_format(request, false);
+
+  if (format != FORMAT_JSON) {
+    send_user_playlists_formatted(pc, request, format, state);
+    return;
+  }
+
+  json_t *json = json_object();
+  json_t *playlists = json_array();
+  json_object_set_new(json, "playlists", playlists);
+  int status = HTTP_OK;
+  char *title = request_title(request);
+
+  if (title != NULL) {
+    int num_playlists;
+    sp_playlist **titled = container_indexes_titled(state->container_indexes,
+                                                    pc, title,
+                                                    &num_playlists);
+
+    for (int i = 0; i < num_playlists; i++)
+      append_playlist_json(playlists, titled[i], &status);
+
+    free(titled);
+    free(title);
+  } else {
+    for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+      if (sp_playlistcontainer_playlist_type(pc, i) !=
+          SP_PLAYLIST_TYPE_PLAYLIST) {
+        continue;
+      }
+
+      append_playlist_json(playlists, sp_playlistcontainer_playlist(pc, i),
+                           &status);
+    }
+  }
+
+  sp_playlistcontainer_release(pc);
+  send_reply_json(request, status, status == HTTP_OK ? "OK" : "Partial Content",
+                  json);
+}
+
+static void put_user_inbox(const char *user,
+                           struct evhttp_request *request,
+                           void *userdata) {
+  json_error_t loads_error;
+  json_t *json = read_request_body_json(request, &loads_error);
+
+  if (json == NULL) {
+    send_error(request, HTTP_BADREQUEST,
+        loads_error.text ? loads_error.text : "Unable to parse JSON");
+    return;
+  }
+
+  if (!json_is_object(json)) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "Not valid JSON object");
+    return;
+  }
+
+  json_t *tracks_json = json_object_get(json, "tracks");
+
+  if (!json_is_array(tracks_json)) {
+    json_decref(tracks_json);
+    send_error(request, HTTP_BADREQUEST, "tracks is not valid JSON array");
+    return;
+  }
+
+  // Handle empty array
+  int num_tracks = json_array_size(tracks_json);
+
+  if (num_tracks == 0) {
+    send_reply(request, HTTP_OK, "OK", NULL);
+    return;
+  }
+
+  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
+  int num_valid_tracks = json_to_tracks(tracks_json, tracks, num_tracks);
+
+  if (num_valid_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+  } else {
+    json_t *message_json = json_object_get(json, "message");
+    struct state *state = userdata;
+    sp_inbox *inbox = sp_inbox_post_tracks(state->session, user, tracks,
+        num_valid_tracks,
+        json_is_string(message_json) ? json_string_value(message_json) : "",
+        &inbox_post_complete, request);
+
+    if (inbox == NULL)
+      send_error(request, HTTP_ERROR,
+                 "Failed to initialize request to add tracks to user's inbox");
+  }
+
+  json_decref(json);
+  free(tracks);
+}
+
+// Posts the same tracks to the inboxes of many users, streaming back the
+// result for each
+static void post_inbox_batch(struct evhttp_request *request,
+                             struct state *state) {
+  json_error_t loads_error;
+  json_t *json = read_request_body_json(request, &loads_error);
+
+  if (json == NULL) {
+    send_error(request, HTTP_BADREQUEST,
+        loads_error.text ? loads_error.text : "Unable to parse JSON");
+    return;
+  }
+
+  if (!json_is_object(json)) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "Not valid JSON object");
+    return;
+  }
+
+  json_t *users_json = json_object_get(json, "users");
+  json_t *tracks_json = json_object_get(json, "tracks");
+  int num_users = json_array_size(users_json);
+  int num_tracks = json_array_size(tracks_json);
+
+  if (!json_is_array(users_json) || num_users == 0 ||
+      num_users > kInboxBatchMaxUsers) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "users is not valid JSON array");
+    return;
+  }
+
+  if (!json_is_array(tracks_json) || num_tracks == 0) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "tracks is not valid JSON array");
+    return;
+  }
+
+  const char **users = calloc(num_users, sizeof (char *));
+
+  for (int i = 0; i < num_users; i++) {
+    users[i] = json_string_value(json_array_get(users_json, i));
+
+    if (users[i] == NULL || *users[i] == '\0') {
+      free(users);
+      json_decref(json);
+      send_error(request, HTTP_BADREQUEST, "users must be usernames");
+      return;
+    }
+  }
+
+  // Tracks are resolved once for all users
+  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
+  int num_valid_tracks = json_to_tracks(tracks_json, tracks, num_tracks);
+
+  if (num_valid_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+  } else {
+    json_t *message_json = json_object_get(json, "message");
+    inbox_batch_start(state->inbox_batches, request, users, num_users, tracks,
+        num_valid_tracks,
+        json_is_string(message_json) ? json_string_value(message_json) : "");
+  }
+
+  json_decref(json);
+  free(users);
+  free(tracks);
+}
+
+static void delete_playlist(sp_playlist *playlist,
+                            struct evhttp_request *request,
+                            void *userdata) {
+  if (playlist == NULL) {
+    send_error(request, HTTP_ERROR, "Unable to delete playlist");
+    return;
+  }
+
+  struct state *state = userdata;
+  sp_session *session = state->session;
+  sp_playlistcontainer *pc = sp_session_playlistcontainer(session);
+  int position = container_indexes_position(state->container_indexes, pc,
+                                            playlist);
+
+  if (position < 0) {
+    send_error(request, HTTP_BADREQUEST, "Unable to delete playlist");
+    return;
+  }
+
+  sp_error remove_error = sp_playlistcontainer_remove_playlist(pc, position);
+
+  if (remove_error == SP_ERROR_OK) {
+    send_reply(request, HTTP_OK, "OK", NULL);
+  } else {
+    send_error_sp(request, HTTP_BADREQUEST, remove_error);
+  }
+}
+
+static void put_playlist_add_tracks(sp_playlist *playlist,
+                                    struct evhttp_request *request,
+                                    void *userdata) {
+  struct state *state = userdata;
+
+  if (!playlist_precondition(playlist, request, state)) {
+    sp_playlist_release(playlist);
+    return;
+  }
+
+  const char *uri = evhttp_request_get_uri(request);
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(uri, &query_fields);
+
+  // Parse index
+  const char *index_field = evhttp_find_header(&query_fields, "index");
+  int index;
+
+  if (index_field == NULL || sscanf(index_field, "%d", &index) <= 0) {
+    index = sp_playlist_num_tracks(playlist);
+  }
+
+  // Parse JSON
+  json_error_t loads_error;
+  json_t *json = read_request_body_json(request, &loads_error);
+
+  if (json == NULL) {
+    sp_playlist_release(playlist);
+    send_error(request, HTTP_BADREQUEST,
+               loads_error.text ? loads_error.text : "Unable to parse JSON");
+    return;
+  }
+
+  if (!json_is_array(json)) {
+    sp_playlist_release(playlist);
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "Not valid JSON array");
+    return;
+  }
+
+  // Handle empty array
+  int num_tracks = json_array_size(json);
+
+  if (num_tracks == 0) {
+    sp_playlist_release(playlist);
+    send_reply(request, HTTP_OK, "OK", NULL);
+    return;
+  }
+
+  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
+  int num_valid_tracks = json_to_tracks(json, tracks, num_tracks);
+  json_decref(json);
+
+  // Bail if no tracks could be read from input
   if (num_valid_tracks == 0) {
     send_error(request, HTTP_BADREQUEST, "No valid tracks");
+    free(tracks);
+    return;
+  }
+
+  struct playlist_handler *handler = register_playlist_callbacks(
+      playlist, request, &get_playlist,
+      &playlist_update_in_progress_callbacks, state, state->sync_timeout);
+  sp_error add_tracks_error = sp_playlist_add_tracks(playlist, tracks,
+                                                     num_valid_tracks,
+                                                     index, state->session);
+
+  if (add_tracks_error != SP_ERROR_OK) {
+    unregister_playlist_callbacks(handler);
+    sp_playlist_release(playlist);
+    send_error_sp(request, HTTP_BADREQUEST, add_tracks_error);
+  }
+
+  free(tracks);
+}
+
+// Adds a track to a set of tracks (an apr_hash keyed by the track, which
+// libspotify keeps one object of per track). Returns false if it was there.
+static bool track_set_add(apr_hash_t *set, sp_track *track) {
+  if (apr_hash_get(set, &track, sizeof (track)) != NULL)
+    return false;
+
+  sp_track **key = apr_palloc(apr_hash_pool_get(set), sizeof (*key));
+  *key = track;
+  apr_hash_set(set, key, sizeof (*key), key);
+  return true;
+}
+
+// A new playlist made from the tracks of other playlists (a copy or merge),
+// and of those given when it's created. The sources are waited for in turn
+// (they load side by side anyway), then the new playlist is created and given
+// the tracks, and the request is responded to once it has synced.
+struct playlist_merge {
+  struct state *state;
+  sp_playlist **sources;
+  int num_sources;
+  int next_source;
+  sp_track **tracks;  // Added after those of the sources
+  int num_tracks;
+  bool dedupe;
+  int collaborative;  // -1 to leave it as created
+  char *title;  // NULL to take the title of the first source
+  long long started;  // Monotonic milliseconds, for its one load deadline
+  sp_playlist *target;  // Once created; taken out again if the merge fails
+};
+
+static void free_playlist_merge(struct playlist_merge *merge) {
+  for (int i = 0; i < merge->num_sources; i++)
+    sp_playlist_release(merge->sources[i]);
+
+  free(merge->sources);
+  free(merge->tracks);
+  free(merge->title);
+  free(merge);
+}
+
+// Takes the new playlist of a merge that failed out of the container, so that
+// it isn't left behind empty or partly filled
+static void remove_merge_target(struct playlist_merge *merge) {
+  if (merge->target == NULL)
+    return;
+
+  struct state *state = merge->state;
+  sp_playlistcontainer *pc = sp_session_playlistcontainer(state->session);
+  int position = container_indexes_position(state->container_indexes, pc,
+                                            merge->target);
+
+  if (position >= 0)
+    sp_playlistcontainer_remove_playlist(pc, position);
+}
+
+static void cancel_playlist_merge(sp_playlist *playlist, void *userdata) {
+  remove_merge_target(userdata);
+  free_playlist_merge(userdata);
+}
+
+static long long now_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Waits for a playlist on behalf of a merge
+static void wait_for_merge_playlist(sp_playlist *playlist,
+                                    struct evhttp_request *request,
+                                    handle_playlist_fn callback,
+                                    struct playlist_merge *merge) {
+  struct playlist_handler *handler = register_playlist_callbacks(
+      playlist, request, callback, &playlist_state_changed_callbacks,
+      merge->state, merge->state->load_timeout);
+  handler->userdata = merge;
+  handler->cancel = &cancel_playlist_merge;
+
+  // All playlists of a merge load within the one timeout, not one each
+  if (handler->parked.deadline != NULL) {
+    long long remaining =
+        request_timeout(request, merge->state->load_timeout) -
+        (now_milliseconds() - merge->started);
+
+    if (remaining < 0)
+      remaining = 0;
+
+    struct timeval tv = { remaining / 1000, (remaining % 1000) * 1000 };
+    evtimer_add(handler->parked.deadline, &tv);
+  }
+}
+
+// Adds the tracks of the sources, and those given, to the new playlist in
+// batches, skipping tracks already added if deduplicating
+static void merge_playlist_tracks(sp_playlist *target,
+                                  struct evhttp_request *request,
+                                  void *userdata) {
+  struct playlist_merge *merge = userdata;
+  struct state *state = merge->state;
+  apr_pool_t *pool = NULL;
+  apr_hash_t *added = NULL;
+
+  if (merge->dedupe) {
+    apr_pool_create(&pool, state->pool);
+    added = apr_hash_make(pool);
+  }
+
+  int num_tracks = merge->num_tracks;
+
+  for (int i = 0; i < merge->num_sources; i++)
+    num_tracks += sp_playlist_num_tracks(merge->sources[i]);
+
+  sp_track **tracks = malloc((num_tracks > 0 ? num_tracks : 1) *
+                             sizeof (sp_track *));
+  int num_added = 0;
+
+  for (int i = 0; i < merge->num_sources; i++) {
+    sp_playlist *source = merge->sources[i];
+
+    for (int j = 0; j < sp_playlist_num_tracks(source); j++) {
+      sp_track *track = sp_playlist_track(source, j);
+
+      if (added == NULL || track_set_add(added, track))
+        tracks[num_added++] = track;
+    }
+  }
+
+  for (int i = 0; i < merge->num_tracks; i++) {
+    if (added == NULL || track_set_add(added, merge->tracks[i]))
+      tracks[num_added++] = merge->tracks[i];
+  }
+
+  sp_error error = SP_ERROR_OK;
+
+  if (merge->collaborative >= 0)
+    sp_playlist_set_collaborative(target, merge->collaborative);
+
+  for (int i = 0; i < num_added && error == SP_ERROR_OK;
+       i += kPlaylistMergeBatchTracks) {
+    int batch = num_added - i < kPlaylistMergeBatchTracks ?
+        num_added - i : kPlaylistMergeBatchTracks;
+    error = sp_playlist_add_tracks(target, tracks + i, batch, i,
+                                   state->session);
+  }
+
+  free(tracks);
+
+  if (pool != NULL)
+    apr_pool_destroy(pool);
+
+  if (error != SP_ERROR_OK)
+    remove_merge_target(merge);
+
+  // The new playlist holds on to the tracks now
+  free_playlist_merge(merge);
+
+  if (error != SP_ERROR_OK) {
+    sp_playlist_release(target);
+    send_error_sp(request, HTTP_ERROR, error);
+  } else if (num_added == 0) {
+    get_playlist(target, request, state);
   } else {
-    json_t *message_json = json_object_get(json, "message");
-    sp_session *session = userdata;
-    sp_inbox *inbox = sp_inbox_post_tracks(session, user, tracks,
-        num_valid_tracks,
-        json_is_string(message_json) ? json_string_value(message_json) : "",
-        &inbox_post_complete, request);
+    // Callbacks come from processing events, so this is the sync of all
+    // batches
+    register_playlist_callbacks(target, request, &get_playlist,
+                                &playlist_update_in_progress_callbacks, state,
+                                state->sync_timeout);
+  }
+}
 
-    if (inbox == NULL)
-      send_error(request, HTTP_ERROR,
-                 "Failed to initialize request to add tracks to user's inbox");
+// Waits for the next source that hasn't loaded, or creates the new playlist
+// once they all have
+static void continue_playlist_merge(struct playlist_merge *merge,
+                                    struct evhttp_request *request);
+
+static void merge_source_loaded(sp_playlist *playlist,
+                                struct evhttp_request *request,
+                                void *userdata) {
+  sp_playlist_release(playlist);
+  continue_playlist_merge(userdata, request);
+}
+
+static void continue_playlist_merge(struct playlist_merge *merge,
+                                    struct evhttp_request *request) {
+  for (; merge->next_source < merge->num_sources; merge->next_source++) {
+    sp_playlist *source = merge->sources[merge->next_source];
+
+    if (!sp_playlist_is_loaded(source)) {
+      // The merge holds on to the source; this reference is for the wait
+      sp_playlist_add_ref(source);
+      wait_for_merge_playlist(source, request, &merge_source_loaded, merge);
+      return;
+    }
+  }
+
+  if (merge->title == NULL)
+    merge->title = strdup(sp_playlist_name(merge->sources[0]));
+
+  sp_playlistcontainer *pc = sp_session_playlistcontainer(
+      merge->state->session);
+  sp_playlist *target = sp_playlistcontainer_add_new_playlist(pc,
+                                                              merge->title);
+
+  if (target == NULL) {
+    free_playlist_merge(merge);
+    send_error(request, HTTP_ERROR, "Unable to create playlist");
+    return;
+  }
+
+  // The container holds the new playlist; get_playlist releases this
+  sp_playlist_add_ref(target);
+  merge->target = target;
+
+  if (sp_playlist_is_loaded(target))
+    merge_playlist_tracks(target, request, merge);
+  else
+    wait_for_merge_playlist(target, request, &merge_playlist_tracks, merge);
+}
+
+// Whether a title for a new playlist is a string short enough for it
+static bool valid_playlist_title(json_t *title_json) {
+  if (!json_is_string(title_json))
+    return false;
+
+  size_t length = strlen(json_string_value(title_json));
+  return length < (size_t) kMaxPlaylistTitleLength;
+}
+
+static struct playlist_merge *playlist_merge_new(struct state *state,
+                                                 int num_sources) {
+  struct playlist_merge *merge = calloc(1, sizeof (struct playlist_merge));
+  merge->state = state;
+  merge->sources = calloc(num_sources, sizeof (sp_playlist *));
+  merge->collaborative = -1;
+  merge->started = now_milliseconds();
+  return merge;
+}
+
+// Reads the title of a copy (and whether to deduplicate), either of which
+// may be left out, as may the body itself
+static bool read_copy_options(struct evhttp_request *request,
+                              struct playlist_merge *merge) {
+  struct evbuffer *buf = evhttp_request_get_input_buffer(request);
+
+  if (evbuffer_get_length(buf) == 0)
+    return true;
+
+  json_error_t loads_error;
+  json_t *json = read_request_body_json(request, &loads_error);
+
+  if (!json_is_object(json)) {
+    json_decref(json);
+    return false;
+  }
+
+  json_t *title_json = json_object_get(json, "title");
+  json_t *dedupe_json = json_object_get(json, "dedupe");
+  bool valid = (title_json == NULL || valid_playlist_title(title_json)) &&
+      (dedupe_json == NULL || json_is_boolean(dedupe_json));
+
+  if (valid && title_json != NULL)
+    merge->title = strdup(json_string_value(title_json));
+
+  merge->dedupe = json_is_true(dedupe_json);
+  json_decref(json);
+  return valid;
+}
+
+static void post_playlist_copy(sp_playlist *playlist,
+                               struct evhttp_request *request,
+                               void *userdata) {
+  struct state *state = userdata;
+  struct playlist_merge *merge = playlist_merge_new(state, 1);
+  merge->sources[merge->num_sources++] = playlist;
+
+  if (!read_copy_options(request, merge)) {
+    free_playlist_merge(merge);
+    send_error(request, HTTP_BADREQUEST, "Invalid copy object");
+    return;
+  }
+
+  continue_playlist_merge(merge, request);
+}
+
+static void post_playlist_merge(struct evhttp_request *request,
+                                struct state *state) {
+  json_error_t loads_error;
+  json_t *json = read_request_body_json(request, &loads_error);
+
+  if (json == NULL) {
+    send_error(request, HTTP_BADREQUEST, "Unable to parse JSON");
+    return;
+  }
+
+  json_t *playlists_json = json_object_get(json, "playlists");
+  int num_sources = json_array_size(playlists_json);
+
+  if (!json_is_array(playlists_json) || num_sources == 0 ||
+      num_sources > kPlaylistMergeMaxSources) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST,
+               "Invalid merge: playlists is not an array of playlist links");
+    return;
+  }
+
+  json_t *title_json = json_object_get(json, "title");
+  json_t *dedupe_json = json_object_get(json, "dedupe");
+
+  if (!valid_playlist_title(title_json) ||
+      (dedupe_json != NULL && !json_is_boolean(dedupe_json))) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST,
+               "Invalid merge: title is not a string or is too long");
+    return;
+  }
+
+  struct playlist_merge *merge = playlist_merge_new(state, num_sources);
+  merge->title = strdup(json_string_value(title_json));
+  merge->dedupe = json_is_true(dedupe_json);
+
+  for (int i = 0; i < num_sources; i++) {
+    const char *source_uri = json_string_value(json_array_get(playlists_json,
+                                                              i));
+    sp_link *link = source_uri != NULL ?
+        sp_link_create_from_string(source_uri) : NULL;
+    sp_playlist *source = NULL;
+
+    if (link != NULL) {
+      if (sp_link_type(link) == SP_LINKTYPE_PLAYLIST)
+        source = sp_playlist_create(state->session, link);
+
+      sp_link_release(link);
+    }
+
+    if (source == NULL) {
+      free_playlist_merge(merge);
+      json_decref(json);
+      send_error(request, HTTP_BADREQUEST,
+                 "Invalid merge: not a playlist link");
+      return;
+    }
+
+    residency_touch_playlist(state->residency, source);
+    merge->sources[merge->num_sources++] = source;
   }
 
   json_decref(json);
+  continue_playlist_merge(merge, request);
+}
+
+static void put_playlist_remove_tracks(sp_playlist *playlist,
+                                       struct evhttp_request *request,
+                                       void *userdata) {
+  struct state *state = userdata;
+
+  if (!playlist_precondition(playlist, request, state)) {
+    sp_playlist_release(playlist);
+    return;
+  }
+
+  const char *uri = evhttp_request_get_uri(request);
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(uri, &query_fields);
+
+  // Parse index
+  const char *index_field = evhttp_find_header(&query_fields, "index");
+  int index;
+
+  if (index_field == NULL ||
+      sscanf(index_field, "%d", &index) <= 0 ||
+      index < 0) {
+    sp_playlist_release(playlist);
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: index must be numeric");
+    return;
+  }
+
+  const char *count_field = evhttp_find_header(&query_fields, "count");
+  int count;
+
+  if (count_field == NULL ||
+      sscanf(count_field, "%d", &count) <= 0 ||
+      count < 1) {
+    sp_playlist_release(playlist);
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: count must be numeric and positive");
+    return;
+  }
+
+  int *tracks = calloc(count, sizeof(int));
+
+  for (int i = 0; i < count; i++)
+    tracks[i] = index + i;
+
+  struct playlist_handler *handler = register_playlist_callbacks(
+      playlist, request, &get_playlist,
+      &playlist_update_in_progress_callbacks, state, state->sync_timeout);
+  sp_error remove_tracks_error = sp_playlist_remove_tracks(playlist, tracks,
+                                                           count);
+
+  if (remove_tracks_error != SP_ERROR_OK) {
+    unregister_playlist_callbacks(handler);
+    sp_playlist_release(playlist);
+    send_error_sp(request, HTTP_BADREQUEST, remove_tracks_error);
+  }
+
   free(tracks);
 }
 
@@ -401,7 +1897,7 @@ static void put_playlist(sp_playlist *playlist,
   // the same, but do they have to be?
   assert(playlist == NULL);
 
-  sp_session *session = userdata;
+  struct state *state = userdata;
   json_error_t loads_error;
   json_t *playlist_json = read_request_body_json(request, &loads_error);
 
@@ -413,6 +1909,7 @@ static void put_playlist(sp_playlist *playlist,
 
   // Parse playlist
   if (!json_is_object(playlist_json)) {
+    json_decref(playlist_json);
     send_error(request, HTTP_BADREQUEST, "Invalid playlist object");
     return;
   }
@@ -427,191 +1924,203 @@ static void put_playlist(sp_playlist *playlist,
     return;
   }
 
-  if (!json_is_string(title_json)) {
+  if (!valid_playlist_title(title_json)) {
     json_decref(playlist_json);
     send_error(request, HTTP_BADREQUEST,
-               "Invalid playlist: title is not a string");
+               "Invalid playlist: title is not a string or is too long");
     return;
   }
 
-  char title[kMaxPlaylistTitleLength];
-  strncpy(title, json_string_value(title_json), kMaxPlaylistTitleLength);
-  json_decref(playlist_json);
-
-  // Add new playlist
-  sp_playlistcontainer *pc = sp_session_playlistcontainer(session);
-  playlist = sp_playlistcontainer_add_new_playlist(pc, title);
+  // libspotify can't set descriptions, so only an empty one is accepted
+  json_t *description_json = json_object_get(playlist_json, "description");
 
-  if (playlist == NULL) {
-    send_error(request, HTTP_ERROR, "Unable to create playlist");
-  } else {
-    register_playlist_callbacks(playlist, request, &get_playlist,
-                                &playlist_state_changed_callbacks, NULL);
+  if (json_is_string(description_json) &&
+      *json_string_value(description_json) != '\0') {
+    json_decref(playlist_json);
+    send_error(request, HTTP_NOTIMPL,
+               "Invalid playlist: description can't be set");
+    return;
   }
-}
 
-static void delete_playlist(sp_playlist *playlist,
-                            struct evhttp_request *request,
-                            void *userdata) {
-  if (playlist == NULL) {
-    send_error(request, HTTP_ERROR, "Unable to delete playlist");
+  json_t *collaborative_json = json_object_get(playlist_json,
+                                               "collaborative");
+  json_t *tracks_json = json_object_get(playlist_json, "tracks");
+
+  if ((description_json != NULL && !json_is_string(description_json)) ||
+      (collaborative_json != NULL && !json_is_boolean(collaborative_json)) ||
+      (tracks_json != NULL && !json_is_array(tracks_json))) {
+    json_decref(playlist_json);
+    send_error(request, HTTP_BADREQUEST,
+               "Invalid playlist: description, collaborative or tracks");
     return;
   }
 
-  struct state *state = userdata;
-  sp_session *session = state->session;
-  sp_playlistcontainer *pc = sp_session_playlistcontainer(session);
-
-  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
-    if (sp_playlistcontainer_playlist_type(pc, i) != SP_PLAYLIST_TYPE_PLAYLIST)
-      continue;
+  struct playlist_merge *merge = playlist_merge_new(state, 0);
+  merge->title = strdup(json_string_value(title_json));
 
-    if (sp_playlistcontainer_playlist(pc, i) != playlist) {
-      sp_error remove_error = sp_playlistcontainer_remove_playlist(pc, i);
+  if (collaborative_json != NULL)
+    merge->collaborative = json_is_true(collaborative_json);
 
-      if (remove_error == SP_ERROR_OK) {
-        send_reply(request, HTTP_OK, "OK", NULL);
-      } else {
-        send_error_sp(request, HTTP_BADREQUEST, remove_error);
-      }
+  int num_tracks = json_array_size(tracks_json);
 
-      return;
-    }
+  if (num_tracks > 0) {
+    merge->tracks = calloc(num_tracks, sizeof (sp_track *));
+    merge->num_tracks = json_to_tracks(tracks_json, merge->tracks,
+                                       num_tracks);
   }
 
-  send_error(request, HTTP_BADREQUEST, "Unable to delete playlist");
-}
-
-static void put_playlist_add_tracks(sp_playlist *playlist,
-                                    struct evhttp_request *request,
-                                    void *userdata) {
-  sp_session *session = userdata;
-  const char *uri = evhttp_request_get_uri(request);
-  struct evkeyvalq query_fields;
-  evhttp_parse_query(uri, &query_fields);
-
-  // Parse index
-  const char *index_field = evhttp_find_header(&query_fields, "index");
-  int index;
+  json_decref(playlist_json);
 
-  if (index_field == NULL || sscanf(index_field, "%d", &index) <= 0) {
-    index = sp_playlist_num_tracks(playlist);
+  // Bail if no tracks could be read from input
+  if (num_tracks > 0 && merge->num_tracks == 0) {
+    free_playlist_merge(merge);
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+    return;
   }
 
-  // Parse JSON
+  continue_playlist_merge(merge, request);
+}
+
+// Responds with whether a playlist has tracks, and where
+static void post_playlist_contains(sp_playlist *playlist,
+                                   struct evhttp_request *request,
+                                   void *userdata) {
+  struct state *state = userdata;
   json_error_t loads_error;
   json_t *json = read_request_body_json(request, &loads_error);
 
-  if (json == NULL) {
-    sp_playlist_release(playlist);
-    send_error(request, HTTP_BADREQUEST,
-               loads_error.text ? loads_error.text : "Unable to parse JSON");
-    return;
-  }
-
   if (!json_is_array(json)) {
-    sp_playlist_release(playlist);
     json_decref(json);
+    sp_playlist_release(playlist);
     send_error(request, HTTP_BADREQUEST, "Not valid JSON array");
     return;
   }
 
-  // Handle empty array
-  int num_tracks = json_array_size(json);
-
-  if (num_tracks == 0) {
-    sp_playlist_release(playlist);
-    send_reply(request, HTTP_OK, "OK", NULL);
-    return;
-  }
+  int num_uris = json_array_size(json);
+  const char **uris = malloc((num_uris > 0 ? num_uris : 1) * sizeof (char *));
 
-  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
-  int num_valid_tracks = json_to_tracks(json, tracks, num_tracks);
-  json_decref(json);
+  for (int i = 0; i < num_uris; i++) {
+    uris[i] = json_string_value(json_array_get(json, i));
 
-  // Bail if no tracks could be read from input
-  if (num_valid_tracks == 0) {
-    send_error(request, HTTP_BADREQUEST, "No valid tracks");
-    free(tracks);
-    return;
+    if (uris[i] == NULL) {
+      free(uris);
+      json_decref(json);
+      sp_playlist_release(playlist);
+      send_error(request, HTTP_BADREQUEST, "Not valid track URI");
+      return;
+    }
   }
 
-  struct playlist_handler *handler = register_playlist_callbacks(
-      playlist, request, &get_playlist,
-      &playlist_update_in_progress_callbacks, NULL);
-  sp_error add_tracks_error = sp_playlist_add_tracks(playlist, tracks,
-                                                     num_valid_tracks,
-                                                     index, session);
+  json_t *result = json_object();
+  json_object_set_new(result, "tracks",
+                      track_indexes_contains(state->track_indexes, playlist,
+                                             uris, num_uris));
+  free(uris);
+  json_decref(json);
+  add_playlist_etag(request, playlist, state);
+  sp_playlist_release(playlist);
+  send_reply_json(request, HTTP_OK, "OK", result);
+}
 
-  if (add_tracks_error != SP_ERROR_OK) {
-    sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks,
-                                 handler);
-    sp_playlist_release(playlist);
-    free(handler);
-    send_error_sp(request, HTTP_BADREQUEST, add_tracks_error);
-  }
+// Result of removing duplicate tracks, sent once the playlist has synced
+struct playlist_dedupe {
+  struct state *state;
+  int num_removed;
+};
 
-  free(tracks);
+static void cancel_playlist_dedupe(sp_playlist *playlist, void *userdata) {
+  free(userdata);
 }
 
-static void put_playlist_remove_tracks(sp_playlist *playlist,
-                                       struct evhttp_request *request,
-                                       void *userdata) {
-  // sp_session *session = userdata;
-  const char *uri = evhttp_request_get_uri(request);
-  struct evkeyvalq query_fields;
-  evhttp_parse_query(uri, &query_fields);
+static void send_playlist_dedupe(sp_playlist *playlist,
+                                 struct evhttp_request *request,
+                                 void *userdata) {
+  struct playlist_dedupe *dedupe = userdata;
+  struct state *state = dedupe->state;
+  json_t *json = json_object();
+  json_object_set_new(json, "removed", json_integer(dedupe->num_removed));
+  add_playlist_etag(request, playlist, state);
+  sp_playlist_release(playlist);
+  free(dedupe);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
 
-  // Parse index
-  const char *index_field = evhttp_find_header(&query_fields, "index");
-  int index;
+// Removes all but the first occurrence of each track, all at once
+static void post_playlist_dedupe(sp_playlist *playlist,
+                                 struct evhttp_request *request,
+                                 void *userdata) {
+  struct state *state = userdata;
 
-  if (index_field == NULL ||
-      sscanf(index_field, "%d", &index) <= 0 ||
-      index < 0) {
+  if (!playlist_precondition(playlist, request, state)) {
     sp_playlist_release(playlist);
-    send_error(request, HTTP_BADREQUEST,
-               "Bad parameter: index must be numeric");
     return;
   }
 
-  const char *count_field = evhttp_find_header(&query_fields, "count");
-  int count;
+  int num_tracks = sp_playlist_num_tracks(playlist);
+  int *duplicates = malloc((num_tracks > 0 ? num_tracks : 1) * sizeof (int));
+  int num_duplicates = 0;
+  apr_pool_t *pool;
+  apr_pool_create(&pool, state->pool);
+  apr_hash_t *seen = apr_hash_make(pool);
 
-  if (count_field == NULL ||
-      sscanf(count_field, "%d", &count) <= 0 ||
-      count < 1) {
-    sp_playlist_release(playlist);
-    send_error(request, HTTP_BADREQUEST,
-               "Bad parameter: count must be numeric and positive");
-    return;
+  for (int i = 0; i < num_tracks; i++) {
+    if (!track_set_add(seen, sp_playlist_track(playlist, i)))
+      duplicates[num_duplicates++] = i;
   }
 
-  int *tracks = calloc(count, sizeof(int));
+  apr_pool_destroy(pool);
+  struct playlist_dedupe *dedupe = malloc(sizeof (struct playlist_dedupe));
+  dedupe->state = state;
+  dedupe->num_removed = num_duplicates;
 
-  for (int i = 0; i < count; i++)
-    tracks[i] = index + i;
+  if (num_duplicates == 0) {
+    free(duplicates);
+    send_playlist_dedupe(playlist, request, dedupe);
+    return;
+  }
 
   struct playlist_handler *handler = register_playlist_callbacks(
-      playlist, request, &get_playlist,
-      &playlist_update_in_progress_callbacks, NULL);
-  sp_error remove_tracks_error = sp_playlist_remove_tracks(playlist, tracks,
-                                                           count);
+      playlist, request, &send_playlist_dedupe,
+      &playlist_update_in_progress_callbacks, state, state->sync_timeout);
+  handler->userdata = dedupe;
+  handler->cancel = &cancel_playlist_dedupe;
+  sp_error remove_tracks_error = sp_playlist_remove_tracks(playlist,
+                                                           duplicates,
+                                                           num_duplicates);
 
   if (remove_tracks_error != SP_ERROR_OK) {
-    sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks, handler);
+    unregister_playlist_callbacks(handler);
     sp_playlist_release(playlist);
-    free(handler);
+    free(dedupe);
     send_error_sp(request, HTTP_BADREQUEST, remove_tracks_error);
   }
 
-  free(tracks);
+  free(duplicates);
 }
 
 static void put_playlist_patch(sp_playlist *playlist,
                                struct evhttp_request *request,
                                void *userdata) {
   struct state *state = userdata;
+
+  if (!playlist_precondition(playlist, request, state)) {
+    sp_playlist_release(playlist);
+    return;
+  }
+
+  // Clients that send the fingerprint of the tracks they want needn't send
+  // them when the playlist already has them
+  const char *fingerprint_header = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "X-Fingerprint");
+  fingerprint_t fingerprint;
+
+  if (fingerprint_header != NULL &&
+      fingerprint_from_string(fingerprint_header, &fingerprint) &&
+      fingerprint == fingerprints_playlist(state->fingerprints, playlist)) {
+    get_playlist(playlist, request, state);
+    return;
+  }
+
   struct evbuffer *buf = evhttp_request_get_input_buffer(request);
   size_t buflen = evbuffer_get_length(buf);
 
@@ -648,6 +2157,22 @@ static void put_playlist_patch(sp_playlist *playlist,
     return;
   }
 
+  // Nothing to diff if the playlist already has the tracks
+  fingerprint = fingerprint_start();
+
+  for (int i = 0; i < num_tracks; i++) {
+    json_t *item = json_array_get(json, i);
+
+    if (json_is_string(item))
+      fingerprint = fingerprint_add_uri(fingerprint, json_string_value(item));
+  }
+
+  if (fingerprint == fingerprints_playlist(state->fingerprints, playlist)) {
+    json_decref(json);
+    get_playlist(playlist, request, state);
+    return;
+  }
+
   sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
   int num_valid_tracks = 0;
 
@@ -719,77 +2244,666 @@ static void put_playlist_patch(sp_playlist *playlist,
 
   if (!sp_playlist_has_pending_changes(playlist)) {
     free(tracks);
-    get_playlist(playlist, request, NULL);
+    get_playlist(playlist, request, state);
+    return;
+  }
+
+  free(tracks);
+  register_playlist_callbacks(playlist, request, &get_playlist,
+                              &playlist_update_in_progress_callbacks, state,
+                              state->sync_timeout);
+}
+
+// A request waiting for the container or starred playlist of a user, along
+// with others waiting for the same
+struct user_handler {
+  struct parked_request parked;
+  struct user_cache_waiter *waiter;
+  bool starred;
+};
+
+static void unregister_user_handler(struct user_handler *handler) {
+  user_cache_cancel(handler->waiter);
+  unpark_request(&handler->parked);
+  free(handler);
+}
+
+static void user_handler_deadline(evutil_socket_t socket,
+                                  short what,
+                                  void *userdata) {
+  struct user_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_deadlines_exceeded++;
+  unregister_user_handler(handler);
+  send_error(request, HTTP_GATEWAY_TIMEOUT,
+             "Timed out waiting for user");
+}
+
+static void user_handler_closed(struct evhttp_connection *connection,
+                                void *userdata) {
+  struct user_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_cancelled_requests++;
+  unregister_user_handler(handler);
+  free_abandoned_request(request);
+}
+
+static void user_dispatch(void *object, void *userdata) {
+  struct user_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  struct state *state = handler->parked.state;
+  bool starred = handler->starred;
+
+  // The waiter is freed by the cache after calling back
+  unpark_request(&handler->parked);
+  free(handler);
+
+  if (starred) {
+    get_playlist(object, request, state);
+  } else {
+    get_user_playlists(object, request, state);
+  }
+}
+
+static void wait_for_user(struct evhttp_request *request,
+                          const char *canonical_username,
+                          bool starred,
+                          struct state *state) {
+  struct user_handler *handler = malloc(sizeof (struct user_handler));
+  handler->starred = starred;
+  park_request(&handler->parked, state, request, state->load_timeout,
+               &user_handler_deadline, &user_handler_closed, handler);
+  handler->waiter = starred ?
+      user_cache_wait_starred(state->user_cache, canonical_username,
+                              &user_dispatch, handler) :
+      user_cache_wait_playlistcontainer(state->user_cache, canonical_username,
+                                        &user_dispatch, handler);
+}
+
+static void handle_user_request(struct evhttp_request *request,
+                                char *action,
+                                const char *canonical_username,
+                                struct state *state) {
+  if (action == NULL) {
+    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    return;
+  }
+
+  int http_method = evhttp_request_get_command(request);
+
+  switch (http_method) {
+    case EVHTTP_REQ_GET:
+      if (strncmp(action, "playlists", 9) == 0) {
+        sp_playlistcontainer *pc = user_cache_playlistcontainer(
+            state->user_cache, canonical_username);
+        residency_touch_playlistcontainer(state->residency, pc);
+
+        if (sp_playlistcontainer_is_loaded(pc)) {
+          get_user_playlists(pc, request, state);
+        } else {
+          sp_playlistcontainer_release(pc);
+          residency_note_reload_wait(state->residency);
+          wait_for_user(request, canonical_username, false, state);
+        }
+
+        return;
+      } else if (strncmp(action, "starred", 7) == 0) {
+        sp_playlist *playlist = user_cache_starred(state->user_cache,
+                                                   canonical_username);
+        residency_touch_playlist(state->residency, playlist);
+
+        if (sp_playlist_is_loaded(playlist)) {
+          get_playlist(playlist, request, state);
+        } else {
+          sp_playlist_release(playlist);
+          residency_note_reload_wait(state->residency);
+          wait_for_user(request, canonical_username, true, state);
+        }
+
+        return;
+      }
+      break;
+
+    case EVHTTP_REQ_PUT:
+    case EVHTTP_REQ_POST:
+      if (strncmp(action, "inbox", 5) == 0) {
+        put_user_inbox(canonical_username, request, state);
+        return;
+      }
+      break;
+  }
+
+  evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+}
+
+// Responds with the state of the residency manager
+static void get_admin_residency(struct evhttp_request *request,
+                                struct state *state) {
+  json_t *json = json_object();
+  residency_to_json(state->residency, json);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with statistics for the response caches
+static void get_admin_caches(struct evhttp_request *request,
+                             struct state *state) {
+  json_t *json = json_object();
+  json_object_set_new(json, "playlists",
+                      cache_to_json(state->playlist_cache, json_object()));
+  json_object_set_new(json, "changes",
+                      changelog_to_json(state->changelog, json_object()));
+  json_object_set_new(json, "containers",
+                      container_indexes_to_json(state->container_indexes,
+                                                json_object()));
+  json_object_set_new(json, "trackIndexes",
+                      track_indexes_to_json(state->track_indexes,
+                                            json_object()));
+  json_object_set_new(json, "users",
+                      user_cache_to_json(state->user_cache, json_object()));
+  json_object_set_new(json, "subscribers",
+                      subscriber_cache_to_json(state->subscribers,
+                                               json_object()));
+  json_object_set_new(json, "tracks",
+                      track_metadata_to_json(state->track_metadata,
+                                             json_object()));
+  json_object_set_new(json, "searches",
+                      search_cache_to_json(state->searches, json_object()));
+  json_object_set_new(json, "browses",
+                      browse_cache_to_json(state->browses, json_object()));
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with the number of requests waiting for libspotify, how many have
+// been given up on, and the state of the admission queues
+static void get_admin_requests(struct evhttp_request *request,
+                               struct state *state) {
+  json_t *json = json_object();
+  json_object_set_new(json, "admission",
+                      admission_to_json(state->admission, json_object()));
+  json_object_set_new(json, "parked",
+                      json_integer(state->num_parked_requests));
+  json_object_set_new(json, "deadlinesExceeded",
+                      json_integer(state->num_deadlines_exceeded));
+  json_object_set_new(json, "cancelled",
+                      json_integer(state->num_cancelled_requests));
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with the number of event streams and what has been sent on them
+static void get_admin_streams(struct evhttp_request *request,
+                              struct state *state) {
+  json_t *json = json_object();
+  playlist_streams_to_json(state->streams, json);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with the state of every rate limited client
+static void get_admin_clients(struct evhttp_request *request,
+                              struct state *state) {
+  if (state->ratelimit == NULL) {
+    send_error(request, HTTP_NOTFOUND, "Rate limiting is disabled");
+    return;
+  }
+
+  json_t *json = json_object();
+  ratelimit_to_json(state->ratelimit, json);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with the log level and how many lines each thread has had written
+// out and dropped
+static void get_admin_log(struct evhttp_request *request) {
+  send_reply_json(request, HTTP_OK, "OK", logger_to_json(json_object()));
+}
+
+// Responds with the number of inbox batches and how fast they are posted
+static void get_admin_inbox(struct evhttp_request *request,
+                            struct state *state) {
+  json_t *json = json_object();
+  inbox_batches_to_json(state->inbox_batches, json);
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with this worker's place among the workers, the requests it has
+// forwarded to the others, and statistics for the shared cache
+static void get_admin_shards(struct evhttp_request *request,
+                             struct state *state) {
+  if (state->shards == NULL) {
+    send_error(request, HTTP_NOTFOUND, "Not running as workers");
+    return;
+  }
+
+  json_t *json = json_object();
+  shards_to_json(state->shards, json);
+  json_object_set_new(json, "sharedCache",
+                      shmcache_to_json(state->shared_cache, json_object()));
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+// Responds with statistics for jobs
+static void get_admin_jobs(struct evhttp_request *request,
+                           struct state *state) {
+  json_t *json = jobs_to_json(state->jobs, json_object());
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+static void handle_admin_request(struct evhttp_request *request,
+                                 char *action,
+                                 struct state *state) {
+  if (action == NULL ||
+      evhttp_request_get_command(request) != EVHTTP_REQ_GET) {
+    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    return;
+  }
+
+  if (strncmp(action, "residency", 9) == 0) {
+    get_admin_residency(request, state);
+    return;
+  }
+
+  if (strncmp(action, "caches", 6) == 0) {
+    get_admin_caches(request, state);
+    return;
+  }
+
+  if (strncmp(action, "requests", 8) == 0) {
+    get_admin_requests(request, state);
+    return;
+  }
+
+  if (strncmp(action, "clients", 7) == 0) {
+    get_admin_clients(request, state);
+    return;
+  }
+
+  if (strncmp(action, "streams", 7) == 0) {
+    get_admin_streams(request, state);
+    return;
+  }
+
+  if (strncmp(action, "log", 3) == 0) {
+    get_admin_log(request);
+    return;
+  }
+
+  if (strncmp(action, "shards", 6) == 0) {
+    get_admin_shards(request, state);
+    return;
+  }
+
+  if (strncmp(action, "inbox", 5) == 0) {
+    get_admin_inbox(request, state);
+    return;
+  }
+
+  if (strncmp(action, "jobs", 4) == 0) {
+    get_admin_jobs(request, state);
+    return;
+  }
+
+  evhttp_send_error(request, HTTP_NOTFOUND, "Not Found");
+}
+
+// How stale (in seconds) a response for a playlist that hasn't loaded yet may
+// be: -1 for any age, 0 for having to wait for the playlist to load. Read from
+// the stale query parameter or else the Cache-Control header.
+static long request_max_stale(struct evhttp_request *request,
+                              long default_max_stale) {
+  long max_stale = default_max_stale;
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *stale_field = evhttp_find_header(&query_fields, "stale");
+  const char *cache_control = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Cache-Control");
+
+  if (stale_field != NULL) {
+    if (strcmp(stale_field, "true") == 0) {
+      max_stale = -1;
+    } else if (strcmp(stale_field, "false") == 0) {
+      max_stale = 0;
+    } else {
+      sscanf(stale_field, "%ld", &max_stale);
+    }
+  } else if (cache_control != NULL) {
+    const char *directive = strstr(cache_control, "max-stale");
+
+    if (strstr(cache_control, "no-cache") != NULL) {
+      max_stale = 0;
+    } else if (directive != NULL) {
+      if (sscanf(directive, "max-stale=%ld", &max_stale) != 1)
+        max_stale = -1;
+    }
+  }
+
+  evhttp_clear_headers(&query_fields);
+  return max_stale;
+}
+
+static void add_stale_headers(struct evhttp_request *request, time_t stored) {
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  char age_str[32];
+  long age = time(NULL) - stored;
+  snprintf(age_str, sizeof (age_str), "%ld", age < 0 ? 0 : age);
+  evhttp_add_header(headers, "Age", age_str);
+  evhttp_add_header(headers, "Warning", "110 - \"Response is Stale\"");
+}
+
+// Responds with the last known serialization of a playlist that hasn't
+// loaded yet, from memory or else from the snapshot file. Returns false if
+// there's none that is fresh enough for the request.
+static bool send_stale_playlist(struct evhttp_request *request,
+                                const char *playlist_uri,
+                                struct state *state) {
+  long max_stale = request_max_stale(request, state->max_stale);
+  unsigned long long since;
+
+  // Only the whole playlist is remembered, in JSON and without the metadata
+  // of its tracks
+  if (max_stale == 0 || format_negotiate(evhttp_find_header(
+          evhttp_request_get_input_headers(request), "Accept"), true) !=
+      FORMAT_JSON || request_expand_tracks(request) ||
+      request_since(request, &since)) {
+    return false;
+  }
+
+  time_t now = time(NULL);
+  time_t stored;
+  struct playlist_serialization *serialization = cache_get(
+      state->playlist_cache, playlist_uri, NULL, &stored);
+
+  if (serialization != NULL && (max_stale < 0 || now - stored <= max_stale)) {
+    struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+    add_playlist_serialization(request, serialization, playlist_uri, state);
+    add_stale_headers(request, stored);
+    send_reply(request, HTTP_OK, "OK", buf);
+    return true;
+  }
+
+  if (state->snapshots == NULL)
+    return false;
+
+  json_t *json = json_object();
+
+  if (snapshot_store_playlist_to_json(state->snapshots, playlist_uri, json,
+                                      &stored) == NULL ||
+      (max_stale > 0 && now - stored > max_stale)) {
+    json_decref(json);
+    return false;
+  }
+
+  char stored_str[32];
+  snprintf(stored_str, sizeof (stored_str), "%ld", (long) stored);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "X-Snapshot", stored_str);
+  add_stale_headers(request, stored);
+  send_reply_json(request, HTTP_OK, "OK", json);
+  return true;
+}
+
+// Reloads a playlist in the background after a stale response was sent for
+// it, so that the next request gets fresh data. Takes over the reference to
+// the playlist.
+static void refresh_playlist_in_background(sp_playlist *playlist,
+                                           struct state *state) {
+  if (apr_hash_get(state->playlist_refreshes, &playlist,
+                   sizeof (playlist)) != NULL) {
+    sp_playlist_release(playlist);
+    return;
+  }
+
+  struct playlist_refresh *refresh = malloc(sizeof (struct playlist_refresh));
+  refresh->playlist = playlist;
+  apr_hash_set(state->playlist_refreshes, &refresh->playlist,
+               sizeof (playlist), refresh);
+  struct playlist_handler *handler = register_playlist_callbacks(
+      playlist, NULL, &refresh_playlist, &playlist_state_changed_callbacks,
+      state, state->load_timeout);
+  handler->cancel = &forget_playlist_refresh;
+}
+
+// A request waiting for a search, or a browse of an album or artist
+struct response_handler {
+  struct parked_request parked;
+  struct search_waiter *search;
+  struct browse_waiter *browse;
+};
+
+static void unregister_response_handler(struct response_handler *handler) {
+  if (handler->search != NULL) {
+    search_cache_cancel(handler->search);
+  } else {
+    browse_cache_cancel(handler->browse);
+  }
+
+  unpark_request(&handler->parked);
+  free(handler);
+}
+
+static void response_handler_deadline(evutil_socket_t socket,
+                                      short what,
+                                      void *userdata) {
+  struct response_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  bool search = handler->search != NULL;
+  handler->parked.state->num_deadlines_exceeded++;
+  unregister_response_handler(handler);
+  send_error(request, HTTP_GATEWAY_TIMEOUT, search ?
+             "Timed out waiting for search" : "Timed out waiting for browse");
+}
+
+static void response_handler_closed(struct evhttp_connection *connection,
+                                    void *userdata) {
+  struct response_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+  handler->parked.state->num_cancelled_requests++;
+  unregister_response_handler(handler);
+  free_abandoned_request(request);
+}
+
+static void response_dispatch(const char *body,
+                              size_t length,
+                              sp_error error,
+                              void *userdata) {
+  struct response_handler *handler = userdata;
+  struct evhttp_request *request = handler->parked.request;
+
+  // The waiter is freed by the cache after calling back
+  unpark_request(&handler->parked);
+  free(handler);
+
+  if (body == NULL) {
+    send_error_sp(request, HTTP_ERROR, error);
+    return;
+  }
+
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  evbuffer_add(buf, body, length);
+  send_reply(request, HTTP_OK, "OK", buf);
+}
+
+static struct response_handler *park_response_handler(
+    struct evhttp_request *request,
+    struct state *state) {
+  struct response_handler *handler = calloc(1,
+      sizeof (struct response_handler));
+  park_request(&handler->parked, state, request, state->load_timeout,
+               &response_handler_deadline, &response_handler_closed, handler);
+  return handler;
+}
+
+// Responds with an error to a request whose search or browse couldn't be
+// started
+static void cancel_response_handler(struct response_handler *handler) {
+  struct evhttp_request *request = handler->parked.request;
+  unpark_request(&handler->parked);
+  free(handler);
+  send_error(request, HTTP_ERROR, "Could not be started");
+}
+
+// Searches for tracks: q is the query, and offset and limit the page
+static void get_search(struct evhttp_request *request, struct state *state) {
+  struct evkeyvalq query_fields;
+  evhttp_parse_query(evhttp_request_get_uri(request), &query_fields);
+  const char *q = evhttp_find_header(&query_fields, "q");
+  const char *offset_field = evhttp_find_header(&query_fields, "offset");
+  const char *limit_field = evhttp_find_header(&query_fields, "limit");
+  int offset = offset_field != NULL ? atoi(offset_field) : 0;
+  int limit = limit_field != NULL ? atoi(limit_field) : kSearchDefaultLimit;
+  char *query = q != NULL ? strdup(q) : NULL;
+  evhttp_clear_headers(&query_fields);
+
+  if (query != NULL)
+    search_normalize_query(query);
+
+  if (query == NULL || *query == '\0' || offset < 0 || limit <= 0 ||
+      limit > kSearchMaxLimit) {
+    free(query);
+    send_error(request, HTTP_BADREQUEST,
+               "Expected q, and offset and limit within bounds");
+    return;
+  }
+
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+
+  if (search_cache_write(state->searches, query, offset, limit, buf)) {
+    free(query);
+    send_reply(request, HTTP_OK, "OK", buf);
+    return;
+  }
+
+  struct response_handler *handler = park_response_handler(request, state);
+  handler->search = search_cache_wait(state->searches, query, offset, limit,
+                                      &response_dispatch, handler);
+  free(query);
+
+  if (handler->search == NULL)
+    cancel_response_handler(handler);
+}
+
+// Responds with an album and its tracks, or an artist with its albums and top
+// tracks
+static void get_browse(struct evhttp_request *request,
+                       const char *entity_uri,
+                       sp_linktype type,
+                       struct state *state) {
+  sp_link *link = sp_link_create_from_string(entity_uri);
+
+  if (link == NULL) {
+    send_error(request, HTTP_NOTFOUND, "Link not found");
+    return;
+  }
+
+  if (sp_link_type(link) != type) {
+    sp_link_release(link);
+    send_error(request, HTTP_BADREQUEST, type == SP_LINKTYPE_ALBUM ?
+               "Not an album link" : "Not an artist link");
     return;
   }
 
-  free(tracks);
-  register_playlist_callbacks(playlist, request, &get_playlist,
-                              &playlist_update_in_progress_callbacks, NULL);
-}
+  char canonical_uri[kTrackLinkLength];
+  sp_link_as_string(link, canonical_uri, sizeof (canonical_uri));
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
 
-static void handle_user_request(struct evhttp_request *request,
-                                char *action,
-                                const char *canonical_username,
-                                sp_session *session) {
-  if (action == NULL) {
-    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+  if (browse_cache_write(state->browses, canonical_uri, buf)) {
+    sp_link_release(link);
+    send_reply(request, HTTP_OK, "OK", buf);
     return;
   }
 
-  int http_method = evhttp_request_get_command(request);
+  // The album or artist is owned by the link, and referenced by the browse
+  struct response_handler *handler = park_response_handler(request, state);
+  handler->browse = type == SP_LINKTYPE_ALBUM ?
+      browse_cache_wait_album(state->browses, canonical_uri,
+                              sp_link_as_album(link), &response_dispatch,
+                              handler) :
+      browse_cache_wait_artist(state->browses, canonical_uri,
+                               sp_link_as_artist(link), &response_dispatch,
+                               handler);
+  sp_link_release(link);
+
+  if (handler->browse == NULL)
+    cancel_response_handler(handler);
+}
 
-  switch (http_method) {
-    case EVHTTP_REQ_GET:
-      if (strncmp(action, "playlists", 9) == 0) {
-        sp_playlistcontainer *pc = sp_session_publishedcontainer_for_user_create(
-            session, canonical_username);
+// Whether a request has a Prefer header asking for respond-async
+static bool request_prefers_async(struct evhttp_request *request) {
+  const char *prefer = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Prefer");
 
-        if (sp_playlistcontainer_is_loaded(pc)) {
-          get_user_playlists(pc, request, session);
-        } else {
-          register_playlistcontainer_callbacks(pc, request,
-              &get_user_playlists,
-              &playlistcontainer_loaded_callbacks,
-              session);
-        }
+  if (prefer == NULL)
+    return false;
 
-        return;
-      } else if (strncmp(action, "starred", 7) == 0) {
-        sp_playlist *playlist = sp_session_starred_for_user_create(session,
-            canonical_username);
+  while (*prefer != '\0') {
+    prefer += strspn(prefer, " \t,");
+    size_t length = strcspn(prefer, " \t,;");
 
-        if (sp_playlist_is_loaded(playlist)) {
-          get_playlist(playlist, request, session);
-        } else {
-          register_playlist_callbacks(playlist, request, &get_playlist,
-              &playlist_state_changed_callbacks,
-              session);
-        }
+    if (length == 13 && strncasecmp(prefer, "respond-async", 13) == 0)
+      return true;
 
-        return;
-      }
-      break;
+    prefer += strcspn(prefer, ",");
+  }
 
-    case EVHTTP_REQ_PUT:
-    case EVHTTP_REQ_POST:
-      if (strncmp(action, "inbox", 5) == 0) {
-        put_user_inbox(canonical_username, request, session);
-        return;
-      }
-      break;
+  return false;
+}
+
+// Job IDs are picked so that requests for them go to this worker
+static bool job_id_owned(const char *id, void *userdata) {
+  struct state *state = userdata;
+
+  if (state->shards == NULL)
+    return true;
+
+  char key[kPlaylistLinkLength];
+  snprintf(key, sizeof (key), "job:%s", id);
+  return shards_owner(state->shards, key) == state->worker;
+}
+
+static void dispatch_request(struct evhttp_request *request, void *userdata);
+
+// Responds to a request with the ID of a job, and then runs the request as
+// that job
+static void start_job(struct evhttp_request *request, struct state *state) {
+  char id[JOBS_ID_LENGTH];
+  struct evhttp_request *job_request = jobs_start(state->jobs, request,
+                                                  &job_id_owned, state, id);
+
+  if (job_request == NULL) {
+    char retry_after[16];
+    snprintf(retry_after, sizeof (retry_after), "%d", kJobsRetryAfterSeconds);
+    evhttp_add_header(evhttp_request_get_output_headers(request),
+                      "Retry-After", retry_after);
+    send_error(request, HTTP_SERVUNAVAIL, "Too many jobs running");
+    return;
   }
 
-  evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+  char location[JOBS_ID_LENGTH + 8];
+  snprintf(location, sizeof (location), "/jobs/%s", id);
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  evhttp_add_header(headers, "Location", location);
+  evhttp_add_header(headers, "Preference-Applied", "respond-async");
+  json_t *json = json_object();
+  json_object_set_new(json, "id", json_string(id));
+  json_object_set_new(json, "location", json_string(location));
+  send_reply_json(request, HTTP_ACCEPTED, "Accepted", json);
+  dispatch_request(job_request, state);
 }
 
-// Request dispatcher
-static void handle_request(struct evhttp_request *request,
-                            void *userdata) {
-  evhttp_connection_set_timeout(request->evcon, 1);
-  evhttp_add_header(evhttp_request_get_output_headers(request),
-                    "Server", "johan@liesen.se/spotify-api-server");
+static void get_job(struct evhttp_request *request,
+                    const char *id,
+                    struct state *state) {
+  json_t *json = jobs_job_to_json(state->jobs, id);
+
+  if (json == NULL) {
+    send_error(request, HTTP_NOTFOUND, "Job not found");
+    return;
+  }
+
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
 
+// Request dispatcher, called once a request has been admitted
+static void dispatch_request(struct evhttp_request *request,
+                             void *userdata) {
   // Check request method
   int http_method = evhttp_request_get_command(request);
 
@@ -807,7 +2921,9 @@ static void handle_request(struct evhttp_request *request,
 
   struct state *state = userdata;
   sp_session *session = state->session;
-  char *uri = evhttp_decode_uri(evhttp_request_get_uri(request));
+  // The query string is read by the handlers that need it
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+  char *uri = evhttp_decode_uri(path != NULL ? path : "/");
 
   char *entity = strtok(uri, "/");
 
@@ -828,7 +2944,71 @@ static void handle_request(struct evhttp_request *request,
     }
 
     char *action = strtok(NULL, "/");
-    handle_user_request(request, action, username, session);
+    handle_user_request(request, action, username, state);
+    free(uri);
+    return;
+  }
+
+  // Handle requests to /inbox/batch
+  if (strcmp(entity, "inbox") == 0) {
+    char *action = strtok(NULL, "/");
+
+    if (action != NULL && strcmp(action, "batch") == 0 &&
+        http_method == EVHTTP_REQ_POST) {
+      post_inbox_batch(request, state);
+    } else {
+      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    free(uri);
+    return;
+  }
+
+  // Handle requests to /search
+  if (strcmp(entity, "search") == 0) {
+    if (http_method == EVHTTP_REQ_GET) {
+      get_search(request, state);
+    } else {
+      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    free(uri);
+    return;
+  }
+
+  // Handle requests to /album/<album_uri> and /artist/<artist_uri>
+  if (strcmp(entity, "album") == 0 || strcmp(entity, "artist") == 0) {
+    char *entity_uri = strtok(NULL, "/");
+
+    if (entity_uri != NULL && http_method == EVHTTP_REQ_GET) {
+      get_browse(request, entity_uri, strcmp(entity, "album") == 0 ?
+                 SP_LINKTYPE_ALBUM : SP_LINKTYPE_ARTIST, state);
+    } else {
+      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    free(uri);
+    return;
+  }
+
+  // Handle requests to /jobs/<id>
+  if (strcmp(entity, "jobs") == 0) {
+    char *id = strtok(NULL, "/");
+
+    if (id != NULL && http_method == EVHTTP_REQ_GET) {
+      get_job(request, id, state);
+    } else {
+      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    free(uri);
+    return;
+  }
+
+  // Handle requests to /admin/<action>
+  if (strncmp(entity, "admin", 5) == 0) {
+    char *action = strtok(NULL, "/");
+    handle_admin_request(request, action, state);
     free(uri);
     return;
   }
@@ -840,13 +3020,32 @@ static void handle_request(struct evhttp_request *request,
     return;
   }
 
+  // Changes to playlists may be run as jobs
+  if (http_method != EVHTTP_REQ_GET && request_prefers_async(request)) {
+    start_job(request, state);
+    free(uri);
+    return;
+  }
+
   char *playlist_uri = strtok(NULL, "/");
 
+  // Handle requests to /playlist/merge
+  if (playlist_uri != NULL && strcmp(playlist_uri, "merge") == 0) {
+    if (http_method == EVHTTP_REQ_POST) {
+      post_playlist_merge(request, state);
+    } else {
+      send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    free(uri);
+    return;
+  }
+
   if (playlist_uri == NULL) {
     switch (http_method) {
       case EVHTTP_REQ_PUT:
       case EVHTTP_REQ_POST:
-        put_playlist(NULL, request, session);
+        put_playlist(NULL, request, state);
         break;
 
       default:
@@ -873,6 +3072,8 @@ static void handle_request(struct evhttp_request *request,
     return;
   }
 
+  char canonical_uri[kPlaylistLinkLength];
+  sp_link_as_string(playlist_link, canonical_uri, kPlaylistLinkLength);
   sp_playlist *playlist = sp_playlist_create(session, playlist_link);
   sp_link_release(playlist_link);
 
@@ -887,7 +3088,6 @@ static void handle_request(struct evhttp_request *request,
 
   // Default request handler
   handle_playlist_fn request_callback = &not_implemented;
-  void *callback_userdata = session;
 
   switch (http_method) {
   case EVHTTP_REQ_GET:
@@ -899,6 +3099,8 @@ static void handle_request(struct evhttp_request *request,
         request_callback = &get_playlist_collaborative;
       } else if (strncmp(action, "subscribers", 11) == 0) {
         request_callback = &get_playlist_subscribers;
+      } else if (strncmp(action, "events", 6) == 0) {
+        request_callback = &get_playlist_events;
       }
     }
     break;
@@ -911,102 +3113,603 @@ static void handle_request(struct evhttp_request *request,
       } else if (strncmp(action, "remove", 6) == 0) {
         request_callback = &put_playlist_remove_tracks;
       } else if (strncmp(action, "patch", 5) == 0) {
-        callback_userdata = state;
         request_callback = &put_playlist_patch;
+      } else if (strncmp(action, "contains", 8) == 0) {
+        request_callback = &post_playlist_contains;
+      } else if (strncmp(action, "dedupe", 6) == 0) {
+        request_callback = &post_playlist_dedupe;
+      } else if (strncmp(action, "copy", 4) == 0 &&
+                 http_method == EVHTTP_REQ_POST) {
+        request_callback = &post_playlist_copy;
       }
     }
     break;
 
   case EVHTTP_REQ_DELETE:
     {
-      callback_userdata = state;
       request_callback = &delete_playlist;
     }
     break;
   }
 
+  residency_touch_playlist(state->residency, playlist);
+
   if (sp_playlist_is_loaded(playlist)) {
-    request_callback(playlist, request, callback_userdata);
+    request_callback(playlist, request, state);
+  } else if (request_callback == &get_playlist &&
+             send_stale_playlist(request, canonical_uri, state)) {
+    refresh_playlist_in_background(playlist, state);
   } else {
     // Wait for playlist to load
+    residency_note_reload_wait(state->residency);
     register_playlist_callbacks(playlist, request, request_callback,
                                 &playlist_state_changed_callbacks,
-                                callback_userdata);
+                                state, state->load_timeout);
   }
 
   free(uri);
 }
 
+static void send_retry_after(struct evhttp_request *request,
+                             int code,
+                             const char *message,
+                             int retry_after) {
+  char retry_after_str[16];
+  snprintf(retry_after_str, sizeof (retry_after_str), "%d", retry_after);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Retry-After", retry_after_str);
+  send_error(request, code, message);
+}
+
+// Responds to a request that was turned away by admission control
+static void reject_request(struct evhttp_request *request,
+                           int retry_after,
+                           void *userdata) {
+  send_retry_after(request, HTTP_SERVUNAVAIL, "Service Unavailable",
+                   retry_after);
+}
+
+// Identifies the client of a request for rate limiting: by a hash of the
+// known API key it sent (so that GET /admin/clients doesn't give keys away),
+// or else by its address
+static void request_client(struct evhttp_request *request,
+                           struct state *state,
+                           char *client,
+                           size_t client_size) {
+  const char *api_key = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "X-API-Key");
+
+  // Only known keys are trusted, or any client could get a bucket of its own
+  // by making one up
+  if (api_key != NULL && state->api_keys != NULL &&
+      apr_hash_get(state->api_keys, api_key, APR_HASH_KEY_STRING) != NULL) {
+    snprintf(client, client_size, "key:%016" PRIx64,
+             fnv1a_string(kFnvOffsetBasis, api_key));
+    return;
+  }
+
+  char *address = NULL;
+  ev_uint16_t port;
+  evhttp_connection_get_peer(evhttp_request_get_connection(request), &address,
+                             &port);
+  snprintf(client, client_size, "address:%s",
+           address != NULL ? address : "unknown");
+}
+
+// Admin requests are told apart before the URI is decoded, so that they can
+// skip the queues
+static enum admission_class request_admission_class(
+    struct evhttp_request *request) {
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+
+  if (path != NULL && strncmp(path, "/admin/", 7) == 0)
+    return ADMISSION_ADMIN;
+
+  if (evhttp_request_get_command(request) == EVHTTP_REQ_GET)
+    return ADMISSION_READ;
+
+  return ADMISSION_WRITE;
+}
+
+// Reads the key that decides which worker handles a request: the canonical
+// URI of a playlist, or the name of a user. Sets `shareable` for plain
+// requests for entire playlists as JSON, which may be served from the shared
+// cache.
+// Returns false for requests that any worker can handle.
+static bool request_shard_key(struct evhttp_request *request,
+                              char *key,
+                              size_t key_size,
+                              bool *shareable) {
+  const struct evhttp_uri *uri = evhttp_request_get_evhttp_uri(request);
+  const char *path = evhttp_uri_get_path(uri);
+
+  if (path == NULL)
+    return false;
+
+  char *decoded = evhttp_decode_uri(path);
+  char *entity = strtok(decoded, "/");
+  char *id = entity != NULL ? strtok(NULL, "/") : NULL;
+  char *action = id != NULL ? strtok(NULL, "/") : NULL;
+  bool found = false;
+  *shareable = false;
+
+  if (id == NULL) {
+    // Playlists are created by whichever worker gets the request
+  } else if (strcmp(entity, "user") == 0) {
+    snprintf(key, key_size, "user:%s", id);
+    found = true;
+  } else if (strcmp(entity, "jobs") == 0) {
+    snprintf(key, key_size, "job:%s", id);
+    found = true;
+  } else if (strcmp(entity, "playlist") == 0 &&
+             (action == NULL || strcmp(action, "events") != 0)) {
+    // Event streams are served by whichever worker gets them, as they can't
+    // be forwarded
+    sp_link *link = sp_link_create_from_string(id);
+
+    if (link != NULL) {
+      if (sp_link_type(link) == SP_LINKTYPE_PLAYLIST) {
+        sp_link_as_string(link, key, key_size);
+        *shareable = action == NULL &&
+            evhttp_request_get_command(request) == EVHTTP_REQ_GET &&
+            evhttp_uri_get_query(uri) == NULL &&
+            format_negotiate(evhttp_find_header(
+                evhttp_request_get_input_headers(request), "Accept"), true) ==
+            FORMAT_JSON;
+        found = true;
+      }
+
+      sp_link_release(link);
+    }
+  }
+
+  free(decoded);
+  return found;
+}
+
+// Responds with a playlist serialized by any of the workers, if there is a
+// fresh enough one
+static bool send_shared_playlist(struct evhttp_request *request,
+                                 const char *uri,
+                                 struct state *state) {
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  char etag[SHMCACHE_TAG_LENGTH + 1];
+
+  if (!shmcache_get(state->shared_cache, uri, buf, etag))
+    return false;
+
+  if (*etag != '\0') {
+    evhttp_add_header(evhttp_request_get_output_headers(request), "ETag",
+                      etag);
+  }
+
+  send_reply(request, HTTP_OK, "OK", buf);
+  return true;
+}
+
+// Requests that couldn't be forwarded to the worker they belong to are
+// handled here after all
+static void handle_unforwarded_request(struct evhttp_request *request,
+                                       void *userdata) {
+  struct state *state = userdata;
+  admission_submit(state->admission, request_admission_class(request),
+                   request);
+}
+
+static void handle_request(struct evhttp_request *request,
+                           void *userdata) {
+  struct state *state = userdata;
+  evhttp_connection_set_timeout(request->evcon, 1);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Server", "johan@liesen.se/spotify-api-server");
+  enum admission_class class = request_admission_class(request);
+
+  // Forwarded requests have been rate limited by the worker that got them
+  bool forwarded = state->shards != NULL &&
+      shards_forwarded(state->shards, request);
+
+  if (state->ratelimit != NULL && class != ADMISSION_ADMIN && !forwarded) {
+    char client[kMaxClientKeyLength];
+    request_client(request, state, client, sizeof (client));
+    int retry_after = ratelimit_take(state->ratelimit, client,
+                                     class == ADMISSION_WRITE);
+
+    if (retry_after > 0) {
+      send_retry_after(request, HTTP_TOO_MANY_REQUESTS, "Too Many Requests",
+                       retry_after);
+      return;
+    }
+  }
+
+  char key[kPlaylistLinkLength];
+  bool shareable;
+
+  if (state->shards != NULL && !forwarded && class != ADMISSION_ADMIN &&
+      request_shard_key(request, key, sizeof (key), &shareable)) {
+    if (shareable && send_shared_playlist(request, key, state))
+      return;
+
+    if (shards_forward(state->shards, request, key))
+      return;
+  }
+
+  admission_submit(state->admission, class, request);
+}
+
 void credentials_blob_updated(sp_session *session, const char *blob) {
-  syslog(LOG_DEBUG, "credentials_blob_updated");
+  log_debug("credentials_blob_updated");
   struct state *state = sp_session_userdata(session);
 
   if (state->credentials_blob_filename == NULL) {
-    syslog(LOG_DEBUG, "Not configured to store credentials");
+    log_debug("Not configured to store credentials");
     return;
   }
 
   FILE *fp = fopen(state->credentials_blob_filename, "w+");
 
   if (!fp) {
-    syslog(LOG_DEBUG, "Could not open credentials file for writing");
+    log_debug("Could not open credentials file for writing");
     return;
   }
 
   size_t blob_size = strlen(blob);
   fwrite(blob, 1, blob_size, fp);
   fclose(fp);
-  syslog(LOG_DEBUG, "Wrote new credentials to %s",
-         state->credentials_blob_filename);
+  log_debug("Wrote new credentials to %s",
+            state->credentials_blob_filename);
 }
 
 // Catches SIGINT and exits gracefully
 void sigint_handler(evutil_socket_t socket, short what, void *userdata) {
-  syslog(LOG_DEBUG, "signal_handler\n");
+  log_debug("signal_handler");
   struct state *state = userdata;
   sp_session_logout(state->session);
 }
 
 void logged_out(sp_session *session) {
-  syslog(LOG_DEBUG, "logged_out\n");
+  log_debug("logged_out");
   struct state *state = sp_session_userdata(session);
+
+  // Streams pin playlists in the residency set
+  if (state->streams != NULL) {
+    playlist_streams_free(state->streams);
+    state->streams = NULL;
+  }
+
+  if (state->residency != NULL) {
+    residency_free(state->residency);
+    state->residency = NULL;
+  }
+
+  if (state->snapshots != NULL) {
+    snapshot_store_close(state->snapshots);
+    state->snapshots = NULL;
+  }
+
+  if (state->playlist_cache != NULL) {
+    cache_free(state->playlist_cache);
+    state->playlist_cache = NULL;
+  }
+
+  if (state->fingerprints != NULL) {
+    fingerprints_free(state->fingerprints);
+    state->fingerprints = NULL;
+  }
+
+  if (state->changelog != NULL) {
+    changelog_free(state->changelog);
+    state->changelog = NULL;
+  }
+
+  if (state->container_indexes != NULL) {
+    container_indexes_free(state->container_indexes);
+    state->container_indexes = NULL;
+  }
+
+  if (state->track_indexes != NULL) {
+    track_indexes_free(state->track_indexes);
+    state->track_indexes = NULL;
+  }
+
+  if (state->jobs != NULL) {
+    jobs_free(state->jobs);
+    state->jobs = NULL;
+  }
+
+  if (state->user_cache != NULL) {
+    user_cache_free(state->user_cache);
+    state->user_cache = NULL;
+  }
+
+  if (state->subscribers != NULL) {
+    subscriber_cache_free(state->subscribers);
+    state->subscribers = NULL;
+  }
+
+  if (state->inbox_batches != NULL) {
+    inbox_batches_free(state->inbox_batches);
+    state->inbox_batches = NULL;
+  }
+
+  if (state->browses != NULL) {
+    browse_cache_free(state->browses);
+    state->browses = NULL;
+  }
+
+  if (state->searches != NULL) {
+    search_cache_free(state->searches);
+    state->searches = NULL;
+  }
+
+  if (state->track_metadata != NULL) {
+    track_metadata_free(state->track_metadata);
+    state->track_metadata = NULL;
+  }
+
+  if (state->admission != NULL) {
+    admission_free(state->admission);
+    state->admission = NULL;
+  }
+
+  if (state->ratelimit != NULL) {
+    ratelimit_free(state->ratelimit);
+    state->ratelimit = NULL;
+  }
+
+  if (state->shards != NULL) {
+    shards_free(state->shards);
+    state->shards = NULL;
+  }
+
   event_del(state->async);
   event_del(state->timer);
   event_del(state->sigint);
   event_base_loopbreak(state->event_base);
   apr_pool_destroy(state->pool);
-  closelog();
+}
+
+static void snapshot_watch_resident(sp_playlist *playlist, void *userdata) {
+  snapshot_store_watch(userdata, playlist);
+}
+
+static void snapshot_unwatch_resident(sp_playlist *playlist, void *userdata) {
+  snapshot_store_unwatch(userdata, playlist);
+}
+
+static void fingerprints_watch_resident(sp_playlist *playlist,
+                                        void *userdata) {
+  fingerprints_watch(userdata, playlist);
+}
+
+static void fingerprints_unwatch_resident(sp_playlist *playlist,
+                                          void *userdata) {
+  fingerprints_unwatch(userdata, playlist);
+}
+
+// Fingerprints are kept up to date for playlists while they are resident
+static const struct residency_observer fingerprints_residency_observer = {
+  .playlist_added = &fingerprints_watch_resident,
+  .playlist_removed = &fingerprints_unwatch_resident
+};
+
+static void changelog_watch_resident(sp_playlist *playlist, void *userdata) {
+  changelog_watch(userdata, playlist);
+}
+
+static void changelog_unwatch_resident(sp_playlist *playlist, void *userdata) {
+  changelog_unwatch(userdata, playlist);
+}
+
+// Changes are logged for playlists while they are resident
+static const struct residency_observer changelog_residency_observer = {
+  .playlist_added = &changelog_watch_resident,
+  .playlist_removed = &changelog_unwatch_resident
+};
+
+static void container_indexes_watch_resident(sp_playlistcontainer *pc,
+                                             void *userdata) {
+  container_indexes_watch(userdata, pc);
+}
+
+static void container_indexes_unwatch_resident(sp_playlistcontainer *pc,
+                                               void *userdata) {
+  container_indexes_unwatch(userdata, pc);
+}
+
+// Containers are indexed while they are resident
+static const struct residency_observer container_indexes_residency_observer = {
+  .playlistcontainer_added = &container_indexes_watch_resident,
+  .playlistcontainer_removed = &container_indexes_unwatch_resident
+};
+
+static void track_indexes_watch_resident(sp_playlist *playlist,
+                                         void *userdata) {
+  track_indexes_watch(userdata, playlist);
+}
+
+static void track_indexes_unwatch_resident(sp_playlist *playlist,
+                                           void *userdata) {
+  track_indexes_unwatch(userdata, playlist);
+}
+
+// Tracks are indexed for playlists while they are resident
+static const struct residency_observer track_indexes_residency_observer = {
+  .playlist_added = &track_indexes_watch_resident,
+  .playlist_removed = &track_indexes_unwatch_resident
+};
+
+// Snapshots follow changes to playlists while they are resident
+static const struct residency_observer snapshot_residency_observer = {
+  .playlist_added = &snapshot_watch_resident,
+  .playlist_removed = &snapshot_unwatch_resident
+};
+
+// Playlists that change are no longer served from the shared cache
+static void unshare_playlist(sp_playlist *playlist, void *userdata) {
+  struct state *state = userdata;
+  sp_link *link = sp_link_create_from_playlist(playlist);
+
+  if (link == NULL)
+    return;
+
+  char uri[kPlaylistLinkLength];
+  sp_link_as_string(link, uri, kPlaylistLinkLength);
+  sp_link_release(link);
+  shmcache_remove(state->shared_cache, uri);
+}
+
+// Binds the HTTP server to a port that other workers bind to as well, the
+// kernel spreading connections between them
+static bool bind_shared_socket(struct state *state) {
+  struct evutil_addrinfo hints;
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_PASSIVE;
+  struct evutil_addrinfo *address;
+  char port[8];
+  snprintf(port, sizeof (port), "%d", state->http_port);
+
+  if (evutil_getaddrinfo(state->http_host, port, &hints, &address) != 0)
+    return false;
+
+  struct evconnlistener *listener = evconnlistener_new_bind(
+      state->event_base, NULL, NULL,
+      LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE |
+      LEV_OPT_CLOSE_ON_EXEC, -1, address->ai_addr, address->ai_addrlen);
+  evutil_freeaddrinfo(address);
+  return listener != NULL && evhttp_bind_listener(state->http, listener);
+}
+
+// Binds the HTTP server for a worker: to the shared port, and to its own
+// port for requests forwarded from other workers
+static bool bind_worker(struct state *state) {
+  int port = state->worker_port + state->worker;
+
+  if (!bind_shared_socket(state) ||
+      evhttp_bind_socket(state->http, "127.0.0.1", port) == -1) {
+    return false;
+  }
+
+  // Forwarded requests may wait for libspotify as long as any other
+  int timeout = 0;
+
+  if (state->load_timeout > 0 && state->sync_timeout > 0) {
+    timeout = (state->load_timeout > state->sync_timeout ?
+               state->load_timeout : state->sync_timeout) / 1000 + 5;
+  }
+
+  state->shards = shards_new(state->event_base, state->num_workers,
+                             state->worker, "127.0.0.1", state->worker_port,
+                             timeout, state->worker_token,
+                             &handle_unforwarded_request, state);
+  log_debug("Worker %d taking forwarded requests on port %d",
+            state->worker, port);
+  return true;
 }
 
 void logged_in(sp_session *session, sp_error error) {
   struct state *state = sp_session_userdata(session);
 
   if (error != SP_ERROR_OK) {
-    syslog(LOG_CRIT, "Error logging in to Spotify: %s",
-           sp_error_message(error));
+    log_crit("Error logging in to Spotify: %s",
+             sp_error_message(error));
     state->exit_status = EXIT_FAILURE;
     logged_out(session);
     return;
   }
 
   state->session = session;
+  state->residency = residency_new(session, state->resident_max_tracks,
+                                   state->resident_max_bytes,
+                                   state->unload_evicted, state->pool);
+  state->playlist_cache = cache_new(state->playlist_cache_max_bytes, 0,
+                                    state->pool);
+  state->playlist_refreshes = apr_hash_make(state->pool);
+  state->fingerprints = fingerprints_new(state->pool);
+  state->streams = playlist_streams_new(state->event_base, state->residency,
+                                        state->pool);
+  residency_add_observer(state->residency, &fingerprints_residency_observer,
+                         state->fingerprints);
+  state->changelog = changelog_new(state->pool);
+  residency_add_observer(state->residency, &changelog_residency_observer,
+                         state->changelog);
+
+  if (state->shared_cache != NULL)
+    changelog_set_listener(state->changelog, &unshare_playlist, state);
+
+  // The session's own container (which playlists are created in and deleted
+  // from) is always indexed
+  state->container_indexes = container_indexes_new(state->pool);
+  residency_add_observer(state->residency,
+                         &container_indexes_residency_observer,
+                         state->container_indexes);
+  container_indexes_watch(state->container_indexes,
+                          sp_session_playlistcontainer(session));
+  state->track_indexes = track_indexes_new(state->pool);
+  state->jobs = jobs_new(kJobsMaxEntries, kJobsMaxBytes, state->pool);
+  residency_add_observer(state->residency, &track_indexes_residency_observer,
+                         state->track_indexes);
+  state->user_cache = user_cache_new(session, state->user_cache_max_entries,
+                                     state->user_cache_ttl, state->pool);
+  state->subscribers = subscriber_cache_new(session,
+                                            kSubscriberCacheMaxEntries,
+                                            state->subscribers_ttl,
+                                            state->pool);
+  state->inbox_batches = inbox_batches_new(session, state->inbox_window);
+  state->track_metadata = track_metadata_new(state->track_metadata_max_bytes,
+                                             state->pool);
+  state->searches = search_cache_new(session, state->track_metadata,
+                                     state->search_cache_max_bytes,
+                                     state->pool);
+  state->browses = browse_cache_new(session, state->track_metadata,
+                                    state->browse_cache_max_bytes,
+                                    state->pool);
+
+  state->admission = admission_new(state->event_base, state->max_in_flight,
+                                   state->max_queued, state->max_queue_wait,
+                                   &dispatch_request, &reject_request, state);
+
+  if (state->read_rate > 0 || state->write_rate > 0) {
+    state->ratelimit = ratelimit_new(state->read_rate, state->read_burst,
+                                     state->write_rate, state->write_burst,
+                                     state->ratelimit_max_clients,
+                                     state->pool);
+  }
+
+  if (state->snapshot_path != NULL) {
+    state->snapshots = snapshot_store_open(state->snapshot_path,
+                                           state->event_base, state->pool);
+
+    if (state->snapshots != NULL) {
+      residency_add_observer(state->residency, &snapshot_residency_observer,
+                             state->snapshots);
+    }
+  }
+
   evsignal_add(state->sigint, NULL);
   state->http = evhttp_new(state->event_base);
   evhttp_set_gencb(state->http, &handle_request, state);
 
   // Bind HTTP server
-  int bind = evhttp_bind_socket(state->http, state->http_host,
-                                state->http_port);
+  int bind;
+
+  if (state->num_workers > 0) {
+    bind = bind_worker(state) ? 0 : -1;
+  } else {
+    bind = evhttp_bind_socket(state->http, state->http_host,
+                              state->http_port);
+  }
 
   if (bind == -1) {
-    syslog(LOG_WARNING, "Could not bind HTTP server socket to %s:%d",
-           state->http_host, state->http_port);
+    log_warning("Could not bind HTTP server socket to %s:%d",
+                state->http_host, state->http_port);
     sp_session_logout(session);
     return;
   }
 
-  syslog(LOG_DEBUG, "HTTP server listening on %s:%d", state->http_host,
-         state->http_port);
+  log_debug("HTTP server listening on %s:%d", state->http_host,
+            state->http_port);
 }
 
 void process_events(evutil_socket_t socket, short what, void *userdata) {
@@ -1024,7 +3727,14 @@ void process_events(evutil_socket_t socket, short what, void *userdata) {
 }
 
 void notify_main_thread(sp_session *session) {
-  syslog(LOG_DEBUG, "notify_main_thread\n");
+  log_debug("notify_main_thread");
   struct state *state = sp_session_userdata(session);
   event_active(state->async, 0, 1);
 }
+
+void metadata_updated(sp_session *session) {
+  struct state *state = sp_session_userdata(session);
+
+  if (state->track_metadata != NULL)
+    track_metadata_updated(state->track_metadata);
+}
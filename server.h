@@ -1,6 +1,9 @@
 #include <apr.h>
+#include <apr_hash.h>
 #include <event2/event.h>
+#include <event2/http.h>
 #include <libspotify/api.h>
+#include <stdbool.h>
 
 // Application state
 struct state {
@@ -18,6 +21,110 @@ struct state {
   char *http_host;
   int http_port;
 
+  // Worker processes sharing the port, each with its own session, and the
+  // ports they take requests forwarded from each other on (0 workers means
+  // a single process)
+  int num_workers;
+  int worker;
+  int worker_port;
+  char *worker_token;
+  struct shards *shards;
+
+  // Serialized playlists shared between workers, and for how many seconds
+  struct shmcache *shared_cache;
+  size_t shared_cache_max_bytes;
+  int shared_cache_ttl;
+
+  // Playlists and containers kept loaded between requests
+  struct residency *residency;
+  size_t resident_max_tracks;
+  size_t resident_max_bytes;
+  bool unload_evicted;
+
+  // Snapshots of playlists for serving them before they have loaded
+  struct snapshot_store *snapshots;
+  char *snapshot_path;
+
+  // Last known good playlist serializations, and how old (in seconds) they
+  // may be when served for playlists that haven't loaded; -1 for any age
+  struct cache *playlist_cache;
+  size_t playlist_cache_max_bytes;
+  long max_stale;
+  apr_hash_t *playlist_refreshes;
+
+  // Fingerprints of the tracks of resident playlists
+  struct fingerprints *fingerprints;
+
+  // Recent changes to resident playlists
+  struct changelog *changelog;
+
+  // Positions of playlists in resident containers
+  struct container_indexes *container_indexes;
+
+  // Positions of the tracks in resident playlists
+  struct track_indexes *track_indexes;
+
+  // Requests run as jobs, and their results
+  struct jobs *jobs;
+
+  // Containers and starred playlists of recently requested users
+  struct user_cache *user_cache;
+  size_t user_cache_max_entries;
+  int user_cache_ttl;
+
+  // Subscribers of playlists, and for how many seconds they are served
+  // without asking Spotify again
+  struct subscriber_cache *subscribers;
+  int subscribers_ttl;
+
+  // Posts to the inboxes of many users, at most inbox_window at a time
+  struct inbox_batches *inbox_batches;
+  int inbox_window;
+
+  // Serialized metadata of tracks, for playlists read with expand=tracks
+  struct track_metadata *track_metadata;
+  size_t track_metadata_max_bytes;
+
+  // Serialized search results, and searches under way
+  struct search_cache *searches;
+  size_t search_cache_max_bytes;
+
+  // Serialized browses of albums and artists, and browses under way
+  struct browse_cache *browses;
+  size_t browse_cache_max_bytes;
+
+  // Server-sent event streams of changes to playlists
+  struct playlist_streams *streams;
+
+  // Milliseconds requests may wait for playlists and containers to load, and
+  // for changes to sync (0 means forever)
+  int load_timeout;
+  int sync_timeout;
+
+  // Requests waiting for libspotify
+  unsigned long num_parked_requests;
+  unsigned long num_deadlines_exceeded;
+  unsigned long num_cancelled_requests;
+
+  // Cap on operations waiting for libspotify, and how many requests may queue
+  // (per class) for how many milliseconds when it's reached
+  struct admission *admission;
+  int max_in_flight;
+  int max_queued;
+  int max_queue_wait;
+
+  // Requests per second (and bursts) allowed per client; rate limiting is
+  // off when both rates are 0
+  struct ratelimit *ratelimit;
+  double read_rate;
+  double read_burst;
+  double write_rate;
+  double write_burst;
+  size_t ratelimit_max_clients;
+
+  // API keys that tell clients apart, or NULL to go by their address only
+  apr_hash_t *api_keys;
+
   apr_pool_t *pool;
 
   int exit_status;
@@ -31,6 +138,13 @@ void logged_out(sp_session *session);
 
 void notify_main_thread(sp_session *session);
 
+void metadata_updated(sp_session *session);
+
 void process_events(evutil_socket_t socket, short what, void *userdata);
 
 void sigint_handler(evutil_socket_t socket, short what, void *userdata);
+
+// Requests that haven't been responded to are detached from connections that
+// close, and are then left for us to free. Frees such a request (which may be
+// NULL) once its connection has closed.
+void free_abandoned_request(struct evhttp_request *request);
@@ -0,0 +1,302 @@
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fnv.h"
+#include "logger.h"
+#include "shard.h"
+
+// Points per worker on the hash ring, for spreading keys evenly
+#define SHARD_VIRTUAL_NODES 64
+
+#define HTTP_BAD_GATEWAY 502
+
+struct ring_point {
+  uint64_t hash;
+  int worker;
+};
+
+// Connection to another worker. A connection carries one request at a time,
+// so there are as many as there are requests forwarded at once.
+struct peer_connection {
+  struct evhttp_connection *connection;
+  bool busy;
+};
+
+struct peer {
+  int port;
+  struct peer_connection **connections;
+  int num_connections;
+  unsigned long forwarded;
+};
+
+struct shards {
+  struct event_base *event_base;
+  char *host;
+  int timeout;
+  char token[SHARD_TOKEN_LENGTH + 1];
+  int worker;
+  int num_workers;
+  struct peer *peers;
+  struct ring_point *ring;
+  int ring_size;
+  shards_fallback_fn fallback;
+  void *userdata;
+
+  unsigned long fallbacks;
+  unsigned long failures;
+  unsigned long abandoned;
+};
+
+// Request being forwarded
+struct forward {
+  struct shards *shards;
+  struct evhttp_request *request;
+  struct peer_connection *connection;
+};
+
+static uint64_t hash_string(const char *str) {
+  uint64_t hash = fnv1a_string(kFnvOffsetBasis, str);
+
+  // FNV-1a alone clusters similar keys, such as URIs differing in their last
+  // characters; finish with a mix so they scatter around the ring
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_ring_points(const void *a, const void *b) {
+  const struct ring_point *pa = a, *pb = b;
+  return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+struct shards *shards_new(struct event_base *event_base,
+                          int num_workers,
+                          int worker,
+                          const char *host,
+                          int base_port,
+                          int timeout,
+                          const char *token,
+                          shards_fallback_fn fallback,
+                          void *userdata) {
+  struct shards *shards = calloc(1, sizeof (struct shards));
+  shards->event_base = event_base;
+  shards->host = strdup(host);
+  shards->timeout = timeout;
+  snprintf(shards->token, sizeof (shards->token), "%s", token);
+  shards->worker = worker;
+  shards->num_workers = num_workers;
+  shards->fallback = fallback;
+  shards->userdata = userdata;
+  shards->peers = calloc(num_workers, sizeof (struct peer));
+  shards->ring_size = num_workers * SHARD_VIRTUAL_NODES;
+  shards->ring = malloc(shards->ring_size * sizeof (struct ring_point));
+
+  for (int i = 0; i < num_workers; i++) {
+    shards->peers[i].port = base_port + i;
+
+    for (int j = 0; j < SHARD_VIRTUAL_NODES; j++) {
+      char point[32];
+      snprintf(point, sizeof (point), "worker:%d:%d", i, j);
+      shards->ring[i * SHARD_VIRTUAL_NODES + j].hash = hash_string(point);
+      shards->ring[i * SHARD_VIRTUAL_NODES + j].worker = i;
+    }
+  }
+
+  qsort(shards->ring, shards->ring_size, sizeof (struct ring_point),
+        &compare_ring_points);
+  return shards;
+}
+
+void shards_free(struct shards *shards) {
+  for (int i = 0; i < shards->num_workers; i++) {
+    struct peer *peer = &shards->peers[i];
+
+    for (int j = 0; j < peer->num_connections; j++) {
+      evhttp_connection_free(peer->connections[j]->connection);
+      free(peer->connections[j]);
+    }
+
+    free(peer->connections);
+  }
+
+  free(shards->peers);
+  free(shards->ring);
+  free(shards->host);
+  free(shards);
+}
+
+int shards_owner(struct shards *shards, const char *key) {
+  uint64_t hash = hash_string(key);
+  int low = 0, high = shards->ring_size;
+
+  // First point at or after the key's hash, wrapping around
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+
+    if (shards->ring[middle].hash < hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return shards->ring[low % shards->ring_size].worker;
+}
+
+static struct peer_connection *peer_connection(struct shards *shards,
+                                               struct peer *peer) {
+  for (int i = 0; i < peer->num_connections; i++) {
+    if (!peer->connections[i]->busy)
+      return peer->connections[i];
+  }
+
+  peer->connections = realloc(peer->connections,
+      (peer->num_connections + 1) * sizeof (struct peer_connection *));
+  struct peer_connection *connection = malloc(sizeof (struct peer_connection));
+  connection->busy = false;
+  connection->connection = evhttp_connection_base_new(
+      shards->event_base, NULL, shards->host, peer->port);
+  evhttp_connection_set_timeout(connection->connection, shards->timeout);
+  peer->connections[peer->num_connections++] = connection;
+  return connection;
+}
+
+// Headers that apply to a single hop
+static bool hop_by_hop_header(const char *key) {
+  return strcasecmp(key, "Connection") == 0 ||
+      strcasecmp(key, "Keep-Alive") == 0 ||
+      strcasecmp(key, "Content-Length") == 0 ||
+      strcasecmp(key, "Transfer-Encoding") == 0 ||
+      strcasecmp(key, "Host") == 0 ||
+      strcasecmp(key, "Server") == 0 ||
+      strcasecmp(key, SHARD_FORWARDED_HEADER) == 0 ||
+      strcasecmp(key, "Date") == 0;
+}
+
+static void copy_headers(struct evkeyvalq *from, struct evkeyvalq *to) {
+  for (struct evkeyval *header = from->tqh_first; header != NULL;
+       header = header->next.tqe_next) {
+    if (!hop_by_hop_header(header->key))
+      evhttp_add_header(to, header->key, header->value);
+  }
+}
+
+static void forward_done(struct evhttp_request *response, void *userdata) {
+  struct forward *forward = userdata;
+  struct shards *shards = forward->shards;
+  struct evhttp_request *request = forward->request;
+  forward->connection->busy = false;
+  free(forward);
+
+  if (evhttp_request_get_connection(request) == NULL) {
+    shards->abandoned++;
+    evhttp_request_free(request);
+    return;
+  }
+
+  if (response == NULL || evhttp_request_get_response_code(response) == 0) {
+    // Reads are safe to repeat here, but changes may or may not have been
+    // made by the other worker
+    if (evhttp_request_get_command(request) == EVHTTP_REQ_GET) {
+      shards->fallbacks++;
+      shards->fallback(request, shards->userdata);
+    } else {
+      shards->failures++;
+      evhttp_send_error(request, HTTP_BAD_GATEWAY, "Bad Gateway");
+    }
+
+    return;
+  }
+
+  copy_headers(evhttp_request_get_input_headers(response),
+               evhttp_request_get_output_headers(request));
+  evhttp_send_reply(request, evhttp_request_get_response_code(response),
+                    evhttp_request_get_response_code_line(response),
+                    evhttp_request_get_input_buffer(response));
+}
+
+bool shards_forwarded(struct shards *shards, struct evhttp_request *request) {
+  const char *token = evhttp_find_header(
+      evhttp_request_get_input_headers(request), SHARD_FORWARDED_HEADER);
+  return token != NULL && strcmp(token, shards->token) == 0;
+}
+
+bool shards_forward(struct shards *shards,
+                    struct evhttp_request *request,
+                    const char *key) {
+  struct evkeyvalq *headers = evhttp_request_get_input_headers(request);
+
+  if (shards_forwarded(shards, request))
+    return false;
+
+  int owner = shards_owner(shards, key);
+
+  if (owner == shards->worker)
+    return false;
+
+  struct peer *peer = &shards->peers[owner];
+  struct forward *forward = malloc(sizeof (struct forward));
+  forward->shards = shards;
+  forward->request = request;
+  forward->connection = peer_connection(shards, peer);
+
+  struct evhttp_request *out = evhttp_request_new(&forward_done, forward);
+  struct evkeyvalq *out_headers = evhttp_request_get_output_headers(out);
+  copy_headers(headers, out_headers);
+  evhttp_add_header(out_headers, "Host", shards->host);
+  evhttp_add_header(out_headers, SHARD_FORWARDED_HEADER, shards->token);
+
+  // The body is copied rather than moved, in case the request has to be
+  // handled here after all
+  struct evbuffer *body = evhttp_request_get_input_buffer(request);
+  size_t length = evbuffer_get_length(body);
+
+  if (length > 0) {
+    evbuffer_add(evhttp_request_get_output_buffer(out),
+                 evbuffer_pullup(body, -1), length);
+  }
+
+  if (evhttp_make_request(forward->connection->connection, out,
+                          evhttp_request_get_command(request),
+                          evhttp_request_get_uri(request)) != 0) {
+    log_warning("Could not forward request to worker %d", owner);
+    free(forward);
+    shards->fallbacks++;
+    return false;
+  }
+
+  forward->connection->busy = true;
+  peer->forwarded++;
+  return true;
+}
+
+json_t *shards_to_json(struct shards *shards, json_t *object) {
+  json_t *workers = json_array();
+
+  for (int i = 0; i < shards->num_workers; i++) {
+    json_t *peer = json_object();
+    json_object_set_new(peer, "port", json_integer(shards->peers[i].port));
+    json_object_set_new(peer, "connections",
+                        json_integer(shards->peers[i].num_connections));
+    json_object_set_new(peer, "forwarded",
+                        json_integer(shards->peers[i].forwarded));
+    json_array_append_new(workers, peer);
+  }
+
+  json_object_set_new(object, "worker", json_integer(shards->worker));
+  json_object_set_new(object, "workers", workers);
+  json_object_set_new(object, "fallbacks", json_integer(shards->fallbacks));
+  json_object_set_new(object, "failures", json_integer(shards->failures));
+  json_object_set_new(object, "abandoned", json_integer(shards->abandoned));
+  return object;
+}
@@ -0,0 +1,48 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+// Header marking requests forwarded from one worker to another, carrying a
+// token shared by the workers so that clients can't pass off their requests
+// as forwarded
+#define SHARD_FORWARDED_HEADER "X-Forwarded-Worker"
+
+// Length of the token
+#define SHARD_TOKEN_LENGTH 32
+
+// Routing of requests between worker processes. Keys (such as playlist URIs)
+// are mapped to workers by consistent hashing, so that each playlist is only
+// loaded by one of them, and requests for keys owned by other workers are
+// forwarded to them over their internal ports.
+struct shards;
+
+// Called with requests that couldn't be forwarded, to be handled locally
+typedef void (*shards_fallback_fn)(struct evhttp_request *, void *userdata);
+
+struct shards *shards_new(struct event_base *event_base,
+                          int num_workers,
+                          int worker,
+                          const char *host,
+                          int base_port,
+                          int timeout,
+                          const char *token,
+                          shards_fallback_fn fallback,
+                          void *userdata);
+
+void shards_free(struct shards *);
+
+// Returns the worker owning a key
+int shards_owner(struct shards *, const char *key);
+
+// Returns true if a request has been forwarded from another worker
+bool shards_forwarded(struct shards *, struct evhttp_request *request);
+
+// Forwards a request to the worker owning a key, unless it's this worker or
+// the request has already been forwarded. Returns true if the request was
+// forwarded, and will be responded to.
+bool shards_forward(struct shards *,
+                    struct evhttp_request *request,
+                    const char *key);
+
+json_t *shards_to_json(struct shards *, json_t *object);
+
+#endif
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "fnv.h"
+#include "logger.h"
+#include "shmcache.h"
+
+#define SHMCACHE_KEY_LENGTH 511
+
+// Slots a key may be stored in, per size class
+#define SHMCACHE_WAYS 4
+
+// Sizes of slots (headers included), each size getting an equal share of the
+// memory
+static const size_t kSlotSizes[] = { 8 << 10, 32 << 10, 128 << 10, 512 << 10 };
+#define SHMCACHE_NUM_CLASSES (sizeof (kSlotSizes) / sizeof (kSlotSizes[0]))
+
+struct shmcache_slot {
+  pthread_mutex_t mutex;  // Robust, so that a crashed worker can't wedge it
+  uint64_t hash;  // Read without the lock, as a hint
+  time_t stored;
+  time_t expires;  // 0 for an empty slot
+  size_t length;
+  char key[SHMCACHE_KEY_LENGTH + 1];
+  char tag[SHMCACHE_TAG_LENGTH + 1];
+  char body[];
+};
+
+// Counters, in shared memory along with the slots
+struct shmcache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long evictions;
+  unsigned long removals;
+  unsigned long too_large;
+};
+
+struct shmcache_class {
+  char *slots;
+  size_t slot_size;
+  size_t num_sets;
+};
+
+struct shmcache {
+  void *memory;
+  size_t size;
+  struct shmcache_stats *stats;
+  struct shmcache_class classes[SHMCACHE_NUM_CLASSES];
+};
+
+static uint64_t hash_key(const char *key) {
+  return fnv1a_string(kFnvOffsetBasis, key);
+}
+
+#define STAT_INCREMENT(cache, stat) \
+  __sync_fetch_and_add(&(cache)->stats->stat, 1)
+
+struct shmcache *shmcache_new(size_t max_bytes) {
+  size_t size = sizeof (struct shmcache_stats);
+  size_t class_bytes = max_bytes / SHMCACHE_NUM_CLASSES;
+  struct shmcache *cache = calloc(1, sizeof (struct shmcache));
+
+  for (size_t c = 0; c < SHMCACHE_NUM_CLASSES; c++) {
+    cache->classes[c].slot_size = kSlotSizes[c];
+    cache->classes[c].num_sets = class_bytes / kSlotSizes[c] / SHMCACHE_WAYS;
+    size += cache->classes[c].num_sets * SHMCACHE_WAYS * kSlotSizes[c];
+  }
+
+  // Shared anonymous memory is zeroed, and inherited by forked workers
+  cache->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (cache->memory == MAP_FAILED) {
+    log_crit("Could not map %zu bytes of shared memory: %s", size,
+             strerror(errno));
+    free(cache);
+    return NULL;
+  }
+
+  cache->size = size;
+  cache->stats = cache->memory;
+  char *slots = (char *) cache->memory + sizeof (struct shmcache_stats);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+  for (size_t c = 0; c < SHMCACHE_NUM_CLASSES; c++) {
+    struct shmcache_class *class = &cache->classes[c];
+    class->slots = slots;
+
+    for (size_t i = 0; i < class->num_sets * SHMCACHE_WAYS; i++) {
+      struct shmcache_slot *slot =
+          (struct shmcache_slot *) (slots + i * class->slot_size);
+      pthread_mutex_init(&slot->mutex, &attr);
+    }
+
+    slots += class->num_sets * SHMCACHE_WAYS * class->slot_size;
+  }
+
+  pthread_mutexattr_destroy(&attr);
+  return cache;
+}
+
+void shmcache_free(struct shmcache *cache) {
+  munmap(cache->memory, cache->size);
+  free(cache);
+}
+
+static struct shmcache_slot *class_slot(struct shmcache_class *class,
+                                        uint64_t hash,
+                                        int way) {
+  size_t set = hash % class->num_sets;
+  return (struct shmcache_slot *) (class->slots +
+      (set * SHMCACHE_WAYS + way) * class->slot_size);
+}
+
+// Empties a slot left locked by a worker that died while writing it
+static void slot_lock(struct shmcache_slot *slot) {
+  if (pthread_mutex_lock(&slot->mutex) == EOWNERDEAD) {
+    slot->expires = 0;
+    __sync_lock_test_and_set(&slot->hash, 0);
+    pthread_mutex_consistent(&slot->mutex);
+  }
+}
+
+static void slot_unlock(struct shmcache_slot *slot) {
+  pthread_mutex_unlock(&slot->mutex);
+}
+
+static bool slot_matches(struct shmcache_slot *slot,
+                         uint64_t hash,
+                         const char *key) {
+  return slot->expires != 0 && slot->hash == hash &&
+      strcmp(slot->key, key) == 0;
+}
+
+// Calls back with each slot (locked) that holds a key, until told to stop
+static void find_slots(struct shmcache *cache,
+                       const char *key,
+                       bool (*callback)(struct shmcache_slot *, void *),
+                       void *userdata) {
+  uint64_t hash = hash_key(key);
+
+  for (size_t c = 0; c < SHMCACHE_NUM_CLASSES; c++) {
+    struct shmcache_class *class = &cache->classes[c];
+
+    if (class->num_sets == 0)
+      continue;
+
+    for (int way = 0; way < SHMCACHE_WAYS; way++) {
+      struct shmcache_slot *slot = class_slot(class, hash, way);
+
+      if (__sync_fetch_and_add(&slot->hash, 0) != hash)
+        continue;
+
+      slot_lock(slot);
+      bool more = true;
+
+      if (slot_matches(slot, hash, key))
+        more = callback(slot, userdata);
+
+      slot_unlock(slot);
+
+      if (!more)
+        return;
+    }
+  }
+}
+
+static bool empty_slot(struct shmcache_slot *slot, void *userdata) {
+  slot->expires = 0;
+  __sync_lock_test_and_set(&slot->hash, 0);
+  return true;
+}
+
+// Returns a slot (locked) of a class that a key may be stored in: an empty
+// or expired one, or else (when told to evict) the oldest. Returns NULL if
+// there is no such slot.
+static struct shmcache_slot *choose_slot(struct shmcache_class *class,
+                                         uint64_t hash,
+                                         time_t now,
+                                         bool evict) {
+  struct shmcache_slot *victim = NULL;
+
+  for (int way = 0; way < SHMCACHE_WAYS; way++) {
+    struct shmcache_slot *slot = class_slot(class, hash, way);
+    slot_lock(slot);
+
+    if (slot->expires <= now) {
+      if (victim != NULL)
+        slot_unlock(victim);
+
+      return slot;
+    }
+
+    if (evict && (victim == NULL || slot->stored < victim->stored)) {
+      if (victim != NULL)
+        slot_unlock(victim);
+
+      victim = slot;
+    } else {
+      slot_unlock(slot);
+    }
+  }
+
+  return victim;
+}
+
+void shmcache_put(struct shmcache *cache,
+                  const char *key,
+                  const char *body,
+                  size_t length,
+                  const char *tag,
+                  int ttl) {
+  size_t header = sizeof (struct shmcache_slot);
+  size_t smallest = 0;
+
+  while (smallest < SHMCACHE_NUM_CLASSES &&
+         (cache->classes[smallest].num_sets == 0 ||
+          header + length > cache->classes[smallest].slot_size)) {
+    smallest++;
+  }
+
+  if (smallest == SHMCACHE_NUM_CLASSES || strlen(key) > SHMCACHE_KEY_LENGTH ||
+      (tag != NULL && strlen(tag) > SHMCACHE_TAG_LENGTH)) {
+    STAT_INCREMENT(cache, too_large);
+    shmcache_remove(cache, key);
+    return;
+  }
+
+  // An older response may be in another size class
+  find_slots(cache, key, &empty_slot, NULL);
+
+  uint64_t hash = hash_key(key);
+  time_t now = time(NULL);
+  struct shmcache_slot *victim = NULL;
+
+  // Responses go in free slots of larger sizes before replacing others
+  for (size_t c = smallest; c < SHMCACHE_NUM_CLASSES && victim == NULL; c++) {
+    if (cache->classes[c].num_sets > 0)
+      victim = choose_slot(&cache->classes[c], hash, now, false);
+  }
+
+  if (victim == NULL) {
+    victim = choose_slot(&cache->classes[smallest], hash, now, true);
+    STAT_INCREMENT(cache, evictions);
+  }
+
+  victim->stored = now;
+  victim->expires = now + ttl;
+  victim->length = length;
+  strcpy(victim->key, key);
+  strcpy(victim->tag, tag != NULL ? tag : "");
+  memcpy(victim->body, body, length);
+  __sync_lock_test_and_set(&victim->hash, hash);
+  slot_unlock(victim);
+  STAT_INCREMENT(cache, stores);
+}
+
+struct slot_copy {
+  struct evbuffer *buf;
+  char *tag;
+  bool found;
+};
+
+static bool copy_slot(struct shmcache_slot *slot, void *userdata) {
+  struct slot_copy *copy = userdata;
+
+  if (slot->expires <= time(NULL))
+    return true;
+
+  evbuffer_add(copy->buf, slot->body, slot->length);
+  strcpy(copy->tag, slot->tag);
+  copy->found = true;
+  return false;
+}
+
+bool shmcache_get(struct shmcache *cache,
+                  const char *key,
+                  struct evbuffer *buf,
+                  char tag[SHMCACHE_TAG_LENGTH + 1]) {
+  struct slot_copy copy = { buf, tag, false };
+  find_slots(cache, key, &copy_slot, &copy);
+
+  if (copy.found) {
+    STAT_INCREMENT(cache, hits);
+  } else {
+    STAT_INCREMENT(cache, misses);
+  }
+
+  return copy.found;
+}
+
+static bool remove_slot(struct shmcache_slot *slot, void *userdata) {
+  bool *removed = userdata;
+  *removed = true;
+  return empty_slot(slot, NULL);
+}
+
+void shmcache_remove(struct shmcache *cache, const char *key) {
+  bool removed = false;
+  find_slots(cache, key, &remove_slot, &removed);
+
+  if (removed)
+    STAT_INCREMENT(cache, removals);
+}
+
+json_t *shmcache_to_json(struct shmcache *cache, json_t *object) {
+  struct shmcache_stats *stats = cache->stats;
+  size_t slots = 0;
+
+  for (size_t c = 0; c < SHMCACHE_NUM_CLASSES; c++)
+    slots += cache->classes[c].num_sets * SHMCACHE_WAYS;
+
+  json_object_set_new(object, "bytes", json_integer(cache->size));
+  json_object_set_new(object, "slots", json_integer(slots));
+  json_object_set_new(object, "hits", json_integer(stats->hits));
+  json_object_set_new(object, "misses", json_integer(stats->misses));
+  json_object_set_new(object, "stores", json_integer(stats->stores));
+  json_object_set_new(object, "evictions", json_integer(stats->evictions));
+  json_object_set_new(object, "removals", json_integer(stats->removals));
+  json_object_set_new(object, "tooLarge", json_integer(stats->too_large));
+  return object;
+}
@@ -0,0 +1,40 @@
+#ifndef SHMCACHE_H_
+#define SHMCACHE_H_
+
+// Maximum length of the tag stored along with a response
+#define SHMCACHE_TAG_LENGTH 31
+
+// Serialized responses in memory shared between worker processes, so that
+// any worker can serve what another has serialized. Created before the
+// workers are forked. Responses are kept in slots of a few sizes, going
+// into a free slot of a size they fit, or else replacing the oldest of the
+// slots of the smallest such size they may go in.
+struct shmcache;
+
+// Returns NULL if the memory couldn't be mapped
+struct shmcache *shmcache_new(size_t max_bytes);
+
+void shmcache_free(struct shmcache *);
+
+// Stores a response under a key for ttl seconds, along with a tag (such as
+// an ETag) that may be NULL
+void shmcache_put(struct shmcache *,
+                  const char *key,
+                  const char *body,
+                  size_t length,
+                  const char *tag,
+                  int ttl);
+
+// Appends the response stored under a key to buf, and copies its tag (or an
+// empty string) to tag. Returns false if there is no such response, or it
+// has expired.
+bool shmcache_get(struct shmcache *,
+                  const char *key,
+                  struct evbuffer *buf,
+                  char tag[SHMCACHE_TAG_LENGTH + 1]);
+
+void shmcache_remove(struct shmcache *, const char *key);
+
+json_t *shmcache_to_json(struct shmcache *, json_t *object);
+
+#endif
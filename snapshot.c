@@ -0,0 +1,656 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "logger.h"
+#include "snapshot.h"
+#include "trackid.h"
+
+// The file starts with this, followed by records. Records are only ever
+// appended; the last record for a URI wins. Numbers are in host byte order:
+// the file is a local cache, like libspotify's own.
+static const char kSnapshotFileMagic[8] = "SPSNAP1\n";
+
+#define SNAPSHOT_RECORD_MAGIC 0x736e6170  // "snap"
+
+// Record flags
+#define SNAPSHOT_COLLABORATIVE 0x1
+#define SNAPSHOT_HAS_DESCRIPTION 0x2
+#define SNAPSHOT_TRACK_URIS 0x4  // Tracks are URIs, not 16-byte IDs
+
+// Seconds to wait after a change before writing a snapshot, so that a burst
+// of changes results in a single record
+static const int kSnapshotFlushDelay = 1;
+
+// Files smaller than this aren't compacted, however much of them is stale
+static const size_t kSnapshotCompactThreshold = 1 << 20;
+
+// Records are 8-byte aligned. After the header come the URI, title, creator
+// and description (NUL-terminated), padding, and then the tracks.
+struct snapshot_record {
+  uint32_t magic;
+  uint32_t length;  // Including header and padding
+  int64_t written;
+  uint32_t checksum;  // FNV-1a of the rest of the record, after this field
+  uint32_t flags;
+  uint32_t num_tracks;
+  uint32_t num_subscribers;
+  uint32_t uri_length;  // String lengths exclude NUL
+  uint32_t title_length;
+  uint32_t creator_length;
+  uint32_t description_length;
+};
+
+// Latest record for a playlist URI
+struct snapshot_entry {
+  char *uri;
+  size_t offset;
+};
+
+// Playlist with changes that haven't been written yet
+struct snapshot_dirty {
+  sp_playlist *playlist;
+};
+
+struct snapshot_store {
+  char *path;
+  int fd;
+  size_t file_size;
+  const unsigned char *map;
+  size_t map_size;
+
+  apr_hash_t *index;  // URI -> struct snapshot_entry
+  apr_hash_t *dirty;  // sp_playlist -> struct snapshot_dirty
+  struct event *flush_timer;
+};
+
+static uint32_t fnv1a(const unsigned char *data, size_t length) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static size_t align8(size_t n) {
+  return (n + 7) & ~(size_t) 7;
+}
+
+static const size_t kChecksumOffset =
+    offsetof(struct snapshot_record, checksum) + sizeof (uint32_t);
+
+static uint32_t record_checksum(const struct snapshot_record *record) {
+  const unsigned char *bytes = (const unsigned char *) record;
+  return fnv1a(bytes + kChecksumOffset, record->length - kChecksumOffset);
+}
+
+static const char *record_uri(const struct snapshot_record *record) {
+  return (const char *) (record + 1);
+}
+
+static bool record_is_valid(const unsigned char *data, size_t available) {
+  const struct snapshot_record *record = (const struct snapshot_record *) data;
+
+  if (available < sizeof (struct snapshot_record) ||
+      record->magic != SNAPSHOT_RECORD_MAGIC ||
+      record->length < sizeof (struct snapshot_record) ||
+      record->length % 8 != 0 ||
+      record->length > available)
+    return false;
+
+  size_t strings_length = (size_t) record->uri_length + record->title_length +
+                          record->creator_length +
+                          record->description_length + 4;
+
+  if (sizeof (struct snapshot_record) + strings_length > record->length)
+    return false;
+
+  return record_checksum(record) == record->checksum;
+}
+
+static void snapshot_store_unmap(struct snapshot_store *store) {
+  if (store->map != NULL)
+    munmap((void *) store->map, store->map_size);
+
+  store->map = NULL;
+  store->map_size = 0;
+}
+
+static bool snapshot_store_remap(struct snapshot_store *store) {
+  if (store->map != NULL && store->map_size == store->file_size)
+    return true;
+
+  snapshot_store_unmap(store);
+  void *map = mmap(NULL, store->file_size, PROT_READ, MAP_SHARED, store->fd,
+                   0);
+
+  if (map == MAP_FAILED) {
+    log_warning("Could not map snapshot file %s", store->path);
+    return false;
+  }
+
+  store->map = map;
+  store->map_size = store->file_size;
+  return true;
+}
+
+static void snapshot_store_index_set(struct snapshot_store *store,
+                                     const char *uri,
+                                     size_t offset) {
+  struct snapshot_entry *entry = apr_hash_get(store->index, uri,
+                                              APR_HASH_KEY_STRING);
+
+  if (entry == NULL) {
+    entry = malloc(sizeof (struct snapshot_entry));
+    entry->uri = strdup(uri);
+    apr_hash_set(store->index, entry->uri, APR_HASH_KEY_STRING, entry);
+  }
+
+  entry->offset = offset;
+}
+
+static bool write_fully(int fd, const void *data, size_t length) {
+  const unsigned char *bytes = data;
+
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+
+    if (written < 0)
+      return false;
+
+    bytes += written;
+    length -= written;
+  }
+
+  return true;
+}
+
+// Reads all valid records into the index, dropping a torn tail (from a crash
+// in the middle of a write). Returns the number of live bytes.
+static size_t snapshot_store_scan(struct snapshot_store *store) {
+  size_t offset = sizeof (kSnapshotFileMagic);
+
+  while (offset < store->file_size &&
+         record_is_valid(store->map + offset, store->file_size - offset)) {
+    const struct snapshot_record *record =
+        (const struct snapshot_record *) (store->map + offset);
+    snapshot_store_index_set(store, record_uri(record), offset);
+    offset += record->length;
+  }
+
+  if (offset < store->file_size) {
+    log_warning("Truncating snapshot file %s at %zu bytes (was %zu)",
+                store->path, offset, store->file_size);
+
+    if (ftruncate(store->fd, offset) == 0)
+      store->file_size = offset;
+  }
+
+  size_t live = 0;
+
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, store->index); hi;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct snapshot_entry *entry = value;
+    const struct snapshot_record *record =
+        (const struct snapshot_record *) (store->map + entry->offset);
+    live += record->length;
+  }
+
+  return live;
+}
+
+// Rewrites the file with only the latest record of each playlist
+static bool snapshot_store_compact(struct snapshot_store *store) {
+  size_t tmp_path_length = strlen(store->path) + 5;
+  char *tmp_path = malloc(tmp_path_length);
+  snprintf(tmp_path, tmp_path_length, "%s.tmp", store->path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd == -1) {
+    free(tmp_path);
+    return false;
+  }
+
+  bool ok = write_fully(fd, kSnapshotFileMagic, sizeof (kSnapshotFileMagic));
+
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, store->index); ok && hi;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct snapshot_entry *entry = value;
+    const struct snapshot_record *record =
+        (const struct snapshot_record *) (store->map + entry->offset);
+    ok = write_fully(fd, record, record->length);
+  }
+
+  if (!ok || fsync(fd) != 0 || rename(tmp_path, store->path) != 0) {
+    log_warning("Could not compact snapshot file %s", store->path);
+    close(fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return false;
+  }
+
+  free(tmp_path);
+
+  // Records were written in iteration order
+  size_t offset = sizeof (kSnapshotFileMagic);
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, store->index); hi;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct snapshot_entry *entry = value;
+    const struct snapshot_record *record =
+        (const struct snapshot_record *) (store->map + entry->offset);
+    entry->offset = offset;
+    offset += record->length;
+  }
+
+  snapshot_store_unmap(store);
+  close(store->fd);
+  store->fd = fd;
+  store->file_size = offset;
+  return snapshot_store_remap(store);
+}
+
+static void snapshot_store_flush(evutil_socket_t socket,
+                                 short what,
+                                 void *userdata);
+
+struct snapshot_store *snapshot_store_open(const char *path,
+                                           struct event_base *event_base,
+                                           apr_pool_t *pool) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1) {
+    log_warning("Could not open snapshot file %s", path);
+    return NULL;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  if (st.st_size == 0) {
+    if (!write_fully(fd, kSnapshotFileMagic, sizeof (kSnapshotFileMagic))) {
+      close(fd);
+      return NULL;
+    }
+
+    st.st_size = sizeof (kSnapshotFileMagic);
+  }
+
+  struct snapshot_store *store = calloc(1, sizeof (struct snapshot_store));
+  store->path = strdup(path);
+  store->fd = fd;
+  store->file_size = st.st_size;
+  store->index = apr_hash_make(pool);
+  store->dirty = apr_hash_make(pool);
+  store->flush_timer = evtimer_new(event_base, &snapshot_store_flush, store);
+
+  if (!snapshot_store_remap(store) ||
+      store->file_size < sizeof (kSnapshotFileMagic) ||
+      memcmp(store->map, kSnapshotFileMagic,
+             sizeof (kSnapshotFileMagic)) != 0) {
+    log_warning("%s is not a snapshot file", path);
+    snapshot_store_close(store);
+    return NULL;
+  }
+
+  size_t live = snapshot_store_scan(store);
+
+  if (store->file_size > kSnapshotCompactThreshold &&
+      store->file_size > 2 * live)
+    snapshot_store_compact(store);
+
+  log_debug("Opened snapshot file %s with %u playlists", path,
+            apr_hash_count(store->index));
+  return store;
+}
+
+static void evbuffer_add_string(struct evbuffer *buf,
+                                const char *s,
+                                uint32_t *length) {
+  *length = strlen(s);
+  evbuffer_add(buf, s, *length + 1);
+}
+
+static void evbuffer_add_padding(struct evbuffer *buf) {
+  static const char zeros[8] = { 0 };
+  size_t length = evbuffer_get_length(buf);
+  evbuffer_add(buf, zeros, align8(length) - length);
+}
+
+// Serializes a loaded playlist into a record, ready to be appended
+static struct evbuffer *snapshot_record_create(sp_playlist *playlist) {
+  sp_link *link = sp_link_create_from_playlist(playlist);
+
+  if (link == NULL)
+    return NULL;
+
+  char uri[kPlaylistLinkLength];
+  sp_link_as_string(link, uri, kPlaylistLinkLength);
+  sp_link_release(link);
+
+  struct snapshot_record record = {
+    .magic = SNAPSHOT_RECORD_MAGIC,
+    .written = time(NULL),
+    .num_tracks = sp_playlist_num_tracks(playlist),
+    .num_subscribers = sp_playlist_num_subscribers(playlist)
+  };
+
+  if (sp_playlist_is_collaborative(playlist))
+    record.flags |= SNAPSHOT_COLLABORATIVE;
+
+  struct evbuffer *buf = evbuffer_new();
+  evbuffer_add(buf, &record, sizeof (record));
+  evbuffer_add_string(buf, uri, &record.uri_length);
+  evbuffer_add_string(buf, sp_playlist_name(playlist), &record.title_length);
+
+  sp_user *owner = sp_playlist_owner(playlist);
+  evbuffer_add_string(buf, sp_user_display_name(owner),
+                      &record.creator_length);
+  sp_user_release(owner);
+
+  const char *description = sp_playlist_get_description(playlist);
+
+  if (description != NULL)
+    record.flags |= SNAPSHOT_HAS_DESCRIPTION;
+
+  evbuffer_add_string(buf, description != NULL ? description : "",
+                      &record.description_length);
+  evbuffer_add_padding(buf);
+  size_t tracks_offset = evbuffer_get_length(buf);
+
+  // Use raw IDs unless some track (e.g. a local one) doesn't have one
+  char track_uri[kTrackLinkLength];
+  unsigned char id[TRACK_ID_LENGTH];
+
+  for (uint32_t i = 0; i < record.num_tracks; i++) {
+    track_to_uri(sp_playlist_track(playlist, i), track_uri, kTrackLinkLength);
+
+    if (!track_id_from_uri(track_uri, id)) {
+      record.flags |= SNAPSHOT_TRACK_URIS;
+      break;
+    }
+
+    evbuffer_add(buf, id, TRACK_ID_LENGTH);
+  }
+
+  if (record.flags & SNAPSHOT_TRACK_URIS) {
+    struct evbuffer *head = evbuffer_new();
+    evbuffer_remove_buffer(buf, head, tracks_offset);
+    evbuffer_free(buf);
+    buf = head;
+
+    for (uint32_t i = 0; i < record.num_tracks; i++) {
+      track_to_uri(sp_playlist_track(playlist, i), track_uri,
+                   kTrackLinkLength);
+      evbuffer_add(buf, track_uri, strlen(track_uri) + 1);
+    }
+
+    evbuffer_add_padding(buf);
+  }
+
+  // Fill in lengths and checksum now that the whole record is known
+  record.length = evbuffer_get_length(buf);
+  struct snapshot_record *header =
+      (struct snapshot_record *) evbuffer_pullup(buf, -1);
+  record.checksum = 0;
+  memcpy(header, &record, sizeof (record));
+  header->checksum = record_checksum(header);
+  return buf;
+}
+
+// Whether two records are equal apart from when they were written
+static bool record_equals(const struct snapshot_record *a,
+                          const struct snapshot_record *b) {
+  return a->length == b->length &&
+         a->checksum == b->checksum &&
+         memcmp((const unsigned char *) a + kChecksumOffset,
+                (const unsigned char *) b + kChecksumOffset,
+                a->length - kChecksumOffset) == 0;
+}
+
+static void snapshot_store_write(struct snapshot_store *store,
+                                 sp_playlist *playlist) {
+  if (!sp_playlist_is_loaded(playlist))
+    return;
+
+  struct evbuffer *buf = snapshot_record_create(playlist);
+
+  if (buf == NULL)
+    return;
+
+  const struct snapshot_record *record =
+      (const struct snapshot_record *) evbuffer_pullup(buf, -1);
+  struct snapshot_entry *entry = apr_hash_get(store->index,
+                                              record_uri(record),
+                                              APR_HASH_KEY_STRING);
+
+  // Skip writing what's already there, e.g. for playlists that didn't change
+  // while the server was down
+  if (entry != NULL && snapshot_store_remap(store) &&
+      record_equals(record, (const struct snapshot_record *)
+                                (store->map + entry->offset))) {
+    evbuffer_free(buf);
+    return;
+  }
+
+  size_t offset = store->file_size;
+
+  if (lseek(store->fd, offset, SEEK_SET) == (off_t) -1 ||
+      !write_fully(store->fd, record, record->length)) {
+    log_warning("Could not write to snapshot file %s", store->path);
+
+    if (ftruncate(store->fd, offset) != 0)
+      log_warning("Could not truncate snapshot file %s", store->path);
+  } else {
+    store->file_size += record->length;
+    snapshot_store_index_set(store, record_uri(record), offset);
+  }
+
+  evbuffer_free(buf);
+}
+
+static void snapshot_store_flush(evutil_socket_t socket,
+                                 short what,
+                                 void *userdata) {
+  struct snapshot_store *store = userdata;
+
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, store->dirty); hi;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct snapshot_dirty *dirty = value;
+    snapshot_store_write(store, dirty->playlist);
+    free(dirty);
+  }
+
+  apr_hash_clear(store->dirty);
+}
+
+static void snapshot_mark_dirty(sp_playlist *playlist, void *userdata) {
+  struct snapshot_store *store = userdata;
+
+  if (apr_hash_get(store->dirty, &playlist, sizeof (playlist)) == NULL) {
+    struct snapshot_dirty *dirty = malloc(sizeof (struct snapshot_dirty));
+    dirty->playlist = playlist;
+    apr_hash_set(store->dirty, &dirty->playlist, sizeof (playlist), dirty);
+  }
+
+  if (!evtimer_pending(store->flush_timer, NULL)) {
+    struct timeval delay = { kSnapshotFlushDelay, 0 };
+    evtimer_add(store->flush_timer, &delay);
+  }
+}
+
+static void snapshot_tracks_added(sp_playlist *playlist,
+                                  sp_track *const *tracks,
+                                  int num_tracks,
+                                  int position,
+                                  void *userdata) {
+  snapshot_mark_dirty(playlist, userdata);
+}
+
+static void snapshot_tracks_removed(sp_playlist *playlist,
+                                    const int *tracks,
+                                    int num_tracks,
+                                    void *userdata) {
+  snapshot_mark_dirty(playlist, userdata);
+}
+
+static void snapshot_tracks_moved(sp_playlist *playlist,
+                                  const int *tracks,
+                                  int num_tracks,
+                                  int new_position,
+                                  void *userdata) {
+  snapshot_mark_dirty(playlist, userdata);
+}
+
+static void snapshot_description_changed(sp_playlist *playlist,
+                                         const char *description,
+                                         void *userdata) {
+  snapshot_mark_dirty(playlist, userdata);
+}
+
+// Callbacks for changes that end up in a snapshot
+static sp_playlist_callbacks snapshot_playlist_callbacks = {
+  .tracks_added = &snapshot_tracks_added,
+  .tracks_removed = &snapshot_tracks_removed,
+  .tracks_moved = &snapshot_tracks_moved,
+  .playlist_renamed = &snapshot_mark_dirty,
+  .playlist_state_changed = &snapshot_mark_dirty,
+  .description_changed = &snapshot_description_changed,
+  .subscribers_changed = &snapshot_mark_dirty
+};
+
+void snapshot_store_watch(struct snapshot_store *store,
+                          sp_playlist *playlist) {
+  sp_playlist_add_callbacks(playlist, &snapshot_playlist_callbacks, store);
+
+  // Refresh the snapshot of already loaded playlists (unchanged ones aren't
+  // written again)
+  if (sp_playlist_is_loaded(playlist))
+    snapshot_mark_dirty(playlist, store);
+}
+
+void snapshot_store_unwatch(struct snapshot_store *store,
+                            sp_playlist *playlist) {
+  sp_playlist_remove_callbacks(playlist, &snapshot_playlist_callbacks, store);
+  struct snapshot_dirty *dirty = apr_hash_get(store->dirty, &playlist,
+                                              sizeof (playlist));
+
+  if (dirty != NULL) {
+    apr_hash_set(store->dirty, &playlist, sizeof (playlist), NULL);
+    snapshot_store_write(store, playlist);
+    free(dirty);
+  }
+}
+
+void snapshot_store_close(struct snapshot_store *store) {
+  snapshot_store_flush(-1, 0, store);
+  event_free(store->flush_timer);
+
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, store->index); hi;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct snapshot_entry *entry = value;
+    free(entry->uri);
+    free(entry);
+  }
+
+  snapshot_store_unmap(store);
+  close(store->fd);
+  free(store->path);
+  free(store);
+}
+
+json_t *snapshot_store_playlist_to_json(struct snapshot_store *store,
+                                        const char *uri,
+                                        json_t *object,
+                                        time_t *written) {
+  struct snapshot_entry *entry = apr_hash_get(store->index, uri,
+                                              APR_HASH_KEY_STRING);
+
+  if (entry == NULL || !snapshot_store_remap(store))
+    return NULL;
+
+  const unsigned char *data = store->map + entry->offset;
+  const struct snapshot_record *record = (const struct snapshot_record *) data;
+  const unsigned char *end = data + record->length;
+  const char *title = record_uri(record) + record->uri_length + 1;
+  const char *creator = title + record->title_length + 1;
+  const char *description = creator + record->creator_length + 1;
+  const unsigned char *tracks_data =
+      data + align8(sizeof (struct snapshot_record) + record->uri_length +
+                    record->title_length + record->creator_length +
+                    record->description_length + 4);
+
+  // Same shape as playlist_to_json
+  json_object_set_new_nocheck(object, "creator", json_string_nocheck(creator));
+  json_object_set_new(object, "uri", json_string_nocheck(record_uri(record)));
+  json_object_set_new(object, "title", json_string_nocheck(title));
+  json_object_set_new(object, "collaborative",
+      record->flags & SNAPSHOT_COLLABORATIVE ? json_true() : json_false());
+
+  if (record->flags & SNAPSHOT_HAS_DESCRIPTION) {
+    json_object_set_new(object, "description",
+                        json_string_nocheck(description));
+  }
+
+  json_object_set_new(object, "subscriberCount",
+                      json_integer(record->num_subscribers));
+
+  json_t *tracks = json_array();
+  json_object_set_new(object, "tracks", tracks);
+  char track_uri[kTrackLinkLength];
+
+  for (uint32_t i = 0; i < record->num_tracks; i++) {
+    if (record->flags & SNAPSHOT_TRACK_URIS) {
+      const unsigned char *nul = memchr(tracks_data, '\0', end - tracks_data);
+
+      if (nul == NULL)
+        break;
+
+      json_array_append_new(tracks,
+                            json_string_nocheck((const char *) tracks_data));
+      tracks_data = nul + 1;
+    } else {
+      if (tracks_data + TRACK_ID_LENGTH > end)
+        break;
+
+      track_id_to_uri(tracks_data, track_uri, kTrackLinkLength);
+      json_array_append_new(tracks, json_string_nocheck(track_uri));
+      tracks_data += TRACK_ID_LENGTH;
+    }
+  }
+
+  if (written != NULL)
+    *written = record->written;
+
+  return object;
+}
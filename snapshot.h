@@ -0,0 +1,31 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+// Append-only file of playlist snapshots (metadata and track IDs), memory
+// mapped for reading. Lets playlists be served right after a restart, before
+// libspotify has loaded them.
+struct snapshot_store;
+
+// Opens (or creates) a snapshot file. Returns NULL on error.
+struct snapshot_store *snapshot_store_open(const char *path,
+                                           struct event_base *event_base,
+                                           apr_pool_t *pool);
+
+// Writes pending snapshots and closes the file
+void snapshot_store_close(struct snapshot_store *);
+
+// Starts following changes to a playlist, writing a new snapshot of it
+// shortly after it has changed
+void snapshot_store_watch(struct snapshot_store *, sp_playlist *);
+
+// Stops following changes to a playlist, writing any pending snapshot first
+void snapshot_store_unwatch(struct snapshot_store *, sp_playlist *);
+
+// Fills a playlist JSON object from the latest snapshot of a playlist URI.
+// Returns NULL if there's no snapshot; sets `written` to when it was taken.
+json_t *snapshot_store_playlist_to_json(struct snapshot_store *,
+                                        const char *uri,
+                                        json_t *object,
+                                        time_t *written);
+
+#endif
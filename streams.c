@@ -0,0 +1,471 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "constants.h"
+#include "json.h"
+#include "residency.h"
+#include "server.h"
+#include "streams.h"
+#include "trackid.h"
+
+// Events kept per playlist for clients resuming a stream
+#define STREAM_BACKLOG_EVENTS 256
+
+// A serialized event, shared by the backlog and the output buffers of all
+// subscribers until it has been sent to them
+struct stream_event {
+  int refs;
+  unsigned long long id;
+  size_t length;
+  char data[];
+};
+
+struct subscriber {
+  struct channel *channel;
+  struct evhttp_request *request;
+  TAILQ_ENTRY(subscriber) entries;
+};
+
+TAILQ_HEAD(subscriber_list, subscriber);
+
+// Subscribers to a playlist
+struct channel {
+  struct playlist_streams *streams;
+  sp_playlist *playlist;  // Also the hash key
+  struct subscriber_list subscribers;
+  int num_subscribers;
+
+  // Events with IDs after start_id and dropped_id are in the backlog
+  unsigned long long start_id;
+  unsigned long long dropped_id;
+  struct stream_event *backlog[STREAM_BACKLOG_EVENTS];
+  int backlog_start;
+  int backlog_length;
+
+  // Keeps the channel around for a while after the last subscriber has left,
+  // so that clients can reconnect without missing events
+  struct event *linger;
+};
+
+struct playlist_streams {
+  struct event_base *event_base;
+  struct residency *residency;
+  apr_hash_t *channels;
+  struct event *heartbeat;
+  struct evbuffer *scratch;
+  unsigned long long last_id;
+
+  unsigned long num_channels;
+  unsigned long num_subscribers;
+  unsigned long events;
+  unsigned long resumes;
+  unsigned long resets;
+  unsigned long slow_subscribers;
+};
+
+static const char kStreamHeartbeat[] = ":\n\n";
+
+static void stream_event_unref(struct stream_event *event) {
+  if (--event->refs == 0)
+    free(event);
+}
+
+static void stream_event_cleanup(const void *data,
+                                 size_t length,
+                                 void *userdata) {
+  stream_event_unref(userdata);
+}
+
+static void stream_heartbeat(evutil_socket_t socket,
+                             short what,
+                             void *userdata);
+
+struct playlist_streams *playlist_streams_new(struct event_base *event_base,
+                                              struct residency *residency,
+                                              apr_pool_t *pool) {
+  struct playlist_streams *streams = calloc(1,
+      sizeof (struct playlist_streams));
+  streams->event_base = event_base;
+  streams->residency = residency;
+  streams->channels = apr_hash_make(pool);
+  streams->scratch = evbuffer_new();
+  streams->heartbeat = event_new(event_base, -1, EV_PERSIST,
+                                 &stream_heartbeat, streams);
+  struct timeval tv = { kStreamHeartbeatSeconds, 0 };
+  evtimer_add(streams->heartbeat, &tv);
+  return streams;
+}
+
+// Stops sending to a subscriber, leaving the request alone
+static void subscriber_remove(struct subscriber *subscriber) {
+  struct channel *channel = subscriber->channel;
+  struct playlist_streams *streams = channel->streams;
+  struct evhttp_connection *connection =
+      evhttp_request_get_connection(subscriber->request);
+
+  if (connection != NULL)
+    evhttp_connection_set_closecb(connection, NULL, NULL);
+
+  TAILQ_REMOVE(&channel->subscribers, subscriber, entries);
+  channel->num_subscribers--;
+  streams->num_subscribers--;
+  free(subscriber);
+
+  if (channel->num_subscribers == 0) {
+    struct timeval tv = { kStreamLingerSeconds, 0 };
+    evtimer_add(channel->linger, &tv);
+  }
+}
+
+// Ends a subscriber's stream, giving it a while to drain
+static void subscriber_end(struct subscriber *subscriber) {
+  struct evhttp_request *request = subscriber->request;
+  struct evhttp_connection *connection =
+      evhttp_request_get_connection(request);
+  subscriber_remove(subscriber);
+
+  if (connection != NULL)
+    evhttp_connection_set_timeout(connection, kStreamLingerSeconds);
+
+  evhttp_send_reply_end(request);
+}
+
+static void subscriber_closed(struct evhttp_connection *connection,
+                              void *userdata) {
+  struct subscriber *subscriber = userdata;
+  struct evhttp_request *request = subscriber->request;
+  subscriber_remove(subscriber);
+  free_abandoned_request(request);
+}
+
+// Sends data to a subscriber, unless it isn't keeping up: then its stream is
+// ended, and it can reconnect to carry on from the last event it got. Returns
+// false if the subscriber was dropped.
+static bool subscriber_send(struct subscriber *subscriber,
+                            const char *data,
+                            size_t length,
+                            struct stream_event *event) {
+  struct playlist_streams *streams = subscriber->channel->streams;
+  struct evhttp_connection *connection =
+      evhttp_request_get_connection(subscriber->request);
+
+  if (connection == NULL)
+    return true;  // Closed; the close callback cleans up
+
+  struct evbuffer *output = bufferevent_get_output(
+      evhttp_connection_get_bufferevent(connection));
+
+  if (evbuffer_get_length(output) > kStreamMaxBufferBytes) {
+    streams->slow_subscribers++;
+    subscriber_end(subscriber);
+    return false;
+  }
+
+  if (event != NULL) {
+    event->refs++;
+    evbuffer_add_reference(streams->scratch, data, length,
+                           &stream_event_cleanup, event);
+  } else {
+    evbuffer_add_reference(streams->scratch, data, length, NULL, NULL);
+  }
+
+  evhttp_send_reply_chunk(subscriber->request, streams->scratch);
+  return true;
+}
+
+// Keeps idle streams from timing out and finds subscribers that have gone
+static void stream_heartbeat(evutil_socket_t socket,
+                             short what,
+                             void *userdata) {
+  struct playlist_streams *streams = userdata;
+  apr_hash_index_t *hi;
+
+  for (hi = apr_hash_first(NULL, streams->channels); hi != NULL;
+       hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct channel *channel = value;
+    struct subscriber *subscriber = TAILQ_FIRST(&channel->subscribers);
+
+    while (subscriber != NULL) {
+      struct subscriber *next = TAILQ_NEXT(subscriber, entries);
+      subscriber_send(subscriber, kStreamHeartbeat,
+                      sizeof (kStreamHeartbeat) - 1, NULL);
+      subscriber = next;
+    }
+  }
+}
+
+// Numbers an event, adds it to the backlog and sends it to all subscribers.
+// Takes ownership of data.
+static void channel_publish(struct channel *channel,
+                            const char *name,
+                            json_t *data) {
+  struct playlist_streams *streams = channel->streams;
+  char *data_str = json_dumps(data, JSON_COMPACT);
+  json_decref(data);
+  unsigned long long id = ++streams->last_id;
+  int length = snprintf(NULL, 0, "id: %llu\nevent: %s\ndata: %s\n\n", id,
+                        name, data_str);
+  struct stream_event *event = malloc(sizeof (struct stream_event) +
+                                      length + 1);
+  event->refs = 1;
+  event->id = id;
+  event->length = length;
+  snprintf(event->data, length + 1, "id: %llu\nevent: %s\ndata: %s\n\n", id,
+           name, data_str);
+  free(data_str);
+  streams->events++;
+
+  if (channel->backlog_length == STREAM_BACKLOG_EVENTS) {
+    struct stream_event *dropped = channel->backlog[channel->backlog_start];
+    channel->dropped_id = dropped->id;
+    stream_event_unref(dropped);
+    channel->backlog_start = (channel->backlog_start + 1) %
+                             STREAM_BACKLOG_EVENTS;
+    channel->backlog_length--;
+  }
+
+  channel->backlog[(channel->backlog_start + channel->backlog_length) %
+                   STREAM_BACKLOG_EVENTS] = event;
+  channel->backlog_length++;
+  struct subscriber *subscriber = TAILQ_FIRST(&channel->subscribers);
+
+  while (subscriber != NULL) {
+    struct subscriber *next = TAILQ_NEXT(subscriber, entries);
+    subscriber_send(subscriber, event->data, event->length, event);
+    subscriber = next;
+  }
+}
+
+static void channel_tracks_added(sp_playlist *playlist,
+                                 sp_track *const *tracks,
+                                 int num_tracks,
+                                 int position,
+                                 void *userdata) {
+  json_t *data = json_object();
+  json_t *uris = json_array();
+  json_object_set_new(data, "position", json_integer(position));
+  json_object_set_new(data, "tracks", uris);
+
+  for (int i = 0; i < num_tracks; i++) {
+    char uri[kTrackLinkLength];
+    track_to_uri(tracks[i], uri, kTrackLinkLength);
+    json_array_append_new(uris, json_string(uri));
+  }
+
+  channel_publish(userdata, "tracks-added", data);
+}
+
+static void channel_tracks_removed(sp_playlist *playlist,
+                                   const int *tracks,
+                                   int num_tracks,
+                                   void *userdata) {
+  json_t *data = json_object();
+  json_object_set_new(data, "positions", positions_to_json(tracks,
+                                                           num_tracks));
+  channel_publish(userdata, "tracks-removed", data);
+}
+
+static void channel_tracks_moved(sp_playlist *playlist,
+                                 const int *tracks,
+                                 int num_tracks,
+                                 int new_position,
+                                 void *userdata) {
+  json_t *data = json_object();
+  json_object_set_new(data, "positions", positions_to_json(tracks,
+                                                           num_tracks));
+  json_object_set_new(data, "newPosition", json_integer(new_position));
+  channel_publish(userdata, "tracks-moved", data);
+}
+
+static void channel_playlist_renamed(sp_playlist *playlist, void *userdata) {
+  json_t *data = json_object();
+  json_object_set_new(data, "title", json_string(sp_playlist_name(playlist)));
+  channel_publish(userdata, "renamed", data);
+}
+
+static void channel_description_changed(sp_playlist *playlist,
+                                        const char *description,
+                                        void *userdata) {
+  json_t *data = json_object();
+  json_object_set_new(data, "description",
+                      description != NULL ? json_string(description)
+                                          : json_null());
+  channel_publish(userdata, "description-changed", data);
+}
+
+static void channel_subscribers_changed(sp_playlist *playlist,
+                                        void *userdata) {
+  json_t *data = json_object();
+  json_object_set_new(data, "subscribers",
+                      json_integer(sp_playlist_num_subscribers(playlist)));
+  channel_publish(userdata, "subscribers-changed", data);
+}
+
+static sp_playlist_callbacks channel_callbacks = {
+  .tracks_added = &channel_tracks_added,
+  .tracks_removed = &channel_tracks_removed,
+  .tracks_moved = &channel_tracks_moved,
+  .playlist_renamed = &channel_playlist_renamed,
+  .description_changed = &channel_description_changed,
+  .subscribers_changed = &channel_subscribers_changed
+};
+
+static void channel_free(struct channel *channel) {
+  struct playlist_streams *streams = channel->streams;
+  struct subscriber *subscriber;
+
+  sp_playlist_remove_callbacks(channel->playlist, &channel_callbacks, channel);
+
+  while ((subscriber = TAILQ_FIRST(&channel->subscribers)) != NULL)
+    subscriber_end(subscriber);
+
+  apr_hash_set(streams->channels, &channel->playlist,
+               sizeof (channel->playlist), NULL);
+  streams->num_channels--;
+  event_free(channel->linger);
+
+  for (int i = 0; i < channel->backlog_length; i++) {
+    stream_event_unref(channel->backlog[(channel->backlog_start + i) %
+                                        STREAM_BACKLOG_EVENTS]);
+  }
+
+  residency_unpin_playlist(streams->residency, channel->playlist);
+  sp_playlist_release(channel->playlist);
+  free(channel);
+}
+
+void playlist_streams_free(struct playlist_streams *streams) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, streams->channels)) != NULL) {
+    void *channel;
+    apr_hash_this(hi, NULL, NULL, &channel);
+    channel_free(channel);
+  }
+
+  event_free(streams->heartbeat);
+  evbuffer_free(streams->scratch);
+  free(streams);
+}
+
+static void channel_lingered(evutil_socket_t socket,
+                             short what,
+                             void *userdata) {
+  channel_free(userdata);
+}
+
+static struct channel *channel_get(struct playlist_streams *streams,
+                                   sp_playlist *playlist) {
+  struct channel *channel = apr_hash_get(streams->channels, &playlist,
+                                         sizeof (playlist));
+
+  if (channel != NULL) {
+    evtimer_del(channel->linger);
+    return channel;
+  }
+
+  channel = calloc(1, sizeof (struct channel));
+  channel->streams = streams;
+  channel->playlist = playlist;
+  TAILQ_INIT(&channel->subscribers);
+  channel->start_id = streams->last_id;
+  channel->dropped_id = streams->last_id;
+  channel->linger = evtimer_new(streams->event_base, &channel_lingered,
+                                channel);
+  sp_playlist_add_ref(playlist);
+  residency_pin_playlist(streams->residency, playlist);
+  sp_playlist_add_callbacks(playlist, &channel_callbacks, channel);
+  apr_hash_set(streams->channels, &channel->playlist, sizeof (playlist),
+               channel);
+  streams->num_channels++;
+  return channel;
+}
+
+// Sends the events after an ID to a new subscriber. Returns false if some of
+// them aren't known anymore (or never were).
+static bool channel_replay(struct channel *channel,
+                           struct subscriber *subscriber,
+                           unsigned long long last_id) {
+  if (last_id < channel->dropped_id || last_id > channel->streams->last_id)
+    return false;
+
+  for (int i = 0; i < channel->backlog_length; i++) {
+    struct stream_event *event = channel->backlog[
+        (channel->backlog_start + i) % STREAM_BACKLOG_EVENTS];
+
+    if (event->id > last_id &&
+        !subscriber_send(subscriber, event->data, event->length, event)) {
+      return true;
+    }
+  }
+
+  return true;
+}
+
+void playlist_streams_subscribe(struct playlist_streams *streams,
+                                sp_playlist *playlist,
+                                struct evhttp_request *request,
+                                const char *last_event_id) {
+  struct channel *channel = channel_get(streams, playlist);
+  struct subscriber *subscriber = malloc(sizeof (struct subscriber));
+  subscriber->channel = channel;
+  subscriber->request = request;
+  TAILQ_INSERT_TAIL(&channel->subscribers, subscriber, entries);
+  channel->num_subscribers++;
+  streams->num_subscribers++;
+
+  struct evhttp_connection *connection =
+      evhttp_request_get_connection(request);
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  evhttp_add_header(headers, "Content-Type", "text/event-stream");
+  evhttp_add_header(headers, "Cache-Control", "no-cache");
+
+  // Heartbeats keep the stream busy, and slow subscribers are dropped
+  evhttp_connection_set_timeout(connection, 0);
+  evhttp_connection_set_closecb(connection, &subscriber_closed, subscriber);
+  evhttp_send_reply_start(request, HTTP_OK, "OK");
+
+  if (last_event_id == NULL)
+    return;
+
+  char *end;
+  unsigned long long last_id = strtoull(last_event_id, &end, 10);
+
+  if (*last_event_id != '\0' && *end == '\0' &&
+      channel_replay(channel, subscriber, last_id)) {
+    streams->resumes++;
+    return;
+  }
+
+  // The client has missed events; it has to start over
+  static const char reset[] = "event: reset\ndata: {}\n\n";
+  streams->resets++;
+  subscriber_send(subscriber, reset, sizeof (reset) - 1, NULL);
+}
+
+json_t *playlist_streams_to_json(struct playlist_streams *streams,
+                                 json_t *object) {
+  json_object_set_new(object, "playlists",
+                      json_integer(streams->num_channels));
+  json_object_set_new(object, "subscribers",
+                      json_integer(streams->num_subscribers));
+  json_object_set_new(object, "events", json_integer(streams->events));
+  json_object_set_new(object, "resumes", json_integer(streams->resumes));
+  json_object_set_new(object, "resets", json_integer(streams->resets));
+  json_object_set_new(object, "slowSubscribers",
+                      json_integer(streams->slow_subscribers));
+  return object;
+}
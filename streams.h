@@ -0,0 +1,27 @@
+#ifndef STREAMS_H_
+#define STREAMS_H_
+
+// Server-sent event streams of changes to playlists. Callbacks are registered
+// once per playlist, however many clients are subscribed to it, and recent
+// events are kept for clients that reconnect with a Last-Event-ID.
+struct playlist_streams;
+
+struct playlist_streams *playlist_streams_new(struct event_base *event_base,
+                                              struct residency *residency,
+                                              apr_pool_t *pool);
+
+// Ends all streams
+void playlist_streams_free(struct playlist_streams *);
+
+// Starts streaming changes to a loaded playlist in response to a request.
+// Events after last_event_id (which may be NULL) are replayed if they are
+// still known; otherwise the stream starts with a reset event, telling the
+// client to get the whole playlist again.
+void playlist_streams_subscribe(struct playlist_streams *,
+                                sp_playlist *playlist,
+                                struct evhttp_request *request,
+                                const char *last_event_id);
+
+json_t *playlist_streams_to_json(struct playlist_streams *, json_t *object);
+
+#endif
@@ -0,0 +1,210 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "constants.h"
+#include "json.h"
+#include "subscribers.h"
+
+struct subscribers_entry {
+  sp_playlist *playlist;  // Also the hash key
+  struct subscriber_cache *cache;
+  struct evbuffer *json;  // Empty until first updated
+  unsigned int count;
+  time_t updated;
+  bool stored;
+  bool updating;
+  time_t update_started;
+  TAILQ_ENTRY(subscribers_entry) entries;
+};
+
+TAILQ_HEAD(subscribers_entry_list, subscribers_entry);
+
+struct subscriber_cache {
+  sp_session *session;
+  apr_hash_t *index;
+  struct subscribers_entry_list lru;  // Most recently used first
+  size_t max_entries;
+  size_t num_entries;
+  int ttl;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long updates;
+  unsigned long shared_updates;
+  unsigned long evictions;
+};
+
+static void subscribers_changed(sp_playlist *playlist, void *userdata);
+
+static sp_playlist_callbacks subscribers_entry_callbacks = {
+  .subscribers_changed = &subscribers_changed
+};
+
+struct subscriber_cache *subscriber_cache_new(sp_session *session,
+                                              size_t max_entries,
+                                              int ttl,
+                                              apr_pool_t *pool) {
+  struct subscriber_cache *cache = calloc(1, sizeof (struct subscriber_cache));
+  cache->session = session;
+  cache->index = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->max_entries = max_entries;
+  cache->ttl = ttl;
+  return cache;
+}
+
+static void subscribers_entry_remove(struct subscriber_cache *cache,
+                                     struct subscribers_entry *entry) {
+  TAILQ_REMOVE(&cache->lru, entry, entries);
+  apr_hash_set(cache->index, &entry->playlist, sizeof (entry->playlist), NULL);
+  cache->num_entries--;
+  sp_playlist_remove_callbacks(entry->playlist, &subscribers_entry_callbacks,
+                               entry);
+  sp_playlist_release(entry->playlist);
+  evbuffer_free(entry->json);
+  free(entry);
+}
+
+void subscriber_cache_free(struct subscriber_cache *cache) {
+  struct subscribers_entry *entry;
+
+  while ((entry = TAILQ_FIRST(&cache->lru)) != NULL)
+    subscribers_entry_remove(cache, entry);
+
+  free(cache);
+}
+
+static struct subscribers_entry *subscribers_entry_get(
+    struct subscriber_cache *cache,
+    sp_playlist *playlist) {
+  struct subscribers_entry *entry = apr_hash_get(cache->index, &playlist,
+                                                 sizeof (playlist));
+
+  if (entry != NULL) {
+    TAILQ_REMOVE(&cache->lru, entry, entries);
+    TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+    return entry;
+  }
+
+  entry = calloc(1, sizeof (struct subscribers_entry));
+  entry->playlist = playlist;
+  entry->cache = cache;
+  entry->json = evbuffer_new();
+  sp_playlist_add_ref(playlist);
+  sp_playlist_add_callbacks(playlist, &subscribers_entry_callbacks, entry);
+  apr_hash_set(cache->index, &entry->playlist, sizeof (playlist), entry);
+  TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+  cache->num_entries++;
+
+  // Never evicts the entry just added
+  while (cache->max_entries > 0 && cache->num_entries > cache->max_entries) {
+    subscribers_entry_remove(cache, TAILQ_LAST(&cache->lru,
+                                               subscribers_entry_list));
+    cache->evictions++;
+  }
+
+  return entry;
+}
+
+// Serializes the subscribers as they are now, straight from libspotify
+static void subscribers_entry_store(struct subscribers_entry *entry) {
+  sp_subscribers *subscribers = sp_playlist_subscribers(entry->playlist);
+  evbuffer_drain(entry->json, evbuffer_get_length(entry->json));
+  evbuffer_add(entry->json, "[", 1);
+
+  for (unsigned int i = 0; i < subscribers->count; i++) {
+    if (i > 0)
+      evbuffer_add(entry->json, ",", 1);
+
+    json_string_to_evbuffer(entry->json, subscribers->subscribers[i]);
+  }
+
+  evbuffer_add(entry->json, "]", 1);
+  entry->count = subscribers->count;
+  sp_playlist_subscribers_free(subscribers);
+  entry->updated = time(NULL);
+  entry->stored = true;
+  entry->updating = false;
+}
+
+static void subscribers_changed(sp_playlist *playlist, void *userdata) {
+  subscribers_entry_store(userdata);
+}
+
+static void subscribers_entry_write(struct subscribers_entry *entry,
+                                    struct evbuffer *buf) {
+  size_t length = evbuffer_get_length(entry->json);
+  evbuffer_add(buf, evbuffer_pullup(entry->json, length), length);
+}
+
+bool subscriber_cache_write(struct subscriber_cache *cache,
+                            sp_playlist *playlist,
+                            struct evbuffer *buf) {
+  struct subscribers_entry *entry = subscribers_entry_get(cache, playlist);
+
+  if (!entry->stored || time(NULL) - entry->updated >= cache->ttl) {
+    cache->misses++;
+    return false;
+  }
+
+  cache->hits++;
+  subscribers_entry_write(entry, buf);
+  return true;
+}
+
+void subscriber_cache_update(struct subscriber_cache *cache,
+                             sp_playlist *playlist) {
+  struct subscribers_entry *entry = subscribers_entry_get(cache, playlist);
+  time_t now = time(NULL);
+
+  // Updates that never came back are asked for again
+  if (entry->updating &&
+      now - entry->update_started < kSubscribersUpdateRetrySeconds) {
+    cache->shared_updates++;
+    return;
+  }
+
+  entry->updating = true;
+  entry->update_started = now;
+  cache->updates++;
+  sp_playlist_update_subscribers(cache->session, playlist);
+}
+
+void subscriber_cache_write_updated(struct subscriber_cache *cache,
+                                    sp_playlist *playlist,
+                                    struct evbuffer *buf) {
+  struct subscribers_entry *entry = subscribers_entry_get(cache, playlist);
+
+  // Callbacks are called in no particular order, so the cache's own may not
+  // have been yet
+  if (entry->updating || !entry->stored)
+    subscribers_entry_store(entry);
+
+  subscribers_entry_write(entry, buf);
+}
+
+json_t *subscriber_cache_to_json(struct subscriber_cache *cache,
+                                 json_t *object) {
+  unsigned long subscribers = 0;
+  struct subscribers_entry *entry;
+
+  TAILQ_FOREACH(entry, &cache->lru, entries)
+    subscribers += entry->count;
+
+  json_object_set_new(object, "playlists", json_integer(cache->num_entries));
+  json_object_set_new(object, "subscribers", json_integer(subscribers));
+  json_object_set_new(object, "hits", json_integer(cache->hits));
+  json_object_set_new(object, "misses", json_integer(cache->misses));
+  json_object_set_new(object, "updates", json_integer(cache->updates));
+  json_object_set_new(object, "sharedUpdates",
+                      json_integer(cache->shared_updates));
+  json_object_set_new(object, "evictions", json_integer(cache->evictions));
+  return object;
+}
@@ -0,0 +1,34 @@
+#ifndef SUBSCRIBERS_H_
+#define SUBSCRIBERS_H_
+
+// Subscribers of playlists, as they were last updated from Spotify, kept
+// serialized for a TTL. Requests for the subscribers of the same playlist
+// share a single update.
+struct subscriber_cache;
+
+struct subscriber_cache *subscriber_cache_new(sp_session *session,
+                                              size_t max_entries,
+                                              int ttl,
+                                              apr_pool_t *pool);
+
+void subscriber_cache_free(struct subscriber_cache *);
+
+// Writes the subscribers of a playlist as a JSON array, unless they haven't
+// been updated within the TTL. Returns whether they were written.
+bool subscriber_cache_write(struct subscriber_cache *,
+                            sp_playlist *,
+                            struct evbuffer *buf);
+
+// Asks Spotify for the subscribers of a playlist, unless that's already under
+// way; subscribers_changed callbacks follow
+void subscriber_cache_update(struct subscriber_cache *, sp_playlist *);
+
+// Stores the subscribers of a playlist from a subscribers_changed callback
+// and writes them as subscriber_cache_write does
+void subscriber_cache_write_updated(struct subscriber_cache *,
+                                    sp_playlist *,
+                                    struct evbuffer *buf);
+
+json_t *subscriber_cache_to_json(struct subscriber_cache *, json_t *object);
+
+#endif
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <jansson.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "logger.h"
+#include "supervisor.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal) {
+  stopping = 1;
+}
+
+static void set_signal_handlers(void (*handler)(int)) {
+  struct sigaction action;
+  memset(&action, 0, sizeof (action));
+  action.sa_handler = handler;
+  sigemptyset(&action.sa_mask);
+
+  // Without SA_RESTART, so that waitpid() returns when a signal arrives
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+int supervise(int num_workers) {
+  // 0 for a worker to be started, -1 for one that is done
+  pid_t *pids = calloc(num_workers, sizeof (pid_t));
+  time_t *started = calloc(num_workers, sizeof (time_t));
+  int running = 0;
+  bool signalled = false;
+  set_signal_handlers(&stop);
+
+  for (;;) {
+    for (int i = 0; i < num_workers && !stopping; i++) {
+      if (pids[i] != 0)
+        continue;
+
+      // Don't spin on workers that die right away
+      if (time(NULL) - started[i] < kWorkerRestartSeconds)
+        sleep(kWorkerRestartSeconds);
+
+      if (stopping)
+        break;
+
+      started[i] = time(NULL);
+      pid_t pid = fork();
+
+      if (pid == 0) {
+        set_signal_handlers(SIG_DFL);
+        free(pids);
+        free(started);
+        return i;
+      }
+
+      if (pid < 0) {
+        log_crit("Could not fork worker %d: %s", i, strerror(errno));
+        continue;
+      }
+
+      log_info("Started worker %d (pid %d)", i, (int) pid);
+      pids[i] = pid;
+      running++;
+    }
+
+    if (stopping && !signalled) {
+      for (int i = 0; i < num_workers; i++) {
+        if (pids[i] > 0)
+          kill(pids[i], SIGINT);
+      }
+
+      signalled = true;
+    }
+
+    if (running == 0)
+      break;
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+      if (pids[i] != pid)
+        continue;
+
+      running--;
+
+      // Workers exit cleanly when they log out, and then aren't restarted
+      if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        log_info("Worker %d exited", i);
+        pids[i] = -1;
+      } else {
+        log_warning("Worker %d died (status %d)", i, status);
+        pids[i] = 0;
+      }
+    }
+  }
+
+  free(pids);
+  free(started);
+  return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef SUPERVISOR_H_
+#define SUPERVISOR_H_
+
+// Forks num_workers worker processes and restarts any that die, until the
+// supervisor is sent SIGINT or SIGTERM, which it passes on. Returns the index
+// of the worker in worker processes, and -1 in the supervisor once all
+// workers have exited.
+int supervise(int num_workers);
+
+#endif
@@ -0,0 +1,99 @@
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trackid.h"
+
+static const char kTrackUriPrefix[] = "spotify:track:";
+
+static const char kBase62Alphabet[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// Number of base-62 digits needed for a 128-bit ID
+#define BASE62_ID_LENGTH 22
+
+static int base62_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 36;
+
+  return -1;
+}
+
+bool track_id_from_uri(const char *uri, unsigned char *id) {
+  size_t prefix_length = sizeof (kTrackUriPrefix) - 1;
+
+  if (strncmp(uri, kTrackUriPrefix, prefix_length) != 0)
+    return false;
+
+  const char *digits = uri + prefix_length;
+
+  if (strlen(digits) != BASE62_ID_LENGTH)
+    return false;
+
+  memset(id, 0, TRACK_ID_LENGTH);
+
+  // id = id * 62 + digit, on a big-endian 128-bit number
+  for (int i = 0; i < BASE62_ID_LENGTH; i++) {
+    int digit = base62_digit(digits[i]);
+
+    if (digit < 0)
+      return false;
+
+    unsigned int carry = digit;
+
+    for (int j = TRACK_ID_LENGTH - 1; j >= 0; j--) {
+      carry += id[j] * 62;
+      id[j] = carry & 0xff;
+      carry >>= 8;
+    }
+
+    if (carry != 0)
+      return false;  // Overflow: not a 128-bit ID
+  }
+
+  return true;
+}
+
+void track_id_to_uri(const unsigned char *id, char *uri, int uri_size) {
+  unsigned char n[TRACK_ID_LENGTH];
+  char digits[BASE62_ID_LENGTH + 1];
+  memcpy(n, id, TRACK_ID_LENGTH);
+
+  // Repeatedly divide by 62, collecting remainders as digits from the right
+  for (int i = BASE62_ID_LENGTH - 1; i >= 0; i--) {
+    unsigned int remainder = 0;
+
+    for (int j = 0; j < TRACK_ID_LENGTH; j++) {
+      unsigned int value = (remainder << 8) | n[j];
+      n[j] = value / 62;
+      remainder = value % 62;
+    }
+
+    digits[i] = kBase62Alphabet[remainder];
+  }
+
+  digits[BASE62_ID_LENGTH] = '\0';
+  snprintf(uri, uri_size, "%s%s", kTrackUriPrefix, digits);
+}
+
+int track_to_uri(sp_track *track, char *uri, int uri_size) {
+  sp_link *link = sp_link_create_from_track(track, 0);
+
+  if (link == NULL) {
+    if (uri_size > 0)
+      uri[0] = '\0';
+
+    return 0;
+  }
+
+  int length = sp_link_as_string(link, uri, uri_size);
+  sp_link_release(link);
+  return length;
+}
@@ -0,0 +1,17 @@
+#ifndef TRACKID_H_
+#define TRACKID_H_
+
+// Length of a raw Spotify track ID
+#define TRACK_ID_LENGTH 16
+
+// Reads the base-62 ID of a spotify:track: URI into a raw 16-byte ID. Fails on
+// other kinds of URIs (e.g. local tracks).
+bool track_id_from_uri(const char *uri, unsigned char *id);
+
+// Writes the spotify:track: URI of a raw track ID
+void track_id_to_uri(const unsigned char *id, char *uri, int uri_size);
+
+// Writes the URI of a track; returns its length like sp_link_as_string
+int track_to_uri(sp_track *track, char *uri, int uri_size);
+
+#endif
@@ -0,0 +1,381 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <apr_pools.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "trackid.h"
+#include "trackindex.h"
+
+// A track of an indexed playlist, with its positions chained through the
+// index's `next` array in order
+struct indexed_track {
+  char *uri;  // Also the hash key
+  int first;  // -1 when the track isn't in the playlist any more
+  int last;
+};
+
+struct track_index {
+  sp_playlist *playlist;  // Also the hash key
+  struct track_indexes *indexes;
+  apr_pool_t *pool;  // Tracks and their URIs
+  apr_hash_t *tracks;
+  bool read;  // Whether the tracks have been read from the playlist
+  bool dirty;  // Whether the chains have to be relinked from `positions`
+  struct indexed_track **positions;  // The track at each position
+  int *next;  // The next position of the same track, or -1
+  int num_tracks;
+  int capacity;
+};
+
+struct track_indexes {
+  apr_pool_t *pool;
+  apr_hash_t *playlists;
+
+  unsigned long lookups;
+  unsigned long scans;
+  unsigned long rebuilds;
+};
+
+struct track_indexes *track_indexes_new(apr_pool_t *pool) {
+  struct track_indexes *indexes = calloc(1, sizeof (struct track_indexes));
+  indexes->pool = pool;
+  indexes->playlists = apr_hash_make(pool);
+  return indexes;
+}
+
+static void track_index_reserve(struct track_index *index, int num_tracks) {
+  if (num_tracks <= index->capacity)
+    return;
+
+  index->capacity = num_tracks > 2 * index->capacity ?
+      num_tracks : 2 * index->capacity;
+  index->positions = realloc(index->positions,
+                             index->capacity * sizeof (*index->positions));
+  index->next = realloc(index->next, index->capacity * sizeof (int));
+}
+
+static void track_index_forget(struct track_index *index) {
+  index->read = false;
+  index->num_tracks = 0;
+}
+
+// Chains a position on to the positions of its track
+static void track_index_link(struct track_index *index, int position) {
+  struct indexed_track *track = index->positions[position];
+  index->next[position] = -1;
+
+  if (track->first < 0)
+    track->first = position;
+  else
+    index->next[track->last] = position;
+
+  track->last = position;
+}
+
+static void track_index_relink(struct track_index *index) {
+  for (apr_hash_index_t *hi = apr_hash_first(NULL, index->tracks);
+       hi != NULL; hi = apr_hash_next(hi)) {
+    void *value;
+    apr_hash_this(hi, NULL, NULL, &value);
+    struct indexed_track *track = value;
+    track->first = -1;
+  }
+
+  for (int i = 0; i < index->num_tracks; i++)
+    track_index_link(index, i);
+
+  index->dirty = false;
+}
+
+// Sets the track at a position, adding it to the index if it's new
+static void track_index_set(struct track_index *index,
+                            int position,
+                            sp_track *track) {
+  char uri[kTrackLinkLength];
+  track_to_uri(track, uri, sizeof (uri));
+  struct indexed_track *indexed = apr_hash_get(index->tracks, uri,
+                                               APR_HASH_KEY_STRING);
+
+  if (indexed == NULL) {
+    indexed = apr_pcalloc(index->pool, sizeof (struct indexed_track));
+    indexed->uri = apr_pstrdup(index->pool, uri);
+    indexed->first = -1;
+    apr_hash_set(index->tracks, indexed->uri, APR_HASH_KEY_STRING, indexed);
+  }
+
+  index->positions[position] = indexed;
+}
+
+static void track_index_read(struct track_index *index) {
+  sp_playlist *playlist = index->playlist;
+  int num_tracks = sp_playlist_num_tracks(playlist);
+  apr_pool_clear(index->pool);
+  index->tracks = apr_hash_make(index->pool);
+  track_index_reserve(index, num_tracks);
+
+  for (int i = 0; i < num_tracks; i++)
+    track_index_set(index, i, sp_playlist_track(playlist, i));
+
+  index->num_tracks = num_tracks;
+  index->read = true;
+  index->dirty = true;
+  index->indexes->rebuilds++;
+}
+
+static struct track_index *playlist_track_index(sp_playlist *playlist,
+                                                void *userdata) {
+  struct track_index *index = apr_hash_get(
+      ((struct track_indexes *) userdata)->playlists, &playlist,
+      sizeof (playlist));
+  return index != NULL && index->read ? index : NULL;
+}
+
+static void tracks_added(sp_playlist *playlist,
+                         sp_track *const *added,
+                         int num_added,
+                         int position,
+                         void *userdata) {
+  struct track_index *index = playlist_track_index(playlist, userdata);
+
+  if (index == NULL)
+    return;
+
+  if (position < 0 || position > index->num_tracks) {
+    track_index_forget(index);
+    return;
+  }
+
+  track_index_reserve(index, index->num_tracks + num_added);
+  memmove(index->positions + position + num_added, index->positions + position,
+          (index->num_tracks - position) * sizeof (*index->positions));
+
+  for (int i = 0; i < num_added; i++)
+    track_index_set(index, position + i, added[i]);
+
+  // Tracks appended to the end are chained on; others shift positions
+  bool appended = position == index->num_tracks;
+  index->num_tracks += num_added;
+
+  if (appended && !index->dirty) {
+    for (int i = 0; i < num_added; i++)
+      track_index_link(index, position + i);
+  } else {
+    index->dirty = true;
+  }
+}
+
+// Takes the tracks at the given positions out of the index, optionally
+// copying them (in the given order) to `taken`. Returns false if a position
+// is out of range.
+static bool track_index_take(struct track_index *index,
+                             const int *positions,
+                             int num_positions,
+                             struct indexed_track **taken) {
+  bool *marked = calloc(index->num_tracks, sizeof (bool));
+
+  for (int i = 0; i < num_positions; i++) {
+    if (positions[i] < 0 || positions[i] >= index->num_tracks) {
+      free(marked);
+      return false;
+    }
+
+    marked[positions[i]] = true;
+
+    if (taken != NULL)
+      taken[i] = index->positions[positions[i]];
+  }
+
+  int kept = 0;
+
+  for (int i = 0; i < index->num_tracks; i++) {
+    if (!marked[i])
+      index->positions[kept++] = index->positions[i];
+  }
+
+  free(marked);
+  index->num_tracks = kept;
+  index->dirty = true;
+  return true;
+}
+
+static void tracks_removed(sp_playlist *playlist,
+                           const int *removed,
+                           int num_removed,
+                           void *userdata) {
+  struct track_index *index = playlist_track_index(playlist, userdata);
+
+  if (index != NULL && !track_index_take(index, removed, num_removed, NULL))
+    track_index_forget(index);
+}
+
+static void tracks_moved(sp_playlist *playlist,
+                         const int *moved,
+                         int num_moved,
+                         int new_position,
+                         void *userdata) {
+  struct track_index *index = playlist_track_index(playlist, userdata);
+
+  if (index == NULL)
+    return;
+
+  struct indexed_track **taken = malloc(num_moved * sizeof (*taken));
+
+  if (!track_index_take(index, moved, num_moved, taken)) {
+    free(taken);
+    track_index_forget(index);
+    return;
+  }
+
+  // The new position counts the moved tracks that were before it
+  for (int i = 0; i < num_moved; i++) {
+    if (moved[i] < new_position)
+      new_position--;
+  }
+
+  if (new_position < 0 || new_position > index->num_tracks) {
+    free(taken);
+    track_index_forget(index);
+    return;
+  }
+
+  memmove(index->positions + new_position + num_moved,
+          index->positions + new_position,
+          (index->num_tracks - new_position) * sizeof (*index->positions));
+  memcpy(index->positions + new_position, taken, num_moved * sizeof (*taken));
+  index->num_tracks += num_moved;
+  free(taken);
+}
+
+// Tracks are read again from a playlist that has reloaded
+static void playlist_state_changed(sp_playlist *playlist, void *userdata) {
+  struct track_index *index = playlist_track_index(playlist, userdata);
+
+  if (index != NULL && !sp_playlist_is_loaded(playlist))
+    track_index_forget(index);
+}
+
+static sp_playlist_callbacks track_index_playlist_callbacks = {
+  .tracks_added = &tracks_added,
+  .tracks_removed = &tracks_removed,
+  .tracks_moved = &tracks_moved,
+  .playlist_state_changed = &playlist_state_changed
+};
+
+static struct track_index *track_index_new(struct track_indexes *indexes,
+                                           sp_playlist *playlist) {
+  struct track_index *index = calloc(1, sizeof (struct track_index));
+  index->playlist = playlist;
+  index->indexes = indexes;
+  apr_pool_create(&index->pool, indexes->pool);
+  return index;
+}
+
+static void track_index_free(struct track_index *index) {
+  apr_pool_destroy(index->pool);
+  free(index->positions);
+  free(index->next);
+  free(index);
+}
+
+void track_indexes_watch(struct track_indexes *indexes,
+                         sp_playlist *playlist) {
+  if (apr_hash_get(indexes->playlists, &playlist, sizeof (playlist)) != NULL)
+    return;
+
+  struct track_index *index = track_index_new(indexes, playlist);
+  apr_hash_set(indexes->playlists, &index->playlist, sizeof (playlist), index);
+  sp_playlist_add_callbacks(playlist, &track_index_playlist_callbacks,
+                            indexes);
+}
+
+static void track_index_unwatch(struct track_index *index) {
+  struct track_indexes *indexes = index->indexes;
+  sp_playlist_remove_callbacks(index->playlist,
+                               &track_index_playlist_callbacks, indexes);
+  apr_hash_set(indexes->playlists, &index->playlist, sizeof (index->playlist),
+               NULL);
+  track_index_free(index);
+}
+
+void track_indexes_unwatch(struct track_indexes *indexes,
+                           sp_playlist *playlist) {
+  struct track_index *index = apr_hash_get(indexes->playlists, &playlist,
+                                           sizeof (playlist));
+
+  if (index != NULL)
+    track_index_unwatch(index);
+}
+
+void track_indexes_free(struct track_indexes *indexes) {
+  apr_hash_index_t *hi;
+
+  while ((hi = apr_hash_first(NULL, indexes->playlists)) != NULL) {
+    void *index;
+    apr_hash_this(hi, NULL, NULL, &index);
+    track_index_unwatch(index);
+  }
+
+  free(indexes);
+}
+
+json_t *track_indexes_contains(struct track_indexes *indexes,
+                               sp_playlist *playlist,
+                               const char **uris,
+                               int num_uris) {
+  struct track_index *index = apr_hash_get(indexes->playlists, &playlist,
+                                           sizeof (playlist));
+  bool watched = index != NULL;
+  indexes->lookups++;
+
+  if (!watched) {
+    index = track_index_new(indexes, playlist);
+    indexes->scans++;
+  }
+
+  if (!index->read)
+    track_index_read(index);
+
+  if (index->dirty)
+    track_index_relink(index);
+
+  json_t *results = json_array();
+
+  for (int i = 0; i < num_uris; i++) {
+    struct indexed_track *track = apr_hash_get(index->tracks, uris[i],
+                                               APR_HASH_KEY_STRING);
+    json_t *positions = json_array();
+
+    for (int position = track != NULL ? track->first : -1;
+         position >= 0;
+         position = index->next[position]) {
+      json_array_append_new(positions, json_integer(position));
+    }
+
+    json_t *result = json_object();
+    json_object_set_new(result, "uri", json_string(uris[i]));
+    json_object_set_new(result, "contains",
+                        json_array_size(positions) > 0 ?
+                        json_true() : json_false());
+    json_object_set_new(result, "positions", positions);
+    json_array_append_new(results, result);
+  }
+
+  if (!watched)
+    track_index_free(index);
+
+  return results;
+}
+
+json_t *track_indexes_to_json(struct track_indexes *indexes, json_t *object) {
+  json_object_set_new(object, "playlists",
+                      json_integer(apr_hash_count(indexes->playlists)));
+  json_object_set_new(object, "lookups", json_integer(indexes->lookups));
+  json_object_set_new(object, "scans", json_integer(indexes->scans));
+  json_object_set_new(object, "rebuilds", json_integer(indexes->rebuilds));
+  return object;
+}
@@ -0,0 +1,29 @@
+#ifndef TRACKINDEX_H_
+#define TRACKINDEX_H_
+
+// Positions of the tracks in playlists, by track URI, so that whether a
+// playlist has some tracks can be answered without going through all of its
+// tracks. Indexes are built on first use and kept up to date from playlist
+// callbacks; playlists that aren't watched are indexed for each lookup.
+struct track_indexes;
+
+struct track_indexes *track_indexes_new(apr_pool_t *pool);
+
+void track_indexes_free(struct track_indexes *);
+
+// Starts indexing a playlist, once it's first looked up in
+void track_indexes_watch(struct track_indexes *, sp_playlist *);
+
+// Stops indexing a playlist
+void track_indexes_unwatch(struct track_indexes *, sp_playlist *);
+
+// Looks up tracks, by URI, in a loaded playlist. Returns an array with, for
+// each URI, {"uri":<string>,"contains":<bool>,"positions":[<int>]}.
+json_t *track_indexes_contains(struct track_indexes *,
+                               sp_playlist *,
+                               const char **uris,
+                               int num_uris);
+
+json_t *track_indexes_to_json(struct track_indexes *, json_t *object);
+
+#endif
@@ -0,0 +1,398 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "usercache.h"
+
+struct user_cache_waiter {
+  struct user_object *object;
+  user_cache_loaded_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(user_cache_waiter) entries;
+};
+
+TAILQ_HEAD(user_cache_waiter_list, user_cache_waiter);
+
+enum user_object_type {
+  USER_PLAYLISTCONTAINER,
+  USER_STARRED
+};
+
+// The container or the starred playlist of a user; object is NULL until it's
+// first asked for
+struct user_object {
+  struct user_entry *entry;
+  enum user_object_type type;
+  void *object;
+  time_t created;
+  bool changed;
+  struct user_cache_waiter_list waiters;
+};
+
+struct user_entry {
+  char *username;  // Also the hash key
+  struct user_cache *cache;
+  struct user_object playlistcontainer;
+  struct user_object starred;
+  TAILQ_ENTRY(user_entry) entries;
+};
+
+TAILQ_HEAD(user_entry_list, user_entry);
+
+struct user_cache {
+  sp_session *session;
+  apr_hash_t *index;
+  struct user_entry_list lru;  // Most recently used first
+  size_t max_entries;
+  size_t num_entries;
+  int ttl;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long expirations;
+  unsigned long invalidations;
+  unsigned long evictions;
+  unsigned long shared_loads;
+};
+
+struct user_cache *user_cache_new(sp_session *session,
+                                  size_t max_entries,
+                                  int ttl,
+                                  apr_pool_t *pool) {
+  struct user_cache *cache = calloc(1, sizeof (struct user_cache));
+  cache->session = session;
+  cache->index = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->max_entries = max_entries;
+  cache->ttl = ttl;
+  return cache;
+}
+
+static void add_ref(enum user_object_type type, void *object) {
+  if (type == USER_PLAYLISTCONTAINER) {
+    sp_playlistcontainer_add_ref(object);
+  } else {
+    sp_playlist_add_ref(object);
+  }
+}
+
+static void release(enum user_object_type type, void *object) {
+  if (type == USER_PLAYLISTCONTAINER) {
+    sp_playlistcontainer_release(object);
+  } else {
+    sp_playlist_release(object);
+  }
+}
+
+static void user_object_loaded(struct user_object *object) {
+  // Callbacks may wait again, so only those waiting now are called. They may
+  // also evict the user, so the object is held on to until they are done.
+  struct user_cache_waiter_list waiters;
+  TAILQ_INIT(&waiters);
+  TAILQ_CONCAT(&waiters, &object->waiters, entries);
+  enum user_object_type type = object->type;
+  void *loaded = object->object;
+  add_ref(type, loaded);
+  struct user_cache_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&waiters)) != NULL) {
+    TAILQ_REMOVE(&waiters, waiter, entries);
+    add_ref(type, loaded);
+    waiter->callback(loaded, waiter->userdata);
+    free(waiter);
+  }
+
+  release(type, loaded);
+}
+
+static void playlistcontainer_changed(struct user_object *object) {
+  if (!object->changed) {
+    object->changed = true;
+    object->entry->cache->invalidations++;
+  }
+}
+
+static void playlist_added(sp_playlistcontainer *pc,
+                           sp_playlist *playlist,
+                           int position,
+                           void *userdata) {
+  playlistcontainer_changed(userdata);
+}
+
+static void playlist_removed(sp_playlistcontainer *pc,
+                             sp_playlist *playlist,
+                             int position,
+                             void *userdata) {
+  playlistcontainer_changed(userdata);
+}
+
+static void playlist_moved(sp_playlistcontainer *pc,
+                           sp_playlist *playlist,
+                           int position,
+                           int new_position,
+                           void *userdata) {
+  playlistcontainer_changed(userdata);
+}
+
+static void container_loaded(sp_playlistcontainer *pc, void *userdata) {
+  user_object_loaded(userdata);
+}
+
+static sp_playlistcontainer_callbacks user_playlistcontainer_callbacks = {
+  .playlist_added = &playlist_added,
+  .playlist_removed = &playlist_removed,
+  .playlist_moved = &playlist_moved,
+  .container_loaded = &container_loaded
+};
+
+static void starred_state_changed(sp_playlist *playlist, void *userdata) {
+  if (sp_playlist_is_loaded(playlist))
+    user_object_loaded(userdata);
+}
+
+static sp_playlist_callbacks user_starred_callbacks = {
+  .playlist_state_changed = &starred_state_changed
+};
+
+static void user_object_release(struct user_object *object) {
+  if (object->object == NULL)
+    return;
+
+  if (object->type == USER_PLAYLISTCONTAINER) {
+    sp_playlistcontainer_remove_callbacks(object->object,
+        &user_playlistcontainer_callbacks, object);
+  } else {
+    sp_playlist_remove_callbacks(object->object, &user_starred_callbacks,
+                                 object);
+  }
+
+  release(object->type, object->object);
+  object->object = NULL;
+}
+
+// Creates the container or starred playlist anew. The old one is released
+// only after, so that libspotify can hand back the same one without having
+// to load it again.
+static void user_object_create(struct user_object *object) {
+  sp_session *session = object->entry->cache->session;
+  const char *username = object->entry->username;
+  void *created;
+
+  if (object->type == USER_PLAYLISTCONTAINER) {
+    created = sp_session_publishedcontainer_for_user_create(session, username);
+  } else {
+    created = sp_session_starred_for_user_create(session, username);
+  }
+
+  user_object_release(object);
+  object->object = created;
+
+  if (object->type == USER_PLAYLISTCONTAINER) {
+    sp_playlistcontainer_add_callbacks(created,
+        &user_playlistcontainer_callbacks, object);
+  } else {
+    sp_playlist_add_callbacks(created, &user_starred_callbacks, object);
+  }
+
+  object->created = time(NULL);
+  object->changed = false;
+}
+
+static void user_object_init(struct user_entry *entry,
+                             struct user_object *object,
+                             enum user_object_type type) {
+  object->entry = entry;
+  object->type = type;
+  TAILQ_INIT(&object->waiters);
+}
+
+static void user_object_free(struct user_object *object) {
+  struct user_cache_waiter *waiter;
+
+  while ((waiter = TAILQ_FIRST(&object->waiters)) != NULL) {
+    TAILQ_REMOVE(&object->waiters, waiter, entries);
+    free(waiter);
+  }
+
+  user_object_release(object);
+}
+
+static void user_entry_remove(struct user_cache *cache,
+                              struct user_entry *entry) {
+  TAILQ_REMOVE(&cache->lru, entry, entries);
+  apr_hash_set(cache->index, entry->username, APR_HASH_KEY_STRING, NULL);
+  cache->num_entries--;
+  user_object_free(&entry->playlistcontainer);
+  user_object_free(&entry->starred);
+  free(entry->username);
+  free(entry);
+}
+
+void user_cache_free(struct user_cache *cache) {
+  struct user_entry *entry;
+
+  while ((entry = TAILQ_FIRST(&cache->lru)) != NULL)
+    user_entry_remove(cache, entry);
+
+  free(cache);
+}
+
+static bool user_entry_waiting(struct user_entry *entry) {
+  return !TAILQ_EMPTY(&entry->playlistcontainer.waiters) ||
+         !TAILQ_EMPTY(&entry->starred.waiters);
+}
+
+// Drops the least recently used users nobody is waiting for, but never the
+// most recently used one
+static void user_cache_evict(struct user_cache *cache) {
+  struct user_entry *victim = TAILQ_LAST(&cache->lru, user_entry_list);
+
+  while (cache->max_entries > 0 && cache->num_entries > cache->max_entries) {
+    while (victim != NULL && user_entry_waiting(victim))
+      victim = TAILQ_PREV(victim, user_entry_list, entries);
+
+    if (victim == NULL || victim == TAILQ_FIRST(&cache->lru))
+      break;
+
+    struct user_entry *previous = TAILQ_PREV(victim, user_entry_list, entries);
+    user_entry_remove(cache, victim);
+    cache->evictions++;
+    victim = previous;
+  }
+}
+
+static struct user_entry *user_cache_entry(struct user_cache *cache,
+                                           const char *username) {
+  struct user_entry *entry = apr_hash_get(cache->index, username,
+                                          APR_HASH_KEY_STRING);
+
+  if (entry != NULL) {
+    TAILQ_REMOVE(&cache->lru, entry, entries);
+    TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+    return entry;
+  }
+
+  entry = calloc(1, sizeof (struct user_entry));
+  entry->username = strdup(username);
+  entry->cache = cache;
+  user_object_init(entry, &entry->playlistcontainer, USER_PLAYLISTCONTAINER);
+  user_object_init(entry, &entry->starred, USER_STARRED);
+  apr_hash_set(cache->index, entry->username, APR_HASH_KEY_STRING, entry);
+  TAILQ_INSERT_HEAD(&cache->lru, entry, entries);
+  cache->num_entries++;
+  user_cache_evict(cache);
+  return entry;
+}
+
+// Returns the object, creating it if it's missing, has expired or has
+// changed. Objects being waited for are kept as they are.
+static void *user_object_get(struct user_object *object) {
+  struct user_cache *cache = object->entry->cache;
+
+  if (object->object != NULL && TAILQ_EMPTY(&object->waiters)) {
+    if (object->changed) {
+      user_object_create(object);
+      cache->misses++;
+      return object->object;
+    }
+
+    if (cache->ttl > 0 && time(NULL) - object->created >= cache->ttl) {
+      user_object_create(object);
+      cache->expirations++;
+      cache->misses++;
+      return object->object;
+    }
+  }
+
+  if (object->object == NULL) {
+    user_object_create(object);
+    cache->misses++;
+  } else {
+    cache->hits++;
+  }
+
+  return object->object;
+}
+
+sp_playlistcontainer *user_cache_playlistcontainer(struct user_cache *cache,
+                                                   const char *username) {
+  struct user_entry *entry = user_cache_entry(cache, username);
+  sp_playlistcontainer *pc = user_object_get(&entry->playlistcontainer);
+  sp_playlistcontainer_add_ref(pc);
+  return pc;
+}
+
+sp_playlist *user_cache_starred(struct user_cache *cache,
+                                const char *username) {
+  struct user_entry *entry = user_cache_entry(cache, username);
+  sp_playlist *playlist = user_object_get(&entry->starred);
+  sp_playlist_add_ref(playlist);
+  return playlist;
+}
+
+static struct user_cache_waiter *user_object_wait(
+    struct user_object *object,
+    user_cache_loaded_fn callback,
+    void *userdata) {
+  struct user_cache_waiter *waiter = malloc(sizeof (struct user_cache_waiter));
+  waiter->object = object;
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+
+  if (!TAILQ_EMPTY(&object->waiters))
+    object->entry->cache->shared_loads++;
+
+  TAILQ_INSERT_TAIL(&object->waiters, waiter, entries);
+  return waiter;
+}
+
+struct user_cache_waiter *user_cache_wait_playlistcontainer(
+    struct user_cache *cache,
+    const char *username,
+    user_cache_loaded_fn callback,
+    void *userdata) {
+  struct user_entry *entry = user_cache_entry(cache, username);
+
+  if (entry->playlistcontainer.object == NULL)
+    user_object_create(&entry->playlistcontainer);
+
+  return user_object_wait(&entry->playlistcontainer, callback, userdata);
+}
+
+struct user_cache_waiter *user_cache_wait_starred(
+    struct user_cache *cache,
+    const char *username,
+    user_cache_loaded_fn callback,
+    void *userdata) {
+  struct user_entry *entry = user_cache_entry(cache, username);
+
+  if (entry->starred.object == NULL)
+    user_object_create(&entry->starred);
+
+  return user_object_wait(&entry->starred, callback, userdata);
+}
+
+void user_cache_cancel(struct user_cache_waiter *waiter) {
+  TAILQ_REMOVE(&waiter->object->waiters, waiter, entries);
+  free(waiter);
+}
+
+json_t *user_cache_to_json(struct user_cache *cache, json_t *object) {
+  json_object_set_new(object, "users", json_integer(cache->num_entries));
+  json_object_set_new(object, "hits", json_integer(cache->hits));
+  json_object_set_new(object, "misses", json_integer(cache->misses));
+  json_object_set_new(object, "expirations",
+                      json_integer(cache->expirations));
+  json_object_set_new(object, "invalidations",
+                      json_integer(cache->invalidations));
+  json_object_set_new(object, "evictions", json_integer(cache->evictions));
+  json_object_set_new(object, "sharedLoads",
+                      json_integer(cache->shared_loads));
+  return object;
+}
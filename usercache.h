@@ -0,0 +1,52 @@
+#ifndef USERCACHE_H_
+#define USERCACHE_H_
+
+// Published playlist containers and starred playlists of users, by canonical
+// username, so that repeated requests for a user don't create them again.
+// Entries are recreated after a TTL, or once a container reports a change,
+// and the least recently used users are dropped beyond a maximum number.
+// Requests waiting for the same container or starred playlist to load share
+// one set of libspotify callbacks.
+struct user_cache;
+
+struct user_cache_waiter;
+
+// Called once the container or starred playlist has loaded, with a reference
+// for the callee
+typedef void (*user_cache_loaded_fn)(void *object, void *userdata);
+
+struct user_cache *user_cache_new(sp_session *session,
+                                  size_t max_entries,
+                                  int ttl,
+                                  apr_pool_t *pool);
+
+// Releases all held references. Waiters are dropped without being called.
+void user_cache_free(struct user_cache *);
+
+// Returns the published container of a user, with a reference for the caller
+sp_playlistcontainer *user_cache_playlistcontainer(struct user_cache *,
+                                                   const char *username);
+
+// Returns the starred playlist of a user, with a reference for the caller
+sp_playlist *user_cache_starred(struct user_cache *, const char *username);
+
+// Waits for the container (or starred playlist) of a user, just returned by
+// the above and not yet loaded, to load
+struct user_cache_waiter *user_cache_wait_playlistcontainer(
+    struct user_cache *,
+    const char *username,
+    user_cache_loaded_fn callback,
+    void *userdata);
+
+struct user_cache_waiter *user_cache_wait_starred(
+    struct user_cache *,
+    const char *username,
+    user_cache_loaded_fn callback,
+    void *userdata);
+
+// Stops waiting, without calling back
+void user_cache_cancel(struct user_cache_waiter *);
+
+json_t *user_cache_to_json(struct user_cache *, json_t *object);
+
+#endif